@@ -120,6 +120,7 @@ typedef u16 nodeflag_t;
 //#define NF_NARROWED  ((nodeflag_t)1<< 4)  // type-narrowed from optional
 #define NF_UNKNOWN     ((nodeflag_t)1<< 5)  // has or contains unresolved identifier
 #define NF_NAMEDPARAMS ((nodeflag_t)1<< 6)  // function has named parameters
+#define NF_ONSTACK     ((nodeflag_t)1<< 6)  // [arraylit] storage is on the stack
 #define NF_DROP        ((nodeflag_t)1<< 7)  // type has drop() function
 #define NF_SUBOWNERS   ((nodeflag_t)1<< 8)  // type has owning elements
 #define NF_EXIT        ((nodeflag_t)1<< 9)  // block exits (i.e. "return" or "break")
@@ -181,14 +182,32 @@ typedef struct pkg_ {
   ptrarray_t      imports;  // pkg_t*[] -- imported packages (set by import_pkgs)
   sha256_t        api_sha256; // SHA-256 sum of pub.h
 
-  future_t           loadfut;
+  future_t           loadfut; // API is loaded (and built, if needed)
+  future_t           libfut;  // library is built; may resolve after loadfut
   nodearray_t        api;     // package-level declarations, available after loadfut
   nsexpr_t* nullable api_ns;  // set by pkgbuild after loading api
   unixtime_t         mtime;
+  _Atomic(bool)      imported; // load_dependency has been called for the package
+
+  // lazily-decoded API (see pkg_api_member)
+  struct astdecoder_* nullable apidec; // decodes api_ns members on demand
+  mutex_t                      apidec_mu; // protects apidec, api_ns members and api_index
+  map_t                        api_index; // api_ns member name => index+1 (pkg_api_lookup)
+  const void* nullable         apidata; // contents of metafile (mmap)
+  usize                        apidatasize;
+  str_t                        apifile; // path of metafile (for diagnostics)
+
+  struct pkg_* nullable autoimport; // package whose API is implicitly visible
+
+  // template instances recorded in the package's metafile (set by typecheck)
+  nodearray_t tinstances;
 } pkg_t;
 
 #define PKG_METAFILE_NAME "pub.coast"
 #define PKG_APIHFILE_NAME "pub.h"
+#define PKG_PKGHFILE_NAME "pkg.h"
+#define PKG_PCHFILE_NAME "pkg.h.pch"
+#define PKG_SRCSUMFILE_NAME "srcsums"
 
 
 //———————————————————————————————————————————————————————————————————————————————————————
@@ -374,6 +393,7 @@ typedef struct {
 typedef struct {
   sym_t   name;
   type_t* type;
+  bool    nofree; // storage is not heap allocated; only drop its elements
 } drop_t;
 
 typedef array_type(drop_t) droparray_t;
@@ -650,7 +670,24 @@ bool pkg_exefile(const pkg_t* pkg, const compiler_t* c, str_t* dst);
 node_t* nullable pkg_def_get(pkg_t* pkg, sym_t name);
 err_t pkg_def_set(pkg_t* pkg, memalloc_t ma, sym_t name, node_t* n);
 err_t pkg_def_add(pkg_t* pkg, memalloc_t ma, sym_t name, node_t** np_inout);
-err_t pkg_def_addm(pkg_t* pkg, memalloc_t ma, sym_t* namev, node_t** nodev, u32 count);
+// pkg_def_addm adds count definitions, skipping names which are already defined.
+// A NULL node is a placeholder for the member of pkg->autoimport with that name,
+// which pkg_def_get looks up (and decodes) on demand.
+err_t pkg_def_addm(
+  pkg_t* pkg, memalloc_t ma, sym_t* namev, node_t* nullable* nodev, u32 count);
+
+// pkg_api_member returns pkg->api_ns->members.v[index], decoding it if needed.
+// Returns NULL if decoding failed.
+node_t* nullable pkg_api_member(pkg_t* pkg, u32 index);
+// pkg_api_lookup returns the API member named name, or NULL if there's no such member
+node_t* nullable pkg_api_lookup(pkg_t* pkg, sym_t name);
+// pkg_api_member_name returns the name an API declaration is exported as
+sym_t pkg_api_member_name(const node_t* n);
+// pkg_tinstance_name returns the name which an instance of template_name with args
+// is exported as by the package which defines the template, e.g. "Vec<1A2B…>".
+// These names are not valid identifiers and are thus never imported by name.
+sym_t pkg_tinstance_name(sym_t template_name, const nodearray_t* args);
+bool pkg_api_name_is_tinstance(sym_t name);
 str_t pkg_unit_srcdir(const pkg_t* pkg, const unit_t* unit);
 // pkg_imports_add adds dep to importer_pkg->imports (uniquely)
 bool pkg_imports_add(pkg_t* importer_pkg, pkg_t* dep, memalloc_t ma);
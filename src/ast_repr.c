@@ -252,7 +252,12 @@ static void repr_unit(RPARAMS, const unit_t* n) {
 static void repr_nsexpr(RPARAMS, const nsexpr_t* n) {
   for (usize i = 0; i < n->members.len; i++) {
     REPR_BEGIN('(', n->member_names[i]);
-    repr(RARGS, n->members.v[i]);
+    if (n->members.v[i]) {
+      repr(RARGS, n->members.v[i]);
+    } else {
+      // member of a lazily-decoded package API which has not been used (yet)
+      PRINT(" {undecoded}");
+    }
     REPR_END(')');
   }
 }
@@ -1,7 +1,80 @@
 // SPDX-License-Identifier: Apache-2.0
 /*
 
-AST encoding format:
+AST encoding formats
+
+There are two encoding formats: a compact binary format (version 3), which is what
+package metadata files (pub.coast) are written in, and a text format (version 1)
+which is easy to read and thus useful for debugging. The decoder accepts both;
+the format is identified by the byte following the magic ("cAST"), which is SP for
+the text format.
+
+
+Binary format (version 3):
+
+  root = header
+         pkg
+         srcfile{srccount}
+         pkg{importcount}
+         <padding to 4-byte alignment>
+         symtab
+         <padding to 4-byte alignment>
+         nodetab
+         (<padding to 8-byte alignment> node){nodecount}
+         <padding to 4-byte alignment>
+         root{rootcount}
+
+  header = magic version srccount importcount symcount nodecount rootcount
+           symtaboffs nodetaboffs rootsoffs                            // encheader_t
+  magic  = "cAST"
+  version, srccount, importcount, symcount, nodecount, rootcount = u32
+  symtaboffs, nodetaboffs, rootsoffs = u32 // offsets from start of header
+
+  pkg     = pkgroot pkgpath (<byte 0> | <byte 1> sha256)
+  pkgroot = bytes
+  pkgpath = bytes
+  srcfile = bytes
+  sha256  = <byte>{32}
+
+  symtab  = symoffs{symcount + 1} symdata
+  symoffs = u32 // offset into symdata; symbol N is symdata[symoffs[N]:symoffs[N+1]]
+  symdata = <byte>*
+
+  nodetab = u32{nodecount} // offset of each node from start of header
+
+  node     = nodebase typeid? field*
+  nodebase = kind flags nuse reserved loc                              // encnode_t
+  kind     = u32 // kind tag, see g_ast_kindtagtab
+  flags, nuse, reserved = u32
+  loc      = u64
+  typeid   = strz             // only present for types (and not universal types)
+  field    = uint | f64 | ref | strz | nodearray
+  uint     = varint           // including loc_t
+  f64      = u64
+  ref      = varint           // symbolid+1 or nodeid+1, or 0 for NULL
+  strz     = varint <byte>*   // length+1 followed by bytes, or 0 for NULL
+  nodearray = varint nodeid_varint*
+  nodeid_varint = varint
+
+  root     = nodeid rootname
+  nodeid   = u32
+  rootname = u32              // symbolid+1 of the declared name, or 0 if unnamed
+  bytes    = varint <byte>*   // length followed by bytes
+  varint   = <byte>{1,10}     // unsigned LEB128
+  u32      = <byte>{4}        // little endian
+  u64      = <byte>{8}        // little endian
+
+Nodes are stored children first, so that a node only ever refers to nodes before it.
+Fixed-size data (header, symtab, nodetab, nodebase and roots) is naturally aligned
+so that the decoder can read it directly from the (page-aligned) input buffer.
+Symbols are interned lazily by the decoder, as they are referenced.
+Universal types are encoded solely by nodebase.kind.
+Roots carry the name they declare (see pkg_api_member_name), which together with
+nodetab allows a decoder to decode a single declaration (and the nodes it refers to)
+by name without decoding anything else; see astdecoder_decode_root.
+
+
+Text format (version 1):
 
   root = header
          pkg
@@ -67,13 +140,15 @@ AST encoding format:
 #include "compiler.h"
 #include "path.h"
 #include "hash.h"
+#include "leb128.h"
 #include "sha256.h"
 
 
 #define FILE_MAGIC "cAST"
-#define AST_ENC_VERSION 1
+#define AST_ENC_VERSION      3 // binary format
+#define AST_ENC_VERSION_TEXT 1 // text format
 #define AST_ENC_EXCLUDED_NODEFLAGS \
-    NF_MARK1 | NF_MARK2
+    (NF_MARK1 | NF_MARK2)
 
 // DEBUG_LOG_ENCODE_STATS: define to dlog some encoder stats
 //#define DEBUG_LOG_ENCODE_STATS
@@ -89,6 +164,32 @@ inline static u64 f64_to_u64(f64 v) { return *(u64*)&v; }
 inline static f64 u64_to_f64(u64 v) { return *(f64*)&v; }
 
 
+// encheader_t is the header of the binary format
+typedef struct {
+  u8  magic[4];
+  u32 version;
+  u32 srccount;
+  u32 importcount;
+  u32 symcount;
+  u32 nodecount;
+  u32 rootcount;
+  u32 symtaboffs;  // offset of symtab
+  u32 nodetaboffs; // offset of nodetab
+  u32 rootsoffs;   // offset of roots
+} encheader_t;
+static_assert(sizeof(encheader_t) == 40, "");
+
+// encnode_t is the fixed-layout part of a node in the binary format
+typedef struct {
+  u32 kind;  // kind tag
+  u32 flags;
+  u32 nuse;
+  u32 reserved;
+  u64 loc;   // with document-local srcfile ID
+} encnode_t;
+static_assert(sizeof(encnode_t) == 24, "");
+
+
 //———————————————————————————————————————————————————————————————————————————————————————
 // encoder
 
@@ -442,7 +543,7 @@ static void encode_node(astencoder_t* a, buf_t* outbuf, const node_t* n) {
 static void encode_header(astencoder_t* a, buf_t* outbuf) {
   char* p = outbuf->chars + outbuf->len;
   memcpy(p, FILE_MAGIC, 4); p += 4; *p++ = ' ';
-  p += fmt_u64_base16(p, 8, AST_ENC_VERSION); *p++ = ' ';
+  p += fmt_u64_base16(p, 8, AST_ENC_VERSION_TEXT); *p++ = ' ';
   p += fmt_u64_base16(p, 8, a->srcfileids.len); *p++ = ' ';
   p += fmt_u64_base16(p, 8, a->pkg->imports.len); *p++ = ' ';
   p += fmt_u64_base16(p, 8, a->symmap.len); *p++ = ' ';
@@ -524,7 +625,7 @@ static usize enc_preallocsize(astencoder_t* a) {
   // "the worst"; we will most certainly need to use more space than what
   // we allocate since certain node fields require buffer expansion.
   usize nbyte = 4 + 1  // magic SP
-              + ndigits16(AST_ENC_VERSION) + 1  // version SP
+              + ndigits16(AST_ENC_VERSION_TEXT) + 1  // version SP
               + 8 + 1  // srccount SP
               + 8 + 1  // importcount SP
               + 8 + 1  // symcount SP
@@ -578,12 +679,7 @@ static usize enc_preallocsize(astencoder_t* a) {
 }
 
 
-err_t astencoder_encode(astencoder_t* a, buf_t* outbuf) {
-  assertf(a->pkg != NULL, "astencoder_begin not called before astencoder_encode");
-
-  if (a->oom)
-    return ErrNoMem;
-
+static err_t encode_text(astencoder_t* a, buf_t* outbuf) {
   // allocate space in outbuf
   usize nbyte = enc_preallocsize(a);
   if (a->oom)
@@ -632,6 +728,245 @@ err_t astencoder_encode(astencoder_t* a, buf_t* outbuf) {
 }
 
 
+//———————————————————————————————————————————————————————————————————————————————————————
+// binary encoder
+
+
+// benc_align pads outbuf with zeroes so that its length, relative to base, is
+// aligned to align
+static void benc_align(astencoder_t* a, buf_t* outbuf, usize base, usize align) {
+  usize len = outbuf->len - base;
+  usize npad = ALIGN2(len, align) - len;
+  if (npad)
+    a->oom |= !buf_fill(outbuf, 0, npad);
+}
+
+
+static void benc_uint(astencoder_t* a, buf_t* outbuf, u64 v) {
+  a->oom |= !buf_print_leb128_u64(outbuf, v);
+}
+
+
+static void benc_u32(astencoder_t* a, buf_t* outbuf, u32 v) {
+  v = co_htole(v);
+  a->oom |= !buf_append(outbuf, &v, sizeof(v));
+}
+
+
+// benc_set_u32 overwrites a u32 previously written at offs
+static void benc_set_u32(astencoder_t* a, buf_t* outbuf, usize offs, u32 v) {
+  if (a->oom)
+    return;
+  assert(offs + sizeof(v) <= outbuf->len);
+  v = co_htole(v);
+  memcpy(outbuf->bytes + offs, &v, sizeof(v));
+}
+
+
+static void benc_bytes(astencoder_t* a, buf_t* outbuf, const void* p, usize len) {
+  benc_uint(a, outbuf, len);
+  a->oom |= !buf_append(outbuf, p, len);
+}
+
+
+static void benc_strz(astencoder_t* a, buf_t* outbuf, const void* nullable p, usize len) {
+  if (!p)
+    return benc_uint(a, outbuf, 0);
+  benc_uint(a, outbuf, (u64)len + 1);
+  a->oom |= !buf_append(outbuf, p, len);
+}
+
+
+static void benc_pkg(astencoder_t* a, buf_t* outbuf, const pkg_t* pkg) {
+  benc_bytes(a, outbuf, pkg->root.p, pkg->root.len);
+  benc_bytes(a, outbuf, pkg->path.p, pkg->path.len);
+  bool has_api_sha256 = !sha256_iszero(&pkg->api_sha256);
+  a->oom |= !buf_push(outbuf, (u8)has_api_sha256);
+  if (has_api_sha256)
+    a->oom |= !buf_append(outbuf, &pkg->api_sha256, sizeof(pkg->api_sha256));
+}
+
+
+static void benc_field(astencoder_t* a, buf_t* outbuf, const void* fp, ast_field_t f) {
+  // set fp to point to the field's data
+  fp += f.offs;
+
+  u64 u64val;
+
+  switch ((enum ast_fieldtype)f.type) {
+  case AST_FIELD_U8:   u64val = *(u8*)fp; goto enc_uint;
+  case AST_FIELD_U16:  u64val = *(u16*)fp; goto enc_uint;
+  case AST_FIELD_U32:  u64val = *(u32*)fp; goto enc_uint;
+  case AST_FIELD_U64:  u64val = *(u64*)fp; goto enc_uint;
+  case AST_FIELD_LOC:  u64val = enc_remap_loc(a, *(loc_t*)fp); goto enc_uint;
+  case AST_FIELD_F64:
+    u64val = co_htole(f64_to_u64(*(f64*)fp));
+    a->oom |= !buf_append(outbuf, &u64val, sizeof(u64val));
+    return;
+  case AST_FIELD_SYM:
+  case AST_FIELD_SYMZ:
+    u64val = *(sym_t*)fp ? (u64)encoded_sym_index(a, *(sym_t*)fp) + 1 : 0;
+    goto enc_uint;
+  case AST_FIELD_NODE:
+  case AST_FIELD_NODEZ:
+    u64val = *(node_t**)fp ? (u64)encoded_node_index(a, *(node_t**)fp) + 1 : 0;
+    goto enc_uint;
+  case AST_FIELD_STR:
+  case AST_FIELD_STRZ: {
+    const char* str = *(const char**)fp;
+    return benc_strz(a, outbuf, str, str ? strlen(str) : 0);
+  }
+  case AST_FIELD_NODEARRAY: {
+    const nodearray_t* na = fp;
+    benc_uint(a, outbuf, na->len);
+    for (u32 i = 0; i < na->len; i++)
+      benc_uint(a, outbuf, encoded_node_index(a, na->v[i]));
+    return;
+  }
+  case AST_FIELD_UNDEF: break;
+  }
+  UNREACHABLE;
+
+enc_uint:
+  benc_uint(a, outbuf, u64val);
+}
+
+
+static void benc_node(
+  astencoder_t* a, buf_t* outbuf, usize base, usize nodetaboffs, u32 node_id)
+{
+  const node_t* n = a->nodelist.v[node_id];
+  assertf(n->kind < NODEKIND_COUNT, "%s %u", nodekind_name(n->kind), n->kind);
+
+  // nodes are aligned so that the decoder can read encnode_t in place
+  benc_align(a, outbuf, base, 8);
+  usize offs = outbuf->len - base;
+  encnode_t* en = buf_alloc(outbuf, sizeof(encnode_t));
+  if UNLIKELY(!en) {
+    a->oom = true;
+    return;
+  }
+  memset(en, 0, sizeof(*en));
+  benc_set_u32(a, outbuf, base + nodetaboffs + (usize)node_id*4, (u32)offs);
+
+  en->kind = co_htole(g_ast_kindtagtab[n->kind]);
+
+  // universal type is encoded solely by kind
+  const ast_field_t* fieldtab = g_ast_fieldtab[n->kind];
+  if (fieldtab == g_fieldsof_type_t)
+    return;
+
+  en->flags = co_htole((u32)(n->flags & ~AST_ENC_EXCLUDED_NODEFLAGS));
+  en->nuse = co_htole(n->nuse);
+  en->loc = co_htole((u64)enc_remap_loc(a, n->loc));
+  // note: en is invalid from here on, as outbuf may be reallocated
+
+  // special attributes of type_t
+  if (nodekind_istype(n->kind)) {
+    typeid_t typeid = ((type_t*)n)->_typeid;
+    benc_strz(a, outbuf, typeid ? typeid->bytes : NULL, typeid ? typeid->len : 0);
+  }
+
+  // encode fields
+  for (u8 i = 0; i < g_ast_fieldlentab[n->kind]; i++)
+    benc_field(a, outbuf, n, fieldtab[i]);
+}
+
+
+static err_t encode_bin(astencoder_t* a, buf_t* outbuf) {
+  // offsets are relative to the start of the header
+  usize base = outbuf->len;
+
+  // Reserve space for fixed-size data and an estimate of the rest.
+  // Buffer overflow is not a concern here; buf_ functions grow outbuf as needed.
+  usize nbyte = sizeof(encheader_t)
+              + a->symsize + ((usize)a->symmap.len + 1) * 4
+              + (usize)a->nodelist.len * (sizeof(encnode_t) + 4 + 8)
+              + (usize)a->rootlist.len * 8;
+  BUF_RESERVE(nbyte, ErrNoMem);
+
+  // header (offsets are set at the end)
+  encheader_t* h = buf_alloc(outbuf, sizeof(encheader_t));
+  assertnotnull(h); // we reserved space above
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, FILE_MAGIC, 4);
+  h->version     = co_htole((u32)AST_ENC_VERSION);
+  h->srccount    = co_htole(a->srcfileids.len);
+  h->importcount = co_htole(a->pkg->imports.len);
+  h->symcount    = co_htole(a->symmap.len);
+  h->nodecount   = co_htole(a->nodelist.len);
+  h->rootcount   = co_htole(a->rootlist.len);
+
+  // pkg, srcfiles and imports
+  benc_pkg(a, outbuf, a->pkg);
+  for (u32 i = 0; i < a->srcfileids.len; i++) {
+    const srcfile_t* srcfile = locmap_srcfile(&a->c->locmap, a->srcfileids.v[i]);
+    assertf(a->pkg == srcfile->pkg,
+      "srcfiles from mixed packages %s (%p) and %s (%p)",
+      a->pkg->path.p, a->pkg, srcfile->pkg->path.p, srcfile->pkg);
+    benc_bytes(a, outbuf, srcfile->name.p, srcfile->name.len);
+  }
+  for (u32 i = 0; i < a->pkg->imports.len; i++)
+    benc_pkg(a, outbuf, a->pkg->imports.v[i]);
+
+  // symtab
+  benc_align(a, outbuf, base, 4);
+  usize symtaboffs = outbuf->len - base;
+  u32 symoffs = 0;
+  for (u32 i = 0; i < a->symmap.len; i++) {
+    benc_u32(a, outbuf, symoffs);
+    symoffs += (u32)strlen(a->symmap.v[i]);
+  }
+  benc_u32(a, outbuf, symoffs);
+  for (u32 i = 0; i < a->symmap.len; i++) {
+    sym_t sym = a->symmap.v[i];
+    a->oom |= !buf_append(outbuf, sym, strlen(sym));
+  }
+
+  // nodetab (populated by benc_node) and nodes
+  benc_align(a, outbuf, base, 4);
+  usize nodetaboffs = outbuf->len - base;
+  a->oom |= !buf_fill(outbuf, 0, (usize)a->nodelist.len * 4);
+  for (u32 i = 0; i < a->nodelist.len && !a->oom; i++)
+    benc_node(a, outbuf, base, nodetaboffs, i);
+
+  // roots
+  benc_align(a, outbuf, base, 4);
+  usize rootsoffs = outbuf->len - base;
+  for (u32 i = 0; i < a->rootlist.len; i++) {
+    u32 node_id = a->rootlist.v[i];
+    sym_t name = pkg_api_member_name(a->nodelist.v[node_id]);
+    benc_u32(a, outbuf, node_id);
+    benc_u32(a, outbuf, name == sym__ ? 0 : encoded_sym_index(a, name) + 1);
+  }
+
+  if (a->oom)
+    return ErrNoMem;
+
+  // offsets are u32
+  if (outbuf->len - base > U32_MAX)
+    return ErrOverflow;
+
+  benc_set_u32(a, outbuf, base + offsetof(encheader_t, symtaboffs), (u32)symtaboffs);
+  benc_set_u32(a, outbuf, base + offsetof(encheader_t, nodetaboffs), (u32)nodetaboffs);
+  benc_set_u32(a, outbuf, base + offsetof(encheader_t, rootsoffs), (u32)rootsoffs);
+
+  return 0;
+}
+
+
+err_t astencoder_encode(astencoder_t* a, buf_t* outbuf, u32 flags) {
+  assertf(a->pkg != NULL, "astencoder_begin not called before astencoder_encode");
+
+  if (a->oom)
+    return ErrNoMem;
+
+  if (flags & ASTENCODER_TEXT)
+    return encode_text(a, outbuf);
+  return encode_bin(a, outbuf);
+}
+
+
 // ———————————————— adding AST to be encoded ————————————————
 
 
@@ -926,6 +1261,13 @@ err_t astencoder_add_ast(astencoder_t* a, const node_t* n, u32 flags) {
   // register symbols of added nodes
   for (u32 i = nodelist_start; i < a->nodelist.len; i++)
     reg_syms(a, a->nodelist.v[i]);
+
+  // register the name n is declared as, which is not always a symbol of any node
+  // (e.g. a template instance; see pkg_api_member_name)
+  sym_t name = pkg_api_member_name(n);
+  if (name != sym__)
+    reg_sym(a, name);
+
   if (a->oom)
     return ErrNoMem;
 
@@ -1007,6 +1349,11 @@ typedef struct astdecoder_ {
   sym_t*      symtab;      // ID => sym_t
   node_t**    nodetab;     // ID => node_t*
   u32*        srctab;      // ID => srcfileid (document local ID => global ID)
+  const u32*  symoffs;     // binary format: symcount+1 offsets into symdata
+  const u8*   symdata;     // binary format: symbol names
+  const u32*  nodeoffs;    // binary format: offset of each node
+  const u32*  roots;       // binary format: rootcount (nodeid, rootname) pairs
+  u32         nodelimit;   // binary format: node refs must be less than this
   nodearray_t tmpnodearray;
   memalloc_t  ma;
   memalloc_t  ast_ma;
@@ -1025,6 +1372,9 @@ typedef struct astdecoder_ {
 
 #define DEC_DATA_AVAIL  ((usize)(uintptr)(pend - p))
 
+// DEC_ISBIN is true if the binary format is being decoded
+#define DEC_ISBIN(d)  ((d)->version == AST_ENC_VERSION)
+
 
 const char* astdecoder_srcname(const astdecoder_t* d) {
   return d->srcname;
@@ -1056,6 +1406,12 @@ static const u8* dec_error(DEC_PARAMS, err_t err) {
     return pend;
   d->err = err;
 
+  if (DEC_ISBIN(d)) {
+    elog("AST decoding error: %s: at offset 0x%zx",
+      d->srcname, (usize)(uintptr)(p - d->pstart));
+    return pend;
+  }
+
   u32 line, col;
   decoder_error_loc(DEC_ARGS, &line, &col);
   //usize offs = (usize)(uintptr)(p - d->pstart);
@@ -1124,6 +1480,18 @@ static const u8* dec_u8x(DEC_PARAMS, u8* result) {
   return p;
 }
 
+// dec_remap_loc re-maps the document-local srcfile ID of loc to a global ID
+static const u8* dec_remap_loc(DEC_PARAMS, loc_t loc, loc_t* result) {
+  u32 doc_srcfileid = loc_srcfileid(loc);
+  if (doc_srcfileid > 0) {
+    if UNLIKELY(doc_srcfileid > d->srccount)
+      return DEC_ERROR(ErrNotFound, "invalid srcfile ID %u", doc_srcfileid);
+    // dlog("re-map srcfileid %u => %u", doc_srcfileid, d->srctab[doc_srcfileid - 1]);
+    *result = loc_with_srcfileid(loc, d->srctab[doc_srcfileid - 1]);
+  }
+  return p;
+}
+
 static const u8* dec_loc(DEC_PARAMS, loc_t* result) {
   static_assert(sizeof(u64) == sizeof(loc_t), "");
 
@@ -1133,15 +1501,7 @@ static const u8* dec_loc(DEC_PARAMS, loc_t* result) {
     return p;
 
   // re-map document-local ID to global ID
-  u32 doc_srcfileid = loc_srcfileid(loc);
-  if (doc_srcfileid > 0) {
-    if UNLIKELY(doc_srcfileid > d->srccount)
-      return DEC_ERROR(ErrNotFound, "invalid srcfile ID %u", doc_srcfileid);
-    // dlog("re-map srcfileid %u => %u", doc_srcfileid, d->srctab[doc_srcfileid - 1]);
-    *result = loc_with_srcfileid(loc, d->srctab[doc_srcfileid - 1]);
-  }
-
-  return p;
+  return dec_remap_loc(DEC_ARGS, loc, result);
 }
 
 static const u8* dec_f64x(DEC_PARAMS, f64* result) {
@@ -1430,7 +1790,7 @@ static const u8* decode_header(DEC_PARAMS) {
   p = dec_u32x(DEC_ARGS, &d->version);
   p = dec_whitespace(DEC_ARGS);
 
-  if (d->version != AST_ENC_VERSION && !d->err) {
+  if (d->version != AST_ENC_VERSION_TEXT && !d->err) {
     dlog("unsupported version: %u", d->version);
     d->err = ErrNotSupported;
   }
@@ -1470,34 +1830,67 @@ static const u8* decode_bytes_untilchar(
 }
 
 
-static const u8* decode_pkg(DEC_PARAMS, pkg_t* pkg) {
-  // pkg = pkgroot ":" pkgpath (":" sha256x)? LF
-  const char* linep;
-  usize linelen;
+// dec_setpkg verifies and assigns the root and path of a decoded package
+static const u8* dec_setpkg(DEC_PARAMS, pkg_t* pkg, slice_t root, slice_t path) {
   bool ok = true;
 
   // pkg.root
-  p = decode_bytes_untilchar(DEC_ARGS, &linep, &linelen, ':');
   if UNLIKELY(
     pkg->root.len > 0 && coverbose &&
-    (pkg->root.len != linelen || memcmp(pkg->root.p, linep, linelen) != 0) )
+    (pkg->root.len != root.len || memcmp(pkg->root.p, root.p, root.len) != 0) )
   {
     // elog(
     //   "[astdecoder] warning: %s: unexpected pkg root \"%.*s\""
     //   " (expected \"%s\"; using expected path)",
-    //   relpath(d->srcname), (int)linelen, linep, pkg->root.p);
+    //   relpath(d->srcname), (int)root.len, root.chars, pkg->root.p);
     dlog("%s: unexpected pkg root \"%.*s\" (expected \"%s\")",
-      relpath(d->srcname), (int)linelen, linep, pkg->root.p);
+      relpath(d->srcname), (int)root.len, root.chars, pkg->root.p);
     // this is a "soft" error, so not using DEC_ERROR
     d->err = ErrInvalid;
     return pend;
   } else {
     pkg->root.len = 0;
-    ok &= str_appendlen(&pkg->root, linep, linelen);
+    ok &= str_appendlen(&pkg->root, root.p, root.len);
   }
 
+  // check pkg.path
+  if UNLIKELY(
+    pkg->path.len > 0 &&
+    (pkg->path.len != path.len || memcmp(pkg->path.p, path.p, path.len) != 0) )
+  {
+    d->err = ErrInvalid;
+    if (coverbose) {
+      elog("[astdecoder] error: %s: unexpected pkg path \"%.*s\" (expected \"%s\")",
+        relpath(d->srcname), (int)path.len, path.chars, pkg->path.p);
+    }
+    return p;
+  }
+  pkg->path.len = 0;
+  ok &= str_appendlen(&pkg->path, path.p, path.len);
+
+  // pkg.dir
+  pkg->dir.len = 0;
+  ok &= pkg_dir_of_root_and_path(&pkg->dir, str_slice(pkg->root), str_slice(pkg->path));
+
+  if UNLIKELY(!ok)
+    return DEC_ERROR(ErrNoMem, "OOM");
+  return p;
+}
+
+
+static const u8* decode_pkg(DEC_PARAMS, pkg_t* pkg) {
+  // pkg = pkgroot ":" pkgpath (":" sha256x)? LF
+  const char* linep;
+  usize linelen;
+
+  // pkg.root
+  p = decode_bytes_untilchar(DEC_ARGS, &linep, &linelen, ':');
+  slice_t root = { .chars = linep, .len = linelen };
+
   // pkg.path
   p = decode_bytes_untilchar(DEC_ARGS, &linep, &linelen, '\n');
+  if (d->err)
+    return p;
 
   // decode optional (":" sha256x)?
   isize coloni = string_lastindexof(linep, linelen, ':');
@@ -1520,28 +1913,131 @@ static const u8* decode_pkg(DEC_PARAMS, pkg_t* pkg) {
     linelen = (usize)coloni;
   }
 
-  // check pkg.path
-  if UNLIKELY(
-    pkg->path.len > 0 &&
-    (pkg->path.len != linelen || memcmp(pkg->path.p, linep, linelen) != 0) )
+  slice_t path = { .chars = linep, .len = linelen };
+  return dec_setpkg(DEC_ARGS, pkg, root, path);
+}
+
+
+// ———————————————— binary format ————————————————
+
+
+// bdec_uint decodes a LEB128 varint
+static const u8* bdec_uint(DEC_PARAMS, u64* result, u64 limit) {
+  int n = leb128_read(result, 64, p, pend);
+  if UNLIKELY(n < 0)
+    return DEC_ERROR((err_t)n, "invalid varint");
+  if UNLIKELY(p[n - 1] & 0x80)
+    return DEC_ERROR(ErrInvalid, "end of input");
+  if UNLIKELY(*result > limit)
+    return DEC_ERROR(ErrOverflow, "value too large");
+  return p + n;
+}
+
+
+static const u8* bdec_bytes(DEC_PARAMS, const char** startp, usize* lenp) {
+  u64 len;
+  p = bdec_uint(DEC_ARGS, &len, USIZE_MAX);
+  if UNLIKELY(d->err || len > DEC_DATA_AVAIL) {
+    *startp = "";
+    *lenp = 0;
+    return DEC_ERROR(ErrInvalid, "truncated data");
+  }
+  *startp = (const char*)p;
+  *lenp = (usize)len;
+  return p + len;
+}
+
+
+static const u8* bdecode_header(DEC_PARAMS) {
+  if (DEC_DATA_AVAIL < sizeof(encheader_t)) {
+    dlog("header too small");
+    d->err = ErrInvalid;
+    return p;
+  }
+
+  // the header, symtab, nodetab and nodes are read in place
+  if (!IS_ALIGN2((uintptr)p, 8)) {
+    dlog("misaligned input %p", p);
+    d->err = ErrInvalid;
+    return p;
+  }
+
+  const encheader_t* h = (const encheader_t*)p;
+  if (memcmp(h->magic, FILE_MAGIC, 4) != 0) {
+    dlog("invalid header magic: %02x%02x%02x%02x", p[0], p[1], p[2], p[3]);
+    d->err = ErrInvalid;
+    return p;
+  }
+
+  u32 version = co_htole(h->version);
+  if (version != AST_ENC_VERSION) {
+    dlog("unsupported version: %u", version);
+    d->err = ErrNotSupported;
+    return p;
+  }
+  d->version = version;
+
+  d->srccount = co_htole(h->srccount);
+  d->importcount = co_htole(h->importcount);
+  d->symcount = co_htole(h->symcount);
+  d->nodecount = co_htole(h->nodecount);
+  d->rootcount = co_htole(h->rootcount);
+
+  // verify that tables are within bounds
+  u64 size = (u64)(uintptr)(pend - d->pstart);
+  u64 symtaboffs = co_htole(h->symtaboffs);
+  u64 nodetaboffs = co_htole(h->nodetaboffs);
+  u64 rootsoffs = co_htole(h->rootsoffs);
+  u64 symdataoffs = symtaboffs + ((u64)d->symcount + 1)*4;
+  if (!IS_ALIGN2(symtaboffs, 4) || !IS_ALIGN2(nodetaboffs, 4) || !IS_ALIGN2(rootsoffs, 4) ||
+      symtaboffs < sizeof(encheader_t) ||
+      symdataoffs > nodetaboffs ||
+      nodetaboffs + (u64)d->nodecount*4 > size ||
+      rootsoffs + (u64)d->rootcount*8 > size ||
+      d->rootcount > d->nodecount)
   {
+    dlog("invalid header");
     d->err = ErrInvalid;
-    if (coverbose) {
-      elog("[astdecoder] error: %s: unexpected pkg path \"%.*s\" (expected \"%s\")",
-        relpath(d->srcname), (int)linelen, linep, pkg->path.p);
-    }
     return p;
   }
-  pkg->path.len = 0;
-  ok &= str_appendlen(&pkg->path, linep, linelen);
+  d->symoffs = (const u32*)(d->pstart + symtaboffs);
+  d->symdata = d->pstart + symdataoffs;
+  d->nodeoffs = (const u32*)(d->pstart + nodetaboffs);
+  d->roots = (const u32*)(d->pstart + rootsoffs);
+  d->nodelimit = d->nodecount;
+
+  // verify symbol offsets, so that symbols can be interned without checks later on
+  u32 prevoffs = 0;
+  for (u32 i = 0; i <= d->symcount; i++) {
+    u32 offs = co_htole(d->symoffs[i]);
+    if UNLIKELY(offs < prevoffs || symdataoffs + offs > nodetaboffs) {
+      dlog("invalid symbol offset");
+      d->err = ErrInvalid;
+      return p;
+    }
+    prevoffs = offs;
+  }
 
-  // pkg.dir
-  pkg->dir.len = 0;
-  ok &= pkg_dir_of_root_and_path(&pkg->dir, str_slice(pkg->root), str_slice(pkg->path));
+  return p + sizeof(encheader_t);
+}
 
-  if UNLIKELY(!ok)
-    return DEC_ERROR(ErrNoMem, "OOM");
-  return p;
+
+static const u8* bdecode_pkg(DEC_PARAMS, pkg_t* pkg) {
+  // pkg = pkgroot pkgpath (<byte 0> | <byte 1> sha256)
+  slice_t root, path;
+  p = bdec_bytes(DEC_ARGS, &root.chars, &root.len);
+  p = bdec_bytes(DEC_ARGS, &path.chars, &path.len);
+  if (d->err)
+    return p;
+  if UNLIKELY(DEC_DATA_AVAIL < 1)
+    return DEC_ERROR(ErrInvalid, "truncated data");
+  if (*p++) {
+    if UNLIKELY(DEC_DATA_AVAIL < sizeof(pkg->api_sha256))
+      return DEC_ERROR(ErrInvalid, "truncated data");
+    memcpy(&pkg->api_sha256, p, sizeof(pkg->api_sha256));
+    p += sizeof(pkg->api_sha256);
+  }
+  return dec_setpkg(DEC_ARGS, pkg, root, path);
 }
 
 
@@ -1565,7 +2061,13 @@ static const u8* decode_srcfiles(DEC_PARAMS, pkg_t* pkg) {
   for (u32 i = 0; i < d->srccount; i++) {
     const char* linep;
     usize linelen;
-    p = decode_bytes_untilchar(DEC_ARGS, &linep, &linelen, '\n');
+    if (DEC_ISBIN(d)) {
+      p = bdec_bytes(DEC_ARGS, &linep, &linelen);
+    } else {
+      p = decode_bytes_untilchar(DEC_ARGS, &linep, &linelen, '\n');
+    }
+    if (d->err)
+      return p;
 
     // allocate or retrieve srcfile for pkg
     srcfile_t* srcfile = pkg_add_srcfile(pkg, linep, linelen, NULL);
@@ -1591,7 +2093,11 @@ static const u8* decode_imports(DEC_PARAMS, pkg_t* pkg, sha256_t* api_sha256v) {
     tmp.dir.len = 0;
     tmp.root.len = 0;
     tmp.path.len = 0;
-    p = decode_pkg(DEC_ARGS, &tmp);
+    if (DEC_ISBIN(d)) {
+      p = bdecode_pkg(DEC_ARGS, &tmp);
+    } else {
+      p = decode_pkg(DEC_ARGS, &tmp);
+    }
     if (d->err)
       break;
 
@@ -1641,7 +2147,7 @@ static const u8* decode_symtab(DEC_PARAMS) {
 }
 
 
-static const u8* decode_universal_node(DEC_PARAMS, u32 node_id, nodekind_t kind) {
+static node_t* universal_node(nodekind_t kind) {
   node_t* n = NULL;
   switch (kind) {
     case TYPE_VOID:    n = (node_t*)type_void; break;
@@ -1663,6 +2169,12 @@ static const u8* decode_universal_node(DEC_PARAMS, u32 node_id, nodekind_t kind)
       assertf(0, "unexpected node kind %s", nodekind_name(kind));
       UNREACHABLE;
   }
+  return n;
+}
+
+
+static const u8* decode_universal_node(DEC_PARAMS, u32 node_id, nodekind_t kind) {
+  node_t* n = universal_node(kind);
 
   // dlog("nodetab[%u] = (universal node of kind %s)", node_id, nodekind_name(n->kind));
   d->nodetab[node_id] = n;
@@ -1674,6 +2186,19 @@ static const u8* decode_universal_node(DEC_PARAMS, u32 node_id, nodekind_t kind)
 }
 
 
+static void dec_intern_strtype(astdecoder_t* d, u32 node_id, const node_t* n) {
+  assert(d->c->strtype.kind == TYPE_ALIAS);
+  if (
+    n->kind == TYPE_ALIAS &&
+    ((aliastype_t*)n)->name == sym_str &&
+    ((aliastype_t*)n)->mangledname &&
+    strcmp(d->c->strtype.mangledname, ((aliastype_t*)n)->mangledname) == 0)
+  {
+    d->nodetab[node_id] = (node_t*)&d->c->strtype;
+  }
+}
+
+
 static const u8* decode_node(DEC_PARAMS, u32 node_id) {
   const usize kMinEncNodeSize = strlen("XXXX 0 0 0\n");
   if UNLIKELY(DEC_DATA_AVAIL < kMinEncNodeSize)
@@ -1734,16 +2259,7 @@ static const u8* decode_node(DEC_PARAMS, u32 node_id) {
   // dlog("nodetab[%u] = (kind %s, flags 0x%04x, loc 0x%llx)",
   //   node_id, nodekind_name(n->kind), n->flags, n->loc);
 
-  // intern strtype
-  assert(d->c->strtype.kind == TYPE_ALIAS);
-  if (
-    n->kind == TYPE_ALIAS &&
-    ((aliastype_t*)n)->name == sym_str &&
-    ((aliastype_t*)n)->mangledname &&
-    strcmp(d->c->strtype.mangledname, ((aliastype_t*)n)->mangledname) == 0)
-  {
-    d->nodetab[node_id] = (node_t*)&d->c->strtype;
-  }
+  dec_intern_strtype(d, node_id, n);
 
   return p;
 }
@@ -1759,6 +2275,280 @@ static const u8* decode_nodes(DEC_PARAMS) {
 }
 
 
+// bdec_sym returns symbol by ID, interning it on first use
+static sym_t bdec_sym(astdecoder_t* d, u32 id) {
+  assert(id < d->symcount);
+  if (!d->symtab[id]) {
+    // note: offsets are verified by bdecode_header
+    u32 start = co_htole(d->symoffs[id]);
+    u32 end = co_htole(d->symoffs[id + 1]);
+    d->symtab[id] = sym_intern((const char*)d->symdata + start, end - start);
+  }
+  return d->symtab[id];
+}
+
+
+static const u8* bdec_symref(DEC_PARAMS, sym_t* dst, bool allow_null) {
+  u64 ref;
+  p = bdec_uint(DEC_ARGS, &ref, (u64)d->symcount);
+  if (d->err)
+    return p;
+  if (ref == 0) {
+    if UNLIKELY(!allow_null)
+      return DEC_ERROR(ErrInvalid, "NULL where null is not allowed");
+    *dst = NULL;
+    return p;
+  }
+  *dst = bdec_sym(d, (u32)ref - 1);
+  return p;
+}
+
+
+static const u8* bdecode_node(DEC_PARAMS, u32 node_id);
+
+
+// bdec_node returns node by ID, decoding it if needed.
+// Nodes are stored children first, so when decoding all nodes in order, every
+// reference is to an already-decoded node. When decoding lazily (astdecoder_decode_root)
+// referenced nodes are decoded on demand.
+static const u8* bdec_node(DEC_PARAMS, u64 id, node_t** dst) {
+  // d->nodelimit guards against cycles
+  if UNLIKELY(id >= d->nodelimit)
+    return DEC_ERROR(ErrInvalid, "invalid node reference 0x%llx", id);
+  if (!d->nodetab[id]) {
+    bdecode_node(DEC_ARGS, (u32)id);
+    if (d->err)
+      return pend;
+  }
+  *dst = d->nodetab[id];
+  return p;
+}
+
+
+static const u8* bdec_nodeid(DEC_PARAMS, node_t** dst) {
+  u64 id;
+  p = bdec_uint(DEC_ARGS, &id, U32_MAX);
+  if (d->err)
+    return p;
+  return bdec_node(DEC_ARGS, id, dst);
+}
+
+
+static const u8* bdec_noderef(DEC_PARAMS, node_t** dst, bool allow_null) {
+  u64 ref;
+  p = bdec_uint(DEC_ARGS, &ref, (u64)d->nodecount);
+  if (d->err)
+    return p;
+  if (ref == 0) {
+    if UNLIKELY(!allow_null)
+      return DEC_ERROR(ErrInvalid, "NULL where null is not allowed");
+    *dst = NULL;
+    return p;
+  }
+  return bdec_node(DEC_ARGS, ref - 1, dst);
+}
+
+
+static const u8* bdec_str(DEC_PARAMS, char** dstp, bool allow_null) {
+  u64 ref;
+  p = bdec_uint(DEC_ARGS, &ref, USIZE_MAX);
+  if (d->err)
+    return p;
+  if (ref == 0) {
+    if UNLIKELY(!allow_null)
+      return DEC_ERROR(ErrInvalid, "NULL where null is not allowed");
+    *dstp = NULL;
+    return p;
+  }
+  usize len = (usize)ref - 1;
+  if UNLIKELY(len > DEC_DATA_AVAIL)
+    return DEC_ERROR(ErrInvalid, "truncated data");
+  char* dst = mem_alloc(d->ast_ma, len + 1).p;
+  if UNLIKELY(!dst)
+    return DEC_ERROR(ErrNoMem, "out of memory");
+  memcpy(dst, p, len);
+  dst[len] = 0;
+  *dstp = dst;
+  return p + len;
+}
+
+
+static const u8* bdec_typeid(DEC_PARAMS, typeid_t* dstp) {
+  u64 ref;
+  p = bdec_uint(DEC_ARGS, &ref, U32_MAX);
+  if (d->err)
+    return p;
+  if (ref == 0) {
+    *dstp = NULL;
+    return p;
+  }
+  u32 len = (u32)ref - 1;
+  if UNLIKELY((usize)len > DEC_DATA_AVAIL)
+    return DEC_ERROR(ErrInvalid, "truncated data");
+
+  // build typeid_data_t, in tmpbuf when possible, and intern it
+  usize nbyte = sizeof(typeid_data_t) + (usize)len;
+  typeid_data_t* tid = (typeid_data_t*)d->tmpbuf;
+  if (nbyte > (usize)d->tmpbufcap) {
+    if (!( tid = mem_alloc(d->ma, nbyte).p ))
+      return DEC_ERROR(ErrNoMem, "out of memory");
+  }
+  tid->len = len;
+  memcpy(tid->bytes, p, len);
+  *dstp = typeid_intern_typeid(tid);
+  if ((u8*)tid != d->tmpbuf)
+    mem_freex(d->ma, MEM(tid, nbyte));
+  return p + len;
+}
+
+
+static const u8* bdec_nodearray(DEC_PARAMS, nodearray_t* dstp) {
+  u64 len;
+  p = bdec_uint(DEC_ARGS, &len, U32_MAX);
+  if (d->err)
+    return p;
+
+  if (len == 0) {
+    dstp->len = 0;
+    dstp->cap = 0;
+    return p;
+  }
+
+  // each node ID is at least one byte
+  if UNLIKELY(len > DEC_DATA_AVAIL)
+    return DEC_ERROR(ErrInvalid, "truncated data");
+
+  mem_t m = mem_alloc(d->ast_ma, (usize)len * sizeof(void*));
+  if UNLIKELY(m.p == NULL)
+    return DEC_ERROR(ErrNoMem, "mem_alloc %zu B", (usize)len * sizeof(void*));
+  node_t** v = m.p;
+
+  for (u32 i = 0; i < (u32)len && !d->err; i++)
+    p = bdec_nodeid(DEC_ARGS, &v[i]);
+  if (d->err)
+    return p;
+
+  dstp->v = v;
+  dstp->cap = m.size / sizeof(void*);
+  dstp->len = (u32)len;
+  return p;
+}
+
+
+static const u8* bdecode_field(DEC_PARAMS, void* fp, ast_field_t f) {
+  // set fp to point to the field of the node_t
+  fp += f.offs;
+
+  u64 u64val;
+
+  switch ((enum ast_fieldtype)f.type) {
+  case AST_FIELD_U8:
+    p = bdec_uint(DEC_ARGS, &u64val, 0xff);
+    *(u8*)fp = (u8)u64val;
+    return p;
+  case AST_FIELD_U16:
+    p = bdec_uint(DEC_ARGS, &u64val, 0xffff);
+    *(u16*)fp = (u16)u64val;
+    return p;
+  case AST_FIELD_U32:
+    p = bdec_uint(DEC_ARGS, &u64val, 0xffffffff);
+    *(u32*)fp = (u32)u64val;
+    return p;
+  case AST_FIELD_U64:
+    return bdec_uint(DEC_ARGS, fp, 0xffffffffffffffffllu);
+  case AST_FIELD_F64:
+    if UNLIKELY(DEC_DATA_AVAIL < 8)
+      return DEC_ERROR(ErrInvalid, "truncated data");
+    memcpy(&u64val, p, 8);
+    *(f64*)fp = u64_to_f64(co_htole(u64val));
+    return p + 8;
+  case AST_FIELD_LOC:
+    p = bdec_uint(DEC_ARGS, &u64val, 0xffffffffffffffffllu);
+    if (d->err)
+      return p;
+    *(loc_t*)fp = (loc_t)u64val;
+    return dec_remap_loc(DEC_ARGS, (loc_t)u64val, fp);
+  case AST_FIELD_SYM:       return bdec_symref(DEC_ARGS, fp, /*allow_null*/false);
+  case AST_FIELD_SYMZ:      return bdec_symref(DEC_ARGS, fp, /*allow_null*/true);
+  case AST_FIELD_NODE:      return bdec_noderef(DEC_ARGS, fp, /*allow_null*/false);
+  case AST_FIELD_NODEZ:     return bdec_noderef(DEC_ARGS, fp, /*allow_null*/true);
+  case AST_FIELD_STR:       return bdec_str(DEC_ARGS, fp, /*allow_null*/false);
+  case AST_FIELD_STRZ:      return bdec_str(DEC_ARGS, fp, /*allow_null*/true);
+  case AST_FIELD_NODEARRAY: return bdec_nodearray(DEC_ARGS, fp);
+  case AST_FIELD_UNDEF:     UNREACHABLE; break;
+  }
+
+  return p;
+}
+
+
+static const u8* bdecode_node(DEC_PARAMS, u32 node_id) {
+  // locate node via nodetab
+  usize offs = (usize)co_htole(d->nodeoffs[node_id]);
+  if UNLIKELY(
+    !IS_ALIGN2(offs, 8) || offs > (usize)(uintptr)(pend - d->pstart) - sizeof(encnode_t))
+  {
+    return DEC_ERROR(ErrInvalid, "invalid offset 0x%zx of node %u", offs, node_id);
+  }
+  p = d->pstart + offs;
+  const encnode_t* en = (const encnode_t*)p;
+  p += sizeof(encnode_t);
+
+  nodekind_t kind = nodekind_of_tag(co_htole(en->kind));
+  if UNLIKELY(kind == NODE_BAD)
+    return DEC_ERROR(ErrInvalid, "invalid node kind 0x%08x", co_htole(en->kind));
+
+  // get field table for kind
+  const ast_field_t* fieldtab = g_ast_fieldtab[kind];
+
+  // universal types are singletons compared by address
+  if (fieldtab == g_fieldsof_type_t) {
+    d->nodetab[node_id] = universal_node(kind);
+    return p;
+  }
+
+  // decode standard node, starting by allocating memory for the node struct
+  node_t* n = mem_alloc_zeroed(d->ast_ma, g_ast_sizetab[kind]).p;
+  if UNLIKELY(!n)
+    return DEC_ERROR(ErrNoMem);
+  n->kind = kind;
+  n->flags = (nodeflag_t)co_htole(en->flags) & ~AST_ENC_EXCLUDED_NODEFLAGS;
+  n->nuse = co_htole(en->nuse);
+  n->loc = (loc_t)co_htole(en->loc);
+  p = dec_remap_loc(DEC_ARGS, n->loc, &n->loc);
+
+  // read typeid
+  if (nodekind_istype(kind))
+    p = bdec_typeid(DEC_ARGS, &((type_t*)n)->_typeid);
+
+  // read fields, which may only refer to nodes stored before this one
+  u32 nodelimit = d->nodelimit;
+  d->nodelimit = node_id;
+  for (u8 i = 0; i < g_ast_fieldlentab[kind] && !d->err; i++)
+    p = bdecode_field(DEC_ARGS, n, fieldtab[i]);
+  d->nodelimit = nodelimit;
+  if (d->err)
+    return pend;
+
+  d->nodetab[node_id] = n;
+  dec_intern_strtype(d, node_id, n);
+
+  return p;
+}
+
+
+static const u8* bdecode_nodes(DEC_PARAMS) {
+  for (u32 node_id = 0; node_id < d->nodecount; node_id++) {
+    if (d->nodetab[node_id])
+      continue;
+    p = bdecode_node(DEC_ARGS, node_id);
+    if (d->err)
+      break;
+  }
+  return p;
+}
+
+
 static bool dec_tmptabs_alloc(astdecoder_t* d) {
   usize nbyte_nodetab = (usize)d->nodecount;
   usize nbyte_symtab = (usize)d->symcount;
@@ -1778,6 +2568,10 @@ static bool dec_tmptabs_alloc(astdecoder_t* d) {
     return false;
   }
 
+  // the binary decoder interns symbols lazily and checks for forward node references
+  if (p && DEC_ISBIN(d))
+    memset(p, 0, nbyte);
+
   d->nodetab = p;
   d->symtab = p + nbyte_nodetab;
 
@@ -1839,8 +2633,12 @@ err_t astdecoder_decode_header(astdecoder_t* d, pkg_t* pkg, u32* importcount) {
   const u8* p = d->pcurr;
   const u8* pend = d->pend;
 
-  // decode header
-  p = decode_header(DEC_ARGS);
+  // decode header (text format has SP after magic)
+  if (DEC_DATA_AVAIL > 4 && p[4] == ' ') {
+    p = decode_header(DEC_ARGS);
+  } else {
+    p = bdecode_header(DEC_ARGS);
+  }
   if (d->err) {
     dlog("decode_header: %s", err_str(d->err));
     goto end;
@@ -1855,7 +2653,11 @@ err_t astdecoder_decode_header(astdecoder_t* d, pkg_t* pkg, u32* importcount) {
     goto end;
   }
 
-  p = decode_pkg(DEC_ARGS, pkg);
+  if (DEC_ISBIN(d)) {
+    p = bdecode_pkg(DEC_ARGS, pkg);
+  } else {
+    p = decode_pkg(DEC_ARGS, pkg);
+  }
   if (d->err) {
     dlog("decode_pkg: %s", err_str(d->err));
     goto end;
@@ -1892,13 +2694,15 @@ err_t astdecoder_decode_ast(astdecoder_t* d, node_t** resultv[], u32* resultc) {
 
   node_t** roots = NULL;
 
-  // decode symbols
-  p = decode_symtab(DEC_ARGS);
-  if (d->err)
-    goto error;
-
-  // decode nodes
-  p = decode_nodes(DEC_ARGS);
+  if (DEC_ISBIN(d)) {
+    // decode nodes (symbols are decoded as they are referenced)
+    p = bdecode_nodes(DEC_ARGS);
+  } else {
+    // decode symbols, then nodes
+    p = decode_symtab(DEC_ARGS);
+    if (!d->err)
+      p = decode_nodes(DEC_ARGS);
+  }
   if (d->err)
     goto error;
 
@@ -1912,11 +2716,15 @@ err_t astdecoder_decode_ast(astdecoder_t* d, node_t** resultv[], u32* resultc) {
 
   // read root node IDs
   for (u32 i = 0, id; i < d->rootcount; i++) {
-    p = dec_u32x(DEC_ARGS, &id);
-    p = dec_byte(DEC_ARGS, '\n');
+    if (DEC_ISBIN(d)) {
+      id = co_htole(d->roots[i*2]);
+    } else {
+      p = dec_u32x(DEC_ARGS, &id);
+      p = dec_byte(DEC_ARGS, '\n');
+    }
     if (d->err)
       goto error;
-    if UNLIKELY(id > d->nodecount) {
+    if UNLIKELY(id >= d->nodecount) {
       dlog("invalid root %u; no such node", id);
       d->err = ErrInvalid;
       goto error;
@@ -1939,3 +2747,66 @@ error:
 end:
   return d->err;
 }
+
+
+err_t astdecoder_decode_rootnames(astdecoder_t* d, sym_t* namevp[], u32* countp) {
+  assertf(d->version > 0, "header not decoded");
+  if (d->err)
+    return d->err;
+  if (!DEC_ISBIN(d))
+    return ErrNotSupported;
+
+  // DEC_ARGS
+  const u8* p = d->pcurr;
+  const u8* pend = d->pend;
+
+  sym_t* namev = mem_alloc(d->ast_ma, (usize)d->rootcount * sizeof(sym_t)).p;
+  if (!namev && d->rootcount > 0)
+    return d->err = ErrNoMem;
+
+  for (u32 i = 0; i < d->rootcount; i++) {
+    u32 node_id = co_htole(d->roots[i*2]);
+    u32 ref = co_htole(d->roots[i*2 + 1]);
+    if UNLIKELY(node_id >= d->nodecount || ref > d->symcount) {
+      DEC_ERROR(ErrInvalid, "invalid root %u", i);
+      break;
+    }
+    namev[i] = ref ? bdec_sym(d, ref - 1) : sym__;
+  }
+
+  if (d->err) {
+    mem_freex(d->ast_ma, MEM(namev, (usize)d->rootcount * sizeof(sym_t)));
+    return d->err;
+  }
+
+  *namevp = namev;
+  *countp = d->rootcount;
+  return 0;
+}
+
+
+err_t astdecoder_decode_root(astdecoder_t* d, u32 index, node_t** result) {
+  assertf(d->version > 0, "header not decoded");
+  assertf(DEC_ISBIN(d), "lazy decoding requires the binary format");
+  if (d->err)
+    return d->err;
+  if (index >= d->rootcount)
+    return ErrInvalid;
+
+  // DEC_ARGS
+  const u8* p = d->pcurr;
+  const u8* pend = d->pend;
+
+  u32 node_id = co_htole(d->roots[index*2]);
+  if UNLIKELY(node_id >= d->nodecount) {
+    DEC_ERROR(ErrInvalid, "invalid root %u", index);
+    return d->err;
+  }
+
+  node_t* n;
+  bdec_node(DEC_ARGS, node_id, &n);
+  if (d->err)
+    return d->err;
+  *result = n;
+  return 0;
+}
@@ -8,13 +8,14 @@ An encoder can be used multiple times, e.g.
   for ( ... ) {
     astencoder_begin(astenc, compiler);
     astencoder_add_ast(astenc, node, flags);
-    astencoder_encode(astenc, outbuf);
+    astencoder_encode(astenc, outbuf, 0);
   }
   astencoder_free(astenc);
 
 A decoder has a different API since it is usually paused and resumed
 between learning what packages are imported, loading those packages
 and decoding the AST (which refers to the imported packages.)
+The decoder accepts both the binary and the text format.
 
   astdec = astdecoder_open(ma, ast_ma, locmap, srcname, src, srclen);
 
@@ -40,6 +41,9 @@ typedef struct astdecoder_ astdecoder_t;
 // flags for astencoder_add_ast
 #define ASTENCODER_PUB_API (1u << 0) // encode a public API
 
+// flags for astencoder_encode
+#define ASTENCODER_TEXT (1u << 0) // use text format instead of binary (for debugging)
+
 
 astencoder_t* nullable astencoder_create(compiler_t* c);
 void astencoder_free(astencoder_t* a);
@@ -48,7 +52,7 @@ void astencoder_begin(astencoder_t* a, const pkg_t* pkg);
 err_t astencoder_add_ast(astencoder_t* a, const node_t* n, u32 flags);
 err_t astencoder_add_srcfileid(astencoder_t* a, u32 srcfileid);
 err_t astencoder_add_srcfile(astencoder_t* a, const srcfile_t* srcfile);
-err_t astencoder_encode(astencoder_t* a, buf_t* outbuf);
+err_t astencoder_encode(astencoder_t* a, buf_t* outbuf, u32 flags);
 
 
 astdecoder_t* nullable astdecoder_open(
@@ -67,5 +71,14 @@ err_t astdecoder_decode_imports(
   astdecoder_t* d, pkg_t* pkg, sha256_t* nullable api_sha256v);
 err_t astdecoder_decode_ast(astdecoder_t* d, node_t** resultv[], u32* resultc);
 
+// Lazy decoding, as an alternative to astdecoder_decode_ast.
+// Only supported by the binary format; returns ErrNotSupported for the text format.
+// astdecoder_decode_rootnames returns the name of each root node (allocated in ast_ma.)
+// astdecoder_decode_root decodes the root node at index, along with the nodes it
+// refers to, when it is first requested. The decoder and its input must remain
+// valid for as long as astdecoder_decode_root is used. Not thread safe.
+err_t astdecoder_decode_rootnames(astdecoder_t* d, sym_t* namevp[], u32* countp);
+err_t astdecoder_decode_root(astdecoder_t* d, u32 index, node_t** result);
+
 
 ASSUME_NONNULL_END
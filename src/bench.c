@@ -0,0 +1,749 @@
+// front-end benchmark ("co bench")
+// SPDX-License-Identifier: Apache-2.0
+#include "colib.h"
+#include "path.h"
+#include "compiler.h"
+#include "pkgbuild.h"
+#include "threadpool.h"
+#include "jobserver.h"
+#include "thread.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+// "co bench" generates a synthetic package and runs the compiler front end on it,
+// timing each phase separately: scanning, parsing, typecheck, IR analysis and
+// C code generation. The shape of the package is controlled with options:
+//
+//   --files    number of source files in the package
+//   --funcs    number of functions per source file
+//   --depth    nesting depth of "if" blocks in each function
+//   --strlen   length of a string literal in each function
+//   --imports  number of packages imported by each source file
+//
+// Imported packages are generated as well, at "{dir}/main/dep{N}". They are
+// built by pkgbuild_import (which is timed as a separate "import" phase) and do
+// not affect the other phases.
+//
+// For each phase the wall time, source throughput (MB/s) and AST throughput
+// (nodes/s) is reported, along with the AST arena usage after the phase.
+// Since the arena is a bump allocator, its usage after the last phase is its peak.
+//
+// Benchmarks of individual components can be selected by naming them on the
+// command line, e.g. "co bench sym". See benchcases below; the default is
+// "frontend", described above.
+
+// cli options
+static bool opt_help = false;
+static int  opt_verbose = 0;
+static const char* opt_dir = "";
+static const char* opt_files = "16";
+static const char* opt_funcs = "64";
+static const char* opt_depth = "4";
+static const char* opt_strlen = "32";
+static const char* opt_imports = "0";
+static const char* opt_threads = "";
+
+#define FOREACH_CLI_OPTION(S, SV, L, LV,  DEBUG_L, DEBUG_LV) \
+  /* S( var, ch, name,          descr) */\
+  /* SV(var, ch, name, valname, descr) */\
+  /* L( var,     name,          descr) */\
+  /* LV(var,     name, valname, descr) */\
+  LV(&opt_dir,     "dir",     "<dir>", "Generate package in <dir> (default $COCACHE/bench)")\
+  LV(&opt_files,   "files",   "<n>",   "Number of source files (default 16)")\
+  LV(&opt_funcs,   "funcs",   "<n>",   "Number of functions per file (default 64)")\
+  LV(&opt_depth,   "depth",   "<n>",   "Block nesting depth of functions (default 4)")\
+  LV(&opt_strlen,  "strlen",  "<n>",   "Length of string literals (default 32)")\
+  LV(&opt_imports, "imports", "<n>",   "Number of packages imported (default 0)")\
+  SV(&opt_threads,'j', "threads", "<n>", "Number of threadpool workers (default 1, 8 and 64)")\
+  S( &opt_verbose,'v', "verbose", "Verbose mode prints extra information")\
+  S( &opt_help,   'h', "help",    "Print help on stdout and exit")\
+// end FOREACH_CLI_OPTION
+
+#include "cliopt.inc.h"
+
+
+typedef struct {
+  u32 files, funcs, depth, strlen, imports;
+} corpus_t;
+
+typedef struct {
+  const char* name;
+  u64         duration; // nanoseconds
+  usize       arenause; // AST arena usage after the phase, in bytes
+} phase_t;
+
+typedef struct {
+  const char* name;
+  const char* descr;
+  err_t(*fn)(const corpus_t*);
+} benchcase_t;
+
+
+static u32 parse_count(const char* optname, const char* value, u32 max) {
+  char* end;
+  unsigned long n = strtoul(value, &end, 10);
+  if (*end || end == value || n > max)
+    errx(1, "invalid value for --%s: %s (expected 0-%u)", optname, value, max);
+  return (u32)n;
+}
+
+
+static void diaghandler(const diag_t* d, void* nullable userdata) {
+  // the generated code has unused variables; only report errors
+  if (d->kind == DIAG_WARN && !coverbose)
+    return;
+  elog("%s", d->msg);
+  if (d->srclines && *d->srclines)
+    elog("%s", d->srclines);
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————
+// corpus generation
+
+
+// BENCH_MARKER is the name of a file which marks a directory as generated
+#define BENCH_MARKER ".cobench"
+
+
+static void gen_function(buf_t* b, const corpus_t* cp, u32 fileidx, u32 funidx) {
+  buf_printf(b, "fun f%u_%u(x int) int {\n  var a = x\n", fileidx, funidx);
+
+  // nested blocks
+  u32 indent = 2;
+  for (u32 d = 0; d < cp->depth; d++, indent += 2) {
+    buf_printf(b, "%*sif a > %u {\n", indent, "", d);
+    buf_printf(b, "%*s  a = a * %u + %u\n", indent, "", d + 2, funidx);
+  }
+  for (u32 d = cp->depth; d > 0; d--) {
+    indent -= 2;
+    buf_printf(b, "%*s}\n", indent, "");
+  }
+
+  // string literal
+  if (cp->strlen > 0) {
+    buf_print(b, "  bench_use(\"");
+    for (u32 i = 0; i < cp->strlen; i++)
+      buf_push(b, "abcdefghijklmnopqrstuvwxyz0123456789 "[(funidx + i) % 37]);
+    buf_print(b, "\")\n");
+  }
+
+  // calls to imported packages and to the previous function
+  if (funidx == 0) {
+    for (u32 i = 0; i < cp->imports; i++)
+      buf_printf(b, "  a = a + dep%u.value(a)\n", i);
+  } else {
+    buf_printf(b, "  a = a + f%u_%u(a)\n", fileidx, funidx - 1);
+  }
+
+  buf_print(b, "  a\n}\n\n");
+}
+
+
+static err_t gen_file(buf_t* b, const char* filename) {
+  if (b->oom)
+    return ErrNoMem;
+  err_t err = fs_writefile_mkdirs(filename, 0644, buf_slice(*b));
+  if (err)
+    elog("%s: %s", filename, err_str(err));
+  buf_clear(b);
+  return err;
+}
+
+
+static err_t gen_corpus(const char* pkgdir, const corpus_t* cp) {
+  err_t err = 0;
+  buf_t b = buf_make(memalloc_ctx());
+  str_t filename = {0};
+
+  // Start from an empty directory so that files from an earlier run with
+  // a different shape are not included. Only remove a directory that we
+  // generated ourselves, which is identified by a marker file.
+  filename = path_join(pkgdir, BENCH_MARKER);
+  if (!filename.p) {
+    err = ErrNoMem;
+    goto end;
+  }
+  if (fs_isdir(pkgdir)) {
+    if (!fs_isfile(filename.p)) {
+      elog("%s: directory exists and was not generated by \"%s bench\";"
+        " refusing to replace it (use --dir to choose another directory)",
+        relpath(pkgdir), coprogname);
+      err = ErrExists;
+      goto end;
+    }
+    if (( err = fs_remove(pkgdir) )) {
+      elog("%s: %s", pkgdir, err_str(err));
+      goto end;
+    }
+  }
+  buf_print(&b, "generated by co bench; this directory is replaced on every run\n");
+  if (( err = gen_file(&b, filename.p) ))
+    goto end;
+
+  for (u32 i = 0; i < cp->imports && !err; i++) {
+    buf_printf(&b, "pub fun value(x int) int { x + %u }\n", i + 1);
+    char depname[16];
+    snprintf(depname, sizeof(depname), "dep%u", i);
+    str_free(filename);
+    filename = path_join(pkgdir, depname, "dep.co");
+    err = gen_file(&b, filename.p);
+  }
+
+  for (u32 fileidx = 0; fileidx < cp->files && !err; fileidx++) {
+    for (u32 i = 0; i < cp->imports; i++)
+      buf_printf(&b, "import \"./dep%u\"\n", i);
+    if (cp->imports)
+      buf_push(&b, '\n');
+    if (fileidx == 0 && cp->strlen > 0)
+      buf_print(&b, "\"c\" fun bench_use(str) void\n\n");
+    for (u32 funidx = 0; funidx < cp->funcs; funidx++)
+      gen_function(&b, cp, fileidx, funidx);
+    char name[32];
+    snprintf(name, sizeof(name), "f%u.co", fileidx);
+    str_free(filename);
+    filename = path_join(pkgdir, name);
+    err = gen_file(&b, filename.p);
+  }
+
+end:
+  str_free(filename);
+  buf_dispose(&b);
+  return err;
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————
+// benchmark
+
+
+static node_t* count_nodes(ast_transform_t* tr, node_t* n, void* ctx) {
+  (*(u64*)ctx)++;
+  return ast_transform_children(tr, n, ctx);
+}
+
+
+static err_t bench_scan(pkgbuild_t* pb, u64* ntokens) {
+  pkg_t* pkg = pb->pkgc.pkg;
+  scanner_t scanner;
+  if (!scanner_init(&scanner, pb->c))
+    return ErrNoMem;
+  err_t err = 0;
+  for (u32 i = 0; i < pkg->srcfiles.len && !err; i++) {
+    srcfile_t* srcfile = pkg->srcfiles.v[i];
+    if (srcfile->type != FILE_CO)
+      continue;
+    if (( err = srcfile_open(srcfile) ))
+      break;
+    scanner_begin(&scanner, srcfile);
+    for (;;) {
+      scanner_next(&scanner);
+      if (scanner.tok == TEOF)
+        break;
+      (*ntokens)++;
+    }
+    srcfile_close(srcfile);
+    if (scanner.errcount)
+      err = ErrCanceled;
+  }
+  scanner_dispose(&scanner);
+  return err;
+}
+
+
+static err_t bench_parse(pkgbuild_t* pb) {
+  pkg_t* pkg = pb->pkgc.pkg;
+  parser_t parser;
+
+  if (!( pb->unitv = mem_alloctv(pb->ast_ma, unit_t*, pkg->srcfiles.len) ))
+    return ErrNoMem;
+  if (!parser_init(&parser, pb->c))
+    return ErrNoMem;
+
+  err_t err = 0;
+  for (u32 i = 0; i < pkg->srcfiles.len && !err; i++) {
+    srcfile_t* srcfile = pkg->srcfiles.v[i];
+    if (srcfile->type != FILE_CO)
+      continue;
+    if (( err = srcfile_open(srcfile) ))
+      break;
+    err = parser_parse(&parser, pb->ast_ma, srcfile, &pb->unitv[pb->unitc++]);
+    srcfile_close(srcfile);
+    if (!err && parser_errcount(&parser) > 0)
+      err = ErrCanceled;
+  }
+
+  parser_dispose(&parser);
+  return err;
+}
+
+
+static err_t bench_cgen(pkgbuild_t* pb, usize* noutbytes) {
+  cgen_t g;
+  cgen_pkgapi_t pkgapi;
+  if (!cgen_init(&g, pb->c, pb->pkgc.pkg, pb->c->ma, CGEN_SRCINFO))
+    return ErrNoMem;
+  err_t err = cgen_pkgapi(&g, pb->unitv, pb->unitc, &pkgapi);
+  for (u32 i = 0; i < pb->unitc && !err; i++) {
+    err = cgen_unit_impl(&g, pb->unitv[i], &pkgapi);
+    *noutbytes += g.outbuf.len;
+  }
+  cgen_pkgapi_dispose(&g, &pkgapi);
+  cgen_dispose(&g);
+  return err;
+}
+
+
+static void print_phase(const phase_t* ph, usize nbytes, u64 nnodes) {
+  char durbuf[25];
+  fmtduration(durbuf, ph->duration);
+  double sec = (double)MAX(ph->duration, 1ull) / 1e9;
+  printf("%-10s %12s %10.1f %12.0f %10.1f\n",
+    ph->name, durbuf,
+    nbytes ? ((double)nbytes / (1024.0*1024.0)) / sec : 0.0,
+    (double)nnodes / sec,
+    (double)ph->arenause / (1024.0*1024.0));
+}
+
+
+static err_t run_bench(compiler_t* c, const char* pkgdir) {
+  pkg_t* pkgv;
+  u32 pkgc;
+  const char* argv[] = { pkgdir };
+  err_t err = pkgs_for_argv(1, argv, &pkgv, &pkgc);
+  if (err)
+    return err;
+  pkg_t* pkg = &pkgv[0];
+  if (( err = pkgindex_add(c, pkg) ))
+    return err;
+
+  pkgbuild_t pb;
+  u32 pbflags = PKGBUILD_NOLINK | PKGBUILD_NOCLEANUP;
+  if (( err = pkgbuild_init(&pb, (pkgcell_t){NULL,pkg}, c, c->ma, pbflags) ))
+    return err;
+  if (( err = pkgbuild_locate_sources(&pb) ))
+    goto end;
+
+  usize nbytes = 0;
+  for (u32 i = 0; i < pkg->srcfiles.len; i++) {
+    const srcfile_t* srcfile = pkg->srcfiles.v[i];
+    if (srcfile->type == FILE_CO)
+      nbytes += srcfile->size;
+  }
+
+  phase_t phasev[6] = {
+    {.name="scan"}, {.name="parse"}, {.name="import"},
+    {.name="typecheck"}, {.name="ir"}, {.name="cgen"},
+  };
+  u64 ntokens = 0, nnodes = 0;
+  usize ncbytes = 0;
+  u64 t;
+
+  #define PHASE(i, expr) \
+    t = nanotime(); \
+    err = (expr); \
+    phasev[i].duration = nanotime() - t; \
+    phasev[i].arenause = memalloc_bump2_use(pb.ast_ma); \
+    if (err || compiler_errcount(c) > 0) { \
+      err = err ? err : ErrCanceled; \
+      elog("%s failed: %s", phasev[i].name, err_str(err)); \
+      goto end; \
+    }
+
+  PHASE(0, bench_scan(&pb, &ntokens));
+  PHASE(1, bench_parse(&pb));
+
+  for (u32 i = 0; i < pb.unitc && !err; i++) {
+    node_t* result;
+    err = ast_transform((node_t*)pb.unitv[i], pb.ast_ma, count_nodes, &nnodes, &result);
+  }
+
+  PHASE(2, pkgbuild_import(&pb));
+  PHASE(3, typecheck(c, pb.ast_ma, pkg, pb.unitv, pb.unitc));
+  if (( err = check_typedeps(c, pb.unitv, pb.unitc) ) || compiler_errcount(c) > 0)
+    goto end;
+  PHASE(4, iranalyze(c, pb.ast_ma, pkg, pb.unitv, pb.unitc, NULL));
+  PHASE(5, bench_cgen(&pb, &ncbytes));
+
+  #undef PHASE
+
+  printf("%u files, %.1f kB, %llu tokens, %llu AST nodes, %.1f kB C\n",
+    pb.unitc, (double)nbytes / 1024.0,
+    (unsigned long long)ntokens, (unsigned long long)nnodes,
+    (double)ncbytes / 1024.0);
+  printf("%-10s %12s %10s %12s %10s\n", "phase", "time", "MB/s", "nodes/s", "arena MB");
+  for (u32 i = 0; i < countof(phasev); i++) {
+    // import time is dominated by building dependencies, not by this package
+    bool isfrontend = (i != 2);
+    print_phase(&phasev[i], isfrontend ? nbytes : 0, isfrontend ? nnodes : 0);
+  }
+  printf("peak arena: %.1f MB used, %.1f MB reserved\n",
+    (double)memalloc_bump2_use(pb.ast_ma) / (1024.0*1024.0),
+    (double)memalloc_bump2_cap(pb.ast_ma) / (1024.0*1024.0));
+
+end:
+  // wait for dependencies' libraries to finish building before we exit
+  for (u32 i = 0; i < pkg->imports.len; i++)
+    future_wait(&((pkg_t*)pkg->imports.v[i])->libfut);
+  pkgbuild_dispose(&pb);
+  return err;
+}
+
+
+static err_t bench_frontend(const corpus_t* corpus) {
+  str_t dir = *opt_dir ? str_make(opt_dir) : path_join(cocachedir, "bench");
+  str_t pkgdir = path_join(dir.p, "main");
+  str_t builddir = path_join(dir.p, "build");
+  if (!dir.p || !pkgdir.p || !builddir.p)
+    errx(1, "out of memory");
+
+  err_t err;
+  if (( err = gen_corpus(pkgdir.p, corpus) ))
+    goto end;
+
+  compiler_t c;
+  compiler_init(&c, memalloc_ctx(), &diaghandler);
+  compiler_config_t ccfg = {
+    .target = target_default(),
+    .buildroot = builddir.p,
+    .buildmode = BUILDMODE_OPT,
+    .nomain = true,
+    .nostdruntime = true,
+    .verbose = coverbose,
+  };
+  if (( err = compiler_configure(&c, &ccfg) )) {
+    dlog("compiler_configure: %s", err_str(err));
+    goto end;
+  }
+
+  // imported packages are compiled to C & object files, which needs the sysroot
+  if (corpus->imports > 0 && ( err = build_sysroot(&c, /*flags*/0) )) {
+    dlog("build_sysroot: %s", err_str(err));
+    goto end;
+  }
+
+  err = run_bench(&c, pkgdir.p);
+
+end:
+  str_free(builddir);
+  str_free(pkgdir);
+  str_free(dir);
+  return err;
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————
+// scanner
+
+
+#define SCANBENCH_NROUNDS 5
+
+
+// bench_scanner measures scanner throughput on a generated corpus held in memory,
+// which mixes keywords, identifiers, numbers and string literals like source code
+static err_t bench_scanner(const corpus_t* corpus) {
+  memalloc_t ma = memalloc_ctx();
+  err_t err = 0;
+  compiler_t c;
+  compiler_init(&c, ma, &diaghandler);
+
+  buf_t* bufv = mem_alloctv(ma, buf_t, corpus->files);
+  srcfile_t* srcfilev = mem_alloctv(ma, srcfile_t, corpus->files);
+  if (!bufv || !srcfilev) {
+    err = ErrNoMem;
+    goto end;
+  }
+
+  usize nbytes = 0;
+  for (u32 i = 0; i < corpus->files; i++) {
+    buf_init(&bufv[i], ma);
+    for (u32 funidx = 0; funidx < corpus->funcs; funidx++)
+      gen_function(&bufv[i], corpus, i, funidx);
+    if (bufv[i].oom) {
+      err = ErrNoMem;
+      goto end;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "f%u.co", i);
+    srcfilev[i] = (srcfile_t){
+      .name = str_make(name),
+      .data = bufv[i].p,
+      .size = bufv[i].len,
+      .type = FILE_CO,
+    };
+    nbytes += bufv[i].len;
+  }
+
+  scanner_t scanner;
+  if (!scanner_init(&scanner, &c)) {
+    err = ErrNoMem;
+    goto end;
+  }
+
+  printf("%u files, %.1f kB\n", corpus->files, (double)nbytes / 1024.0);
+  printf("%-10s %12s %10s %14s\n", "round", "time", "MB/s", "tokens/s");
+  for (u32 round = 0; round < SCANBENCH_NROUNDS && !err; round++) {
+    u64 ntokens = 0;
+    u64 t = nanotime();
+    for (u32 i = 0; i < corpus->files; i++) {
+      scanner_begin(&scanner, &srcfilev[i]);
+      for (;;) {
+        scanner_next(&scanner);
+        if (scanner.tok == TEOF)
+          break;
+        ntokens++;
+      }
+      if (scanner.errcount) {
+        err = ErrCanceled;
+        break;
+      }
+    }
+    u64 duration = nanotime() - t;
+    if (err)
+      break;
+
+    char durbuf[25];
+    fmtduration(durbuf, duration);
+    double sec = (double)MAX(duration, 1ull) / 1e9;
+    printf("%-10u %12s %10.1f %14.0f\n",
+      round + 1, durbuf, ((double)nbytes / (1024.0*1024.0)) / sec, (double)ntokens / sec);
+  }
+  scanner_dispose(&scanner);
+
+end:
+  for (u32 i = 0; srcfilev && i < corpus->files; i++)
+    str_free(srcfilev[i].name);
+  for (u32 i = 0; bufv && i < corpus->files; i++)
+    buf_dispose(&bufv[i]);
+  if (srcfilev) mem_freetv(ma, srcfilev, corpus->files);
+  if (bufv) mem_freetv(ma, bufv, corpus->files);
+  return err;
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————
+// sym_intern
+
+
+#define SYMBENCH_NKEYS   4096
+#define SYMBENCH_NROUNDS 16
+
+typedef struct { char s[16]; } symbench_key_t;
+
+typedef struct {
+  thrd_t          t;
+  symbench_key_t* keys;
+  sym_t*          expect;
+  u32             seed;
+  bool            ok;
+} symbench_thread_t;
+
+
+static int symbench_thread(void* arg) {
+  symbench_thread_t* t = arg;
+  u32 x = t->seed;
+  t->ok = true;
+  for (u32 round = 0; round < SYMBENCH_NROUNDS; round++) {
+    for (u32 i = 0; i < SYMBENCH_NKEYS; i++) {
+      // visit keys in a per-thread pseudo-random order
+      x = x*1103515245 + 12345;
+      u32 k = (x >> 8) % SYMBENCH_NKEYS;
+      sym_t sym = sym_intern(t->keys[k].s, strlen(t->keys[k].s));
+      t->ok &= (sym == t->expect[k]);
+    }
+  }
+  return 0;
+}
+
+
+// bench_sym measures sym_intern throughput with 1-64 threads interning the same
+// set of identifiers, like parallel parsers of a package would
+static err_t bench_sym(const corpus_t* corpus) {
+  memalloc_t ma = memalloc_ctx();
+  const u32 maxthreads = 64;
+  symbench_key_t* keys = mem_alloctv(ma, symbench_key_t, SYMBENCH_NKEYS);
+  sym_t* expect = mem_alloctv(ma, sym_t, SYMBENCH_NKEYS);
+  symbench_thread_t* threads = mem_alloctv(ma, symbench_thread_t, maxthreads);
+  err_t err = 0;
+  if (!keys || !expect || !threads) {
+    err = ErrNoMem;
+    goto end;
+  }
+
+  for (u32 i = 0; i < SYMBENCH_NKEYS; i++) {
+    snprintf(keys[i].s, sizeof(keys[i].s), "bench_%u", i);
+    expect[i] = sym_intern(keys[i].s, strlen(keys[i].s));
+  }
+
+  printf("%-10s %12s %14s\n", "threads", "time", "lookups/s");
+  for (u32 nthreads = 1; nthreads <= maxthreads && !err; nthreads *= 2) {
+    u32 nstarted = 0;
+    u64 t = nanotime();
+    for (; nstarted < nthreads; nstarted++) {
+      symbench_thread_t* th = &threads[nstarted];
+      *th = (symbench_thread_t){ .keys = keys, .expect = expect, .seed = nstarted + 1 };
+      if (thrd_create(&th->t, symbench_thread, th) != thrd_success) {
+        err = ErrNoMem;
+        break;
+      }
+    }
+    for (u32 i = 0; i < nstarted; i++) {
+      thrd_join(threads[i].t, NULL);
+      if (!threads[i].ok) {
+        elog("sym_intern returned different symbols for the same string");
+        err = ErrInvalid;
+      }
+    }
+    u64 duration = nanotime() - t;
+    if (err)
+      break;
+
+    u64 nops = (u64)nthreads * SYMBENCH_NROUNDS * SYMBENCH_NKEYS;
+    char durbuf[25];
+    fmtduration(durbuf, duration);
+    printf("%-10u %12s %14.0f\n",
+      nthreads, durbuf, (double)nops / ((double)MAX(duration, 1ull) / 1e9));
+  }
+
+end:
+  if (threads) mem_freetv(ma, threads, maxthreads);
+  if (expect) mem_freetv(ma, expect, SYMBENCH_NKEYS);
+  if (keys) mem_freetv(ma, keys, SYMBENCH_NKEYS);
+  return err;
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————
+// threadpool
+
+
+// Each "root" job submitted from the main thread submits POOLBENCH_FANOUT child
+// jobs from within a worker (see threadpool_bench.)
+#define POOLBENCH_NROOTS  256
+#define POOLBENCH_FANOUT  64
+#define POOLBENCH_NROUNDS 5
+
+
+// bench_threadpool measures job throughput of thread pools with 1, 8 and 64
+// workers, or with the number of workers given with -j.
+// The fastest of POOLBENCH_NROUNDS rounds is reported for each pool size.
+static err_t bench_threadpool(const corpus_t* corpus) {
+  static const u32 default_nthreads[] = { 1, 8, 64 };
+  const u32* nthreadsv = default_nthreads;
+  u32 nthreadsc = countof(default_nthreads);
+  u32 opt_n;
+  if (*opt_threads) {
+    opt_n = parse_count("threads", opt_threads, 1024);
+    if (opt_n == 0)
+      errx(1, "-j must be at least 1");
+    nthreadsv = &opt_n;
+    nthreadsc = 1;
+  }
+
+  const u32 njobs = POOLBENCH_NROOTS * (POOLBENCH_FANOUT + 1);
+  err_t err = 0;
+
+  printf("%-10s %12s %14s\n", "threads", "time", "jobs/s");
+  for (u32 i = 0; i < nthreadsc && !err; i++) {
+    u64 best = U64_MAX;
+    for (u32 round = 0; round < POOLBENCH_NROUNDS && !err; round++) {
+      u64 duration;
+      err = threadpool_bench(nthreadsv[i], POOLBENCH_NROOTS, POOLBENCH_FANOUT, &duration);
+      best = MIN(best, duration);
+    }
+    if (err) {
+      elog("threadpool_bench(%u threads): %s", nthreadsv[i], err_str(err));
+      break;
+    }
+
+    char durbuf[25];
+    fmtduration(durbuf, best);
+    printf("%-10u %12s %14.0f\n",
+      nthreadsv[i], durbuf, (double)njobs / ((double)MAX(best, 1ull) / 1e9));
+  }
+
+  return err;
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————
+
+
+static const benchcase_t benchcases[] = {
+  { "frontend",   "Front-end phases on a generated package (default)", bench_frontend },
+  { "scanner",    "Scanner throughput on a generated corpus", bench_scanner },
+  { "sym",        "sym_intern throughput with 1-64 threads", bench_sym },
+  { "threadpool", "Thread pool job throughput with 1, 8 and 64 threads", bench_threadpool },
+};
+
+
+static void help(const char* cmdname) {
+  printf(
+    "Benchmarks the compiler front end on a generated package\n"
+    "Usage: %s %s [options] [<benchmark> ...]\n"
+    "Benchmarks:\n"
+    "",
+    coprogname, cmdname);
+  for (u32 i = 0; i < countof(benchcases); i++)
+    printf("  %-12s %s\n", benchcases[i].name, benchcases[i].descr);
+  printf("Options:\n");
+  cliopt_print();
+  exit(0);
+}
+
+
+
+
+int bench_main(int argc, char* argv[]) {
+  if (!cliopt_parse(&argc, &argv, help))
+    return 1;
+
+  coverbose = MAX(coverbose, (u8)opt_verbose);
+
+  corpus_t corpus = {
+    .files   = parse_count("files",   opt_files,   100000),
+    .funcs   = parse_count("funcs",   opt_funcs,   1000000),
+    .depth   = parse_count("depth",   opt_depth,   1000),
+    .strlen  = parse_count("strlen",  opt_strlen,  100000000),
+    .imports = parse_count("imports", opt_imports, 1000),
+  };
+  if (corpus.files == 0)
+    errx(1, "--files must be at least 1");
+
+  // select benchmarks to run
+  const benchcase_t* casev[countof(benchcases)];
+  u32 casec = 0;
+  for (int i = 0; i < argc; i++) {
+    const benchcase_t* bc = NULL;
+    for (u32 j = 0; j < countof(benchcases) && !bc; j++) {
+      if (strcmp(argv[i], benchcases[j].name) == 0)
+        bc = &benchcases[j];
+    }
+    if (!bc)
+      errx(1, "unknown benchmark \"%s\" (see %s bench --help)", argv[i], coprogname);
+    if (casec < countof(casev))
+      casev[casec++] = bc;
+  }
+  if (casec == 0)
+    casev[casec++] = &benchcases[0];
+
+  err_t err;
+  if (( err = threadpool_init() )) {
+    elog("failed to initialize thread pool: %s", err_str(err));
+    return 1;
+  }
+  if (( err = jobserver_init() )) {
+    elog("failed to initialize job server: %s", err_str(err));
+    return 1;
+  }
+
+  for (u32 i = 0; i < casec && !err; i++) {
+    if (casec > 1)
+      printf("%s%s:\n", i ? "\n" : "", casev[i]->name);
+    err = casev[i]->fn(&corpus);
+  }
+
+  return (int)!!err;
+}
@@ -10,6 +10,9 @@
 #include "hash.h"
 #include "chan.h"
 #include "pkgbuild.h"
+#include "timetrace.h"
+#include "jobserver.h"
+#include "objcache.h"
 
 #include <stdlib.h> // exit
 #include <unistd.h> // getopt
@@ -18,6 +21,11 @@
 #include <errno.h>
 #include <getopt.h>
 
+compiler_t* nullable serve_warm_compiler( // serve.c
+  const compiler_config_t* ccfg, diaghandler_t dh, pkg_t* pkgv, u32 pkgc);
+void serve_report_build( // serve.c
+  compiler_t* c, const compiler_config_t* ccfg, const pkg_t* pkgv, u32 pkgc);
+
 // cli options
 static bool opt_help = false;
 static const char* opt_out = "";
@@ -31,10 +39,13 @@ static bool opt_printir = false;
 static bool opt_genirdot = false;
 static bool opt_genasm = false;
 static bool opt_nolink = false;
+static bool opt_ccfork = false;
+static const char* opt_backend = "c";
 static bool opt_nomain = false;
 static bool opt_nostdruntime = false;
 static bool opt_version = false;
 static const char* opt_builddir = "build";
+static const char* opt_tracefile = "";
 #if DEBUG
   static bool opt_trace_all = false;
   bool opt_trace_scan = false;
@@ -45,6 +56,7 @@ static const char* opt_builddir = "build";
   bool opt_trace_ir = false;
   bool opt_trace_cgen = false;
   bool opt_trace_subproc = false;
+  bool opt_textmeta = false;
 #endif
 
 #define FOREACH_CLI_OPTION(S, SV, L, LV,  DEBUG_L, DEBUG_LV) \
@@ -65,11 +77,14 @@ static const char* opt_builddir = "build";
   L( &opt_printir,      "print-ir",           "Print IR to stderr")\
   L( &opt_genirdot,     "write-ir-dot",       "Write IR as Graphviz .dot file to build dir")\
   L( &opt_nolink,       "no-link",            "Only compile, don't link")\
+  L( &opt_ccfork,       "cc-fork",            "Compile C in subprocesses instead of threads")\
+  LV(&opt_backend,      "backend", "<name>",  "Code generator: c (default) or llvm")\
   L( &opt_nomain,       "no-main",            "Don't auto-generate C ABI \"main\" for main.main")\
   L( &opt_nostdruntime, "no-stdruntime",      "Don't automatically import std/runtime")\
   L( &opt_version,      "version",            "Print Compis version on stdout and exit")\
+  LV(&opt_tracefile,    "trace", "<file>",    "Write timing of build phases to <file> as Chrome trace JSON")\
   /* debug-only options */\
-  DEBUG_L( &opt_trace_all,       "trace",           "Trace everything")\
+  DEBUG_L( &opt_trace_all,       "trace-all",       "Trace everything")\
   DEBUG_L( &opt_trace_scan,      "trace-scan",      "Trace lexical scanning")\
   DEBUG_L( &opt_trace_parse,     "trace-parse",     "Trace parsing")\
   DEBUG_L( &opt_trace_typecheck, "trace-typecheck", "Trace type checking")\
@@ -78,6 +93,7 @@ static const char* opt_builddir = "build";
   DEBUG_L( &opt_trace_ir,        "trace-ir",        "Trace IR")\
   DEBUG_L( &opt_trace_cgen,      "trace-cgen",      "Trace code generation")\
   DEBUG_L( &opt_trace_subproc,   "trace-subproc",   "Trace subprocess execution")\
+  DEBUG_L( &opt_textmeta,        "text-meta",       "Write package metadata as text")\
 // end FOREACH_CLI_OPTION
 
 #include "cliopt.inc.h"
@@ -161,7 +177,7 @@ int main_build(int argc, char* argv[]) {
   coverbose = MAX(coverbose, (u8)opt_verbose);
 
   #if DEBUG
-    // --co-trace turns on all trace flags
+    // --trace-all turns on all trace flags
     opt_trace_scan |= opt_trace_all;
     opt_trace_parse |= opt_trace_all;
     opt_trace_typecheck |= opt_trace_all;
@@ -188,6 +204,14 @@ int main_build(int argc, char* argv[]) {
     return 1;
   }
 
+  backend_t backend = BACKEND_C;
+  if (strcmp(opt_backend, "llvm") == 0) {
+    backend = BACKEND_LLVM;
+  } else if (strcmp(opt_backend, "c") != 0) {
+    elog("Invalid backend \"%s\" (expected \"c\" or \"llvm\")", opt_backend);
+    return 1;
+  }
+
   // configure target
   if (!( opt_target = target_find(opt_targetstr) )) {
     elog("Invalid target \"%s\"", opt_targetstr);
@@ -207,37 +231,58 @@ int main_build(int argc, char* argv[]) {
   if (pkgc > 1 && *opt_out)
     errx(1, "cannot specify -o option when building multiple packages");
 
+  // start recording timing events (before any threads are started)
+  if (*opt_tracefile && ( err = timetrace_enable() ))
+    errx(1, "--trace: %s", err_str(err));
+
   // initialize thread pool
   if (( err = threadpool_init() ))
     elog("failed to initialize thread pool: %s", err_str(err));
 
-  // create a compiler instance
-  compiler_t c;
-  compiler_init(&c, memalloc_ctx(), &diaghandler);
+  // limit concurrent subprocesses across all packages
+  if (!err && ( err = jobserver_init() ))
+    elog("failed to initialize job server: %s", err_str(err));
 
   // configure compiler
   compiler_config_t ccfg = {
     .target = opt_target,
     .buildroot = opt_builddir,
     .buildmode = opt_debug ? BUILDMODE_DEBUG : BUILDMODE_OPT,
+    .backend = backend,
     .printast = opt_printast,
     .printir = opt_printir,
     .genirdot = opt_genirdot,
     .genasm = opt_genasm,
+    .ccfork = opt_ccfork,
     .verbose = coverbose,
     .nomain = opt_nomain,
     .nostdruntime = opt_nostdruntime,
   };
-  if (err || ( err = compiler_configure(&c, &ccfg) )) {
-    dlog("compiler_configure: %s", err_str(err));
-    return 1;
+
+  // create a compiler instance, or use one which the compile server has loaded
+  // dependencies into (when running as a build of "co serve")
+  compiler_t cbuf;
+  compiler_t* c = err ? NULL : serve_warm_compiler(&ccfg, &diaghandler, pkgv, pkgc);
+  if (!c) {
+    c = &cbuf;
+    compiler_init(c, memalloc_ctx(), &diaghandler);
+    if (err || ( err = compiler_configure(c, &ccfg) )) {
+      dlog("compiler_configure: %s", err_str(err));
+      return 1;
+    }
   }
 
-  if (coverbose)
-    vlog_config(&c);
+  objcache_stats_t objcache_stats0 = {0};
+  if (coverbose) {
+    vlog_config(c);
+    objcache_stats(&objcache_stats0);
+  }
 
   // build sysroot if needed (only reads compiler attributes; never mutates it)
-  if (( err = build_sysroot(&c, /*flags*/0) )) {
+  u64 trace_start = timetrace_begin();
+  err = build_sysroot(c, /*flags*/0);
+  timetrace_end(trace_start, "build_sysroot", NULL);
+  if (err) {
     dlog("build_sysroot: %s", err_str(err));
     return 1;
   }
@@ -247,18 +292,40 @@ int main_build(int argc, char* argv[]) {
   if (opt_nolink) pkgbuild_flags |= PKGBUILD_NOLINK;
   pkgbuild_flags |= PKGBUILD_NOCLEANUP; // since we exit the process after this
 
+  // add all packages to the index before building any of them, so that a package
+  // imported by another one is resolved to the same pkg_t
   for (u32 i = 0; i < pkgc; i++) {
     pkg_t* pkg = &pkgv[i];
-    if (( err = pkgindex_add(&c, pkg) )) {
+    if (( err = pkgindex_add(c, pkg) )) {
       dlog("pkgindex_add(pkg_t{dir=\"%s\"}) failed: %s", pkg->dir.p, err_str(err));
       break;
     }
-    if (( err = build_toplevel_pkg(pkg, &c, opt_out, pkgbuild_flags) )) {
-      dlog("error while building pkg %s: %s", pkg->path.p, err_str(err));
-      break;
+  }
+  if (!err)
+    err = build_toplevel_pkgs(pkgv, pkgc, c, opt_out, pkgbuild_flags);
+
+  // let the compile server know what dependencies to keep loaded for the next build
+  serve_report_build(c, &ccfg, pkgv, pkgc);
+
+  if (coverbose) {
+    jobserver_stats_t st;
+    jobserver_stats(&st);
+    vlog("jobserver: %llu jobs, %u/%u tokens used at most%s; "
+      "waited %llu times, max queue depth %u",
+      (unsigned long long)st.nacquired, st.maxinuse, st.cap,
+      st.make ? " (from make)" : "",
+      (unsigned long long)st.nwaits, st.maxwaiting);
+    objcache_vlog_stats(&objcache_stats0);
+  }
+
+  if (*opt_tracefile) {
+    err_t err1 = timetrace_write(opt_tracefile);
+    if (err1) {
+      elog("failed to write %s: %s", opt_tracefile, err_str(err1));
+      err = err ? err : err1;
     }
   }
 
-  // compiler_dispose(&c); // would need to do this if we didn't just exit
+  // compiler_dispose(c); // would need to do this if we didn't just exit
   return (int)!!err;
 }
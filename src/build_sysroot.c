@@ -5,6 +5,8 @@
 #include "strlist.h"
 #include "path.h"
 #include "bgtask.h"
+#include "jobserver.h"
+#include "thread.h"
 #include "llvm/llvm.h"
 
 #include "syslib_librt.h"
@@ -25,6 +27,12 @@
   "include" PATH_SEP_STR "c++" PATH_SEP_STR "v" CO_STRX(CO_LIBCXX_ABI_VERSION)
 
 
+// g_taskflags: bgtask_open flags for components which may build concurrently.
+// BGTASK_NOFANCY while they do, since "fancy" status lines would overwrite
+// each other.
+static int g_taskflags = 0;
+
+
 static err_t copy_target_layer_dirs(
   const compiler_t* c, bgtask_t* task, const char* src_basedir, const char* dst_basedir)
 {
@@ -431,6 +439,7 @@ static err_t build_librt(const compiler_t* c) {
 
   cbuild_t build;
   cbuild_init(&build, c, "librt", /*builddir*/c->sysroot);
+  build.taskflags = g_taskflags;
   build.srcdir = path_join_alloca(coroot, "librt");
 
   // see compiler-rt/lib/builtins/CMakeLists.txt
@@ -530,6 +539,7 @@ static err_t build_libunwind(const compiler_t* c) {
 
   cbuild_t build;
   cbuild_init(&build, c, "libunwind", /*builddir*/c->sysroot);
+  build.taskflags = g_taskflags;
   build.srcdir = path_join_alloca(coroot, "libunwind");
 
   const char* common_flags[] = {
@@ -698,6 +708,7 @@ static err_t build_cxx_config_site(const compiler_t* c) {
 static err_t build_libcxxabi(const compiler_t* c) {
   cbuild_t build;
   cbuild_init(&build, c, "libc++abi", /*builddir*/c->sysroot);
+  build.taskflags = g_taskflags;
   build.srcdir = path_join_alloca(coroot, "libcxxabi");
 
   const char* common_flags[] = {
@@ -790,6 +801,7 @@ static err_t build_libcxxabi(const compiler_t* c) {
 static err_t build_libcxx(const compiler_t* c) {
   cbuild_t build;
   cbuild_init(&build, c, "libc++", /*builddir*/c->sysroot);
+  build.taskflags = g_taskflags;
   build.srcdir = path_join_alloca(coroot, "libcxx");
 
   const char* common_flags[] = {
@@ -1005,6 +1017,71 @@ static void finalize_build_component(
 }
 
 
+typedef struct {
+  const compiler_t* c;
+  u32               flags;
+  const char*       component; // NULL if not a component (no lock or ".ok" file)
+  err_t           (*build)(const compiler_t*);
+  err_t             err;
+  thrd_t            t;
+  bool              threaded; // running on thread t
+} sysroot_job_t;
+
+
+static void sysroot_job_run(sysroot_job_t* job) {
+  int lockfd;
+  if (!job->component) {
+    job->err = job->build(job->c);
+  } else if (build_component(job->c, &lockfd, &job->err, job->flags, job->component)) {
+    job->err = job->build(job->c);
+    finalize_build_component(job->c, lockfd, &job->err, job->component);
+  }
+}
+
+
+static int sysroot_job_thread(void* arg) {
+  sysroot_job_run(arg);
+  return 0;
+}
+
+
+// run_sysroot_jobs runs independent jobs concurrently, each on its own thread
+// (they mostly wait for subprocesses), and returns the first error.
+// jobs[0] runs on the calling thread.
+static err_t run_sysroot_jobs(sysroot_job_t* jobs, u32 njobs) {
+  for (u32 i = 1; i < njobs; i++) {
+    jobs[i].threaded = thrd_create(&jobs[i].t, sysroot_job_thread, &jobs[i]) == thrd_success;
+    if (!jobs[i].threaded) {
+      dlog("thrd_create failed; running job serially");
+      sysroot_job_run(&jobs[i]);
+    }
+  }
+  if (njobs > 0)
+    sysroot_job_run(&jobs[0]);
+  err_t err = 0;
+  for (u32 i = 0; i < njobs; i++) {
+    if (jobs[i].threaded)
+      thrd_join(jobs[i].t, NULL);
+    if (!err)
+      err = jobs[i].err;
+  }
+  return err;
+}
+
+
+static err_t build_libcxx_all(const compiler_t* c) {
+  err_t err = build_cxx_config_site(c); // __config_site header, needed by both
+  if (err)
+    return err;
+  // libc++abi and libc++ are independent of each other
+  sysroot_job_t jobs[] = {
+    { c, 0, NULL, build_libcxxabi },
+    { c, 0, NULL, build_libcxx },
+  };
+  return run_sysroot_jobs(jobs, countof(jobs));
+}
+
+
 err_t build_sysroot(const compiler_t* c, u32 flags) {
   // Coordinate with other racing processes using file-based locks
   int lockfd;
@@ -1017,6 +1094,16 @@ err_t build_sysroot(const compiler_t* c, u32 flags) {
     return err;
   }
 
+  // Components form a dependency graph:
+  //
+  //   sysinc → libc → librt
+  //                 → libunwind
+  //                 → libcxx (__config_site → libc++abi, libc++)
+  //
+  // sysinc and libc install headers which all other components use, so they
+  // are built first. The rest are independent and build concurrently.
+  // Their compiler jobs share one budget via the job server.
+
   if (!err && c->target.sys != SYS_none &&
       build_component(c, &lockfd, &err, flags, "sysinc"))
   {
@@ -1031,32 +1118,30 @@ err_t build_sysroot(const compiler_t* c, u32 flags) {
     finalize_build_component(c, lockfd, &err, "libc");
   }
 
-  if (!err && target_has_syslib(&c->target, SYSLIB_RT) &&
-      build_component(c, &lockfd, &err, flags, "librt"))
-  {
-    err = build_librt(c);
-    finalize_build_component(c, lockfd, &err, "librt");
-  }
+  if (err)
+    return err;
 
-  if (!err && (flags & SYSROOT_BUILD_LIBUNWIND) &&
-      target_has_syslib(&c->target, SYSLIB_UNWIND) &&
-      build_component(c, &lockfd, &err, flags, "libunwind"))
-  {
-    err = build_libunwind(c);
-    finalize_build_component(c, lockfd, &err, "libunwind");
-  }
+  sysroot_job_t jobs[3];
+  u32 njobs = 0;
+  bool concurrent = false;
 
-  if (!err && (flags & SYSROOT_BUILD_LIBCXX) &&
-      target_has_syslib(&c->target, SYSLIB_CXX) &&
-      build_component(c, &lockfd, &err, flags, "libcxx"))
-  {
+  if (target_has_syslib(&c->target, SYSLIB_RT))
+    jobs[njobs++] = (sysroot_job_t){ c, flags, "librt", build_librt };
+
+  if ((flags & SYSROOT_BUILD_LIBUNWIND) && target_has_syslib(&c->target, SYSLIB_UNWIND))
+    jobs[njobs++] = (sysroot_job_t){ c, flags, "libunwind", build_libunwind };
+
+  if ((flags & SYSROOT_BUILD_LIBCXX) && target_has_syslib(&c->target, SYSLIB_CXX)) {
     assert(target_has_syslib(&c->target, SYSLIB_CXXABI));
-    if (!err) err = build_cxx_config_site(c); // __config_site header
-    if (!err) err = build_libcxxabi(c);
-    if (!err) err = build_libcxx(c);
-    finalize_build_component(c, lockfd, &err, "libcxx");
+    jobs[njobs++] = (sysroot_job_t){ c, flags, "libcxx", build_libcxx_all };
+    concurrent = true; // libc++abi and libc++
   }
 
+  if (njobs > 1 || concurrent)
+    g_taskflags = BGTASK_NOFANCY;
+  err = run_sysroot_jobs(jobs, njobs);
+  g_taskflags = 0;
+
   return err;
 }
 
@@ -1193,6 +1278,11 @@ int build_sysroot_main(int argc, char* argv[]) {
 
   coverbose = MAX(coverbose, (u8)opt_verbose);
 
+  // limit concurrent compiler jobs across all sysroot components
+  err_t err;
+  if (( err = jobserver_init() ))
+    elog("failed to initialize job server: %s", err_str(err));
+
   compiler_t compiler;
   compiler_init(&compiler, memalloc_default(), &main_diaghandler);
 
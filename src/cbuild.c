@@ -2,6 +2,7 @@
 #include "cbuild.h"
 #include "subproc.h"
 #include "path.h"
+#include "objcache.h"
 #include "llvm/llvm.h"
 
 #include <unistd.h>
@@ -38,6 +39,7 @@ void cbuild_init(
   }
 
   b->srcdir = ".";
+  b->taskflags = 0;
   memset(&b->cc_snapshot, 0, sizeof(b->cc_snapshot));
   memset(&b->cxx_snapshot, 0, sizeof(b->cxx_snapshot));
   memset(&b->as_snapshot, 0, sizeof(b->as_snapshot));
@@ -240,6 +242,22 @@ static err_t cbuild_clean_objdir(cbuild_t* b) {
 #endif
 
 
+// cbuild_compile_obj compiles one object in a subprocess, unless it is cached
+static err_t cbuild_compile_obj(const compiler_t* c, char*const* argv) {
+  objcache_key_t key;
+  // note: we are in a subproc, holding its job token while preprocessing
+  if (objcache_get(&key, c, argv, NULL, 0))
+    return 0;
+  int argc = 0;
+  for (char*const* p = argv; *p++;)
+    argc++;
+  if (clang_main(argc, argv))
+    return ErrCanceled;
+  objcache_put(&key);
+  return 0;
+}
+
+
 static err_t cbuild_build_compile(cbuild_t* b, bgtask_t* task, strlist_t* objfiles) {
   // create subprocs attached to promise
   promise_t promise = {0};
@@ -283,7 +301,16 @@ static err_t cbuild_build_compile(cbuild_t* b, bgtask_t* task, strlist_t* objfil
       }
     }
 
-    err = compiler_spawn_tool(b->c, subprocs, args, b->srcdir);
+    // note: the subprocess gets a copy of argv, so we can restore args right away
+    char* const* argv = strlist_array(args);
+    subproc_t* p = NULL;
+    if (!args->ok) {
+      err = ErrNoMem;
+    } else if (!( p = subprocs_alloc(subprocs) )) {
+      err = ErrCanceled;
+    } else {
+      err = subproc_fork(p, cbuild_compile_obj, b->srcdir, b->c, argv);
+    }
     strlist_restore(args, snapshot);
     if (err)
       break;
@@ -376,7 +403,7 @@ err_t cbuild_build(cbuild_t* b, const char* outfile, bgtask_t* nullable usertask
   // create task, unless provided by caller
   bgtask_t* task = usertask;
   if (!usertask)
-    task = bgtask_open(b->c->ma, b->name, cbuild_njobs(b), 0);
+    task = bgtask_open(b->c->ma, b->name, cbuild_njobs(b), b->taskflags);
 
   // compile objects
   err = cbuild_build_compile(b, task, &objfiles);
@@ -45,6 +45,7 @@ typedef struct {
   const char*       srcdir;
   char* nullable    objdir;
   cobjarray_t       objs;
+  int               taskflags; // bgtask_open flags, when cbuild_build creates the task
   char              objfile[PATH_MAX];
 } cbuild_t;
 
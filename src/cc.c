@@ -4,6 +4,7 @@
 #include "strlist.h"
 #include "compiler.h"
 #include "path.h"
+#include "objcache.h"
 #include "llvm/llvm.h"
 #include "clang/Basic/Version.inc" // CLANG_VERSION_STRING
 
@@ -95,6 +96,7 @@ int cc_main(int user_argc, char* user_argv[], bool iscxx) {
   bool ispastflags = false;
   bool print_only = false;
   bool has_link_flags = false;
+  bool use_objcache = false; // opt-in since a cache hit doesn't replay warnings
 
   char* target_arg = NULL;
 
@@ -234,6 +236,8 @@ int cc_main(int user_argc, char* user_argv[], bool iscxx) {
         config.nolto = false;
       } else if (ISARG("--co-debug")) {
         config.buildmode = BUILDMODE_DEBUG;
+      } else if (ISARG("--co-objcache")) {
+        use_objcache = true;
       } else if (ISARG("-fsyntax-only")) {
         link = false;
       } else if (ISARG("-fno-exceptions") || ISARG("-fno-cxx-exceptions")) {
@@ -599,6 +603,7 @@ int cc_main(int user_argc, char* user_argv[], bool iscxx) {
         streq(arg, "--no-standard-includes") ||
         streq(arg, "-nostdlibinc") ||
         streq(arg, "--co-debug") ||
+        streq(arg, "--co-objcache") ||
         string_startswith(arg, "-mmacosx-version-min=") ||
         string_startswith(arg, "--target=") )
     {
@@ -628,6 +633,17 @@ int cc_main(int user_argc, char* user_argv[], bool iscxx) {
       printf("  %s%s\n", argv[i], i+1 < args.len ? " \\" : "");
   }
 
+  // use a cached object, if we are compiling one which is in the cache
+  objcache_key_t objkey = { .ok = false };
+  if (use_objcache && !print_only && iscompiling && !link &&
+      objcache_get(&objkey, &c, argv, NULL, 0))
+  {
+    return 0;
+  }
+
   // invoke clang
-  return clang_main((int)args.len, argv);
+  int status = clang_main((int)args.len, argv);
+  if (status == 0)
+    objcache_put(&objkey);
+  return status;
 }
@@ -625,8 +625,11 @@ static void gen_structtype(cgen_t* g, const structtype_t* st) {
 }
 
 static void gen_structtype_def(cgen_t* g, structtype_t* st) {
-  // must use a defguard for anonymous structs
-  if (st->name == NULL)
+  // Must use a defguard for anonymous structs and template instances.
+  // The same instance may be defined by several packages, e.g. by the package
+  // which defines the template as well as by a package which uses it.
+  bool defguard = st->name == NULL || (st->flags & NF_TEMPLATEI);
+  if (defguard)
     gen_defguard_begin(g, assertnotnull(st->mangledname));
 
   startline(g, st->loc);
@@ -691,7 +694,7 @@ static void gen_structtype_def(cgen_t* g, structtype_t* st) {
   PRINT("};");
 
 end:
-  if (st->name == NULL)
+  if (defguard)
     gen_defguard_end(g);
 }
 
@@ -1131,7 +1134,7 @@ static void gen_drop(cgen_t* g, const drop_t* d) {
   if (type_isptr(effective_type)) {
     startlinex(g);
     gen_drop_ptr(g, d, (ptrtype_t*)effective_type);
-  } else if (bt->kind == TYPE_ARRAY) {
+  } else if (bt->kind == TYPE_ARRAY && !d->nofree) {
     startlinex(g);
     gen_drop_array(g, d, (arraytype_t*)bt);
   }
@@ -2019,6 +2022,16 @@ static void gen_dyn_arraylit1(cgen_t* g, const arraylit_t* n) {
   u64 len = n->values.len;
 
   PRINTF("{%llu,%llu,", len, len);
+
+  if (n->flags & NF_ONSTACK) {
+    // iropt found that the array never outlives the variable it initializes.
+    // A compound literal has automatic storage duration, living until the end
+    // of the enclosing block, which is the same block as the variable's.
+    gen_arraylit1(g, n, len);
+    CHAR('}');
+    return;
+  }
+
   PRINT(RT_mem_dup "(&");
   gen_arraylit1(g, n, n->values.len);
   PRINTF(",%llu)}", len * at->elem->size);
@@ -3372,23 +3385,31 @@ static isize nodearray_indexof(const nodearray_t* na, const node_t* n) {
 }
 
 
-static void gen_unit(cgen_t* g, unit_t* unit, cgen_pkgapi_t* pkgapi) {
+static void gen_unit(cgen_t* g, unit_t* unit, const cgen_pkgapi_t* nullable pkgapi) {
   assert_nodekind(unit, NODE_UNIT);
   nodearray_t children = unit->children;
 
   if (children.len == 0)
     return;
 
-  u32 defs_start = pkgapi->defs.len;
+  // note: pkgapi is shared by all units of the package and must not be modified
   nodearray_t defs = {};
 
+  // Units may be generated concurrently (see pkgbuild_cgen_pkg.)
+  // Toposort marks AST nodes and mangled names are assigned to AST nodes which
+  // may be shared with other units (e.g. types), so we hold cgen_mu while doing so.
+  // Once assigned, a mangledname never changes, so gen_def can run unlocked.
+  mutex_lock(&g->compiler->cgen_mu);
+
   // add unit-local declarations & definitions to topologically-sorted array "defs"
   nodeflag_t visibility = 0;
   for (u32 i = 0; i < children.len; i++) {
     node_t* n = children.v[i];
     u32 flags = AST_TOPOSORT_TOPLEVEL | AST_TOPOSORT_SKIPEXT;
-    if (!ast_toposort_visit_def(&defs, g->ma, visibility, n, flags))
+    if (!ast_toposort_visit_def(&defs, g->ma, visibility, n, flags)) {
+      mutex_unlock(&g->compiler->cgen_mu);
       goto end; // OOM
+    }
   }
 
   // dlog("%u unit defs:", defs.len);
@@ -3402,7 +3423,7 @@ static void gen_unit(cgen_t* g, unit_t* unit, cgen_pkgapi_t* pkgapi) {
   // of a node may be needed in the body of another node preceeding it.
   for (u32 i = 0; i < defs.len; i++) {
     node_t* n = defs.v[i];
-    if (nodearray_indexof(&pkgapi->defs, n) == -1) {
+    if (!pkgapi || nodearray_indexof(&pkgapi->defs, n) == -1) {
       assign_mangledname(g, n);
     } else if (n->kind != EXPR_FUN && !nodekind_isvar(n->kind)) {
       // erase node with already-generted code
@@ -3410,6 +3431,8 @@ static void gen_unit(cgen_t* g, unit_t* unit, cgen_pkgapi_t* pkgapi) {
     }
   }
 
+  mutex_unlock(&g->compiler->cgen_mu);
+
   // generate definitions
   for (u32 i = 0; i < defs.len; i++) {
     node_t* n = defs.v[i];
@@ -3418,11 +3441,11 @@ static void gen_unit(cgen_t* g, unit_t* unit, cgen_pkgapi_t* pkgapi) {
   }
 
 end:
-  pkgapi->defs.len = defs_start;
+  nodearray_dispose(&defs, g->ma);
 }
 
 
-err_t cgen_unit_impl(cgen_t* g, unit_t* u, cgen_pkgapi_t* pkgapi) {
+err_t cgen_unit_impl(cgen_t* g, unit_t* u, const cgen_pkgapi_t* pkgapi) {
   cgen_reset(g);
 
   if (pkgapi) {
@@ -3434,7 +3457,10 @@ err_t cgen_unit_impl(cgen_t* g, unit_t* u, cgen_pkgapi_t* pkgapi) {
 
   // Include pre-generated package API.
   // This data is usually a copy of g->outbuf after callint cgen_pkg_api
-  if (pkgapi && pkgapi->pkg_header.len > 0) {
+  if (pkgapi && pkgapi->pkg_hfile.len > 0) {
+    // API is in a header file shared by all units (see cgen_pkgapi_header)
+    PRINTF("#include <%s>\n", include_filename(g, pkgapi->pkg_hfile));
+  } else if (pkgapi && pkgapi->pkg_header.len > 0) {
     PRINT("\n// ------ begin package api ------\n");
     buf_append(&g->outbuf, pkgapi->pkg_header.p, pkgapi->pkg_header.len);
     if ( ((u8*)pkgapi->pkg_header.p)[pkgapi->pkg_header.len-1] != '\n' )
@@ -3457,6 +3483,7 @@ void cgen_pkgapi_dispose(cgen_t* g, cgen_pkgapi_t* pkgapi) {
   if (g->ma == NULL)
     return;
   str_free(pkgapi->pkg_header);
+  str_free(pkgapi->pkg_hfile);
   map_dispose(&pkgapi->pkg_typedefs, g->ma);
   nodearray_dispose(&pkgapi->defs, g->ma);
 }
@@ -3640,3 +3667,38 @@ end:
     cgen_pkgapi_dispose(g, pkgapi);
   return g->err;
 }
+
+
+err_t cgen_pkgapi_header(cgen_t* g, const cgen_pkgapi_t* pkgapi, buf_t* out) {
+  const pkg_t* pkg = g->pkg;
+  str_t headerfile = {};
+
+  buf_printf(out, "// package %s\n#pragma once\n", pkg->path.p);
+
+  // include API headers of all imported packages (and std/runtime, like gen_imports)
+  if (pkg->imports.len > 0) {
+    bool include_stdruntime = !g->compiler->opt_nostdruntime;
+    for (u32 i = 0; i < pkg->imports.len; i++)
+      include_stdruntime &= pkg->imports.v[i] != g->compiler->stdruntime_pkg;
+    for (u32 i = 0; i < pkg->imports.len + (u32)include_stdruntime; i++) {
+      const pkg_t* dep = i < pkg->imports.len ?
+        pkg->imports.v[i] : assertnotnull(g->compiler->stdruntime_pkg);
+      headerfile.len = 0;
+      if UNLIKELY(!pkg_buildfile(dep, g->compiler, &headerfile, PKG_APIHFILE_NAME)) {
+        str_free(headerfile);
+        return ErrNoMem;
+      }
+      buf_printf(out, "#include <%s>\n", include_filename(g, headerfile));
+    }
+  }
+  str_free(headerfile);
+
+  buf_append(out, pkgapi->pkg_header.p, pkgapi->pkg_header.len);
+  if (pkgapi->pkg_header.len > 0 &&
+      ((u8*)pkgapi->pkg_header.p)[pkgapi->pkg_header.len-1] != '\n')
+  {
+    buf_push(out, '\n');
+  }
+
+  return out->oom ? ErrNoMem : 0;
+}
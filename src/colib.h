@@ -609,6 +609,7 @@ ASSUME_NONNULL_END
   extern bool opt_trace_ir;
   extern bool opt_trace_cgen;
   extern bool opt_trace_subproc;
+  extern bool opt_textmeta;
 #else
   #define opt_trace_scan      false
   #define opt_trace_parse     false
@@ -618,6 +619,7 @@ ASSUME_NONNULL_END
   #define opt_trace_ir        false
   #define opt_trace_cgen      false
   #define opt_trace_subproc   false
+  #define opt_textmeta        false
 #endif
 
 // no more includes beyond this point; enable default non-nullable pointers
@@ -908,16 +910,21 @@ void memalloc_bump_in_dispose(memalloc_t ma);
 usize memalloc_bumpcap(memalloc_t ma);
 usize memalloc_bumpuse(memalloc_t ma);
 #define MEMALLOC_BUMP_OVERHEAD  (sizeof(void*)*6)
+#define MEMALLOC_BUMP2_NOSYNC (1u<<0) // flag to memalloc_bump2: used by one thread at a time
 
 // memalloc_bump2 is a thread safe bump allocator that uses vm pages to grow
 // automatically as more memory is requested.
 // If slabsize>0, at least ceil(slabsize/pagesize) vm pages are allocated whenever the
 // allocator grows (including its initial allocation.)
 // If slabsize=0, some default implementation-specific size is chosen.
-// flags is currently unused. Pass 0.
+// flags is a bitmask of MEMALLOC_BUMP2_ flags, or 0.
 // Returns memalloc_null() if initial allocation failed.
 memalloc_t memalloc_bump2(usize slabsize, u32 flags);
 void memalloc_bump2_dispose(memalloc_t ma);
+// memalloc_bump2_adopt transfers ownership of the memory of child_ma to ma,
+// without copying: child_ma's allocations stay valid until ma is disposed.
+// child_ma must not be used or disposed after this call. Thread safe.
+void memalloc_bump2_adopt(memalloc_t ma, memalloc_t child_ma);
 usize memalloc_bump2_cap(memalloc_t ma); // total capacity, in bytes
 usize memalloc_bump2_use(memalloc_t ma); // allocated memory, in bytes
 usize memalloc_bump2_avail(memalloc_t ma); // free memory, in bytes
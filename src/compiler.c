@@ -3,6 +3,8 @@
 #include "compiler.h"
 #include "path.h"
 #include "subproc.h"
+#include "timetrace.h"
+#include "objcache.h"
 #include "llvm/llvm.h"
 #include "clang/Basic/Version.inc" // CLANG_VERSION_STRING
 
@@ -24,6 +26,7 @@ void compiler_init(compiler_t* c, memalloc_t ma, diaghandler_t dh) {
   safecheckxf(locmap_init(&c->locmap) == 0, "locmap_init");
   safecheckxf(rwmutex_init(&c->pkgindex_mu) == 0, "rwmutex_init");
   safecheckxf(map_init(&c->pkgindex, c->ma, 32), "map_init");
+  safecheckxf(mutex_init(&c->cgen_mu) == 0, "mutex_init");
 }
 
 
@@ -35,12 +38,12 @@ void compiler_dispose(compiler_t* c) {
   mem_freecstr(c->ma, c->builddir);
   mem_freecstr(c->ma, c->sysroot);
   rwmutex_dispose(&c->diag_mu);
-  locmap_dispose(&c->locmap, c->ma);
 
   for (const mapent_t* e = map_it(&c->pkgindex); map_itnext(&c->pkgindex, &e); )
     pkg_dispose(e->value, c->ma);
   map_dispose(&c->pkgindex, c->ma);
   rwmutex_dispose(&c->pkgindex_mu);
+  mutex_dispose(&c->cgen_mu);
 
   if (c->u8stype.mangledname)
     mem_freex(c->ma, MEM(c->u8stype.mangledname, strlen(c->u8stype.mangledname) + 1));
@@ -485,12 +488,14 @@ static err_t configure_builtins(compiler_t* c) {
 
 err_t configure_options(compiler_t* c, const compiler_config_t* config) {
   c->buildmode = config->buildmode;
+  c->backend = config->backend;
   c->opt_nolto = config->nolto;
   c->opt_nomain = config->nomain;
   c->opt_printast = config->printast;
   c->opt_printir = config->printir;
   c->opt_genirdot = config->genirdot;
   c->opt_genasm = config->genasm;
+  c->opt_ccfork = config->ccfork;
   c->opt_verbose = config->verbose;
   c->opt_nolibc = config->nolibc;
   c->opt_nolibcxx = config->nolibcxx;
@@ -747,10 +752,29 @@ err_t compiler_run_tool_sync(
 // compiler_compile
 
 
-static void add_cflags_for_srctype(compiler_t* c, strlist_t* args, filetype_t srctype) {
+// add_pch_args adds flags for using the precompiled package header, if pkgbuild
+// built one next to cfile (see compile_c_to_pch)
+static void add_pch_args(strlist_t* args, const char* cfile) {
+  char pchfile[PATH_MAX];
+  int dirlen = (int)path_dir_len(cfile, strlen(cfile));
+  int n = snprintf(pchfile, sizeof(pchfile), "%.*s%c%s",
+    dirlen, cfile, PATH_SEPARATOR, PKG_PCHFILE_NAME);
+  if (n > 0 && (usize)n < sizeof(pchfile) && fs_isfile(pchfile))
+    strlist_add(args, "-include-pch", pchfile);
+}
+
+
+static void add_cflags_for_srctype(
+  compiler_t* c, strlist_t* args, filetype_t srctype, const char* cfile)
+{
   switch ((enum filetype)srctype) {
-    case FILE_C:     strlist_add_slice(args, c->cflags_c); break;
-    case FILE_CO:    strlist_add_slice(args, c->cflags_co); break;
+    case FILE_C:
+      strlist_add_slice(args, c->cflags_c);
+      break;
+    case FILE_CO:
+      strlist_add_slice(args, c->cflags_co);
+      add_pch_args(args, cfile);
+      break;
     case FILE_OTHER:
     case FILE_O:
       panic("unexpected srctype %u", srctype);
@@ -758,16 +782,51 @@ static void add_cflags_for_srctype(compiler_t* c, strlist_t* args, filetype_t sr
 }
 
 
-static err_t cc_to_asm_main(
-  compiler_t* c, const char* cfile, const char* asmfile, filetype_t srctype)
+static void cc_to_asm_args(
+  compiler_t* c, strlist_t* args, const char* cfile, const char* asmfile,
+  filetype_t srctype)
 {
-  strlist_t args = strlist_make(c->ma, "clang");
-  add_cflags_for_srctype(c, &args, srctype);
-  strlist_add(&args,
+  add_cflags_for_srctype(c, args, srctype, cfile);
+  strlist_add(args,
     "-w", // don't produce warnings (already reported by cc_to_obj_main)
     "-fno-lto", // make sure LTO is disabled or we will write LLVM IR
     "-S", "-xc", cfile,
     "-o", asmfile);
+}
+
+
+static void cc_to_obj_args(
+  compiler_t* c, strlist_t* args, const char* cfile, const char* ofile,
+  filetype_t srctype)
+{
+  add_cflags_for_srctype(c, args, srctype, cfile);
+  strlist_add(args,
+    // enable all warnings in debug builds, disable them in release builds
+    #if DEBUG
+      "-Wall",
+      "-Wcovered-switch-default",
+      "-Werror=implicit-function-declaration",
+      "-Werror=incompatible-pointer-types",
+      "-Werror=format-insufficient-args",
+      "-Wno-unused-value",
+      "-Wno-unused-function",
+      "-Wno-tautological-compare" // e.g. "x == x"
+    #else
+      "-w"
+    #endif
+  );
+  strlist_add(args,
+    "-c", "-xc", cfile,
+    "-o", ofile,
+    c->opt_verbose > 1 ? "-v" : "");
+}
+
+
+static err_t cc_to_asm_main(
+  compiler_t* c, const char* cfile, const char* asmfile, filetype_t srctype)
+{
+  strlist_t args = strlist_make(c->ma, "clang");
+  cc_to_asm_args(c, &args, cfile, asmfile, srctype);
   char* const* argv = strlist_array(&args);
   if (!args.ok)
     return ErrNoMem;
@@ -786,37 +845,29 @@ static err_t cc_to_asm_main(
 }
 
 
+// cc_to_obj_main compiles cfile with clang_main.
+// key is the object cache key, if the caller has already looked it up.
 static err_t cc_to_obj_main(
-  compiler_t* c, const char* cfile, const char* ofile, filetype_t srctype)
+  compiler_t* c, const char* cfile, const char* ofile, filetype_t srctype,
+  const objcache_key_t* nullable key)
 {
   // note: clang crashes if we run it more than once in the same process
+  // (see cc_inproc_main for the thread-safe in-process path)
 
   strlist_t args = strlist_make(c->ma, "clang");
-  add_cflags_for_srctype(c, &args, srctype);
-  strlist_add(&args,
-    // enable all warnings in debug builds, disable them in release builds
-    #if DEBUG
-      "-Wall",
-      "-Wcovered-switch-default",
-      "-Werror=implicit-function-declaration",
-      "-Werror=incompatible-pointer-types",
-      "-Werror=format-insufficient-args",
-      "-Wno-unused-value",
-      "-Wno-unused-function",
-      "-Wno-tautological-compare" // e.g. "x == x"
-    #else
-      "-w"
-    #endif
-  );
-  strlist_add(&args,
-    "-c", "-xc", cfile,
-    "-o", ofile,
-    c->opt_verbose > 1 ? "-v" : "");
+  cc_to_obj_args(c, &args, cfile, ofile, srctype);
 
   char* const* argv = strlist_array(&args);
   if (!args.ok)
     return ErrNoMem;
 
+  objcache_key_t key1;
+  if (!key) {
+    key = &key1;
+    if (objcache_get(&key1, c, argv, NULL, 0))
+      return 0;
+  }
+
   // dlog("cc %s -> %s", relpath(cfile), relpath(ofile));
   // if (c->opt_verbose > 1) {
   //   for (int i = 0; i < args.len; i++)
@@ -825,7 +876,59 @@ static err_t cc_to_obj_main(
   // }
 
   int status = clang_main(args.len, argv);
-  return status == 0 ? 0 : ErrCanceled;
+  if (status != 0)
+    return ErrCanceled;
+  objcache_put(key);
+  return 0;
+}
+
+
+// cc_inproc_main compiles cfile on the calling thread using clang_compile.
+// wdir is passed to clang as -working-directory since chdir would affect all threads.
+// If clang_compile can't do the job, we fall back to a subprocess, which also
+// isolates the build from clang crashes.
+static err_t cc_inproc_main(
+  compiler_t* c, const char* wdir, const char* cfile, const char* outfile,
+  filetype_t srctype, bool toasm)
+{
+  strlist_t args = strlist_make(c->ma, "clang", "-working-directory", wdir);
+  if (toasm) {
+    cc_to_asm_args(c, &args, cfile, outfile, srctype);
+  } else {
+    cc_to_obj_args(c, &args, cfile, outfile, srctype);
+  }
+  char* const* argv = strlist_array(&args);
+  objcache_key_t key = { .ok = false };
+  if (!toasm && args.ok && objcache_get(&key, c, argv, wdir, OBJCACHE_INPROC)) {
+    strlist_dispose(&args);
+    return 0;
+  }
+  u64 trace_start = timetrace_begin();
+  err_t err = args.ok ? clang_compile(args.len, argv) : ErrNoMem;
+  timetrace_end(trace_start, "cc", cfile);
+  strlist_dispose(&args);
+  if (err == 0)
+    objcache_put(&key);
+  if (err != ErrNotSupported)
+    return err;
+
+  dlog("cc %s: in-process compilation not possible; using subprocess", cfile);
+  subproc_t p = {0};
+  if (toasm) {
+    err = subproc_fork(&p, cc_to_asm_main, wdir, c, cfile, outfile, srctype);
+  } else {
+    // the subprocess gets a copy of key, which we already looked up
+    err = subproc_fork(&p, cc_to_obj_main, wdir, c, cfile, outfile, srctype, &key);
+  }
+  if (err)
+    return err;
+  return subproc_await(&p);
+}
+
+
+static bool cc_use_inproc(const compiler_t* c) {
+  // verbose mode prints clang's commands, which only clang_main does
+  return !c->opt_ccfork && c->opt_verbose < 2;
 }
 
 
@@ -840,7 +943,29 @@ err_t compile_c_to_obj_async(
   subproc_t* p = subprocs_alloc(sp);
   if (!p)
     return ErrNoMem;
-  return subproc_fork(p, cc_to_obj_main, wdir, c, cfile, ofile, srctype);
+  if (cc_use_inproc(c)) {
+    err_t err = subproc_thread(p, cc_inproc_main, c, wdir, cfile, ofile, srctype, false);
+    if (err != ErrNotSupported)
+      return err;
+  }
+  return subproc_fork(p, cc_to_obj_main, wdir, c, cfile, ofile, srctype, NULL);
+}
+
+
+err_t compile_c_to_pch(
+  compiler_t* c, const char* wdir, const char* hfile, const char* pchfile)
+{
+  // Note: cflags_co includes "-include coprelude.h" which thus becomes part of the
+  // precompiled header. clang loads the PCH before processing -include flags.
+  strlist_t args = strlist_make(c->ma, "cc");
+  strlist_add_slice(&args, c->cflags_co);
+  strlist_add(&args,
+    "-w", // warnings are reported when compiling units
+    "-xc-header", hfile,
+    "-o", pchfile);
+  err_t err = args.ok ? compiler_run_tool_sync(c, &args, wdir) : ErrNoMem;
+  strlist_dispose(&args);
+  return err;
 }
 
 
@@ -862,5 +987,11 @@ err_t compile_c_to_asm_async(
   if (!buf_nullterm(&asmfile))
     return ErrNoMem;
 
+  if (cc_use_inproc(c)) {
+    err_t err = subproc_thread(
+      p, cc_inproc_main, c, wdir, cfile, asmfile.chars, srctype, true);
+    if (err != ErrNotSupported)
+      return err;
+  }
   return subproc_fork(p, cc_to_asm_main, wdir, c, cfile, asmfile.chars, srctype);
 }
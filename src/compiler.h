@@ -26,10 +26,19 @@ enum buildmode {
   BUILDMODE_OPT,
 };
 
+typedef u8 backend_t;
+enum backend {
+  BACKEND_C,    // generate C and compile it with clang (default)
+  BACKEND_LLVM, // lower IR directly to LLVM IR (incomplete; falls back to BACKEND_C)
+};
+
+typedef struct irunit_ irunit_t;
+
 // compiler_t
 typedef struct compiler_ {
   memalloc_t  ma;            // memory allocator
   buildmode_t buildmode;     // BUILDMODE_ constant
+  backend_t   backend;       // BACKEND_ constant
   char*       buildroot;     // where all generated files go, e.g. "build"
   char*       builddir;      // "{buildroot}/{mode}-{triple}"
   char*       sysroot;       // "{builddir}/sysroot"
@@ -72,6 +81,7 @@ typedef struct compiler_ {
   bool opt_printir : 1;
   bool opt_genirdot : 1;
   bool opt_genasm : 1;
+  bool opt_ccfork : 1;
   bool opt_nolibc : 1;
   bool opt_nolibcxx : 1;
   bool opt_nostdruntime : 1;
@@ -88,6 +98,10 @@ typedef struct compiler_ {
   rwmutex_t       pkgindex_mu;    // guards access to pkgindex
   map_t           pkgindex;       // const char* abs_fspath -> pkg_t*
   pkg_t* nullable stdruntime_pkg; // std/runtime package
+  bool            loadonly;       // load packages without building them (see pkgbuild_load_api)
+
+  // code generation
+  mutex_t cgen_mu; // guards AST mutations by concurrent cgen_t's (e.g. mangledname)
 } compiler_t;
 
 typedef struct { // compiler_config_t
@@ -97,6 +111,7 @@ typedef struct { // compiler_config_t
 
   // Optional fields; zero value is assumed to be a common default
   buildmode_t buildmode; // BUILDMODE_ constant. 0 = BUILDMODE_DEBUG
+  backend_t   backend;   // BACKEND_ constant. 0 = BACKEND_C
 
   // Options which maps to compiler_t.opt_
   bool nolto;    // prevent use of LTO, even if that would be the default
@@ -105,6 +120,7 @@ typedef struct { // compiler_config_t
   bool printir;
   bool genirdot;
   bool genasm;   // write machine assembly .S source file to build dir
+  bool ccfork;   // compile C in subprocesses instead of in-process on threads
   bool nolibc;
   bool nolibcxx;
   bool nostdruntime; // do not include or link with std/runtime
@@ -157,6 +173,7 @@ typedef struct {
   u64         litint;      // parsed INTLIT
   buf_t       litbuf;      // interpreted source literal (e.g. "foo\n")
   sym_t       sym;         // current identifier value
+  const struct bytescan_* bytescan; // byte classification loops for the host CPU
 } scanner_t;
 
 typedef struct {
@@ -209,6 +226,7 @@ typedef struct {
 typedef struct {
   slice_t pub_header;   // .h file data of public statements (ref cgen_t.outbuf)
   str_t   pkg_header;   // statements for all units of the package
+  str_t   pkg_hfile;    // if set, units #include this file instead of pkg_header
   map_t   pkg_typedefs; // type definitions for all PKG- & PUB-visibility interfaces
   // note: pkgapidata and pkgtypedefs are allocated in cgen_t.ma, it's the
   // responsibility of the cgen_pkgapi caller to free these with cgen_pkgapi_dispose.
@@ -262,6 +280,11 @@ err_t compile_c_to_obj_async(
 err_t compile_c_to_asm_async(
   compiler_t* c, subprocs_t* sp, const char* wdir,
   const char* cfile, const char* ofile, filetype_t srctype);
+// compile_c_to_pch compiles a .co unit header (e.g. "pkg.h") into a precompiled
+// header. Units compiled from C files in the same directory as pchfile use it
+// automatically if it's named PKG_PCHFILE_NAME.
+err_t compile_c_to_pch(
+  compiler_t* c, const char* wdir, const char* hfile, const char* pchfile);
 bool compiler_fully_qualified_name(
   const compiler_t*, const pkg_t*, buf_t* dst, const node_t*);
 bool compiler_mangle(const compiler_t*, const pkg_t*, buf_t* dst, const node_t*);
@@ -327,7 +350,11 @@ inline static u32 parser_errcount(const parser_t* p) { return p->scanner.errcoun
 
 // post-parse passes
 err_t typecheck(compiler_t*, memalloc_t ast_ma, pkg_t* pkg, unit_t** unitv, u32 unitc);
-err_t iranalyze(compiler_t*, memalloc_t ast_ma, pkg_t* pkg, unit_t** unitv, u32 unitc);
+// iranalyze performs ownership analysis.
+// If irunitv is not NULL, the IR of unitv[i] is stored at irunitv[i] (in ast_ma.)
+err_t iranalyze(
+  compiler_t*, memalloc_t ast_ma, pkg_t* pkg, unit_t** unitv, u32 unitc,
+  irunit_t* nullable* nullable irunitv);
 err_t check_typedeps(compiler_t* c, unit_t** unitv, u32 unitc);
 bool check_typedep(compiler_t* c, node_t* n);
 
@@ -354,9 +381,22 @@ err_t pkgindex_add(compiler_t* c, pkg_t* pkg);
 bool cgen_init(
   cgen_t* g, compiler_t* c, const pkg_t*, memalloc_t out_ma, u32 flags);
 void cgen_dispose(cgen_t* g);
-err_t cgen_unit_impl(cgen_t* g, unit_t* unit, cgen_pkgapi_t* pkgapi);
+err_t cgen_unit_impl(cgen_t* g, unit_t* unit, const cgen_pkgapi_t* nullable pkgapi);
 err_t cgen_pkgapi(cgen_t* g, unit_t** unitv, u32 unitc, cgen_pkgapi_t* result);
 void cgen_pkgapi_dispose(cgen_t* g, cgen_pkgapi_t* result);
+// cgen_pkgapi_header generates a header file with the package-internal API,
+// preceded by #includes of imported packages' API headers. Units generated with
+// pkgapi.pkg_hfile set to the file's path include it instead of embedding the API.
+err_t cgen_pkgapi_header(cgen_t* g, const cgen_pkgapi_t* pkgapi, buf_t* out);
+
+// LLVM code generator (llvm/llvmgen.c)
+// llvmgen_unit generates an object file for unit u from its IR (irfunm maps
+// fun_t* => irfun_t*.) flags are CGEN_ flags.
+// Returns ErrNotSupported if the unit uses features the backend doesn't support,
+// in which case the caller should use cgen instead.
+err_t llvmgen_unit(
+  compiler_t* c, const pkg_t* pkg, unit_t* u, const map_t* irfunm, u32 flags,
+  const char* ofile);
 
 // co_strlit_check validates a compis string literal while calculating
 // its decoded byte length. I.e. "hello\nworld" is 11 bytes decoded.
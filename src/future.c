@@ -54,4 +54,9 @@ void future_finalize(future_t* p, err_t result_err) {
   assertf(AtomicLoadAcq(&p->status) == 1, "unbalanced future_begin/finish calls");
   AtomicStoreRel(&p->status, result_err == 0 ? 2 : result_err);
   sema_signal(&p->sem, 2); // yes, 2 signals
-}
\ No newline at end of file
+}
+
+void future_release(future_t* p) {
+  assertf(AtomicLoadAcq(&p->status) == 1, "future not acquired");
+  AtomicStore(&p->status, (err_t)0, memory_order_seq_cst);
+}
@@ -34,4 +34,9 @@ bool future_acquire(future_t* p);
 // call to future_acquire and only called once.
 void future_finalize(future_t* p, err_t result_err);
 
+// future_release undoes a successful call to future_acquire, allowing p to be
+// acquired again. Threads already in future_wait keep waiting; the caller must
+// make sure someone acquires and finalizes p for them.
+void future_release(future_t* p);
+
 ASSUME_NONNULL_END
@@ -3,6 +3,8 @@
 #include "ir.h"
 #include "bits.h"
 #include "compiler.h"
+#include "thread.h"
+#include "threadpool.h"
 
 #include <stdlib.h> // for debug_graphviz hack
 
@@ -11,8 +13,15 @@ typedef array_type(map_t) maparray_t;
 DEF_ARRAY_TYPE_API(map_t, maparray)
 
 
+// irshared_t is state shared by all ircons_t working on the same package
+typedef struct {
+  mutex_t mu;
+  map_t   claimed; // {fun_t* => fun_t*} functions which body is built (guarded by mu)
+} irshared_t;
+
 typedef struct {
   compiler_t* compiler;
+  irshared_t* shared;
   pkg_t*      pkg;
   memalloc_t  ma;          // compiler->ma
   memalloc_t  ir_ma;       // allocator for ir data
@@ -837,6 +846,11 @@ static void backpropagate_drop_to_ast(ircons_t* c, irval_t* v, irval_t* dropv) {
     return out_of_mem(c);
   d->name = name;
   d->type = v->type;
+  d->nofree = false;
+
+  // remember where the drop went, in case iropt eliminates it
+  dropv->aux.drop.drops = drops;
+  dropv->aux.drop.index = drops->len - 1;
 }
 
 
@@ -1290,6 +1304,7 @@ static irval_t* assign_local(ircons_t* c, local_t* dst, irval_t* v) {
 
 static irval_t* var_define(ircons_t* c, local_t* var, irval_t* init) {
   irval_t* v = move_or_copy(c, init, var->loc, NULL, var->init);
+  v->flags |= IR_FL_VARDEF;
   if (var->name != sym__) {
     if (v == init && v->comment && *v->comment) {
       commentf(c, v, "%s aka %s", v->comment, var->name);
@@ -1343,8 +1358,65 @@ static irval_t* vardef(ircons_t* c, local_t* n) {
 }
 
 
+// mark_mutated flags the current value of the variable at the root of an
+// assignment target like "x.y", "x[i]" or "*x" as being modified in place.
+// Its value is no longer what the IR says it is (e.g. ZERO), which iropt must know.
+static void mark_mutated(ircons_t* c, expr_t* left) {
+  expr_t* n = left;
+  for (;;) {
+    switch (n->kind) {
+      case EXPR_MEMBER:    n = ((member_t*)n)->recv; continue;
+      case EXPR_SUBSCRIPT: n = ((subscript_t*)n)->recv; continue;
+      case EXPR_DEREF:     n = ((unaryop_t*)n)->expr; continue;
+      default: break;
+    }
+    break;
+  }
+  if (n == left || n->kind != EXPR_ID)
+    return;
+  local_t* var = (local_t*)((idexpr_t*)n)->ref;
+  if (!var || !node_islocal((node_t*)var))
+    return;
+  irval_t* v = var_read(c, var->name, var->type, n->loc);
+  v->flags |= IR_FL_MUTATED;
+}
+
+
+// assignop_binop returns the binary operation of a compound assignment operation,
+// e.g. OP_ADD for OP_ADD_ASSIGN
+static op_t assignop_binop(op_t op) {
+  switch (op) {
+    case OP_ADD_ASSIGN: return OP_ADD;
+    case OP_SUB_ASSIGN: return OP_SUB;
+    case OP_MUL_ASSIGN: return OP_MUL;
+    case OP_DIV_ASSIGN: return OP_DIV;
+    case OP_MOD_ASSIGN: return OP_MOD;
+    case OP_AND_ASSIGN: return OP_AND;
+    case OP_OR_ASSIGN:  return OP_OR;
+    case OP_XOR_ASSIGN: return OP_XOR;
+    case OP_SHL_ASSIGN: return OP_SHL;
+    case OP_SHR_ASSIGN: return OP_SHR;
+    default:
+      assertf(0, "unexpected %s", op_name(op));
+      return op;
+  }
+}
+
+
 static irval_t* assign(ircons_t* c, binop_t* n) {
   irval_t* v = load_expr(c, n->right);
+  mark_mutated(c, n->left);
+
+  // The new value of a variable after a compound assignment, e.g. "x += y",
+  // is computed from its current value.
+  // Other targets, e.g. "x.y += z", are flagged as mutated by mark_mutated.
+  if (n->op != OP_ASSIGN && n->left->kind == EXPR_ID) {
+    irval_t* curr = load_expr(c, n->left);
+    irval_t* result = pushval(c, c->b, assignop_binop(n->op), n->loc, curr->type);
+    pusharg(result, curr);
+    pusharg(result, v);
+    v = result;
+  }
   local_t* dst = NULL;
 
   expr_t* left = n->left;
@@ -1850,11 +1922,13 @@ static irval_t* ifexpr(ircons_t* c, ifexpr_t* n) {
   if (!isrvalue(n) || thenv == elsev)
     return thenv;
 
-  // make Phi, joining the two branches together
+  // make Phi, joining the two branches together.
+  // Args are in the same order as c->b->preds (like phis made by var_read_recursive);
+  // the edge from the "then" branch is always preds[1] (see wiring above.)
   assertf(c->b->preds[0], "phi in block without predecessors");
   irval_t* phi = pushval(c, c->b, OP_PHI, n->loc, thenv->type);
-  pusharg(phi, thenv);
   pusharg(phi, elsev);
+  pusharg(phi, thenv);
   comment(c, phi, "if");
 
   return phi;
@@ -1872,10 +1946,26 @@ static irval_t* binop(ircons_t* c, binop_t* n) {
 }
 
 
+// incdec records the result v of "x++" or "x--" (prefix or postfix) as the new
+// value of x. Other operands, e.g. "x.y++", are flagged as mutated.
+static void incdec(ircons_t* c, unaryop_t* n, irval_t* v) {
+  if (n->op != OP_INC && n->op != OP_DEC)
+    return;
+  if (n->expr->kind != EXPR_ID) {
+    mark_mutated(c, n->expr);
+    return;
+  }
+  local_t* var = (local_t*)((idexpr_t*)n->expr)->ref;
+  if (var && node_islocal((node_t*)var))
+    assign_local(c, var, v);
+}
+
+
 static irval_t* prefixop(ircons_t* c, unaryop_t* n) {
   irval_t* expr  = load_expr(c, n->expr);
   irval_t* v = pushval(c, c->b, n->op, n->loc, n->type);
   pusharg(v, expr);
+  incdec(c, n, v);
   return v;
 }
 
@@ -1884,6 +1974,7 @@ static irval_t* postfixop(ircons_t* c, unaryop_t* n) {
   irval_t* expr = load_expr(c, n->expr);
   irval_t* v = pushval(c, c->b, n->op, n->loc, n->type);
   pusharg(v, expr);
+  incdec(c, n, v);
   return expr;
 }
 
@@ -1903,6 +1994,7 @@ static irval_t* strlit(ircons_t* c, strlit_t* n) {
 
 static irval_t* arraylit(ircons_t* c, arraylit_t* n) {
   irval_t* v = pushval(c, c->b, OP_ARRAY, n->loc, n->type);
+  v->aux.ptr = n; // for iropt (stack allocation)
   for (u32 i = 0; i < n->values.len; i++) {
     expr_t* cn = (expr_t*)n->values.v[i];
     irval_t* vv = load_expr(c, cn);
@@ -2005,6 +2097,21 @@ UNUSED static void check_borrowing(ircons_t* c, irfun_t* f) {
 }
 
 
+// claimfun returns true if the caller should build the body of function n
+static bool claimfun(ircons_t* c, fun_t* n) {
+  irshared_t* shared = c->shared;
+  mutex_lock(&shared->mu);
+  void** vp = map_assign_ptr(&shared->claimed, c->ma, n);
+  bool claimed = vp && *vp == NULL;
+  if (claimed)
+    *vp = n;
+  mutex_unlock(&shared->mu);
+  if UNLIKELY(!vp)
+    out_of_mem(c);
+  return claimed;
+}
+
+
 static bool addfun(ircons_t* c, fun_t* n, irfun_t** fp) {
   // make sure *fp is initialized no matter what happens
   *fp = &bad_irfun;
@@ -2040,6 +2147,12 @@ static bool addfun(ircons_t* c, fun_t* n, irfun_t** fp) {
   if (n->body == NULL)
     return false;
 
+  // Only build a function once per package.
+  // The function might be referenced from a unit other than the one defining it
+  // (and units may be analyzed concurrently.)
+  if (!claimfun(c, n))
+    return false;
+
   // handle function refs and nested function definitions
   if (c->f != &bad_irfun) {
     trace("funqueue push %s", fmtnode(0, n));
@@ -2410,69 +2523,185 @@ static void ircons_reset(ircons_t* c) {
 }
 
 
-err_t iranalyze(
-  compiler_t* compiler, memalloc_t ir_ma, pkg_t* pkg, unit_t** unitv, u32 unitc)
+static err_t ircons_init(
+  ircons_t* c, compiler_t* compiler, irshared_t* shared, memalloc_t ir_ma, pkg_t* pkg)
 {
-  bad_irval.type = type_void;
-  bad_astfuntype.result = type_void;
-
-  // initialize ircons_t
-  ircons_t c = {
+  *c = (ircons_t){
     .compiler = compiler,
+    .shared = shared,
+    .pkg = pkg,
     .ma = compiler->ma,
     .ir_ma = ir_ma,
     .unit = &bad_irunit,
     .f = &bad_irfun,
     .b = &bad_irblock,
-    .deadset = assertnotnull( bitset_make(compiler->ma, BITSET_STACK_CAP) ),
+    .deadset = bitset_make(compiler->ma, BITSET_STACK_CAP),
   };
-  if (!map_init(&c.funm, c.ma, 64)) {
-    c.err = ErrNoMem;
-    goto end1;
+  if (!c->deadset)
+    return ErrNoMem;
+  if (!map_init(&c->funm, c->ma, 64))
+    goto oom1;
+  if (!map_init(&c->vars, c->ma, 8))
+    goto oom2;
+  return 0;
+oom2:
+  map_dispose(&c->funm, c->ma);
+oom1:
+  bitset_dispose(c->deadset, c->ma);
+  return ErrNoMem;
+}
+
+
+static void ircons_dispose(ircons_t* c) {
+  ptrarray_dispose(&c->funqueue, c->ma);
+  ptrarray_dispose(&c->dropstack, c->ma);
+  ptrarray_dispose(&c->owners.entries, c->ma);
+
+  dispose_maparray(c->ma, &c->defvars);
+  dispose_maparray(c->ma, &c->pendingphis);
+  dispose_maparray(c->ma, &c->freemaps);
+
+  map_dispose(&c->vars, c->ma);
+  map_dispose(&c->funm, c->ma);
+  bitset_dispose(c->deadset, c->ma);
+}
+
+
+static void analyze_unit(ircons_t* c, unit_t* n, irunit_t* nullable* result) {
+  compiler_t* compiler = c->compiler;
+  dlog("[ir] analyzing %s", node_srcfilename((node_t*)n, &compiler->locmap));
+
+  irunit_t* u = unit(c, n);
+  if (c->err)
+    return;
+
+  // optimize, unless there were errors (in which case the IR may be incomplete)
+  if (u != &bad_irunit && c->errcount == 0 && ( c->err = iropt_unit(c->ma, u) ))
+    return;
+
+  if (u != &bad_irunit) {
+    if (compiler->opt_printir)
+      dump_irunit(compiler, c->pkg, u);
+    if (compiler->opt_genirdot)
+      debug_graphviz(compiler, c->pkg, u);
   }
-  if (!map_init(&c.vars, c.ma, 8)) {
-    c.err = ErrNoMem;
-    goto end2;
+
+  // The irunit is allocated in ir_ma, which is expected to be a bump allocator,
+  // so no need to deallocate irunit here. It's kept if the caller asks for it
+  // (e.g. for the LLVM backend), otherwise discarded.
+  if (result)
+    *result = u;
+}
+
+
+typedef struct {
+  compiler_t*         compiler;
+  irshared_t*         shared;
+  memalloc_t          ir_ma;
+  pkg_t*              pkg;
+  unit_t*             unit;
+  irunit_t* nullable* result;
+  sema_t              sem;
+  _Atomic(err_t)      err;
+} irjob_t;
+
+
+static void irjob_run(irjob_t* job) {
+  ircons_t c;
+  err_t err = ircons_init(&c, job->compiler, job->shared, job->ir_ma, job->pkg);
+  if (!err) {
+    analyze_unit(&c, job->unit, job->result);
+    err = c.err;
+    ircons_dispose(&c);
   }
+  AtomicStoreRel(&job->err, err);
+  sema_signal(&job->sem, 1);
+}
+
+
+static err_t iranalyze_parallel(
+  compiler_t* compiler, irshared_t* shared, memalloc_t ir_ma, pkg_t* pkg,
+  unit_t** unitv, u32 unitc, irunit_t* nullable* nullable irunitv)
+{
+  irjob_t* jobv = mem_alloctv(compiler->ma, irjob_t, unitc);
+  if (!jobv)
+    return ErrNoMem;
 
-  // visit unit by unit
   for (u32 i = 0; i < unitc; i++) {
-    dlog("[ir] analyzing %s", node_srcfilename((node_t*)unitv[i], &compiler->locmap));
+    irjob_t* job = &jobv[i];
+    job->compiler = compiler;
+    job->shared = shared;
+    job->ir_ma = ir_ma;
+    job->pkg = pkg;
+    job->unit = unitv[i];
+    job->result = irunitv ? &irunitv[i] : NULL;
+    job->err = 0;
+    safecheckx(sema_init(&job->sem, 0) == 0);
+    // analyze last unit on the current thread to make the most of what we have
+    if (i == unitc - 1 || threadpool_submit(irjob_run, job) != 0)
+      irjob_run(job);
+  }
+
+  // wait for results
+  err_t err = 0;
+  for (u32 i = 0; i < unitc; i++) {
+    safecheckx(sema_wait(&jobv[i].sem));
+    err_t err1 = AtomicLoadAcq(&jobv[i].err);
+    if (err1 && !err)
+      err = err1;
+    sema_dispose(&jobv[i].sem);
+  }
 
-    irunit_t* u = unit(&c, unitv[i]);
-    if (c.err)
-      break;
+  mem_freetv(compiler->ma, jobv, unitc);
+  return err;
+}
 
-    if (u != &bad_irunit) {
-      if (compiler->opt_printir)
-        dump_irunit(compiler, pkg, u);
-      if (compiler->opt_genirdot)
-        debug_graphviz(compiler, pkg, u);
-    }
 
-    // Note: For now, we just discard the irunit. We have no use for it anymore.
-    // It is allocated in ir_ma, which is expected to be a bump allocator,
-    // so no need to deallocate irunit here.
+err_t iranalyze(
+  compiler_t* compiler, memalloc_t ir_ma, pkg_t* pkg, unit_t** unitv, u32 unitc,
+  irunit_t* nullable* nullable irunitv)
+{
+  bad_irval.type = type_void;
+  bad_astfuntype.result = type_void;
+
+  irshared_t shared = {0};
+  err_t err;
+  if (( err = mutex_init(&shared.mu) ))
+    return err;
+  if (!map_init(&shared.claimed, compiler->ma, 64)) {
+    mutex_dispose(&shared.mu);
+    return ErrNoMem;
+  }
+
+  // Units are independent of each other and are analyzed concurrently, unless
+  // IR is to be printed or traced, in which case we want the output to be ordered.
+  if (comaxproc > 1 && unitc > 1 &&
+      !opt_trace_ir && !compiler->opt_printir && !compiler->opt_genirdot)
+  {
+    err = iranalyze_parallel(compiler, &shared, ir_ma, pkg, unitv, unitc, irunitv);
+    goto end;
+  }
+
+  ircons_t c;
+  if (( err = ircons_init(&c, compiler, &shared, ir_ma, pkg) ))
+    goto end;
+
+  // visit unit by unit
+  for (u32 i = 0; i < unitc; i++) {
+    analyze_unit(&c, unitv[i], irunitv ? &irunitv[i] : NULL);
+    if (c.err)
+      break;
 
     // reset state before parsing next unit
     if (i + 1 < unitc)
       ircons_reset(&c);
   }
 
-  // end
-  ptrarray_dispose(&c.funqueue, c.ma);
-  ptrarray_dispose(&c.dropstack, c.ma);
-  ptrarray_dispose(&c.owners.entries, c.ma);
-
-  dispose_maparray(c.ma, &c.defvars);
-  dispose_maparray(c.ma, &c.pendingphis);
-  dispose_maparray(c.ma, &c.freemaps);
+  err = c.err;
+  ircons_dispose(&c);
 
-  map_dispose(&c.vars, c.ma);
-end2:
-  map_dispose(&c.funm, c.ma);
-end1:
-  bitset_dispose(c.deadset, c.ma);
-
-  return c.err;
+end:
+  map_dispose(&shared.claimed, compiler->ma);
+  mutex_dispose(&shared.mu);
+  return err;
 }
@@ -5,6 +5,8 @@ ASSUME_NONNULL_BEGIN
 
 typedef u8 irflag_t;
 #define IR_FL_SEALED  ((irflag_t)1<< 0) // [block] is sealed
+#define IR_FL_VARDEF  ((irflag_t)1<< 1) // [value] initial value of a local variable
+#define IR_FL_MUTATED ((irflag_t)1<< 2) // [value] modified in place, e.g. "x.y = z"
 
 typedef u8 irblockkind_t;
 enum irblockkind {
@@ -31,6 +33,10 @@ typedef struct irval_ {
     f64            f64val;
     void* nullable ptr;
     slice_t        bytes; // pointer into AST node, e.g. strlit_t
+    struct {
+      droparray_t* nullable drops; // AST drops that an OP_DROP was propagated to
+      u32                   index; // index in drops
+    } drop;
   } aux;
 
   struct {
@@ -60,7 +66,7 @@ typedef struct irblock_ {
   const char* nullable comment;
 } irblock_t;
 
-typedef struct {
+typedef struct irfun_ {
   fun_t*      ast;
   const char* name;
   ptrarray_t  blocks;
@@ -71,12 +77,16 @@ typedef struct {
   u32         nglobalw;   // # writes to globals
 } irfun_t;
 
-typedef struct {
+typedef struct irunit_ {
   ptrarray_t          functions;
   srcfile_t* nullable srcfile;
 } irunit_t;
 
 
+// iropt_fun optimizes f (see iropt.c). ma is used for temporary allocations.
+err_t iropt_fun(memalloc_t ma, irfun_t* f);
+err_t iropt_unit(memalloc_t ma, irunit_t* u);
+
 bool irfmt(compiler_t*, const pkg_t*, buf_t*, const irunit_t*);
 bool irfmt_dot(compiler_t*, const pkg_t*, buf_t*, const irunit_t*);
 bool irfmt_fun(compiler_t*, const pkg_t*, buf_t*, const irfun_t*);
@@ -0,0 +1,898 @@
+// IR optimization
+// SPDX-License-Identifier: Apache-2.0
+//
+// Optimizes the SSA form of a function after ownership analysis:
+// - constant folding of integer and boolean operations (except on values which
+//   may be modified through a reference)
+// - copy propagation of trivial phis (phis whose arguments are all the same)
+// - folding of switch blocks with a constant control value
+// - dead block elimination (blocks that are unreachable from the entry block)
+// - redundant drop elimination (drops of values which are known to be empty)
+// - dead value elimination (values without side effects that are never used)
+// - stack allocation of dynamic array literals which do not escape their variable
+//
+// ir.c propagates every DROP to the AST, where cgen picks it up. A drop that is
+// eliminated here is removed from the AST too.
+//
+#include "colib.h"
+#include "ir.h"
+#include "bits.h"
+#include "compiler.h"
+
+
+#define trace(fmt, va...) _trace(opt_trace_ir, 1, "IROPT", fmt, ##va)
+
+// upper limit on the number of times we run the passes on a function
+#define MAX_ROUNDS 16
+
+
+typedef struct {
+  irfun_t*   f;
+  memalloc_t ma;       // allocator for temporary data
+  irval_t**  replv;    // {[irval_t.id] => irval_t*} values replaced by another value
+  bitset_t*  pinned;   // {[irval_t.id]} values which may change behind ir.c's back
+  ptrarray_t dropsets; // droparray_t*[] AST drops with elided entries (sorted set)
+  bool       changed;  // true if the current round changed anything
+  bool       oom;
+} iropt_t;
+
+
+static bool hassideeffects(const irval_t* v) {
+  switch (v->op) {
+    case OP_NOOP: // placeholder for something not yet supported by ir.c
+    case OP_ARG:
+    case OP_CALL:
+    case OP_STORE:
+    case OP_DROP:
+    case OP_ASSIGN:
+    case OP_ADD_ASSIGN:
+    case OP_SUB_ASSIGN:
+    case OP_MUL_ASSIGN:
+    case OP_DIV_ASSIGN:
+    case OP_MOD_ASSIGN:
+    case OP_AND_ASSIGN:
+    case OP_OR_ASSIGN:
+    case OP_XOR_ASSIGN:
+    case OP_SHL_ASSIGN:
+    case OP_SHR_ASSIGN:
+      return true;
+    default:
+      return false;
+  }
+}
+
+
+static irval_t* resolve(iropt_t* o, irval_t* v) {
+  while (o->replv[v->id])
+    v = o->replv[v->id];
+  return v;
+}
+
+
+static void replace(iropt_t* o, irval_t* v, irval_t* replacement) {
+  assert(v != replacement);
+  trace("replace v%u with v%u", v->id, replacement->id);
+  o->replv[v->id] = replacement;
+  if (bitset_has(o->pinned, v->id))
+    bitset_add(o->pinned, replacement->id);
+  o->changed = true;
+}
+
+
+static void elide_drop(iropt_t* o, irval_t* v) {
+  assert(v->op == OP_DROP);
+  droparray_t* drops = v->aux.drop.drops;
+  if (!drops)
+    return;
+  trace("elide drop v%u", v->id);
+  assert(v->aux.drop.index < drops->len);
+  drops->v[v->aux.drop.index].name = NULL;
+  v->aux.drop.drops = NULL;
+  if (!ptrarray_sortedset_addptr(&o->dropsets, o->ma, drops, NULL))
+    o->oom = true;
+}
+
+
+// compact_dropsets removes elided entries from AST drops
+static void compact_dropsets(iropt_t* o) {
+  for (u32 i = 0; i < o->dropsets.len; i++) {
+    droparray_t* drops = o->dropsets.v[i];
+    u32 len = 0;
+    for (u32 j = 0; j < drops->len; j++) {
+      if (drops->v[j].name)
+        drops->v[len++] = drops->v[j];
+    }
+    drops->len = len;
+  }
+}
+
+
+//—————————————————————————————————————————————————————————————————————————————————————
+// constant folding
+
+
+static bool isintconst(const irval_t* v) {
+  return v->op == OP_ICONST && TYPE_BOOL <= v->type->kind && v->type->kind <= TYPE_UINT;
+}
+
+
+static u64 trunc_bits(u64 x, u32 bits) {
+  return bits >= 64 ? x : x & ((1llu << bits) - 1);
+}
+
+
+static i64 sext_bits(u64 x, u32 bits) {
+  if (bits >= 64)
+    return (i64)x;
+  u64 m = 1llu << (bits - 1);
+  return (i64)((trunc_bits(x, bits) ^ m) - m);
+}
+
+
+// isfoldable returns true if v is an integer constant which may be folded.
+// ir.c does not give a variable a new value when it's modified through a
+// reference (e.g. "var r = &x; *r = 1"), so the value of a variable which has
+// a reference taken to it, or which is modified in place, is not constant.
+static bool isfoldable(const iropt_t* o, const irval_t* v) {
+  return isintconst(v) && !bitset_has(o->pinned, v->id);
+}
+
+
+// update_pinned computes o->pinned for the current state of the IR
+static void update_pinned(iropt_t* o) {
+  bitset_clear(o->pinned);
+  for (u32 bi = 0; bi < o->f->blocks.len; bi++) {
+    irblock_t* b = o->f->blocks.v[bi];
+    for (u32 i = 0; i < b->values.len; i++) {
+      irval_t* v = b->values.v[i];
+      if (v->flags & IR_FL_MUTATED)
+        bitset_add(o->pinned, v->id);
+      if ((v->op == OP_REF || v->op == OP_MUTREF) && v->argc > 0)
+        bitset_add(o->pinned, v->argv[0]->id);
+    }
+  }
+}
+
+
+static void make_iconst(iropt_t* o, irval_t* v, u64 value) {
+  trace("fold v%u %s => %llu", v->id, op_name(v->op), value);
+  v->op = OP_ICONST;
+  v->argc = 0;
+  v->aux.i64val = value;
+  o->changed = true;
+}
+
+
+static bool fold_unary(irval_t* v, const irval_t* x, u64* result) {
+  u32 bits = (u32)x->type->size * 8;
+  u64 a = x->aux.i64val;
+  switch (v->op) {
+    case OP_ADD: *result = a; break;
+    case OP_SUB: *result = trunc_bits(-a, bits); break;
+    case OP_INV: *result = trunc_bits(~a, bits); break;
+    case OP_NOT: *result = !a; break;
+    case OP_INC: *result = trunc_bits(a + 1, bits); break;
+    case OP_DEC: *result = trunc_bits(a - 1, bits); break;
+    default: return false;
+  }
+  return true;
+}
+
+
+static bool fold_binary(irval_t* v, const irval_t* x, const irval_t* y, u64* result) {
+  u32 bits = (u32)x->type->size * 8;
+  bool issigned = !type_isunsigned(x->type);
+  u64 a = x->aux.i64val, b = y->aux.i64val;
+  i64 sa = sext_bits(a, bits), sb = sext_bits(b, bits);
+  u64 r;
+  switch (v->op) {
+    case OP_ADD: r = a + b; break;
+    case OP_SUB: r = a - b; break;
+    case OP_MUL: r = a * b; break;
+    case OP_DIV:
+    case OP_MOD:
+      // leave division by zero and overflow (e.g. INT_MIN/-1) to the target
+      if (b == 0 || (issigned && sb == -1))
+        return false;
+      if (v->op == OP_DIV) {
+        r = issigned ? (u64)(sa / sb) : trunc_bits(a, bits) / trunc_bits(b, bits);
+      } else {
+        r = issigned ? (u64)(sa % sb) : trunc_bits(a, bits) % trunc_bits(b, bits);
+      }
+      break;
+    case OP_AND: r = a & b; break;
+    case OP_OR:  r = a | b; break;
+    case OP_XOR: r = a ^ b; break;
+    case OP_SHL:
+    case OP_SHR:
+      if (b >= bits)
+        return false;
+      if (v->op == OP_SHL) {
+        r = a << b;
+      } else {
+        r = issigned ? (u64)(sa >> b) : trunc_bits(a, bits) >> b;
+      }
+      break;
+    case OP_LAND: *result = a && b; return true;
+    case OP_LOR:  *result = a || b; return true;
+    case OP_EQ:   *result = trunc_bits(a, bits) == trunc_bits(b, bits); return true;
+    case OP_NEQ:  *result = trunc_bits(a, bits) != trunc_bits(b, bits); return true;
+    case OP_LT:   *result = issigned ? sa < sb  : trunc_bits(a, bits) < trunc_bits(b, bits);
+                  return true;
+    case OP_GT:   *result = issigned ? sa > sb  : trunc_bits(a, bits) > trunc_bits(b, bits);
+                  return true;
+    case OP_LTEQ: *result = issigned ? sa <= sb : trunc_bits(a, bits) <= trunc_bits(b, bits);
+                  return true;
+    case OP_GTEQ: *result = issigned ? sa >= sb : trunc_bits(a, bits) >= trunc_bits(b, bits);
+                  return true;
+    default:
+      return false;
+  }
+  *result = trunc_bits(r, bits);
+  return true;
+}
+
+
+static void fold_value(iropt_t* o, irval_t* v) {
+  if (v->argc == 0 || v->argc > 2 || !isfoldable(o, v->argv[0]))
+    return;
+  if (!(TYPE_BOOL <= v->type->kind && v->type->kind <= TYPE_UINT))
+    return;
+  u64 result;
+  if (v->argc == 1) {
+    if (fold_unary(v, v->argv[0], &result))
+      make_iconst(o, v, result);
+  } else if (isfoldable(o, v->argv[1]) && v->argv[0]->type == v->argv[1]->type) {
+    if (fold_binary(v, v->argv[0], v->argv[1], &result))
+      make_iconst(o, v, result);
+  }
+}
+
+
+//—————————————————————————————————————————————————————————————————————————————————————
+// copy propagation
+
+
+static void simplify_phi(iropt_t* o, irval_t* v) {
+  if (v->argc == 0)
+    return;
+
+  // A phi which arguments are all the same value (or the phi itself) is a copy
+  // of that value.
+  irval_t* same = NULL;
+  for (u32 i = 0; i < v->argc; i++) {
+    irval_t* arg = v->argv[i];
+    if (arg == v || arg == same)
+      continue;
+    if (same)
+      goto notcopy;
+    same = arg;
+  }
+  if (same)
+    replace(o, v, same);
+  return;
+
+notcopy:
+  // A phi which arguments are equal constants is that constant
+  for (u32 i = 0; i < v->argc; i++) {
+    irval_t* arg = v->argv[i];
+    if (!isfoldable(o, arg) || arg->type != v->type ||
+        arg->aux.i64val != v->argv[0]->aux.i64val)
+    {
+      return;
+    }
+  }
+  make_iconst(o, v, v->argv[0]->aux.i64val);
+}
+
+
+//—————————————————————————————————————————————————————————————————————————————————————
+// control flow
+
+
+// remove_pred removes the edge pred -> b, including the corresponding phi arguments
+static void remove_pred(irblock_t* b, irblock_t* pred) {
+  u32 k = 0;
+  for (; k < countof(b->preds); k++) {
+    if (b->preds[k] == pred)
+      break;
+  }
+  if (k == countof(b->preds))
+    return;
+  for (u32 i = 0; i < b->values.len; i++) {
+    irval_t* v = b->values.v[i];
+    if (v->op != OP_PHI || v->argc <= k)
+      continue;
+    for (u32 j = k + 1; j < v->argc; j++)
+      v->argv[j - 1] = v->argv[j];
+    v->argc--;
+  }
+  for (u32 j = k + 1; j < countof(b->preds); j++)
+    b->preds[j - 1] = b->preds[j];
+  b->preds[countof(b->preds) - 1] = NULL;
+}
+
+
+static void fold_switch(iropt_t* o, irblock_t* b) {
+  if (b->kind != IR_BLOCK_SWITCH || !b->control || !isfoldable(o, b->control))
+    return;
+  if (!b->succs[0] || !b->succs[1])
+    return;
+  // switch control -> [false, true]
+  bool cond = b->control->aux.i64val != 0;
+  irblock_t* taken = b->succs[cond];
+  irblock_t* nottaken = b->succs[!cond];
+  trace("fold switch b%u -> b%u", b->id, taken->id);
+  b->kind = IR_BLOCK_GOTO;
+  b->control = NULL;
+  b->succs[0] = taken;
+  b->succs[1] = NULL;
+  remove_pred(nottaken, b);
+  o->changed = true;
+}
+
+
+static void remove_unreachable_blocks(iropt_t* o) {
+  irfun_t* f = o->f;
+  bitset_t* reachable = bitset_make(o->ma, f->bidgen);
+  ptrarray_t stack = {0};
+  if (!reachable) {
+    o->oom = true;
+    return;
+  }
+
+  irblock_t* entryb = f->blocks.v[0];
+  bitset_add(reachable, entryb->id);
+  if (!ptrarray_push(&stack, o->ma, entryb))
+    goto oom;
+  while (stack.len) {
+    irblock_t* b = ptrarray_pop(&stack);
+    for (u32 i = 0; i < countof(b->succs); i++) {
+      irblock_t* s = b->succs[i];
+      if (!s || bitset_has(reachable, s->id))
+        continue;
+      bitset_add(reachable, s->id);
+      if (!ptrarray_push(&stack, o->ma, s))
+        goto oom;
+    }
+  }
+
+  for (u32 i = f->blocks.len; i-- > 1;) {
+    irblock_t* b = f->blocks.v[i];
+    if (bitset_has(reachable, b->id))
+      continue;
+    trace("remove unreachable b%u", b->id);
+    for (u32 j = 0; j < countof(b->succs); j++) {
+      if (b->succs[j])
+        remove_pred(b->succs[j], b);
+    }
+    for (u32 j = 0; j < b->values.len; j++) {
+      irval_t* v = b->values.v[j];
+      if (v->op == OP_DROP)
+        elide_drop(o, v);
+    }
+    ptrarray_remove(&f->blocks, i, 1);
+    o->changed = true;
+  }
+
+  goto end;
+oom:
+  o->oom = true;
+end:
+  ptrarray_dispose(&stack, o->ma);
+  bitset_dispose(reachable, o->ma);
+}
+
+
+//—————————————————————————————————————————————————————————————————————————————————————
+// drops
+
+
+static bool isempty(const irval_t* v) {
+  return v->op == OP_ZERO || (v->op == OP_ICONST && v->aux.i64val == 0);
+}
+
+
+// ismutable_use returns true if v may modify its argument in place,
+// e.g. "s.a" (GEP) or "&s" where s is mutable
+static bool ismutable_use(const irval_t* v) {
+  switch (v->op) {
+    case OP_GEP:
+    case OP_MUTREF:
+      return true;
+    case OP_REF:
+      return v->type->kind == TYPE_MUTREF;
+    default:
+      return false;
+  }
+}
+
+
+// isknown_empty returns true if v is empty and stays empty for its entire lifetime.
+// ir.c does not give a variable a new value when a field of it is assigned, or
+// when it's modified through a reference, so the value of a zero-initialized
+// variable is not necessarily empty when it's dropped.
+static bool isknown_empty(iropt_t* o, const irval_t* v) {
+  if (!isempty(v) || (v->flags & IR_FL_MUTATED))
+    return false;
+  for (u32 bi = 0; bi < o->f->blocks.len; bi++) {
+    irblock_t* b = o->f->blocks.v[bi];
+    for (u32 i = 0; i < b->values.len; i++) {
+      irval_t* use = b->values.v[i];
+      if (!ismutable_use(use))
+        continue;
+      for (u32 j = 0; j < use->argc; j++) {
+        if (use->argv[j] == v)
+          return false;
+      }
+    }
+  }
+  return true;
+}
+
+
+static void remove_redundant_drops(iropt_t* o, irblock_t* b) {
+  for (u32 i = 0; i < b->values.len; i++) {
+    irval_t* v = b->values.v[i];
+    if (v->op != OP_DROP || v->argc == 0 || !isknown_empty(o, v->argv[0]))
+      continue;
+    // dropping something that is known to be empty (e.g. "none") is a no-op
+    elide_drop(o, v);
+    ptrarray_remove(&b->values, i--, 1);
+    o->changed = true;
+  }
+}
+
+
+//—————————————————————————————————————————————————————————————————————————————————————
+// stack allocation
+//
+// The only owning values that are heap allocated by generated code (rather than
+// by a function called from it) are dynamic array literals, e.g. "var a = [1,2,3]".
+// When such an array is the initial value of a local variable and the variable's
+// value never escapes, i.e. it's never moved, mutably borrowed or returned, the
+// storage of the array can be placed on the stack instead.
+// The array is then known to have the same lifetime as the variable, and since
+// it's never mutably borrowed, it can't be reallocated.
+
+
+// upper limit on the size of array storage placed on the stack
+#define STACKALLOC_MAXSIZE 4096
+
+
+static bool isstackalloc_candidate(const irval_t* v) {
+  if (v->op != OP_ARRAY || v->type->kind != TYPE_ARRAY || !v->aux.ptr)
+    return false;
+  const arraytype_t* at = (arraytype_t*)v->type;
+  const arraylit_t* n = v->aux.ptr;
+  return at->len == 0 &&
+         n->values.len > 0 &&
+         (u64)n->values.len * at->elem->size <= STACKALLOC_MAXSIZE;
+}
+
+
+// isborrowed_param returns true if a function parameter of type t only borrows
+// (immutably) its argument
+static bool isborrowed_param(const type_t* t) {
+  return t->kind == TYPE_REF || t->kind == TYPE_SLICE;
+}
+
+
+// isborrow returns true if the use of argument argi of v can not make the argument
+// escape or reallocate it
+static bool isborrow(const irval_t* v, u32 argi) {
+  switch (v->op) {
+    case OP_DROP:
+    case OP_REF:
+      return true;
+
+    case OP_GEP: {
+      // "a.f" where f is a method; treat as a call to f, which borrows "this".
+      // Otherwise it's a field or element access, e.g. "a.len" or "a[1]"
+      if (v->type->kind != TYPE_FUN)
+        return true;
+      const funtype_t* ft = (funtype_t*)v->type;
+      return funtype_hasthis(ft) &&
+             isborrowed_param(((local_t*)ft->params.v[0])->type);
+    }
+
+    case OP_CALL: {
+      const irval_t* recv = v->argv[0];
+      if (argi == 0 || recv->type->kind != TYPE_FUN)
+        return false;
+      const funtype_t* ft = (funtype_t*)recv->type;
+      // "this" is not an argument of a method call, e.g. "a.f(b)"
+      u32 parami = argi - 1;
+      if (recv->op == OP_GEP && funtype_hasthis(ft))
+        parami++;
+      return parami < ft->params.len &&
+             isborrowed_param(((local_t*)ft->params.v[parami])->type);
+    }
+
+    default:
+      return false;
+  }
+}
+
+
+static void stackalloc(iropt_t* o) {
+  irfun_t* f = o->f;
+
+  // {[irval_t.id] => irval_t*} the one user of an array (or NULL)
+  irval_t** userv = mem_alloctv(o->ma, irval_t*, (usize)f->vidgen);
+  bitset_t* escapes = bitset_make(o->ma, f->vidgen);
+  bitset_t* onstack = bitset_make(o->ma, f->vidgen);
+  if (!userv || !escapes || !onstack) {
+    o->oom = true;
+    goto end;
+  }
+
+  for (u32 bi = 0; bi < f->blocks.len; bi++) {
+    irblock_t* b = f->blocks.v[bi];
+    for (u32 i = 0; i < b->values.len; i++) {
+      irval_t* v = b->values.v[i];
+      // ir.c does not yet produce IR for all expressions (placeholder NOOP) and
+      // truncates arguments beyond the capacity of argv, so a use of a value
+      // might be missing from the IR. Don't guess.
+      if (v->op == OP_NOOP || v->argc == countof(v->argv))
+        goto end;
+      for (u32 j = 0; j < v->argc; j++) {
+        irval_t* arg = v->argv[j];
+        userv[arg->id] = v;
+        if (!isborrow(v, j))
+          bitset_add(escapes, arg->id);
+      }
+    }
+    if (b->control)
+      bitset_add(escapes, b->control->id);
+  }
+
+  u32 n = 0;
+  for (u32 bi = 0; bi < f->blocks.len; bi++) {
+    irblock_t* b = f->blocks.v[bi];
+    for (u32 i = 0; i < b->values.len; i++) {
+      irval_t* v = b->values.v[i];
+      if (v->nuse != 1 || !isstackalloc_candidate(v))
+        continue;
+      // the array must be moved straight into a variable, e.g. "var a = [1,2,3]".
+      // An unused variable has its MOVE turned into a DROP by ir.c
+      irval_t* var = userv[v->id];
+      if (!var || (var->flags & IR_FL_VARDEF) == 0 || var->argv[0] != v)
+        continue;
+      if (var->op == OP_MOVE) {
+        if (bitset_has(escapes, var->id))
+          continue;
+      } else if (var->op != OP_DROP) {
+        continue;
+      }
+      trace("stack allocate v%u (%s)", v->id, var->var.dst ? var->var.dst : "_");
+      ((arraylit_t*)v->aux.ptr)->flags |= NF_ONSTACK;
+      bitset_add(onstack, v->id);
+      bitset_add(onstack, var->id);
+      n++;
+    }
+  }
+
+  // drops of stack allocated arrays must not free their storage
+  for (u32 bi = 0; n > 0 && bi < f->blocks.len; bi++) {
+    irblock_t* b = f->blocks.v[bi];
+    for (u32 i = 0; i < b->values.len; i++) {
+      irval_t* v = b->values.v[i];
+      if (v->op != OP_DROP || v->argc == 0 || !bitset_has(onstack, v->argv[0]->id))
+        continue;
+      droparray_t* drops = v->aux.drop.drops;
+      if (drops)
+        drops->v[v->aux.drop.index].nofree = true;
+    }
+  }
+
+end:
+  if (onstack)
+    bitset_dispose(onstack, o->ma);
+  if (escapes)
+    bitset_dispose(escapes, o->ma);
+  if (userv)
+    mem_freetv(o->ma, userv, (usize)f->vidgen);
+}
+
+
+//—————————————————————————————————————————————————————————————————————————————————————
+
+
+static void resolve_args(iropt_t* o) {
+  for (u32 bi = 0; bi < o->f->blocks.len; bi++) {
+    irblock_t* b = o->f->blocks.v[bi];
+    for (u32 i = 0; i < b->values.len; i++) {
+      irval_t* v = b->values.v[i];
+      for (u32 j = 0; j < v->argc; j++)
+        v->argv[j] = resolve(o, v->argv[j]);
+    }
+    if (b->control)
+      b->control = resolve(o, b->control);
+  }
+}
+
+
+static void remove_replaced_values(iropt_t* o) {
+  for (u32 bi = 0; bi < o->f->blocks.len; bi++) {
+    irblock_t* b = o->f->blocks.v[bi];
+    u32 len = 0;
+    for (u32 i = 0; i < b->values.len; i++) {
+      irval_t* v = b->values.v[i];
+      if (!o->replv[v->id])
+        b->values.v[len++] = v;
+    }
+    b->values.len = len;
+  }
+}
+
+
+static void remove_dead_values(iropt_t* o) {
+  irfun_t* f = o->f;
+  bitset_t* live = bitset_make(o->ma, f->vidgen);
+  ptrarray_t stack = {0};
+  if (!live) {
+    o->oom = true;
+    return;
+  }
+
+  // roots are values with side effects and control values of blocks
+  for (u32 bi = 0; bi < f->blocks.len; bi++) {
+    irblock_t* b = f->blocks.v[bi];
+    for (u32 i = 0; i < b->values.len; i++) {
+      irval_t* v = b->values.v[i];
+      if (hassideeffects(v) && !bitset_has(live, v->id)) {
+        bitset_add(live, v->id);
+        if (!ptrarray_push(&stack, o->ma, v))
+          goto oom;
+      }
+    }
+    if (b->control && !bitset_has(live, b->control->id)) {
+      bitset_add(live, b->control->id);
+      if (!ptrarray_push(&stack, o->ma, b->control))
+        goto oom;
+    }
+  }
+
+  // mark values which the roots depend on
+  while (stack.len) {
+    irval_t* v = ptrarray_pop(&stack);
+    for (u32 i = 0; i < v->argc; i++) {
+      irval_t* arg = v->argv[i];
+      if (bitset_has(live, arg->id))
+        continue;
+      bitset_add(live, arg->id);
+      if (!ptrarray_push(&stack, o->ma, arg))
+        goto oom;
+    }
+  }
+
+  // sweep
+  for (u32 bi = 0; bi < f->blocks.len; bi++) {
+    irblock_t* b = f->blocks.v[bi];
+    u32 len = 0;
+    for (u32 i = 0; i < b->values.len; i++) {
+      irval_t* v = b->values.v[i];
+      if (bitset_has(live, v->id)) {
+        b->values.v[len++] = v;
+      } else {
+        trace("remove dead v%u %s", v->id, op_name(v->op));
+      }
+    }
+    b->values.len = len;
+  }
+
+  goto end;
+oom:
+  o->oom = true;
+end:
+  ptrarray_dispose(&stack, o->ma);
+  bitset_dispose(live, o->ma);
+}
+
+
+static void update_nuse(irfun_t* f) {
+  for (u32 bi = 0; bi < f->blocks.len; bi++) {
+    irblock_t* b = f->blocks.v[bi];
+    for (u32 i = 0; i < b->values.len; i++)
+      ((irval_t*)b->values.v[i])->nuse = 0;
+  }
+  for (u32 bi = 0; bi < f->blocks.len; bi++) {
+    irblock_t* b = f->blocks.v[bi];
+    for (u32 i = 0; i < b->values.len; i++) {
+      irval_t* v = b->values.v[i];
+      for (u32 j = 0; j < v->argc; j++)
+        v->argv[j]->nuse++;
+    }
+    if (b->control)
+      b->control->nuse++;
+  }
+}
+
+
+static void optimize_fun(iropt_t* o) {
+  irfun_t* f = o->f;
+  trace("optimize %s", f->name);
+
+  for (u32 round = 0; round < MAX_ROUNDS && !o->oom; round++) {
+    o->changed = false;
+    resolve_args(o);
+    update_pinned(o);
+    for (u32 bi = 0; bi < f->blocks.len; bi++) {
+      irblock_t* b = f->blocks.v[bi];
+      for (u32 i = 0; i < b->values.len; i++) {
+        irval_t* v = b->values.v[i];
+        if (o->replv[v->id])
+          continue;
+        if (v->op == OP_PHI) {
+          simplify_phi(o, v);
+        } else {
+          fold_value(o, v);
+        }
+      }
+      fold_switch(o, b);
+    }
+    remove_unreachable_blocks(o);
+    for (u32 bi = 0; bi < f->blocks.len; bi++)
+      remove_redundant_drops(o, f->blocks.v[bi]);
+    if (!o->changed)
+      break;
+  }
+
+  resolve_args(o);
+  remove_replaced_values(o);
+  remove_dead_values(o);
+  update_nuse(f);
+}
+
+
+err_t iropt_fun(memalloc_t ma, irfun_t* f) {
+  if (f->blocks.len == 0)
+    return 0;
+
+  iropt_t o = { .f = f, .ma = ma };
+  o.replv = mem_alloctv(ma, irval_t*, (usize)f->vidgen);
+  if (!o.replv)
+    return ErrNoMem;
+  o.pinned = bitset_alloc(ma, (usize)f->vidgen);
+  if (!o.pinned) {
+    mem_freetv(ma, o.replv, (usize)f->vidgen);
+    return ErrNoMem;
+  }
+
+  optimize_fun(&o);
+  if (!o.oom)
+    stackalloc(&o);
+
+  // remove elided drops from the AST, even if we ran out of memory, since
+  // the IR no longer has them
+  compact_dropsets(&o);
+
+  ptrarray_dispose(&o.dropsets, ma);
+  bitset_dispose(o.pinned, ma);
+  mem_freetv(ma, o.replv, (usize)f->vidgen);
+  return o.oom ? ErrNoMem : 0;
+}
+
+
+err_t iropt_unit(memalloc_t ma, irunit_t* u) {
+  for (u32 i = 0; i < u->functions.len; i++) {
+    err_t err = iropt_fun(ma, u->functions.v[i]);
+    if (err)
+      return err;
+  }
+  return 0;
+}
+
+
+#ifdef CO_ENABLE_TESTS
+UNITTEST_DEF(iropt_fold) {
+  type_t i8t = { .kind = TYPE_I8, .size = 1 };
+  type_t u8t = { .kind = TYPE_U8, .size = 1 };
+  irval_t x = { .op = OP_ICONST }, y = x, v = {0};
+  u64 r;
+
+  #define FOLD(OP, T, A, B) ( \
+    x.type = y.type = v.type = (T), \
+    x.aux.i64val = (A), y.aux.i64val = (B), v.op = (OP), \
+    fold_binary(&v, &x, &y, &r) )
+
+  // results wrap around at the width of the type
+  safecheck(FOLD(OP_ADD, &i8t, 127, 1) && r == 0x80);
+  safecheck(FOLD(OP_MUL, &u8t, 16, 16) && r == 0);
+
+  // signedness
+  safecheck(FOLD(OP_DIV, &i8t, 0xf8, 2) && sext_bits(r, 8) == -4);
+  safecheck(FOLD(OP_LT, &i8t, 0xff, 1) && r == 1);
+  safecheck(FOLD(OP_LT, &u8t, 0xff, 1) && r == 0);
+  safecheck(FOLD(OP_SHR, &i8t, 0x80, 7) && r == 0xff);
+  safecheck(FOLD(OP_SHR, &u8t, 0x80, 7) && r == 1);
+
+  // left for the target to deal with
+  safecheck(!FOLD(OP_DIV, &u8t, 1, 0));
+  safecheck(!FOLD(OP_MOD, &i8t, 0x80, 0xff));
+  safecheck(!FOLD(OP_SHL, &u8t, 1, 8));
+
+  #undef FOLD
+}
+
+
+UNITTEST_DEF(iropt_fold_ref) {
+  // var x = 0   // v0 = ICONST 0
+  // var r = &x  // v1 = MUTREF v0
+  // *r = 1      // not visible to ir.c as a new value of x
+  // x == 0      // v3 = EQ v0 v2
+  memalloc_t ma = memalloc_default();
+  type_t it = { .kind = TYPE_INT, .size = 4 };
+  type_t bt = { .kind = TYPE_BOOL, .size = 1 };
+  type_t mt = { .kind = TYPE_MUTREF };
+  irval_t v[4] = {
+    { .id = 0, .op = OP_ICONST, .type = &it },
+    { .id = 1, .op = OP_MUTREF, .type = &mt, .argc = 1, .argv = {&v[0]} },
+    { .id = 2, .op = OP_ICONST, .type = &it },
+    { .id = 3, .op = OP_EQ, .type = &bt, .argc = 2, .argv = {&v[0], &v[2]} },
+  };
+  irblock_t b = {0};
+  irfun_t f = {0};
+  for (u32 i = 0; i < countof(v); i++)
+    safecheck(ptrarray_push(&b.values, ma, &v[i]));
+  safecheck(ptrarray_push(&f.blocks, ma, &b));
+
+  iropt_t o = { .f = &f, .ma = ma, .pinned = bitset_alloc(ma, countof(v)) };
+  safecheck(o.pinned);
+
+  // x has a reference taken to it, so its value is not known
+  update_pinned(&o);
+  fold_value(&o, &v[3]);
+  safecheck(v[3].op == OP_EQ);
+
+  // without the reference, x == 0 is constant
+  v[1].argc = 0;
+  update_pinned(&o);
+  fold_value(&o, &v[3]);
+  safecheck(v[3].op == OP_ICONST && v[3].aux.i64val == 1);
+
+  bitset_dispose(o.pinned, ma);
+  ptrarray_dispose(&b.values, ma);
+  ptrarray_dispose(&f.blocks, ma);
+}
+
+
+UNITTEST_DEF(iropt_drops) {
+  // var s S     // v0 = ZERO
+  // s.a = x     // field assignment; ir.c flags v0 as mutated
+  // var t S     // v1 = ZERO
+  // f(&t)       // v2 = MUTREF v1
+  // var u S     // v3 = ZERO
+  // drop s, t, u
+  memalloc_t ma = memalloc_default();
+  type_t st = { .kind = TYPE_STRUCT };
+  type_t mt = { .kind = TYPE_MUTREF };
+  irval_t v[7] = {
+    { .id = 0, .op = OP_ZERO, .type = &st, .flags = IR_FL_MUTATED },
+    { .id = 1, .op = OP_ZERO, .type = &st },
+    { .id = 2, .op = OP_MUTREF, .type = &mt, .argc = 1, .argv = {&v[1]} },
+    { .id = 3, .op = OP_ZERO, .type = &st },
+    { .id = 4, .op = OP_DROP, .type = type_void, .argc = 1, .argv = {&v[0]} },
+    { .id = 5, .op = OP_DROP, .type = type_void, .argc = 1, .argv = {&v[1]} },
+    { .id = 6, .op = OP_DROP, .type = type_void, .argc = 1, .argv = {&v[3]} },
+  };
+  irblock_t b = {0};
+  irfun_t f = {0};
+  for (u32 i = 0; i < countof(v); i++)
+    safecheck(ptrarray_push(&b.values, ma, &v[i]));
+  safecheck(ptrarray_push(&f.blocks, ma, &b));
+
+  iropt_t o = { .f = &f, .ma = ma };
+  remove_redundant_drops(&o, &b);
+
+  // only the drop of u is redundant
+  safecheck(b.values.len == countof(v) - 1);
+  safecheck(ptrarray_rindexof(&b.values, &v[4]) != U32_MAX);
+  safecheck(ptrarray_rindexof(&b.values, &v[5]) != U32_MAX);
+  safecheck(ptrarray_rindexof(&b.values, &v[6]) == U32_MAX);
+
+  ptrarray_dispose(&b.values, ma);
+  ptrarray_dispose(&f.blocks, ma);
+}
+#endif // CO_ENABLE_TESTS
@@ -0,0 +1,300 @@
+// SPDX-License-Identifier: Apache-2.0
+#include "colib.h"
+#include "jobserver.h"
+#include "thread.h"
+
+#include <stdlib.h> // getenv, strtol
+#include <string.h>
+#include <unistd.h> // read, write
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+
+#define trace(fmt, va...) _trace(opt_trace_subproc, 3, "jobserver", fmt, ##va)
+
+
+static mutex_t           g_mu;
+static sema_t            g_released;   // signalled when a token is released
+static u32               g_nsleepers;  // callers blocked in jobserver_acquire
+static bool              g_enabled = false;
+static bool              g_implicit;   // implicit token in use
+static jobserver_stats_t g_stats;
+static int               g_make_rfd = -1; // make's jobserver (private, non-blocking)
+static int               g_make_wfd = -1;
+
+
+// make_jobserver_auth returns the value of the --jobserver-auth (or, with make
+// older than 4.2, --jobserver-fds) option in MAKEFLAGS, or NULL if there's none.
+// The value is either "R,W" (file descriptors) or "fifo:PATH" (make >=4.4).
+// If the option appears multiple times, the last one counts.
+static char* nullable make_jobserver_auth(const char* makeflags) {
+  const char* val = NULL;
+  const char* opts[] = { "--jobserver-auth=", "--jobserver-fds=" };
+  for (const char* p = makeflags; *p; ) {
+    while (*p == ' ')
+      p++;
+    for (u32 i = 0; i < countof(opts); i++) {
+      if (strncmp(p, opts[i], strlen(opts[i])) == 0)
+        val = p + strlen(opts[i]);
+    }
+    while (*p && *p != ' ')
+      p++;
+  }
+  if (!val)
+    return NULL;
+  return strndup(val, strcspn(val, " "));
+}
+
+
+static bool isvalidfd(int fd) {
+  return fd >= 0 && fcntl(fd, F_GETFD) != -1;
+}
+
+
+// make_connect opens a private, non-blocking descriptor for reading tokens from
+// make's jobserver. We can't make make's own descriptor non-blocking since its
+// file description is shared with make and its other children.
+static err_t make_connect(const char* auth) {
+  if (strncmp(auth, "fifo:", 5) == 0) {
+    int fd = open(auth + 5, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1)
+      return err_errno();
+    g_make_rfd = g_make_wfd = fd;
+    return 0;
+  }
+
+  char* end;
+  long rfd = strtol(auth, &end, 10);
+  if (*end != ',')
+    return ErrInvalid;
+  long wfd = strtol(end + 1, &end, 10);
+  if (*end || rfd < 0 || wfd < 0 || rfd > I32_MAX || wfd > I32_MAX)
+    return ErrInvalid;
+
+  // make only passes the descriptors on to commands it considers recursive
+  if (!isvalidfd((int)rfd) || !isvalidfd((int)wfd))
+    return ErrNotFound;
+
+  #ifdef __linux__
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/self/fd/%ld", rfd);
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1)
+      return err_errno();
+    g_make_rfd = fd;
+    g_make_wfd = (int)wfd;
+    return 0;
+  #else
+    return ErrNotSupported;
+  #endif
+}
+
+
+err_t jobserver_init() {
+  err_t err = mutex_init(&g_mu);
+  if (err)
+    return err;
+  if (( err = sema_init(&g_released, 0) )) {
+    mutex_dispose(&g_mu);
+    return err;
+  }
+
+  g_stats.cap = comaxproc;
+
+  const char* makeflags = getenv("MAKEFLAGS");
+  char* auth = makeflags ? make_jobserver_auth(makeflags) : NULL;
+  if (auth) {
+    if (( err = make_connect(auth) )) {
+      dlog("not using make jobserver \"%s\": %s", auth, err_str(err));
+    } else {
+      g_stats.make = true;
+      trace("using make jobserver \"%s\"", auth);
+    }
+    free(auth);
+  }
+
+  g_enabled = true;
+  return 0;
+}
+
+
+static bool make_tryacquire(u8* cp) {
+  for (;;) {
+    isize n = read(g_make_rfd, cp, 1);
+    if (n == 1)
+      return true;
+    if (n == -1 && errno == EINTR)
+      continue;
+    return false; // EAGAIN (no tokens available) or EOF (make exited)
+  }
+}
+
+
+static void make_release(u8 c) {
+  for (;;) {
+    isize n = write(g_make_wfd, &c, 1);
+    if (n == 1)
+      return;
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && errno == EAGAIN) {
+      // only possible with the fifo, which is non-blocking
+      struct pollfd pfd = { .fd = g_make_wfd, .events = POLLOUT };
+      poll(&pfd, 1, -1);
+      continue;
+    }
+    // losing a token makes make run fewer jobs, but is otherwise harmless
+    dlog("failed to return token to make jobserver: %s", err_str(err_errno()));
+    return;
+  }
+}
+
+
+// tryacquire_locked is jobserver_tryacquire with g_mu held
+static bool tryacquire_locked(jobtoken_t* tok) {
+  bool ok = g_stats.inuse < g_stats.cap;
+  if (ok && !g_implicit) {
+    tok->kind = JOBTOKEN_IMPLICIT;
+    g_implicit = true;
+  } else if (ok) {
+    tok->kind = JOBTOKEN_LOCAL;
+    if (g_stats.make) {
+      ok = make_tryacquire(&tok->c);
+      tok->kind = JOBTOKEN_MAKE;
+    }
+  }
+  if (ok) {
+    g_stats.inuse++;
+    g_stats.maxinuse = MAX(g_stats.maxinuse, g_stats.inuse);
+    g_stats.nacquired++;
+  } else {
+    tok->kind = JOBTOKEN_NONE;
+  }
+  return ok;
+}
+
+
+bool jobserver_tryacquire(jobtoken_t* tok) {
+  tok->kind = JOBTOKEN_NONE;
+  if (!g_enabled)
+    return true;
+
+  mutex_lock(&g_mu);
+  bool ok = tryacquire_locked(tok);
+  mutex_unlock(&g_mu);
+
+  return ok;
+}
+
+
+void jobserver_release(jobtoken_t* tok) {
+  if (tok->kind == JOBTOKEN_NONE)
+    return;
+  mutex_lock(&g_mu);
+  assert(g_stats.inuse > 0);
+  g_stats.inuse--;
+  if (tok->kind == JOBTOKEN_IMPLICIT) {
+    assert(g_implicit);
+    g_implicit = false;
+  } else if (tok->kind == JOBTOKEN_MAKE) {
+    make_release(tok->c);
+  }
+  if (g_nsleepers > 0)
+    sema_signal(&g_released, 1);
+  mutex_unlock(&g_mu);
+  tok->kind = JOBTOKEN_NONE;
+}
+
+
+void jobserver_acquire(jobtoken_t* tok) {
+  tok->kind = JOBTOKEN_NONE;
+  if (!g_enabled)
+    return;
+
+  mutex_lock(&g_mu);
+  if (tryacquire_locked(tok)) {
+    mutex_unlock(&g_mu);
+    return;
+  }
+
+  g_stats.waiting++;
+  g_stats.maxwaiting = MAX(g_stats.maxwaiting, g_stats.waiting);
+  g_stats.nwaits++;
+
+  // Tokens returned to make by other processes don't signal g_released,
+  // so when using make's jobserver we poll it periodically.
+  u64 timeout_usecs = g_stats.make ? 10000 : 1000000;
+
+  // note: g_nsleepers is incremented in the same critical section as the failed
+  // attempt to acquire a token, so that a release which happens before we
+  // start waiting sees us and signals g_released.
+  // A signal may be left over from an earlier release; that just causes a
+  // spurious wakeup.
+  while (!tryacquire_locked(tok)) {
+    g_nsleepers++;
+    mutex_unlock(&g_mu);
+    sema_timedwait(&g_released, timeout_usecs);
+    mutex_lock(&g_mu);
+    g_nsleepers--;
+  }
+
+  assert(g_stats.waiting > 0);
+  g_stats.waiting--;
+  mutex_unlock(&g_mu);
+}
+
+
+void jobserver_wait_begin() {
+  if (!g_enabled)
+    return;
+  mutex_lock(&g_mu);
+  g_stats.waiting++;
+  g_stats.maxwaiting = MAX(g_stats.maxwaiting, g_stats.waiting);
+  g_stats.nwaits++;
+  mutex_unlock(&g_mu);
+}
+
+
+void jobserver_wait_end() {
+  if (!g_enabled)
+    return;
+  mutex_lock(&g_mu);
+  assert(g_stats.waiting > 0);
+  g_stats.waiting--;
+  mutex_unlock(&g_mu);
+}
+
+
+void jobserver_stats(jobserver_stats_t* result) {
+  if (!g_enabled) {
+    *result = (jobserver_stats_t){0};
+    return;
+  }
+  mutex_lock(&g_mu);
+  *result = g_stats;
+  mutex_unlock(&g_mu);
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————————
+#ifdef CO_ENABLE_TESTS
+
+
+UNITTEST_DEF(jobserver_make_auth) {
+  char* s;
+  assert(make_jobserver_auth("") == NULL);
+  assert(make_jobserver_auth("-j8") == NULL);
+
+  s = make_jobserver_auth(" -j8 --jobserver-auth=3,4");
+  assertnotnull(s);
+  assert(strcmp(s, "3,4") == 0);
+  free(s);
+
+  s = make_jobserver_auth("-j --jobserver-fds=5,6 --jobserver-auth=fifo:/tmp/x -- A=1");
+  assertnotnull(s);
+  assert(strcmp(s, "fifo:/tmp/x") == 0);
+  free(s);
+}
+
+
+#endif // CO_ENABLE_TESTS
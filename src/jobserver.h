@@ -0,0 +1,61 @@
+// process-wide limit on concurrent jobs (subprocesses and in-process tool jobs)
+// SPDX-License-Identifier: Apache-2.0
+//
+// The job server hands out tokens which a job must hold while it runs.
+// Like with GNU make, the process has one implicit token and needs one token
+// from the job server for each additional job it runs concurrently.
+// There are comaxproc tokens in total, including the implicit one.
+//
+// When running under a GNU make jobserver (MAKEFLAGS has --jobserver-auth),
+// tokens other than the implicit one are also taken from make, so that
+// e.g. "make -j8" limits jobs across all processes of the build.
+//
+#pragma once
+ASSUME_NONNULL_BEGIN
+
+typedef struct {
+  u8 kind; // JOBTOKEN_
+  u8 c;    // token character read from make's jobserver, for JOBTOKEN_MAKE
+} jobtoken_t;
+
+#define JOBTOKEN_NONE     0 // no token held (e.g. job server not initialized)
+#define JOBTOKEN_IMPLICIT 1 // the process's implicit token
+#define JOBTOKEN_LOCAL    2 // token from our own pool
+#define JOBTOKEN_MAKE     3 // token from GNU make's jobserver (also counted locally)
+
+typedef struct {
+  u32  cap;        // number of tokens, including the implicit one
+  u32  inuse;      // tokens currently held
+  u32  maxinuse;   // max tokens held at once
+  u32  waiting;    // callers currently waiting for a token
+  u32  maxwaiting; // max callers waiting at once (max queue depth)
+  u64  nacquired;  // total number of tokens handed out
+  u64  nwaits;     // total number of times a caller had to wait for a token
+  bool make;       // tokens are taken from a GNU make jobserver
+} jobserver_stats_t;
+
+// jobserver_init sets up the job server with comaxproc tokens and connects to
+// make's jobserver, if there is one. Until it's called, there's no limit.
+err_t jobserver_init();
+
+// jobserver_tryacquire takes a token, if one is available, without blocking.
+// The implicit token is handed out first, when it's not in use.
+bool jobserver_tryacquire(jobtoken_t* tok);
+
+// jobserver_acquire takes a token, blocking until one is available.
+// To avoid deadlock, the caller must not hold any tokens while calling this.
+void jobserver_acquire(jobtoken_t* tok);
+
+// jobserver_release returns a token acquired with jobserver_tryacquire or
+// jobserver_acquire and sets tok->kind to JOBTOKEN_NONE.
+// Does nothing if tok->kind is JOBTOKEN_NONE.
+void jobserver_release(jobtoken_t* tok);
+
+// jobserver_wait_begin and _end bracket a caller waiting for a token to become
+// available (e.g. for one of its own jobs to finish.) Only used for statistics.
+void jobserver_wait_begin();
+void jobserver_wait_end();
+
+void jobserver_stats(jobserver_stats_t* result);
+
+ASSUME_NONNULL_END
@@ -0,0 +1,112 @@
+// in-process clang compilation
+// SPDX-License-Identifier: Apache-2.0
+#include "llvm-includes.hh"
+#include "llvmimpl.h"
+
+#include "clang/Basic/DiagnosticOptions.h"
+#include "clang/Basic/Stack.h"
+#include "clang/Driver/Compilation.h"
+#include "clang/Driver/Driver.h"
+#include "clang/Driver/Job.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/CompilerInvocation.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "clang/FrontendTool/Utils.h"
+#include "llvm/Support/BuryPointer.h"
+
+#include <atomic>
+#include <mutex>
+
+using namespace clang;
+using namespace clang::driver;
+
+// clang.cc
+std::string GetExecutablePath(const char *Argv0, bool CanonicalPrefixes);
+
+
+// Once clang has crashed in this process its global state can't be trusted.
+// _clang_is_corrupt tracks this state, like _lld_is_corrupt in lld.cc.
+static std::atomic<bool> _clang_is_corrupt{false};
+
+
+static err_t run_cc1(
+  ArrayRef<const char*> args, const char* argv0, DiagnosticsEngine& diags)
+{
+  auto clang = std::make_unique<CompilerInstance>();
+  if (!CompilerInvocation::CreateFromArgs(clang->getInvocation(), args, diags, argv0))
+    return ErrCanceled;
+
+  // cc1_main sets up process-global state for some options (llvm::cl options via
+  // -mllvm, timers, stats, plugins.) Leave those to a subprocess.
+  FrontendOptions& opts = clang->getFrontendOpts();
+  if (!opts.LLVMArgs.empty() || opts.ShowTimers || opts.ShowStats ||
+      !opts.Plugins.empty() || !opts.ActionName.empty())
+  {
+    return ErrNotSupported;
+  }
+
+  // The driver passes -disable-free since it assumes the process exits after
+  // compiling a single file. We are going to stick around.
+  opts.DisableFree = false;
+
+  clang->createDiagnostics();
+  if (!clang->hasDiagnostics())
+    return ErrCanceled;
+
+  bool ok = false;
+  llvm::CrashRecoveryContext crc;
+  if (!crc.RunSafely([&]() { ok = ExecuteCompilerInvocation(clang.get()); })) {
+    _clang_is_corrupt = true;
+    // don't run destructors on state that may have been left inconsistent
+    llvm::BuryPointer(std::move(clang));
+    return ErrNotSupported;
+  }
+
+  return ok ? 0 : ErrCanceled;
+}
+
+
+EXTERN_C err_t clang_compile(int argc, char*const* argv) {
+  if (_clang_is_corrupt)
+    return ErrNotSupported;
+
+  static std::once_flag once;
+  std::call_once(once, []() {
+    llvm_init();
+    // install signal handlers so that RunSafely can catch crashes
+    llvm::CrashRecoveryContext::Enable();
+  });
+  noteBottomOfStack();
+
+  SmallVector<const char*, 64> args(argv, argv + argc);
+  std::string path = GetExecutablePath(args[0], /*CanonicalPrefixes*/true);
+
+  IntrusiveRefCntPtr<DiagnosticOptions> diagopts = new DiagnosticOptions();
+  TextDiagnosticPrinter* diagclient = new TextDiagnosticPrinter(llvm::errs(), &*diagopts);
+  IntrusiveRefCntPtr<DiagnosticIDs> diagid(new DiagnosticIDs());
+  DiagnosticsEngine diags(diagid, &*diagopts, diagclient);
+
+  Driver driver(path, llvm::sys::getDefaultTargetTriple(), diags);
+  std::unique_ptr<Compilation> C(driver.BuildCompilation(args));
+  if (!C || C->containsError())
+    return ErrCanceled;
+
+  // we only handle plain cc1 jobs; anything else (e.g. -cc1as or an external
+  // tool) is run by clang_main in a subprocess
+  for (const Command& job : C->getJobs()) {
+    const llvm::opt::ArgStringList& jargs = job.getArguments();
+    if (jargs.empty() || strcmp(jargs[0], "-cc1") != 0)
+      return ErrNotSupported;
+  }
+
+  err_t err = 0;
+  for (const Command& job : C->getJobs()) {
+    const llvm::opt::ArgStringList& jargs = job.getArguments();
+    ArrayRef<const char*> cc1args = makeArrayRef(jargs).slice(1);
+    if (( err = run_cc1(cc1args, job.getExecutable(), diags) ))
+      break;
+  }
+
+  diags.getClient()->finish();
+  return err;
+}
@@ -302,6 +302,15 @@ EXTERN_C const char* CoLLVMEnvironment_name(CoLLVMEnvironment); // canonical nam
 // llvm/driver.cc
 EXTERN_C int clang_main(int argc, char*const* argv);
 
+// llvm/clang_inproc.cc
+// clang_compile compiles C sources in-process on the calling thread, given
+// clang command-line arguments (argv[0] is the program name.)
+// It is thread safe, unlike clang_main which can only be run once per process.
+// Returns ErrCanceled if compilation failed (diagnostics are written to stderr.)
+// Returns ErrNotSupported if the arguments require a separate process, or if clang
+// crashed, in which case the caller should retry with clang_main in a subprocess.
+EXTERN_C err_t clang_compile(int argc, char*const* argv);
+
 // —————————————————————————————————————————————————————————————————————————————————————
 // linker
 
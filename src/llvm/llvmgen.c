@@ -0,0 +1,696 @@
+// LLVM code generator; lowers IR directly to LLVM IR (see --backend=llvm)
+// SPDX-License-Identifier: Apache-2.0
+#include "llvmimpl.h"
+#include "../compiler.h"
+#include "../ir.h"
+
+
+// This backend is an alternative to cgen which skips generating C code and having
+// clang parse it again. It's incomplete: only a subset of the language is supported,
+// namely functions operating on primitive types (bool, ints and floats) using
+// arithmetic, comparisons, calls, "if" and "return".
+//
+// Units using anything else are rejected with ErrNotSupported and the caller falls
+// back to cgen for that unit. IR is a lossy representation of some constructs
+// (e.g. assignment to struct fields, compound assignment, "x++") so units are
+// checked against their AST before IR is lowered.
+
+
+typedef struct {
+  compiler_t*     c;
+  const pkg_t*    pkg;
+  const map_t*    irfunm;  // fun_t* => irfun_t*
+  u32             flags;   // CGEN_ flags
+  LLVMContextRef  ctx;
+  LLVMModuleRef   mod;
+  LLVMBuilderRef  b;
+  ptrarray_t      locals;  // local_t* defined in current function (AST check)
+  LLVMValueRef*   values;  // current function's values, indexed by irval_t.id
+  LLVMBasicBlockRef* blocks; // current function's blocks, indexed by irblock_t.id
+  buf_t           namebuf;
+  err_t           err;
+} llvmgen_t;
+
+
+static type_t* unwrap_alias(type_t* t) {
+  while (t->kind == TYPE_ALIAS)
+    t = assertnotnull(((aliastype_t*)t)->elem);
+  return t;
+}
+
+
+static bool type_issigned(llvmgen_t* g, const type_t* t) {
+  switch (t->kind) {
+    case TYPE_I8: case TYPE_I16: case TYPE_I32: case TYPE_I64: case TYPE_INT:
+      return true;
+  }
+  return false;
+}
+
+
+static bool type_isfloat(const type_t* t) {
+  return t->kind == TYPE_F32 || t->kind == TYPE_F64;
+}
+
+
+static LLVMTypeRef nullable get_type(llvmgen_t* g, type_t* t) {
+  t = unwrap_alias(t);
+  switch (t->kind) {
+    case TYPE_VOID: return LLVMVoidTypeInContext(g->ctx);
+    case TYPE_BOOL: return LLVMInt1TypeInContext(g->ctx);
+    case TYPE_I8:  case TYPE_U8:  return LLVMInt8TypeInContext(g->ctx);
+    case TYPE_I16: case TYPE_U16: return LLVMInt16TypeInContext(g->ctx);
+    case TYPE_I32: case TYPE_U32: return LLVMInt32TypeInContext(g->ctx);
+    case TYPE_I64: case TYPE_U64: return LLVMInt64TypeInContext(g->ctx);
+    case TYPE_INT: case TYPE_UINT:
+      return LLVMIntTypeInContext(g->ctx, g->c->target.intsize * 8);
+    case TYPE_F32: return LLVMFloatTypeInContext(g->ctx);
+    case TYPE_F64: return LLVMDoubleTypeInContext(g->ctx);
+  }
+  return NULL;
+}
+
+
+static bool supported_type(llvmgen_t* g, type_t* nullable t) {
+  return t && get_type(g, t) != NULL;
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————————
+// AST check
+
+
+static bool check_expr(llvmgen_t* g, const expr_t* n);
+
+
+static bool check_block(llvmgen_t* g, const block_t* n) {
+  for (u32 i = 0; i < n->children.len; i++) {
+    if (!check_expr(g, (expr_t*)n->children.v[i]))
+      return false;
+  }
+  return true;
+}
+
+
+static bool check_local_ref(llvmgen_t* g, const node_t* nullable ref) {
+  return ref && (ref->kind == EXPR_PARAM || ref->kind == EXPR_VAR ||
+                 ref->kind == EXPR_LET) &&
+         ptrarray_rindexof(&g->locals, ref) != U32_MAX;
+}
+
+
+static bool check_callee(llvmgen_t* g, const fun_t* fn) {
+  // IR can't currently represent calls with more than two arguments (irval_t.argv)
+  const funtype_t* ft = (const funtype_t*)fn->type;
+  if (ft->params.len > 2 || !supported_type(g, ft->result))
+    return false;
+  for (u32 i = 0; i < ft->params.len; i++) {
+    if (!supported_type(g, ((local_t*)ft->params.v[i])->type))
+      return false;
+  }
+  return true;
+}
+
+
+static bool check_expr(llvmgen_t* g, const expr_t* n) {
+  if (n->type && !supported_type(g, n->type))
+    return false;
+
+  switch (n->kind) {
+  case EXPR_BOOLLIT:
+  case EXPR_INTLIT:
+  case EXPR_FLOATLIT:
+    return true;
+
+  case EXPR_ID:
+    return check_local_ref(g, ((idexpr_t*)n)->ref);
+
+  case EXPR_VAR:
+  case EXPR_LET: {
+    local_t* local = (local_t*)n;
+    if (local->init && !check_expr(g, local->init))
+      return false;
+    return ptrarray_push(&g->locals, g->c->ma, local);
+  }
+
+  case EXPR_ASSIGN: {
+    const binop_t* op = (binop_t*)n;
+    return op->op == OP_ASSIGN &&
+           op->left->kind == EXPR_ID &&
+           check_local_ref(g, ((idexpr_t*)op->left)->ref) &&
+           check_expr(g, op->right);
+  }
+
+  case EXPR_BINOP: {
+    const binop_t* op = (binop_t*)n;
+    if (op->op == OP_LAND || op->op == OP_LOR) // not short-circuited in IR
+      return false;
+    return check_expr(g, op->left) && check_expr(g, op->right);
+  }
+
+  case EXPR_PREFIXOP: {
+    const unaryop_t* op = (unaryop_t*)n;
+    switch (op->op) {
+      case OP_ADD: case OP_SUB: case OP_NOT: case OP_INV:
+        return check_expr(g, op->expr);
+    }
+    return false;
+  }
+
+  case EXPR_BLOCK:
+    return check_block(g, (block_t*)n);
+
+  case EXPR_IF: {
+    const ifexpr_t* ifx = (ifexpr_t*)n;
+    return check_expr(g, ifx->cond) &&
+           check_block(g, ifx->thenb) &&
+           (!ifx->elseb || check_block(g, ifx->elseb));
+  }
+
+  case EXPR_RETURN: {
+    const retexpr_t* ret = (retexpr_t*)n;
+    return !ret->value || check_expr(g, ret->value);
+  }
+
+  case EXPR_CALL: {
+    const call_t* call = (call_t*)n;
+    if (call->recv->kind != EXPR_ID)
+      return false;
+    const node_t* ref = ((idexpr_t*)call->recv)->ref;
+    if (!ref || ref->kind != EXPR_FUN || !check_callee(g, (fun_t*)ref))
+      return false;
+    for (u32 i = 0; i < call->args.len; i++) {
+      const expr_t* arg = (expr_t*)call->args.v[i];
+      if (arg->kind == EXPR_PARAM || !check_expr(g, arg)) // no named args
+        return false;
+    }
+    return true;
+  }
+
+  case EXPR_TYPECONS: {
+    const typecons_t* tc = (typecons_t*)n;
+    return type_isprim(n->type) && (!tc->expr || check_expr(g, tc->expr));
+  }
+
+  default:
+    return false;
+  }
+}
+
+
+static bool check_fun(llvmgen_t* g, const fun_t* fn) {
+  if (fn->name == sym_main && (g->flags & CGEN_EXE)) // needs C ABI main wrapper
+    return false;
+  const funtype_t* ft = (const funtype_t*)fn->type;
+  if (!supported_type(g, ft->result))
+    return false;
+  g->locals.len = 0;
+  for (u32 i = 0; i < ft->params.len; i++) {
+    local_t* param = (local_t*)ft->params.v[i];
+    if (!supported_type(g, param->type) || !ptrarray_push(&g->locals, g->c->ma, param))
+      return false;
+  }
+  return !fn->body || check_block(g, fn->body);
+}
+
+
+static bool check_unit(llvmgen_t* g, const unit_t* u) {
+  for (u32 i = 0; i < u->children.len; i++) {
+    const node_t* n = u->children.v[i];
+    if (n->kind != EXPR_FUN || !check_fun(g, (fun_t*)n))
+      return false;
+  }
+  return true;
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————————
+// functions
+
+
+static const char* fun_name(llvmgen_t* g, const fun_t* fn) {
+  if (fn->mangledname)
+    return fn->mangledname;
+  // note: we don't assign fn->mangledname as units may be generated concurrently
+  buf_clear(&g->namebuf);
+  if (!compiler_mangle(g->c, g->pkg, &g->namebuf, (node_t*)fn) ||
+      !buf_nullterm(&g->namebuf))
+  {
+    g->err = ErrNoMem;
+    return "";
+  }
+  return g->namebuf.chars;
+}
+
+
+static void add_ext_attr(llvmgen_t* g, LLVMValueRef fn, u32 index, type_t* t) {
+  // C ABI: integers smaller than 32 bits are extended by the caller (e.g. clang
+  // marks them "signext" or "zeroext".) We must agree with code generated by clang.
+  t = unwrap_alias(t);
+  const char* name;
+  switch (t->kind) {
+    case TYPE_BOOL: case TYPE_U8: case TYPE_U16: name = "zeroext"; break;
+    case TYPE_I8: case TYPE_I16:                  name = "signext"; break;
+    default: return;
+  }
+  u32 kind = LLVMGetEnumAttributeKindForName(name, strlen(name));
+  LLVMAttributeRef attr = LLVMCreateEnumAttribute(g->ctx, kind, 0);
+  if (LLVMIsACallInst(fn)) {
+    LLVMAddCallSiteAttribute(fn, index, attr);
+  } else {
+    LLVMAddAttributeAtIndex(fn, index, attr);
+  }
+}
+
+
+static LLVMTypeRef get_funtype(llvmgen_t* g, const fun_t* fn) {
+  const funtype_t* ft = (const funtype_t*)fn->type;
+  LLVMTypeRef paramtypes[16];
+  assert(ft->params.len <= countof(paramtypes)); // see check_callee
+  for (u32 i = 0; i < ft->params.len; i++)
+    paramtypes[i] = get_type(g, ((local_t*)ft->params.v[i])->type);
+  return LLVMFunctionType(get_type(g, ft->result), paramtypes, ft->params.len, false);
+}
+
+
+static LLVMValueRef get_fun(llvmgen_t* g, const fun_t* fn) {
+  const char* name = fun_name(g, fn);
+  LLVMValueRef f = LLVMGetNamedFunction(g->mod, name);
+  if (f)
+    return f;
+
+  f = LLVMAddFunction(g->mod, name, get_funtype(g, fn));
+
+  const funtype_t* ft = (const funtype_t*)fn->type;
+  add_ext_attr(g, f, LLVMAttributeReturnIndex, ft->result);
+  for (u32 i = 0; i < ft->params.len; i++)
+    add_ext_attr(g, f, i + 1, ((local_t*)ft->params.v[i])->type);
+
+  if (fn->body) {
+    // same visibility as cgen's ATTR_PKG and ATTR_PUB (see coprelude.h)
+    switch (fn->flags & NF_VIS_MASK) {
+      case NF_VIS_UNIT: LLVMSetLinkage(f, LLVMInternalLinkage); break;
+      case NF_VIS_PKG:  LLVMSetVisibility(f, LLVMHiddenVisibility); break;
+      case NF_VIS_PUB:  LLVMSetVisibility(f, LLVMDefaultVisibility); break;
+    }
+  }
+  return f;
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————————
+// values
+
+
+static LLVMValueRef unsupported(llvmgen_t* g, const irval_t* v) {
+  dlog("llvmgen: unsupported IR op %s", op_name(v->op));
+  if (!g->err)
+    g->err = ErrNotSupported;
+  return LLVMGetUndef(LLVMInt1TypeInContext(g->ctx));
+}
+
+
+static LLVMValueRef arg(llvmgen_t* g, const irval_t* v, u32 i) {
+  assert(i < v->argc);
+  LLVMValueRef arg = g->values[v->argv[i]->id];
+  if (!arg) // e.g. arg defined in unreachable block
+    return unsupported(g, v);
+  return arg;
+}
+
+
+static LLVMValueRef gen_cast(llvmgen_t* g, const irval_t* v) {
+  type_t* dst = unwrap_alias(v->type);
+  type_t* src = unwrap_alias(v->argv[0]->type);
+  LLVMValueRef x = arg(g, v, 0);
+  LLVMTypeRef t = get_type(g, dst);
+
+  if (dst->kind == TYPE_BOOL) {
+    if (src->kind == TYPE_BOOL)
+      return x;
+    if (type_isfloat(src))
+      return LLVMBuildFCmp(g->b, LLVMRealUNE, x, LLVMConstNull(LLVMTypeOf(x)), "");
+    return LLVMBuildICmp(g->b, LLVMIntNE, x, LLVMConstNull(LLVMTypeOf(x)), "");
+  }
+
+  if (type_isfloat(dst)) {
+    if (type_isfloat(src))
+      return dst->size < src->size ? LLVMBuildFPTrunc(g->b, x, t, "") :
+             dst->size > src->size ? LLVMBuildFPExt(g->b, x, t, "") :
+             x;
+    if (type_issigned(g, src))
+      return LLVMBuildSIToFP(g->b, x, t, "");
+    return LLVMBuildUIToFP(g->b, x, t, "");
+  }
+
+  // integer destination
+  if (type_isfloat(src)) {
+    if (type_issigned(g, dst))
+      return LLVMBuildFPToSI(g->b, x, t, "");
+    return LLVMBuildFPToUI(g->b, x, t, "");
+  }
+  u32 dstbits = LLVMGetIntTypeWidth(t);
+  u32 srcbits = LLVMGetIntTypeWidth(LLVMTypeOf(x));
+  if (dstbits < srcbits)
+    return LLVMBuildTrunc(g->b, x, t, "");
+  if (dstbits > srcbits) {
+    if (type_issigned(g, src))
+      return LLVMBuildSExt(g->b, x, t, "");
+    return LLVMBuildZExt(g->b, x, t, "");
+  }
+  return x;
+}
+
+
+static LLVMValueRef gen_cmp(llvmgen_t* g, const irval_t* v) {
+  type_t* t = unwrap_alias(v->argv[0]->type);
+  LLVMValueRef x = arg(g, v, 0), y = arg(g, v, 1);
+  if (type_isfloat(t)) {
+    LLVMRealPredicate pred = LLVMRealOEQ;
+    switch (v->op) {
+      case OP_EQ:   pred = LLVMRealOEQ; break;
+      case OP_NEQ:  pred = LLVMRealUNE; break;
+      case OP_LT:   pred = LLVMRealOLT; break;
+      case OP_GT:   pred = LLVMRealOGT; break;
+      case OP_LTEQ: pred = LLVMRealOLE; break;
+      case OP_GTEQ: pred = LLVMRealOGE; break;
+    }
+    return LLVMBuildFCmp(g->b, pred, x, y, "");
+  }
+  bool issigned = type_issigned(g, t);
+  LLVMIntPredicate pred = LLVMIntEQ;
+  switch (v->op) {
+    case OP_EQ:   pred = LLVMIntEQ; break;
+    case OP_NEQ:  pred = LLVMIntNE; break;
+    case OP_LT:   pred = issigned ? LLVMIntSLT : LLVMIntULT; break;
+    case OP_GT:   pred = issigned ? LLVMIntSGT : LLVMIntUGT; break;
+    case OP_LTEQ: pred = issigned ? LLVMIntSLE : LLVMIntULE; break;
+    case OP_GTEQ: pred = issigned ? LLVMIntSGE : LLVMIntUGE; break;
+  }
+  return LLVMBuildICmp(g->b, pred, x, y, "");
+}
+
+
+static LLVMValueRef gen_binop(llvmgen_t* g, const irval_t* v) {
+  type_t* t = unwrap_alias(v->type);
+  LLVMValueRef x = arg(g, v, 0), y = arg(g, v, 1);
+  bool isfloat = type_isfloat(t);
+  bool issigned = type_issigned(g, t);
+  switch (v->op) {
+    case OP_ADD: return isfloat ? LLVMBuildFAdd(g->b, x, y, "") : LLVMBuildAdd(g->b, x, y, "");
+    case OP_SUB: return isfloat ? LLVMBuildFSub(g->b, x, y, "") : LLVMBuildSub(g->b, x, y, "");
+    case OP_MUL: return isfloat ? LLVMBuildFMul(g->b, x, y, "") : LLVMBuildMul(g->b, x, y, "");
+    case OP_DIV:
+      return isfloat ? LLVMBuildFDiv(g->b, x, y, "") :
+             issigned ? LLVMBuildSDiv(g->b, x, y, "") :
+             LLVMBuildUDiv(g->b, x, y, "");
+    case OP_MOD:
+      return isfloat ? LLVMBuildFRem(g->b, x, y, "") :
+             issigned ? LLVMBuildSRem(g->b, x, y, "") :
+             LLVMBuildURem(g->b, x, y, "");
+    case OP_AND: return LLVMBuildAnd(g->b, x, y, "");
+    case OP_OR:  return LLVMBuildOr(g->b, x, y, "");
+    case OP_XOR: return LLVMBuildXor(g->b, x, y, "");
+    case OP_SHL: return LLVMBuildShl(g->b, x, y, "");
+    case OP_SHR:
+      return issigned ? LLVMBuildAShr(g->b, x, y, "") : LLVMBuildLShr(g->b, x, y, "");
+  }
+  return unsupported(g, v);
+}
+
+
+static LLVMValueRef gen_unop(llvmgen_t* g, const irval_t* v) {
+  LLVMValueRef x = arg(g, v, 0);
+  switch (v->op) {
+    case OP_ADD: return x;
+    case OP_SUB:
+      return type_isfloat(unwrap_alias(v->type)) ?
+        LLVMBuildFNeg(g->b, x, "") : LLVMBuildNeg(g->b, x, "");
+    case OP_NOT: // bool
+    case OP_INV: // integer
+      return LLVMBuildNot(g->b, x, "");
+  }
+  return unsupported(g, v);
+}
+
+
+static LLVMValueRef gen_call(llvmgen_t* g, const irval_t* v) {
+  const irval_t* recv = v->argv[0];
+  if (recv->op != OP_FUN)
+    return unsupported(g, v);
+  const fun_t* fn = ((irfun_t*)recv->aux.ptr)->ast;
+  const funtype_t* ft = (const funtype_t*)fn->type;
+  if (v->argc - 1 != ft->params.len) // truncated args (see pusharg in ir.c)
+    return unsupported(g, v);
+
+  LLVMValueRef args[2];
+  for (u32 i = 1; i < v->argc; i++)
+    args[i - 1] = arg(g, v, i);
+
+  LLVMValueRef callee = get_fun(g, fn);
+  LLVMValueRef call = LLVMBuildCall2(
+    g->b, get_funtype(g, fn), callee, args, v->argc - 1, "");
+  add_ext_attr(g, call, LLVMAttributeReturnIndex, ft->result);
+  for (u32 i = 0; i < ft->params.len; i++)
+    add_ext_attr(g, call, i + 1, ((local_t*)ft->params.v[i])->type);
+  return call;
+}
+
+
+static LLVMValueRef gen_val(llvmgen_t* g, LLVMValueRef fn, const irval_t* v) {
+  switch (v->op) {
+    case OP_ICONST:
+      return LLVMConstInt(get_type(g, v->type), v->aux.i64val, /*signext*/false);
+    case OP_FCONST:
+      return LLVMConstReal(get_type(g, v->type), v->aux.f64val);
+    case OP_ZERO:
+      return LLVMConstNull(get_type(g, v->type));
+    case OP_ARG:
+      return LLVMGetParam(fn, v->aux.i32val);
+    case OP_MOVE:
+      return arg(g, v, 0);
+    case OP_FUN:
+      return NULL; // only used as callee (see gen_call)
+    case OP_PHI:
+      return LLVMBuildPhi(g->b, get_type(g, v->type), "");
+    case OP_CALL:
+      return gen_call(g, v);
+    case OP_CAST:
+      return gen_cast(g, v);
+
+    case OP_ADD: case OP_SUB:
+      if (v->argc == 1)
+        return gen_unop(g, v);
+      return gen_binop(g, v);
+    case OP_MUL: case OP_DIV: case OP_MOD:
+    case OP_AND: case OP_OR: case OP_XOR: case OP_SHL: case OP_SHR:
+      return gen_binop(g, v);
+
+    case OP_NOT: case OP_INV:
+      return gen_unop(g, v);
+
+    case OP_EQ: case OP_NEQ: case OP_LT: case OP_GT: case OP_LTEQ: case OP_GTEQ:
+      return gen_cmp(g, v);
+  }
+  return unsupported(g, v);
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————————
+// blocks
+
+
+static void rpo_visit(irblock_t* b, u8* visited, irblock_t** order, u32* n) {
+  visited[b->id] = 1;
+  for (u32 i = 0; i < countof(b->succs); i++) {
+    irblock_t* s = b->succs[i];
+    if (s && !visited[s->id])
+      rpo_visit(s, visited, order, n);
+  }
+  order[--*n] = b;
+}
+
+
+static void gen_block_end(llvmgen_t* g, LLVMValueRef fn, const irblock_t* b) {
+  switch ((enum irblockkind)b->kind) {
+    case IR_BLOCK_GOTO:
+      LLVMBuildBr(g->b, g->blocks[assertnotnull(b->succs[0])->id]);
+      return;
+    case IR_BLOCK_SWITCH:
+      if (!b->control || !g->values[b->control->id] || !b->succs[0] || !b->succs[1])
+        break;
+      // note: succs are [false, true], i.e. [else, then] (see ifexpr in ir.c)
+      LLVMBuildCondBr(g->b, g->values[b->control->id],
+        g->blocks[b->succs[1]->id], g->blocks[b->succs[0]->id]);
+      return;
+    case IR_BLOCK_RET: {
+      LLVMTypeRef rt = LLVMGetReturnType(LLVMGlobalGetValueType(fn));
+      if (LLVMGetTypeKind(rt) == LLVMVoidTypeKind) {
+        LLVMBuildRetVoid(g->b);
+        return;
+      }
+      if (!b->control || !g->values[b->control->id])
+        break;
+      LLVMBuildRet(g->b, g->values[b->control->id]);
+      return;
+    }
+  }
+  dlog("llvmgen: unsupported block b%u", b->id);
+  g->err = ErrNotSupported;
+}
+
+
+static void gen_fun(llvmgen_t* g, const irfun_t* f) {
+  LLVMValueRef fn = get_fun(g, f->ast);
+  if (g->err || f->blocks.len == 0)
+    return;
+
+  usize nvalues = (usize)f->vidgen + 1;
+  usize nblocks = (usize)f->bidgen + 1;
+  g->values = mem_alloctv(g->c->ma, LLVMValueRef, nvalues);
+  g->blocks = mem_alloctv(g->c->ma, LLVMBasicBlockRef, nblocks);
+  u8* visited = mem_alloctv(g->c->ma, u8, nblocks);
+  irblock_t** order = mem_alloctv(g->c->ma, irblock_t*, (usize)f->blocks.len);
+  if (!g->values || !g->blocks || !visited || !order) {
+    g->err = ErrNoMem;
+    goto end;
+  }
+
+  // order blocks so that definitions are generated before their uses
+  u32 norder = f->blocks.len;
+  rpo_visit(f->blocks.v[0], visited, order, &norder);
+  irblock_t** orderv = &order[norder];
+  u32 orderc = f->blocks.len - norder;
+
+  for (u32 i = 0; i < orderc; i++)
+    g->blocks[orderv[i]->id] = LLVMAppendBasicBlockInContext(g->ctx, fn, "");
+
+  for (u32 i = 0; i < orderc && !g->err; i++) {
+    irblock_t* b = orderv[i];
+    LLVMPositionBuilderAtEnd(g->b, g->blocks[b->id]);
+    // LLVM requires phis to be grouped at the start of a block, but ir.c may
+    // add phis to a block after other values (when reading a var in a sealed block)
+    for (u32 j = 0; j < b->values.len && !g->err; j++) {
+      irval_t* v = b->values.v[j];
+      if (v->op == OP_PHI)
+        g->values[v->id] = gen_val(g, fn, v);
+    }
+    for (u32 j = 0; j < b->values.len && !g->err; j++) {
+      irval_t* v = b->values.v[j];
+      if (v->op != OP_PHI)
+        g->values[v->id] = gen_val(g, fn, v);
+    }
+    if (!g->err)
+      gen_block_end(g, fn, b);
+  }
+
+  // now that all values are defined, connect phis with their incoming values
+  for (u32 i = 0; i < orderc && !g->err; i++) {
+    irblock_t* b = orderv[i];
+    for (u32 j = 0; j < b->values.len; j++) {
+      irval_t* v = b->values.v[j];
+      if (v->op != OP_PHI)
+        continue;
+      for (u32 k = 0; k < v->argc; k++) {
+        irblock_t* pred = k < countof(b->preds) ? b->preds[k] : NULL;
+        if (!pred || !visited[pred->id] || !g->values[v->argv[k]->id]) {
+          unsupported(g, v);
+          break;
+        }
+        LLVMValueRef inval = g->values[v->argv[k]->id];
+        LLVMBasicBlockRef inblock = g->blocks[pred->id];
+        LLVMAddIncoming(g->values[v->id], &inval, &inblock, 1);
+      }
+    }
+  }
+
+end:
+  mem_freetv(g->c->ma, g->values, nvalues);
+  mem_freetv(g->c->ma, g->blocks, nblocks);
+  mem_freetv(g->c->ma, visited, nblocks);
+  mem_freetv(g->c->ma, order, (usize)f->blocks.len);
+  g->values = NULL;
+  g->blocks = NULL;
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————————
+
+
+static err_t gen_unit(llvmgen_t* g, unit_t* u) {
+  if (!check_unit(g, u))
+    return ErrNotSupported;
+
+  // declare all functions of the unit before generating their bodies
+  for (u32 i = 0; i < u->children.len && !g->err; i++)
+    get_fun(g, (fun_t*)u->children.v[i]);
+
+  for (u32 i = 0; i < u->children.len && !g->err; i++) {
+    fun_t* fn = (fun_t*)u->children.v[i];
+    if (!fn->body)
+      continue;
+    irfun_t** fp = (irfun_t**)map_lookup_ptr(g->irfunm, fn);
+    if (!fp) {
+      dlog("llvmgen: no IR for function %s", fn->name);
+      return ErrNotSupported;
+    }
+    gen_fun(g, *fp);
+  }
+
+  return g->err;
+}
+
+
+err_t llvmgen_unit(
+  compiler_t* c, const pkg_t* pkg, unit_t* u, const map_t* irfunm, u32 flags,
+  const char* ofile)
+{
+  const char* name = u->srcfile ? u->srcfile->name.p : "unit";
+  BuildCtx build = {
+    .opt = c->buildmode == BUILDMODE_OPT ? '2' : '0',
+    .debug = c->buildmode == BUILDMODE_DEBUG,
+  };
+  CoLLVMModule m;
+  llvm_module_init(&m, &build, name);
+
+  llvmgen_t g = {
+    .c = c,
+    .pkg = pkg,
+    .irfunm = irfunm,
+    .flags = flags,
+    .ctx = LLVMGetModuleContext(m.M),
+    .mod = m.M,
+    .namebuf = buf_make(c->ma),
+  };
+  g.b = LLVMCreateBuilderInContext(g.ctx);
+
+  err_t err = gen_unit(&g, u);
+
+  LLVMDisposeBuilder(g.b);
+  ptrarray_dispose(&g.locals, c->ma);
+  buf_dispose(&g.namebuf);
+
+  // reject (rather than crash on or miscompile) anything we got wrong;
+  // the caller falls back to cgen
+  if (!err) {
+    char* msg = NULL;
+    if (LLVMVerifyModule(m.M, LLVMReturnStatusAction, &msg)) {
+      dlog("llvmgen: invalid module %s: %s", name, msg);
+      err = ErrNotSupported;
+    }
+    LLVMDisposeMessage(msg);
+  }
+  if (!err)
+    err = llvm_module_set_target(&m, c->target.triple);
+  if (!err) {
+    CoLLVMBuild opt = { .target_triple = c->target.triple };
+    err = llvm_module_optimize(&m, &opt);
+  }
+  if (!err)
+    err = llvm_module_emit(&m, ofile, CoLLVMEmit_obj, 0);
+
+  if (m.TM)
+    LLVMDisposeTargetMachine(m.TM);
+  llvm_module_dispose(&m);
+  return err;
+}
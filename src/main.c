@@ -3,6 +3,7 @@
 #include "compiler.h"
 #include "path.h"
 #include "userconfig.h"
+#include "objcache.h"
 #include "clang/Basic/Version.inc" // CLANG_VERSION_STRING
 
 #include <stdlib.h>
@@ -31,6 +32,9 @@ u32 comaxproc = 1;
 // externally-implemented tools
 int main_build(int argc, char* argv[]); // build.c
 int build_sysroot_main(int argc, char* argv[]); // build_sysroot.c
+int serve_main(int argc, char* argv[]); // serve.c
+bool serve_forward(int argc, char* argv[], int* status); // serve.c
+int bench_main(int argc, char* argv[]); // bench.c
 int cc_main(int argc, char* argv[], bool iscxx); // cc.c
 int llvm_ar_main(int argc, char* argv[]); // llvm/llvm-ar.cc
 int llvm_nm_main(int argc, char* argv[]); // llvm/llvm-nm.cc
@@ -56,6 +60,7 @@ static int usage(FILE* f) {
     "Usage: %s <command> [args ...]\n"
     "Commands:\n"
     "  build         Build a package\n"
+    "  serve         Run a server which keeps \"build\" state loaded between builds\n"
     "\n"
     "  ar            Archiver\n"
     "  cc            C compiler (clang)\n"
@@ -70,6 +75,7 @@ static int usage(FILE* f) {
     "  wasm-ld       WebAssembly linker\n"
     "\n"
     "  build-sysroot Prebuild sysroot\n"
+    "  bench         Benchmark the compiler front end\n"
     "  help          Print help on stdout and exit\n"
     "  targets       List supported targets\n"
     "  version       Print version on stdout and exit\n"
@@ -78,9 +84,11 @@ static int usage(FILE* f) {
     "  %s <command> --help\n"
     "\n"
     "Environment variables:\n"
-    "  COROOT    Bundled resources. Defaults to executable directory\n"
-    "  COCACHE   Build cache. Defaults to ~/" COCACHE_DEFAULT "\n"
-    "  COMAXPROC Parallelism limit. Defaults to number of CPUs (%u)\n"
+    "  COROOT     Bundled resources. Defaults to executable directory\n"
+    "  COCACHE    Build cache. Defaults to ~/" COCACHE_DEFAULT "\n"
+    "  COMAXPROC  Parallelism limit. Defaults to number of CPUs (%u)\n"
+    "  COOBJCACHE Object cache size limit, e.g. 10G, or 0 to disable. Defaults to 5G\n"
+    "  COSERVE    Compile server socket, or \"off\". Defaults to $COCACHE/serve.sock\n"
     "\n",
     coprogname,
     host_ld,
@@ -251,12 +259,19 @@ int main(int argc, char* argv[]) {
   comaxproc_init();
   relpath_init();
   tmpbuf_init(ma);
-  sym_init(ma);
-  typeid_init(ma);
-  universe_init();
   coroot_init(ma);
   copath_init(ma);
   cocachedir_init(ma);
+  objcache_init();
+
+  // forward build to compile server, if one is running
+  int status;
+  if (IS("build") && serve_forward(argc, argv, &status))
+    return status;
+
+  sym_init(ma);
+  typeid_init(ma);
+  universe_init();
   err_t err = llvm_init();
   if (err) errx(1, "llvm_init: %s", err_str(err));
 
@@ -276,6 +291,8 @@ int main(int argc, char* argv[]) {
   // command dispatch
   if IS("build")                return main_build(argc, argv);
   if IS("build-sysroot")        return build_sysroot_main(argc, argv);
+  if IS("serve")                return serve_main(argc, argv);
+  if IS("bench")                return bench_main(argc, argv);
   if IS("cc", "clang")          return cc_main(argc, argv, /*iscxx*/false);
   if IS("c++", "clang++")       return cc_main(argc, argv, /*iscxx*/true);
   if IS("ld")                   return ld_main(argc, argv);
@@ -49,9 +49,11 @@ typedef struct slab_ {
 static_assert(IS_ALIGN2(sizeof(slab_t), MIN_ALIGNMENT), "");
 
 // bump_allocator_t contains book-keeping data for the allocator
-typedef struct {
+typedef struct bump_allocator_ bump_allocator_t;
+typedef struct bump_allocator_ {
   slab_t           head;   // caution: cyclic; head->prev initially points to &head
   rwmutex_t        tailmu; // guards modifications to tail
+  u32              flags;  // MEMALLOC_BUMP2_ flags
 
   #if defined(DEBUG) && defined(__SIZEOF_INT128__)
   union { struct {
@@ -65,6 +67,11 @@ typedef struct {
   #endif
 
   _Atomic(void*)   end;    // end of backing memory (== tail + tail->size)
+
+  // allocators adopted by this one (see memalloc_bump2_adopt)
+  _Atomic(bump_allocator_t*) adopted;     // most recently adopted allocator
+  bump_allocator_t* nullable nextadopted; // sibling in parent's "adopted" list
+
   struct memalloc  ma;
 } bump_allocator_t;
 
@@ -142,9 +149,36 @@ static bool bump_alloc_grow(bump_allocator_t* a, usize size) {
   return true;
 }
 
+// bump_alloc_nosync is used for MEMALLOC_BUMP2_NOSYNC allocators, which are only
+// ever allocated from by one thread at a time; it's just a pointer bump.
+static bool bump_alloc_nosync(bump_allocator_t* a, mem_t* m, usize size, bool zeroed) {
+  size = ALIGN2(size, MIN_ALIGNMENT);
+  void* ptr = AtomicLoad(&a->ptr, memory_order_relaxed);
+
+  while UNLIKELY(ptr + size > AtomicLoad(&a->end, memory_order_relaxed)) {
+    if UNLIKELY(!bump_alloc_grow(a, size)) {
+      *m = (mem_t){0};
+      return false;
+    }
+    ptr = AtomicLoad(&a->ptr, memory_order_relaxed);
+  }
+
+  AtomicStore(&a->ptr, ptr + size, memory_order_relaxed);
+
+  m->p = ptr;
+  m->size = size;
+  if (zeroed && !ISZERO(a))
+    memset(m->p, 0, size);
+
+  return true;
+}
+
 #if 1 // lock-based impl
 
 static bool bump_alloc(bump_allocator_t* a, mem_t* m, usize size, bool zeroed) {
+  if (a->flags & MEMALLOC_BUMP2_NOSYNC)
+    return bump_alloc_nosync(a, m, size, zeroed);
+
   rwmutex_rlock(&a->tailmu);
 
   size = ALIGN2(size, MIN_ALIGNMENT);
@@ -180,6 +214,9 @@ static bool bump_alloc(bump_allocator_t* a, mem_t* m, usize size, bool zeroed) {
 #else // lock-free impl, which has a race on slab_t.prev somewhere
 
 static bool bump_alloc(bump_allocator_t* a, mem_t* m, usize size, bool zeroed) {
+  if (a->flags & MEMALLOC_BUMP2_NOSYNC)
+    return bump_alloc_nosync(a, m, size, zeroed);
+
   void* oldptr;
   void* newptr;
 
@@ -277,7 +314,7 @@ static bool _memalloc_bump_impl(void* ma, mem_t* m, usize size, bool zeroed) {
 
 
 memalloc_t memalloc_bump2(usize slabsize, u32 flags) {
-  assert(flags == 0); // no flags, for now
+  assert((flags & ~MEMALLOC_BUMP2_NOSYNC) == 0);
 
   // adjust slabsize
   usize pagesize = sys_pagesize();
@@ -298,6 +335,7 @@ memalloc_t memalloc_bump2(usize slabsize, u32 flags) {
   bump_allocator_t* a = m.p;
   a->head.size = m.size;
   a->head.prev = &a->head;
+  a->flags = flags;
   a->tail = &a->head;
   err_t err = rwmutex_init(&a->tailmu);
   a->end = m.p + m.size;
@@ -320,6 +358,15 @@ void memalloc_bump2_dispose(memalloc_t ma) {
   assert(ma->f == _memalloc_bump_impl);
   bump_allocator_t* a = BUMPALLOC_OF_MEMALLOC(ma);
 
+  // dispose adopted allocators.
+  // Note that a child's header lives in its own memory, so load next first.
+  bump_allocator_t* child = ATOMIC_LOAD(&a->adopted);
+  while (child) {
+    bump_allocator_t* next = child->nextadopted;
+    memalloc_bump2_dispose(&child->ma);
+    child = next;
+  }
+
   rwmutex_dispose(&a->tailmu);
 
   err_t err;
@@ -338,10 +385,27 @@ void memalloc_bump2_dispose(memalloc_t ma) {
 }
 
 
+void memalloc_bump2_adopt(memalloc_t ma, memalloc_t child_ma) {
+  assert(ma->f == _memalloc_bump_impl);
+  assert(child_ma->f == _memalloc_bump_impl);
+  assert(ma != child_ma);
+  bump_allocator_t* a = BUMPALLOC_OF_MEMALLOC(ma);
+  bump_allocator_t* child = BUMPALLOC_OF_MEMALLOC(child_ma);
+
+  // push child onto a's list of adopted allocators
+  bump_allocator_t* head = ATOMIC_LOAD(&a->adopted);
+  do {
+    child->nextadopted = head;
+  } while (!AtomicCASAcqRel(&a->adopted, &head, child));
+}
+
+
 usize memalloc_bump2_cap(memalloc_t ma) {
   const bump_allocator_t* a = BUMPALLOC_OF_MEMALLOC(ma);
   const slab_t* slab = ATOMIC_LOAD(&a->tail);
   usize cap = 0;
+  for (bump_allocator_t* child = ATOMIC_LOAD(&a->adopted); child; child = child->nextadopted)
+    cap += memalloc_bump2_cap(&child->ma);
   for (;;) {
     cap += slab->size;
     if (slab == &a->head)
@@ -382,6 +446,9 @@ usize memalloc_bump2_use(memalloc_t ma) {
     }
   }
 
+  for (bump_allocator_t* child = ATOMIC_LOAD(&a->adopted); child; child = child->nextadopted)
+    use += memalloc_bump2_use(&child->ma);
+
   return use - sizeof(bump_allocator_t);
 }
 
@@ -493,6 +560,36 @@ UNITTEST_DEF(memalloc_bump2) {
 }
 
 
+UNITTEST_DEF(memalloc_bump2_adopt) {
+  memalloc_t ma = memalloc_bump2(/*slabsize*/1, 0);
+  memalloc_t child_ma = memalloc_bump2(/*slabsize*/1, MEMALLOC_BUMP2_NOSYNC);
+  assert(ma != memalloc_null() && child_ma != memalloc_null());
+
+  // make the child allocator grow beyond its first slab
+  usize size = memalloc_bump2_avail(child_ma) + MIN_ALIGNMENT;
+  mem_t m1 = mem_alloc_zeroed(child_ma, MIN_ALIGNMENT);
+  mem_t m2 = mem_alloc_zeroed(child_ma, size);
+  assert(m1.p != NULL && m2.p != NULL);
+  memset(m1.p, 1, m1.size);
+  memset(m2.p, 2, m2.size);
+
+  usize use = memalloc_bump2_use(ma);
+  usize child_use = memalloc_bump2_use(child_ma);
+  usize cap = memalloc_bump2_cap(ma);
+  usize child_cap = memalloc_bump2_cap(child_ma);
+
+  memalloc_bump2_adopt(ma, child_ma);
+
+  // the parent now accounts for the child's memory, which is left untouched
+  assert(memalloc_bump2_use(ma) == use + child_use);
+  assert(memalloc_bump2_cap(ma) == cap + child_cap);
+  assert(((u8*)m1.p)[0] == 1 && ((u8*)m2.p)[size - 1] == 2);
+
+  // disposing the parent disposes the child as well
+  memalloc_bump2_dispose(ma);
+}
+
+
 typedef struct {
   thrd_t         t;  // thread handle
   memalloc_t     ma; // shared bump2 allocator
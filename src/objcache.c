@@ -0,0 +1,645 @@
+// SPDX-License-Identifier: Apache-2.0
+#include "colib.h"
+#include "objcache.h"
+#include "strlist.h"
+#include "path.h"
+#include "dirwalk.h"
+#include "array.h"
+#include "llvm/llvm.h"
+
+#include <stdlib.h> // getenv
+#include <string.h>
+#include <unistd.h> // getpid, getcwd, unlink
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/file.h> // flock
+#include <sys/stat.h>
+
+// Cache layout:
+//   cocachedir/obj/xx/yyyy….o  object; "xxyyyy…" is the key hash in hex
+//   cocachedir/obj/xx/yyyy….d  dependency file, for commands using -MD or -MMD
+//   cocachedir/obj/tmp/        preprocessor output and partially written objects
+//   cocachedir/obj/stats       statistics (see stats_read)
+//   cocachedir/obj/lock        guards stats and trimming
+//
+// The lock is taken with flock rather than fs_lock, since fcntl locks don't
+// exclude threads of the same process from each other.
+// Reading and writing objects does not need the lock; objects are written to
+// a temporary file which is then renamed. The mtime of an object is updated
+// when it's used, which is what least-recently-used eviction is based on.
+
+#define KEY_VERSION      "objcache 1"
+#define DEFAULT_MAXSIZE  (5llu*1024*1024*1024)
+#define TRIM_RATIO       80 // percent of maxsize to trim down to
+#define TMPFILE_MAXAGE   (60*60*1000000llu) // remove stale temporary files (usecs)
+
+static u64          g_maxsize = 0; // 0 when the cache is disabled
+static char*        g_dir = "";
+static _Atomic(u32) g_tmpgen = 0;
+
+
+// parse_size parses a byte size with an optional K, M or G suffix, e.g. "512M"
+static bool parse_size(const char* s, u64* result) {
+  // note: scan the terminating NUL too, which co_intscan needs to see as the end
+  const u8* p = (const u8*)s;
+  usize len = strlen(s);
+  if (len == 0 || co_intscan(&p, len + 1, 10, U64_MAX, result))
+    return false;
+  u64 mul = 1;
+  switch (*p) {
+    case 'K': case 'k': mul = 1024llu; p++; break;
+    case 'M': case 'm': mul = 1024llu*1024; p++; break;
+    case 'G': case 'g': mul = 1024llu*1024*1024; p++; break;
+  }
+  if (*p || *result > U64_MAX / mul)
+    return false;
+  *result *= mul;
+  return true;
+}
+
+
+void objcache_init() {
+  u64 maxsize = DEFAULT_MAXSIZE;
+  const char* envvar = getenv("COOBJCACHE");
+  if (envvar && *envvar && !parse_size(envvar, &maxsize)) {
+    elog("ignoring invalid COOBJCACHE=%s", envvar);
+    maxsize = DEFAULT_MAXSIZE;
+  }
+  if (maxsize == 0)
+    return;
+  str_t dir = path_join(cocachedir, "obj");
+  if (!dir.p)
+    return;
+  g_dir = dir.p;
+  g_maxsize = maxsize;
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————————
+// statistics
+
+#define STATS_FILENAME "stats"
+#define LOCK_FILENAME  "lock"
+
+
+static int lock_open() {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s" PATH_SEP_STR LOCK_FILENAME, g_dir);
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0 && errno == ENOENT && fs_mkdirs(g_dir, 0755, 0) == 0)
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+  while (flock(fd, LOCK_EX) != 0) {
+    if (errno != EINTR) {
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+
+static void lock_close(int fd) {
+  flock(fd, LOCK_UN);
+  close(fd);
+}
+
+
+// stats_read reads the stats file, which has the format
+//   "hits" SP u64 LF "misses" SP u64 LF "evictions" SP u64 LF "size" SP u64 LF
+// Caller must hold the lock. A missing or malformed file reads as all zeroes.
+static void stats_read(objcache_stats_t* st) {
+  memset(st, 0, sizeof(*st));
+  st->maxsize = g_maxsize;
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s" PATH_SEP_STR STATS_FILENAME, g_dir);
+  const void* data;
+  struct stat fst;
+  if (mmap_file_ro(path, &data, &fst))
+    return;
+
+  const u8* p = data;
+  const u8* pend = p + fst.st_size;
+  const char* names[] = { "hits ", "misses ", "evictions ", "size " };
+  u64* fields[] = { &st->hits, &st->misses, &st->evictions, &st->size };
+  for (usize i = 0; i < countof(names); i++) {
+    usize namelen = strlen(names[i]);
+    if ((usize)(pend - p) < namelen || memcmp(p, names[i], namelen) != 0)
+      break;
+    p += namelen;
+    if (co_intscan(&p, (usize)(pend - p), 10, U64_MAX, fields[i]) ||
+        p == pend || *p++ != '\n')
+    {
+      break;
+    }
+  }
+
+  mmap_unmap(data, (usize)fst.st_size);
+}
+
+
+static void stats_write(const objcache_stats_t* st) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s" PATH_SEP_STR STATS_FILENAME, g_dir);
+  char buf[128];
+  int n = snprintf(buf, sizeof(buf), "hits %llu\nmisses %llu\nevictions %llu\nsize %llu\n",
+    (unsigned long long)st->hits, (unsigned long long)st->misses,
+    (unsigned long long)st->evictions, (unsigned long long)st->size);
+  err_t err = fs_writefile(path, 0644, (slice_t){ .p = buf, .len = (usize)n });
+  if (err)
+    dlog("objcache: write %s: %s", path, err_str(err));
+}
+
+
+void objcache_stats(objcache_stats_t* result) {
+  memset(result, 0, sizeof(*result));
+  if (g_maxsize == 0)
+    return;
+  int fd = lock_open();
+  if (fd < 0)
+    return;
+  stats_read(result);
+  lock_close(fd);
+}
+
+
+void objcache_vlog_stats(const objcache_stats_t* since) {
+  objcache_stats_t st;
+  objcache_stats(&st);
+  if (st.maxsize == 0)
+    return;
+  // note: counts include other processes using the cache at the same time
+  u64 total = st.hits + st.misses;
+  vlog("objcache: %llu hits, %llu misses; in total %llu%% hits, %llu evictions, "
+    "%llu/%llu MiB used",
+    (unsigned long long)(st.hits - MIN(st.hits, since->hits)),
+    (unsigned long long)(st.misses - MIN(st.misses, since->misses)),
+    (unsigned long long)(total ? (st.hits * 100) / total : 0),
+    (unsigned long long)st.evictions,
+    (unsigned long long)(st.size / (1024*1024)),
+    (unsigned long long)(st.maxsize / (1024*1024)));
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————————
+// eviction
+
+
+typedef struct {
+  char*      path; // .o file
+  unixtime_t mtime;
+  u64        size; // including .d file
+} cachefile_t;
+
+
+static int cachefile_cmp(const void* x, const void* y, void* ctx) {
+  unixtime_t a = ((const cachefile_t*)x)->mtime;
+  unixtime_t b = ((const cachefile_t*)y)->mtime;
+  return a < b ? -1 : a > b ? 1 : 0;
+}
+
+
+// trim removes the least recently used files until the cache is at most
+// TRIM_RATIO percent of maxsize. Caller must hold the lock.
+// Since it scans the entire cache, it also corrects st->size.
+static void trim(objcache_stats_t* st) {
+  memalloc_t ma = memalloc_default();
+  array_t files = {0}; // cachefile_t
+  u64 size = 0;
+  unixtime_t now = unixtime_now();
+
+  dirwalk_t* dw = dirwalk_open(ma, g_dir, 0);
+  if (!dw)
+    return;
+  err_t err;
+  while ((err = dirwalk_next(dw)) > 0) {
+    if (dw->type == S_IFDIR) {
+      dirwalk_descend(dw);
+      continue;
+    }
+    if (dw->type != S_IFREG)
+      continue;
+    struct stat* fst = dirwalk_lstat(dw);
+    unixtime_t mtime = unixtime_of_stat_mtime(fst);
+    bool stale = now > mtime + TMPFILE_MAXAGE;
+
+    if (string_startswith(dw->name, "tmp.")) {
+      // temporary file left behind by a process that didn't finish
+      if (stale)
+        unlink(dw->path);
+      continue;
+    }
+
+    // a .d file is accounted for with its .o file
+    char sibling[PATH_MAX];
+    const char* ext = path_ext_cstr(dw->name);
+    usize len = strlen(dw->path) - strlen(ext);
+    if (!streq(ext, ".o") && !streq(ext, ".d"))
+      continue;
+    snprintf(sibling, sizeof(sibling), "%.*s%s",
+      (int)len, dw->path, streq(ext, ".o") ? ".d" : ".o");
+    struct stat sibling_st;
+    bool has_sibling = stat(sibling, &sibling_st) == 0;
+    if (streq(ext, ".d")) {
+      // remove .d without .o, unless it's being added right now (see objcache_put)
+      if (!has_sibling && stale)
+        unlink(dw->path);
+      continue;
+    }
+
+    cachefile_t f = { .path = strdup(dw->path), .mtime = mtime, .size = (u64)fst->st_size };
+    if (has_sibling)
+      f.size += (u64)sibling_st.st_size;
+    if (!f.path || !array_push(cachefile_t, &files, ma, f)) {
+      free(f.path);
+      err = ErrNoMem;
+      break;
+    }
+    size += f.size;
+  }
+  dirwalk_close(dw);
+
+  if (err == 0) {
+    co_qsort(files.ptr, files.len, sizeof(cachefile_t), cachefile_cmp, NULL);
+    u64 limit = (st->maxsize / 100) * TRIM_RATIO;
+    for (u32 i = 0; i < files.len && size > limit; i++) {
+      cachefile_t* f = array_ptr(cachefile_t, &files, i);
+      if (unlink(f->path) != 0)
+        continue;
+      memcpy(f->path + strlen(f->path) - 2, ".d", 2);
+      unlink(f->path);
+      size -= f->size;
+      st->evictions++;
+    }
+    st->size = size;
+  } else {
+    dlog("objcache: trim %s: %s", g_dir, err_str(err));
+  }
+
+  for (u32 i = 0; i < files.len; i++)
+    free(array_ptr(cachefile_t, &files, i)->path);
+  array_dispose(cachefile_t, &files, ma);
+}
+
+
+static void stats_add(u64 hits, u64 misses, u64 nbytes) {
+  int fd = lock_open();
+  if (fd < 0)
+    return;
+  objcache_stats_t st;
+  stats_read(&st);
+  st.hits += hits;
+  st.misses += misses;
+  st.size += nbytes;
+  if (st.size > st.maxsize)
+    trim(&st);
+  stats_write(&st);
+  lock_close(fd);
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————————
+// lookup & insertion
+
+
+typedef struct {
+  const char* nullable ofile;   // -o
+  const char* nullable depfile; // -MF
+  bool compile; // -c
+  bool depgen;  // -MD or -MMD
+  bool ok;      // cacheable
+} ccargs_t;
+
+
+// ccargs_parse checks if a command line can be cached: it must compile one source
+// file (or stdin) to an object, without side effects other than a dependency file.
+static void ccargs_parse(ccargs_t* a, char*const* argv) {
+  memset(a, 0, sizeof(*a));
+  a->ok = true;
+  for (char*const* p = argv + 1; *p; p++) {
+    const char* arg = *p;
+    if (*arg != '-' || arg[1] == 0) {
+      if (arg[0] == '-') // "-" is stdin
+        a->ok = false;
+    } else if (streq(arg, "-c")) {
+      a->compile = true;
+    } else if (streq(arg, "-o")) {
+      a->ok &= a->ofile == NULL && p[1];
+      if (p[1]) a->ofile = *++p;
+    } else if (streq(arg, "-MD") || streq(arg, "-MMD")) {
+      a->depgen = true;
+    } else if (streq(arg, "-MF") || streq(arg, "-MT") || streq(arg, "-MQ")) {
+      a->ok &= p[1] != NULL;
+      if (p[1] && arg[2] == 'F') a->depfile = p[1];
+      if (p[1]) p++;
+    } else if (streq(arg, "-MP")) {
+      // phony targets in dependency file
+    } else if (
+      string_startswith(arg, "-M") || // e.g. -M, -MM (no object)
+      string_startswith(arg, "-Wp,") ||
+      string_startswith(arg, "-save-temps") ||
+      streq(arg, "-E") ||
+      streq(arg, "-S") ||
+      streq(arg, "-v") ||
+      streq(arg, "-###") ||
+      streq(arg, "-fsyntax-only") ||
+      streq(arg, "--analyze") )
+    {
+      a->ok = false;
+    }
+  }
+  a->ok &= a->compile && a->ofile && !streq(a->ofile, "-");
+}
+
+
+static void hash_str(SHA256* h, const char* s) {
+  sha256_write(h, s, strlen(s) + 1);
+}
+
+
+static void hash_u64(SHA256* h, u64 v) {
+  sha256_write(h, &v, sizeof(v));
+}
+
+
+static bool hash_file(SHA256* h, const char* path) {
+  struct stat st;
+  if (stat(path, &st) != 0)
+    return false;
+  hash_u64(h, (u64)st.st_size);
+  if (st.st_size == 0)
+    return true;
+  const void* data;
+  if (mmap_file_ro(path, &data, &st))
+    return false;
+  sha256_write(h, data, (usize)st.st_size);
+  mmap_unmap(data, (usize)st.st_size);
+  return true;
+}
+
+
+// preprocess runs the command with "-E" instead of "-c" and adds its output to h
+static bool preprocess(
+  SHA256* h, const compiler_t* c, char*const* argv, const char* cwd, u32 flags)
+{
+  char tmpfile[PATH_MAX];
+  snprintf(tmpfile, sizeof(tmpfile), "%s" PATH_SEP_STR "tmp" PATH_SEP_STR "tmp.%ld.%u.i",
+    g_dir, (long)getpid(), AtomicAdd(&g_tmpgen, 1, memory_order_relaxed));
+  if (fs_mkdirs(path_dir_alloca(tmpfile), 0755, 0))
+    return false;
+
+  strlist_t args = strlist_make(c->ma, argv[0]);
+  for (char*const* p = argv + 1; *p; p++) {
+    const char* arg = *p;
+    if (streq(arg, "-c")) {
+      strlist_add(&args, "-E");
+    } else if (
+      streq(arg, "-o") || streq(arg, "-MF") || streq(arg, "-MT") || streq(arg, "-MQ") ||
+      streq(arg, "-include-pch") )
+    {
+      // Skip arguments with values which don't apply.
+      // Note: A precompiled header is always made from a header that the source
+      // includes, so the preprocessed source covers its contents.
+      p++;
+    } else if (!streq(arg, "-MD") && !streq(arg, "-MMD") && !streq(arg, "-MP")) {
+      strlist_add(&args, arg);
+    }
+  }
+  strlist_add(&args,
+    "-w", // warnings are reported when compiling
+    "-o", tmpfile);
+
+  char*const* ppargv = strlist_array(&args);
+  err_t err = ErrNotSupported;
+  if (!args.ok) {
+    err = ErrNoMem;
+  } else if (flags & OBJCACHE_INPROC) {
+    // note: argv has "-working-directory cwd" in this case (see cc_inproc_main)
+    err = clang_compile((int)args.len, ppargv);
+  }
+  if (err == ErrNotSupported)
+    err = compiler_run_tool_sync(c, &args, cwd);
+  strlist_dispose(&args);
+  bool ok = !err && hash_file(h, tmpfile);
+  unlink(tmpfile);
+  return ok;
+}
+
+
+// abspath resolves path relative to cwd into buf
+static bool abspath(char buf[PATH_MAX], const char* cwd, const char* path) {
+  int n = path_isabs(path) ? snprintf(buf, PATH_MAX, "%s", path)
+                           : snprintf(buf, PATH_MAX, "%s" PATH_SEP_STR "%s", cwd, path);
+  return n > 0 && n < PATH_MAX;
+}
+
+
+static bool compute_key(
+  objcache_key_t* key, const ccargs_t* a, const compiler_t* c, char*const* argv,
+  const char* cwd, u32 flags)
+{
+  SHA256 h;
+  sha256_init(&h, &key->hash);
+  hash_str(&h, KEY_VERSION);
+  hash_str(&h, CO_VERSION_STR);
+
+  // the compiler itself (of which development builds all have the same version)
+  struct stat st;
+  if (stat(coexefile, &st) != 0)
+    return false;
+  hash_u64(&h, (u64)st.st_size);
+  hash_u64(&h, unixtime_of_stat_mtime(&st));
+
+  hash_str(&h, c->target.triple);
+  hash_str(&h, c->sysroot ? c->sysroot : "");
+  hash_str(&h, cwd);
+
+  // Arguments, and the contents of any files they name (e.g. the source file and
+  // files passed to -include.) The output file is not included, unless it's named
+  // in the dependency file. Neither is a precompiled header: it embeds the mtimes
+  // of the headers it was made from, and the preprocessed source covers it.
+  char path[PATH_MAX];
+  for (char*const* p = argv; *p; p++) {
+    if (*p == a->ofile && !a->depgen)
+      continue;
+    hash_str(&h, *p);
+    if (streq(*p, "-include-pch") && p[1]) {
+      p++;
+      continue;
+    }
+    if (**p == '-' || **p == 0 || !abspath(path, cwd, *p))
+      continue;
+    if (fs_isfile(path) && !hash_file(&h, path))
+      return false;
+  }
+
+  if (!preprocess(&h, c, argv, cwd, flags))
+    return false;
+
+  sha256_close(&h);
+  return true;
+}
+
+
+static void cachefile_path(char path[PATH_MAX], const objcache_key_t* key, const char* ext) {
+  static const char hexchars[] = "0123456789abcdef";
+  char hex[sizeof(key->hash)*2 + 1];
+  const u8* bytes = (const u8*)&key->hash;
+  for (usize i = 0; i < sizeof(key->hash); i++) {
+    hex[i*2]   = hexchars[bytes[i] >> 4];
+    hex[i*2+1] = hexchars[bytes[i] & 0xf];
+  }
+  hex[sizeof(hex) - 1] = 0;
+  snprintf(path, PATH_MAX, "%s" PATH_SEP_STR "%.2s" PATH_SEP_STR "%s%s",
+    g_dir, hex, hex + 2, ext);
+}
+
+
+// fetch copies a cached file to dst and marks it as recently used
+static bool fetch(const objcache_key_t* key, const char* ext, const char* dst) {
+  char path[PATH_MAX];
+  cachefile_path(path, key, ext);
+  if (fs_copyfile(path, dst, 0))
+    return false;
+  utimensat(AT_FDCWD, path, NULL, 0);
+  return true;
+}
+
+
+// store copies src to the cache. Returns the number of bytes stored.
+static u64 store(const objcache_key_t* key, const char* ext, const char* src) {
+  char path[PATH_MAX];
+  char tmppath[PATH_MAX];
+  cachefile_path(path, key, ext);
+  snprintf(tmppath, sizeof(tmppath), "%s" PATH_SEP_STR "tmp" PATH_SEP_STR "tmp.%ld.%u%s",
+    g_dir, (long)getpid(), AtomicAdd(&g_tmpgen, 1, memory_order_relaxed), ext);
+  struct stat st;
+  if (stat(src, &st) != 0 || fs_copyfile(src, tmppath, 0))
+    return 0;
+  if (rename(tmppath, path) != 0) {
+    if (errno != ENOENT || fs_mkdirs(path_dir_alloca(path), 0755, 0) ||
+        rename(tmppath, path) != 0)
+    {
+      unlink(tmppath);
+      return 0;
+    }
+  }
+  return (u64)st.st_size;
+}
+
+
+bool objcache_get(
+  objcache_key_t* key, const compiler_t* c, char*const* argv, const char* nullable cwd,
+  u32 flags)
+{
+  key->ok = false;
+  if (g_maxsize == 0)
+    return false;
+
+  ccargs_t a;
+  ccargs_parse(&a, argv);
+  if (!a.ok)
+    return false;
+
+  char cwdbuf[PATH_MAX];
+  if (!cwd || !*cwd) {
+    if (!getcwd(cwdbuf, sizeof(cwdbuf)))
+      return false;
+    cwd = cwdbuf;
+  }
+
+  if (!abspath(key->ofile, cwd, a.ofile))
+    return false;
+  key->depfile[0] = 0;
+  if (a.depgen) {
+    if (a.depfile) {
+      if (!abspath(key->depfile, cwd, a.depfile))
+        return false;
+    } else {
+      // like clang: output file with its extension replaced by ".d"
+      usize len = strlen(key->ofile) - strlen(path_ext_cstr(key->ofile));
+      if (len + 3 > sizeof(key->depfile))
+        return false;
+      memcpy(key->depfile, key->ofile, len);
+      memcpy(key->depfile + len, ".d", 3);
+    }
+  }
+
+  if (!compute_key(key, &a, c, argv, cwd, flags))
+    return false;
+  key->ok = true;
+
+  if (!fetch(key, ".o", key->ofile))
+    return false;
+  if (*key->depfile && !fetch(key, ".d", key->depfile)) {
+    unlink(key->ofile);
+    return false;
+  }
+  if (coverbose > 1)
+    vlog("objcache: hit %s", relpath(key->ofile));
+  stats_add(1, 0, 0);
+  return true;
+}
+
+
+void objcache_put(const objcache_key_t* key) {
+  if (!key->ok)
+    return;
+  // the .d file goes in first, since a .o without a .d is a miss while
+  // a .d without a .o is just garbage (that will eventually be evicted)
+  u64 nbytes = 0;
+  if (*key->depfile) {
+    if (( nbytes = store(key, ".d", key->depfile) ) == 0)
+      return;
+  }
+  u64 n = store(key, ".o", key->ofile);
+  if (n == 0)
+    return;
+  stats_add(0, 1, nbytes + n);
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————————
+#ifdef CO_ENABLE_TESTS
+
+
+UNITTEST_DEF(objcache_ccargs) {
+  ccargs_t a;
+
+  char* argv1[] = { "cc", "-O2", "-c", "foo.c", "-o", "foo.o", NULL };
+  ccargs_parse(&a, argv1);
+  assert(a.ok);
+  assert(a.ofile == argv1[5]);
+  assert(!a.depgen);
+
+  char* argv2[] = { "cc", "-MD", "-MT", "x", "-MF", "foo.d", "-c", "foo.c", "-o", "foo.o",
+    NULL };
+  ccargs_parse(&a, argv2);
+  assert(a.ok);
+  assert(a.depgen);
+  assert(a.depfile == argv2[5]);
+
+  char* argv3[] = { "cc", "-c", "foo.c", NULL }; // no -o
+  ccargs_parse(&a, argv3);
+  assert(!a.ok);
+
+  char* argv4[] = { "cc", "-S", "foo.c", "-o", "foo.s", NULL };
+  ccargs_parse(&a, argv4);
+  assert(!a.ok);
+
+  char* argv5[] = { "cc", "-M", "-c", "foo.c", "-o", "foo.o", NULL };
+  ccargs_parse(&a, argv5);
+  assert(!a.ok);
+
+  u64 size;
+  assert(parse_size("512", &size) && size == 512);
+  assert(parse_size("2K", &size) && size == 2048);
+  assert(parse_size("3G", &size) && size == 3llu*1024*1024*1024);
+  assert(!parse_size("", &size));
+  assert(!parse_size("1T", &size));
+}
+
+
+#endif // CO_ENABLE_TESTS
@@ -0,0 +1,71 @@
+// content-addressed cache of compiled objects
+// SPDX-License-Identifier: Apache-2.0
+//
+// Objects are stored in cocachedir/obj, named by a hash of everything that
+// determines their contents:
+// - the compis executable (version, size and mtime)
+// - target triple and sysroot
+// - working directory and command-line arguments (except the output file)
+// - contents of input files named on the command line
+// - the preprocessed source (clang -E), which covers all included headers
+//
+// The cache is limited in size by the COOBJCACHE environment variable,
+// e.g. "COOBJCACHE=10G" (default 5G.) "COOBJCACHE=0" disables the cache.
+// When the cache grows larger, the least recently used objects are removed.
+// Hit & miss statistics of all processes are recorded in cocachedir/obj/stats.
+//
+// A cache hit does not replay compiler warnings, so "co cc" only uses the cache
+// when given --co-objcache.
+//
+#pragma once
+#include "compiler.h"
+#include "sha256.h"
+ASSUME_NONNULL_BEGIN
+
+typedef struct {
+  sha256_t hash;
+  bool     ok;                // command is cacheable
+  char     ofile[PATH_MAX];   // absolute path of output object file
+  char     depfile[PATH_MAX]; // absolute path of dependency file (-MD), or ""
+} objcache_key_t;
+
+typedef struct {
+  u64 hits;      // objects copied from the cache
+  u64 misses;    // objects compiled and added to the cache
+  u64 evictions; // objects removed to stay within maxsize
+  u64 size;      // bytes used
+  u64 maxsize;   // size limit (0 if the cache is disabled)
+} objcache_stats_t;
+
+// objcache_init reads configuration from the environment.
+// Until it's called, the cache is disabled.
+void objcache_init();
+
+#define OBJCACHE_INPROC (1u << 0) // preprocess on the calling thread (clang_compile)
+
+// objcache_get computes the cache key for a "cc" command line which compiles
+// one source file with "-c -o ofile", running in cwd (or the current directory.)
+// If the cache holds an object for the key, it's copied to ofile (along with the
+// dependency file, if the command generates one) and true is returned.
+// Otherwise false is returned, and if key->ok the caller should call objcache_put
+// after the command succeeds.
+//
+// Computing the key involves preprocessing the source. With OBJCACHE_INPROC this
+// is done with clang_compile, which must not be used by a process that later runs
+// clang_main. Otherwise a clang subprocess is run and waited for, on behalf of
+// the caller's job (the caller should hold a job token, like a subproc does.)
+bool objcache_get(
+  objcache_key_t* key, const compiler_t* c, char*const* argv, const char* nullable cwd,
+  u32 flags);
+
+// objcache_put adds the output of a successful command to the cache
+void objcache_put(const objcache_key_t* key);
+
+// objcache_stats reads statistics accumulated by all processes using the cache
+void objcache_stats(objcache_stats_t* result);
+
+// objcache_vlog_stats logs hits & misses since the stats in "since" were read,
+// along with totals
+void objcache_vlog_stats(const objcache_stats_t* since);
+
+ASSUME_NONNULL_END
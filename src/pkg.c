@@ -3,9 +3,12 @@
 #include "compiler.h"
 #include "path.h"
 #include "dirwalk.h"
+#include "astencode.h"
+#include "sha256.h"
 
 #include <sys/stat.h>
 #include <err.h>
+#include <string.h> // strchr
 
 
 err_t pkg_init(pkg_t* pkg, memalloc_t ma) {
@@ -21,8 +24,16 @@ err_t pkg_init(pkg_t* pkg, memalloc_t ma) {
     goto end_err2;
   if (( err = typefuntab_init(&pkg->tfundefs, ma) ))
     goto end_err3;
+  if (( err = mutex_init(&pkg->apidec_mu) ))
+    goto end_err4;
+  if (( err = future_init(&pkg->libfut) ))
+    goto end_err5;
   return 0;
 
+end_err5:
+  mutex_dispose(&pkg->apidec_mu);
+end_err4:
+  typefuntab_dispose(&pkg->tfundefs);
 end_err3:
   map_dispose(&pkg->defs, ma);
 end_err2:
@@ -42,7 +53,17 @@ void pkg_dispose(pkg_t* pkg, memalloc_t ma) {
   if (pkg->defs.cap != 0)
     map_dispose(&pkg->defs, ma);
   rwmutex_dispose(&pkg->defs_mu);
+  future_dispose(&pkg->loadfut);
+  future_dispose(&pkg->libfut);
   typefuntab_dispose(&pkg->tfundefs);
+  if (pkg->apidec)
+    astdecoder_close(pkg->apidec);
+  if (pkg->apidata)
+    mmap_unmap(pkg->apidata, pkg->apidatasize);
+  str_free(pkg->apifile);
+  if (pkg->api_index.cap != 0)
+    map_dispose(&pkg->api_index, memalloc_default());
+  mutex_dispose(&pkg->apidec_mu);
 }
 
 
@@ -679,6 +700,9 @@ node_t* nullable pkg_def_get(pkg_t* pkg, sym_t name) {
   if (vp)
     n = *vp;
   rwmutex_runlock(&pkg->defs_mu);
+  // NULL value is a placeholder for a member of autoimport (see pkg_def_addm)
+  if (vp && !n && pkg->autoimport)
+    n = pkg_api_lookup(pkg->autoimport, name);
   return n;
 }
 
@@ -713,7 +737,9 @@ err_t pkg_def_add(pkg_t* pkg, memalloc_t ma, sym_t name, node_t** np_inout) {
 }
 
 
-err_t pkg_def_addm(pkg_t* pkg, memalloc_t ma, sym_t* namev, node_t** nodev, u32 count) {
+err_t pkg_def_addm(
+  pkg_t* pkg, memalloc_t ma, sym_t* namev, node_t* nullable* nodev, u32 count)
+{
   err_t err = 0;
   rwmutex_lock(&pkg->defs_mu);
   if UNLIKELY(!map_reserve(&pkg->defs, ma, count)) {
@@ -726,7 +752,8 @@ err_t pkg_def_addm(pkg_t* pkg, memalloc_t ma, sym_t* namev, node_t** nodev, u32
       err = ErrNoMem;
       break;
     } else if (*vp == NULL) {
-      *vp = assertnotnull(nodev[i]);
+      assert(nodev[i] || pkg->autoimport);
+      *vp = nodev[i];
     }
   }
 end:
@@ -734,3 +761,133 @@ end:
   return err;
 }
 
+
+sym_t pkg_api_member_name(const node_t* n) {
+  switch (n->kind) {
+    case EXPR_FUN: {
+      const fun_t* fn = (const fun_t*)n;
+      return fn->name ? fn->name : sym__;
+    }
+    case STMT_TYPEDEF: {
+      const type_t* t = ((const typedef_t*)n)->type;
+      if (t->kind == TYPE_STRUCT)
+        return ((const structtype_t*)t)->name ? ((const structtype_t*)t)->name : sym__;
+      assertf(t->kind == TYPE_ALIAS, "unexpected %s", nodekind_name(t->kind));
+      return ((const aliastype_t*)t)->name;
+    }
+    case TYPE_STRUCT:
+    case TYPE_ALIAS: {
+      // template instance (see typecheck)
+      const usertype_t* t = (const usertype_t*)n;
+      if ((t->flags & NF_TEMPLATEI) == 0)
+        return sym__;
+      sym_t name = n->kind == TYPE_STRUCT ?
+        ((const structtype_t*)n)->name : ((const aliastype_t*)n)->name;
+      return pkg_tinstance_name(assertnotnull(name), &t->templateparams);
+    }
+    default:
+      return sym__;
+  }
+}
+
+
+sym_t pkg_tinstance_name(sym_t template_name, const nodearray_t* args) {
+  // "name<H>" where H is the hex encoding of the first 16 bytes of the SHA-256
+  // sum of the typeids of args
+  SHA256 state;
+  sha256_t sum;
+  sha256_init(&state, &sum);
+  for (u32 i = 0; i < args->len; i++) {
+    const type_t* t = (const type_t*)args->v[i];
+    assert(node_istype((node_t*)t));
+    if (t->kind == TYPE_IMPORTED)
+      t = assertnotnull(((const importedtype_t*)t)->elem);
+    typeid_t typeid = typeid_of(t);
+    sha256_write(&state, typeid, typeid_len(typeid));
+  }
+  sha256_close(&state);
+
+  buf_t buf = buf_make(memalloc_ctx());
+  buf_print(&buf, template_name);
+  buf_push(&buf, '<');
+  buf_appendhex(&buf, &sum, 16);
+  buf_push(&buf, '>');
+  if (buf.oom)
+    panic("out of memory");
+  sym_t name = sym_intern(buf.chars, buf.len);
+  buf_dispose(&buf);
+  return name;
+}
+
+
+bool pkg_api_name_is_tinstance(sym_t name) {
+  return strchr(name, '<') != NULL;
+}
+
+
+node_t* nullable pkg_api_member(pkg_t* pkg, u32 index) {
+  nsexpr_t* ns = assertnotnull(pkg->api_ns);
+  assert(index < ns->members.len);
+
+  // eagerly decoded (e.g. text metafile, or package built in this session)
+  if (!pkg->apidec)
+    return ns->members.v[index];
+
+  mutex_lock(&pkg->apidec_mu);
+  node_t* n = ns->members.v[index];
+  if (!n) {
+    err_t err = astdecoder_decode_root(pkg->apidec, index, &n);
+    if (err) {
+      elog("%s: failed to decode API of package \"%s\" (%s)",
+        pkg->apifile.p, pkg->path.p, err_str(err));
+      n = NULL;
+    } else {
+      ns->members.v[index] = n;
+      if (n->kind == EXPR_FUN)
+        ((nstype_t*)ns->type)->members.v[index] = (node_t*)((fun_t*)n)->type;
+    }
+  }
+  mutex_unlock(&pkg->apidec_mu);
+  return n;
+}
+
+
+static bool pkg_api_index_build(pkg_t* pkg, memalloc_t ma) {
+  const nsexpr_t* ns = pkg->api_ns;
+  if (!map_init(&pkg->api_index, ma, ns->members.len))
+    return false;
+  for (u32 i = 0; i < ns->members.len; i++) {
+    void** vp = map_assign_ptr(&pkg->api_index, ma, ns->member_names[i]);
+    if (!vp) {
+      map_dispose(&pkg->api_index, ma);
+      pkg->api_index = (map_t){0};
+      return false;
+    }
+    // first member wins, like the linear search this replaced
+    if (!*vp)
+      *vp = (void*)(uintptr)(i + 1);
+  }
+  return true;
+}
+
+
+node_t* nullable pkg_api_lookup(pkg_t* pkg, sym_t name) {
+  nsexpr_t* ns = pkg->api_ns;
+  if (!ns)
+    return NULL;
+
+  // index members by name on first lookup
+  u32 index = 0;
+  mutex_lock(&pkg->apidec_mu);
+  if (pkg->api_index.cap == 0 && !pkg_api_index_build(pkg, memalloc_default())) {
+    mutex_unlock(&pkg->apidec_mu);
+    elog("%s: out of memory", __FUNCTION__);
+    return NULL;
+  }
+  void** vp = map_lookup_ptr(&pkg->api_index, name);
+  if (vp)
+    index = (u32)(uintptr)*vp;
+  mutex_unlock(&pkg->apidec_mu);
+
+  return index ? pkg_api_member(pkg, index - 1) : NULL;
+}
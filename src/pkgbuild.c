@@ -2,10 +2,12 @@
 #include "colib.h"
 #include "pkgbuild.h"
 #include "astencode.h"
+#include "ir.h"
 #include "llvm/llvm.h"
 #include "path.h"
 #include "sha256.h"
 #include "threadpool.h"
+#include "timetrace.h"
 
 #include <sys/stat.h>
 
@@ -24,6 +26,8 @@ static err_t build_pkg(
 static void load_dependency(
   compiler_t* c, memalloc_t api_ma, const pkgcell_t* parent, pkg_t* pkg, bool sync);
 
+static err_t await_dep_libs(compiler_t* c, const pkg_t* pkg);
+
 
 err_t pkgbuild_init(
   pkgbuild_t* pb, pkgcell_t pkgc, compiler_t* c, memalloc_t api_ma, u32 flags)
@@ -83,6 +87,14 @@ void pkgbuild_dispose(pkgbuild_t* pb) {
     assert_promises_completed(pb);
     mem_freetv(pb->c->ma, pb->promisev, (usize)pb->pkgc.pkg->srcfiles.len);
   }
+  if (pb->cosumv)
+    mem_freetv(pb->c->ma, pb->cosumv, (usize)pb->pkgc.pkg->srcfiles.len);
+  if (pb->srcsumv)
+    mem_freetv(pb->c->ma, pb->srcsumv, (usize)pb->pkgc.pkg->srcfiles.len);
+  if (pb->irunitv) {
+    mem_freetv(pb->c->ma, pb->irunitv, (usize)pb->unitc);
+    map_dispose(&pb->irfunm, pb->c->ma);
+  }
 }
 
 
@@ -180,15 +192,6 @@ static const char* cfile_of_srcfile_id(pkgbuild_t* pb, u32 srcfile_id) {
 }
 
 
-static const char* cfile_of_unit(pkgbuild_t* pb, const unit_t* unit) {
-  assert(pb->cfiles.len == pb->pkgc.pkg->srcfiles.len);
-  assertnotnull(unit->srcfile);
-  u32 srcfile_idx = ptrarray_rindexof(&pb->pkgc.pkg->srcfiles, unit->srcfile);
-  assert(srcfile_idx < U32_MAX);
-  return cfile_of_srcfile_id(pb, (u32)srcfile_idx);
-}
-
-
 // compile_c_source compiles a C source file in a background thread.
 // Caller should await the provided promise.
 static err_t compile_c_source(
@@ -304,15 +307,19 @@ typedef struct {
 } parseres_t;
 
 
+// parse_co_file parses srcfile into unit_ma.
+// If unit_ma is not pb->ast_ma it is adopted by pb->ast_ma once parsing is done.
 static void parse_co_file(
-  pkg_t*      pkg,
-  compiler_t* c,
+  pkgbuild_t* pb,
   srcfile_t*  srcfile,
-  memalloc_t  ast_ma,
-  parseres_t* result)
+  parseres_t* result,
+  memalloc_t  unit_ma)
 {
+  pkg_t* pkg = pb->pkgc.pkg;
+  compiler_t* c = pb->c;
   err_t err;
   parser_t parser;
+  u64 trace_start = timetrace_begin();
 
   if (( err = srcfile_open(srcfile) )) {
     elog("%s: %s", srcfile->name.p, err_str(err));
@@ -329,7 +336,7 @@ static void parse_co_file(
     relpath(path_join(pkg->dir.p, srcfile->name.p).p)); // leaking memory :-/
 
   unit_t* unit;
-  err = parser_parse(&parser, ast_ma, srcfile, &unit);
+  err = parser_parse(&parser, unit_ma, srcfile, &unit);
   AtomicStoreRel(&result->unit, unit);
 
   if (!err && parser_errcount(&parser) > 0) {
@@ -345,14 +352,16 @@ static void parse_co_file(
   parser_dispose(&parser);
 
 end:
+  if (unit_ma != pb->ast_ma)
+    memalloc_bump2_adopt(pb->ast_ma, unit_ma);
   srcfile_close(srcfile);
+  timetrace_end(trace_start, "parse", srcfile->name.p);
   AtomicStoreRel(&result->err, err);
   sema_signal(&result->sem, 1);
 }
 
 
 static err_t pkgbuild_parse(pkgbuild_t* pb) {
-  compiler_t* c = pb->c;
   pkg_t* pkg = pb->pkgc.pkg;
 
   // count number of compis source files
@@ -404,9 +413,14 @@ static err_t pkgbuild_parse(pkgbuild_t* pb) {
     if (opt_trace_parse || comaxproc == 1 || resultidx == ncosrc-1) {
       // Parse sources serially when tracing is enabled or if there're no threads.
       // Also, parse last one on the current thread to make the most of what we have.
-      parse_co_file(pkg, c, srcfile, pb->ast_ma, result);
+      parse_co_file(pb, srcfile, result, pb->ast_ma);
     } else {
-      threadpool_submit(parse_co_file, pkg, c, srcfile, pb->ast_ma, result);
+      // Parse into an arena of our own to avoid contention on pb->ast_ma.
+      // Only one thread allocates from it, so it needs no synchronization.
+      memalloc_t unit_ma = memalloc_bump2(/*slabsize*/0, MEMALLOC_BUMP2_NOSYNC);
+      if (unit_ma == memalloc_null())
+        unit_ma = pb->ast_ma;
+      threadpool_submit(parse_co_file, pb, srcfile, result, unit_ma);
     }
   }
 
@@ -437,13 +451,265 @@ static err_t pkgbuild_parse(pkgbuild_t* pb) {
 }
 
 
+// Source checksum file, stored next to the metafile as PKG_SRCSUMFILE_NAME.
+// Records the SHA-256 checksum of each source file the product was built from,
+// along with the file's size and mtime as seen at the time it was checksummed.
+// This allows check_pkg_src_uptodate to tell apart files which have merely been
+// touched (e.g. by a fresh checkout) from files which have actually changed.
+//
+//   srcsums = header srcsum{srccount}
+//   header  = "cSUM" SP version SP srccount LF
+//   srcsum  = sha256x SP size SP mtime SP filename LF
+//   version = u32x
+//   size    = u64x
+//   mtime   = u64x
+//
+#define SRCSUM_MAGIC   "cSUM"
+#define SRCSUM_VERSION 1
+
+typedef struct {
+  sha256_t   sha256;
+  usize      size;
+  unixtime_t mtime;
+  slice_t    name; // points into srcsums_t.data
+} srcsum_t;
+
+typedef struct {
+  srcsum_t*   v;
+  u32         len;
+  const void* data; // mmap'ed file contents
+  usize       datasize;
+} srcsums_t;
+
+
+static void srcsums_dispose(srcsums_t* sums) {
+  if (sums->v)
+    mem_freetv(memalloc_ctx(), sums->v, (usize)sums->len);
+  if (sums->data)
+    mmap_unmap(sums->data, sums->datasize);
+}
+
+
+static const u8* srcsums_decode_u64x(const u8* p, const u8* pend, u64* result) {
+  if (co_intscan(&p, (usize)(pend - p), 16, 0xffffffffffffffffllu, result))
+    return NULL;
+  if (p == pend || *p != ' ')
+    return NULL;
+  return p + 1;
+}
+
+
+// srcsums_load reads a source checksum file.
+// Returns ErrNotFound if there is no such file and ErrInvalid if it is malformed.
+static err_t srcsums_load(srcsums_t* sums, const char* filename) {
+  memset(sums, 0, sizeof(*sums));
+
+  struct stat st;
+  err_t err = mmap_file_ro(filename, &sums->data, &st);
+  if (err)
+    return err;
+  sums->datasize = (usize)st.st_size;
+
+  const u8* p = sums->data;
+  const u8* pend = p + sums->datasize;
+  u64 version, count;
+
+  // header
+  if (sums->datasize < 5 || memcmp(p, SRCSUM_MAGIC " ", 5) != 0)
+    goto invalid;
+  p += 5;
+  if (!(p = srcsums_decode_u64x(p, pend, &version)) || version != SRCSUM_VERSION)
+    goto invalid;
+  if (co_intscan(&p, (usize)(pend - p), 16, U32_MAX, &count) || p == pend || *p++ != '\n')
+    goto invalid;
+
+  if (count > 0) {
+    sums->v = mem_alloctv(memalloc_ctx(), srcsum_t, (usize)count);
+    if (!sums->v) {
+      err = ErrNoMem;
+      goto error;
+    }
+    sums->len = (u32)count;
+  }
+
+  for (u32 i = 0; i < sums->len; i++) {
+    srcsum_t* ent = &sums->v[i];
+    u64 size, mtime;
+
+    // sha256x SP
+    if ((usize)(pend - p) < 64 + 1 || p[64] != ' ')
+      goto invalid;
+    u8* sha256_bytes = (u8*)&ent->sha256;
+    for (usize j = 0; j < 32; j++) {
+      u8 b = 0;
+      for (usize k = 0; k < 2; k++) {
+        u8 c = p[j*2 + k];
+        if ('0' <= c && c <= '9')      c -= '0';
+        else if ('a' <= c && c <= 'f') c -= 'a' - 10;
+        else if ('A' <= c && c <= 'F') c -= 'A' - 10;
+        else goto invalid;
+        b = (u8)(b << 4) | c;
+      }
+      sha256_bytes[j] = b;
+    }
+    p += 64 + 1;
+
+    // size SP mtime SP
+    if (!(p = srcsums_decode_u64x(p, pend, &size)) ||
+        !(p = srcsums_decode_u64x(p, pend, &mtime)) )
+    {
+      goto invalid;
+    }
+    ent->size = (usize)size;
+    ent->mtime = (unixtime_t)mtime;
+
+    // filename LF
+    const u8* name = p;
+    while (p < pend && *p != '\n')
+      p++;
+    if (p == pend || p == name)
+      goto invalid;
+    ent->name = (slice_t){ .p = name, .len = (usize)(p - name) };
+    p++;
+  }
+
+  return 0;
+
+invalid:
+  err = ErrInvalid;
+error:
+  srcsums_dispose(sums);
+  memset(sums, 0, sizeof(*sums));
+  return err;
+}
+
+
+// srcsums_write writes a source checksum file with entries v[0:len]
+static err_t srcsums_write(
+  compiler_t* c, const pkg_t* pkg, const srcsum_t* v, u32 len)
+{
+  err_t err = 0;
+  str_t filename = {0};
+  buf_t buf = buf_make(c->ma);
+
+  if (!pkg_buildfile(pkg, c, &filename, PKG_SRCSUMFILE_NAME)) {
+    err = ErrNoMem;
+    goto end;
+  }
+
+  bool ok = buf_printf(&buf, SRCSUM_MAGIC " %x %x\n", SRCSUM_VERSION, len);
+  for (u32 i = 0; i < len && ok; i++) {
+    const srcsum_t* ent = &v[i];
+    ok &= buf_appendhex(&buf, &ent->sha256, sizeof(ent->sha256));
+    ok &= buf_printf(&buf, " %zx %llx %.*s\n",
+      ent->size, (unsigned long long)ent->mtime, (int)ent->name.len, ent->name.chars);
+  }
+  if (!ok) {
+    err = ErrNoMem;
+    goto end;
+  }
+
+  err = fs_writefile_mkdirs(filename.p, 0644, buf_slice(buf));
+
+end:
+  buf_dispose(&buf);
+  str_free(filename);
+  return err;
+}
+
+
+// pkgbuild_srcsums checksums all source files of the package being built.
+// The checksums are written to the package's source checksum file by
+// pkgbuild_write_srcsums, once the package has been built successfully.
+static err_t pkgbuild_srcsums(pkgbuild_t* pb) {
+  pkg_t* pkg = pb->pkgc.pkg;
+  err_t err = 0;
+
+  if (pkg->srcfiles.len == 0)
+    return 0;
+
+  pb->srcsumv = mem_alloctv(pb->c->ma, sha256_t, (usize)pkg->srcfiles.len);
+  if (!pb->srcsumv)
+    return ErrNoMem;
+
+  for (u32 i = 0; i < pkg->srcfiles.len && !err; i++) {
+    srcfile_t* f = pkg->srcfiles.v[i];
+    if (( err = srcfile_sha256(f, &pb->srcsumv[i]) ))
+      elog("%s: %s", f->name.p, err_str(err));
+  }
+
+  return err;
+}
+
+
+// pkgbuild_write_srcsums writes the checksums computed by pkgbuild_srcsums
+// to the package's source checksum file.
+static err_t pkgbuild_write_srcsums(pkgbuild_t* pb) {
+  pkg_t* pkg = pb->pkgc.pkg;
+  if (!pb->srcsumv)
+    return 0;
+
+  srcsum_t* v = mem_alloctv(pb->c->ma, srcsum_t, (usize)pkg->srcfiles.len);
+  if (!v)
+    return ErrNoMem;
+  for (u32 i = 0; i < pkg->srcfiles.len; i++) {
+    const srcfile_t* f = pkg->srcfiles.v[i];
+    v[i] = (srcsum_t){
+      .sha256 = pb->srcsumv[i],
+      .size = f->size,
+      .mtime = f->mtime,
+      .name = str_slice(f->name),
+    };
+  }
+
+  err_t err = srcsums_write(pb->c, pkg, v, pkg->srcfiles.len);
+  mem_freetv(pb->c->ma, v, (usize)pkg->srcfiles.len);
+  return err;
+}
+
+
+// check_srcfile_unchanged compares the contents of a source file to what it was
+// when the product was built, according to its entry in srcsums.
+// *touchedp is set to true if the file is unchanged but its size or mtime are not
+// what they were when srcsums was written.
+static bool check_srcfile_unchanged(srcfile_t* f, srcsum_t* ent, bool* touchedp) {
+  if (ent->name.len != f->name.len || memcmp(ent->name.p, f->name.p, f->name.len) != 0)
+    return false;
+
+  // stat-based fast path: size and mtime are the same as when checksummed
+  if (ent->size == f->size && ent->mtime == f->mtime)
+    return true;
+
+  // file has different size or mtime; compare content checksum
+  sha256_t sha256;
+  if (srcfile_sha256(f, &sha256))
+    return false;
+  if (memcmp(&sha256, &ent->sha256, sizeof(sha256)) != 0)
+    return false;
+
+  // contents have not changed, but mtime has.
+  // Update entry so that the next check can take the fast path.
+  ent->size = f->size;
+  ent->mtime = f->mtime;
+  *touchedp = true;
+  return true;
+}
+
+
 // check_pkg_src_uptodate stats pkg->files and compares their mtime to product_mtime.
 // It also compares the names at pkg->files to readdir(pkg->dir).
 // product_mtime should be the timestamp of a package product, like metafile or libfile.
-// If a source file is newer than product_mtime, the set of files on disk has changed
-// or an I/O error occurred, false is returned to signal ""
-static bool check_pkg_src_uptodate(pkg_t* pkg, unixtime_t product_mtime) {
+// If a source file is newer than product_mtime, its content checksum is compared
+// to the one recorded in the package's srcsums file (see pkgbuild_srcsums.)
+// If a source file has changed, the set of files on disk has changed
+// or an I/O error occurred, false is returned to signal "out of date."
+static bool check_pkg_src_uptodate(
+  compiler_t* c, pkg_t* pkg, unixtime_t product_mtime)
+{
   bool ok = false;
+  bool touched = false; // true if some file was touched but did not change
+  srcsums_t sums = {0};
+  str_t sumsfile = {0};
 
   // First we need to scan for added or removed source files on disk.
   // Since we "own" pkg here, it's safe to modify its srcfiles array, which we'll
@@ -477,8 +743,24 @@ static bool check_pkg_src_uptodate(pkg_t* pkg, unixtime_t product_mtime) {
       //dlog("newfound srcfile: %s", found_srcfile->name.p);
       goto end;
     }
-    if (found_srcfile->mtime > product_mtime) {
-      //dlog("modified srcfile: %s", pkg->srcfiles.v[i].name.p);
+    if (found_srcfile->mtime <= product_mtime)
+      continue;
+
+    // Source file is newer than the product. Check if its contents changed.
+    // Load srcsums lazily, the first time we need it.
+    if (sums.data == NULL) {
+      if (!pkg_buildfile(pkg, c, &sumsfile, PKG_SRCSUMFILE_NAME))
+        goto end;
+      if (( err = srcsums_load(&sums, sumsfile.p) )) {
+        if (err != ErrNotFound)
+          dlog("%s: %s", relpath(sumsfile.p), err_str(err));
+        goto end;
+      }
+      if (sums.len != pkg->srcfiles.len)
+        goto end;
+    }
+    if (!check_srcfile_unchanged(found_srcfile, &sums.v[i], &touched)) {
+      //dlog("modified srcfile: %s", found_srcfile->name.p);
       goto end;
     }
   }
@@ -486,7 +768,17 @@ static bool check_pkg_src_uptodate(pkg_t* pkg, unixtime_t product_mtime) {
   // pkg is up-to-date; source files have not changed since product was created
   ok = true;
 
+  // Record new mtimes of files which were touched without being modified.
+  // Only entries verified by check_srcfile_unchanged have been updated; the
+  // others keep the size and mtime they were recorded with.
+  if (touched) {
+    if (( err = srcsums_write(c, pkg, sums.v, sums.len) ))
+      dlog("srcsums_write: %s", err_str(err));
+  }
+
 end:
+  srcsums_dispose(&sums);
+  str_free(sumsfile);
   // note: we are NOT using srcfilearray_dispose here since that would dispose
   // of the srcfile structs as well, which are owned by the pkg->srcfiles array.
   ptrarray_dispose(&cached_srcfiles, memalloc_ctx());
@@ -494,8 +786,13 @@ end:
 }
 
 
-// create_pkg_api_ns creates pkg->api_ns from pkg->api
-static err_t create_pkg_api_ns(memalloc_t api_ma, pkg_t* pkg) {
+// create_pkg_api_ns creates pkg->api_ns from pkg->api.
+// If member_names is NULL, names are derived from pkg->api, which must then be
+// fully populated. Otherwise pkg->api may contain NULL entries which are decoded
+// on demand by pkg_api_member.
+static err_t create_pkg_api_ns(
+  memalloc_t api_ma, pkg_t* pkg, sym_t* nullable member_names)
+{
   nsexpr_t* ns = NULL;
 
   // allocate namespace type
@@ -510,9 +807,13 @@ static err_t create_pkg_api_ns(memalloc_t api_ma, pkg_t* pkg) {
   ns = (nsexpr_t*)ast_mknode(api_ma, sizeof(nsexpr_t), EXPR_NS);
   if (!ns)
     goto oom;
-  sym_t* member_names = mem_alloc(api_ma, sizeof(sym_t) * (usize)pkg->api.len).p;
-  if (!member_names)
-    goto oom;
+  if (!member_names) {
+    member_names = mem_alloc(api_ma, sizeof(sym_t) * (usize)pkg->api.len).p;
+    if (!member_names)
+      goto oom;
+    for (u32 i = 0; i < pkg->api.len; i++)
+      member_names[i] = pkg_api_member_name(pkg->api.v[i]);
+  }
   ns->flags |= NF_CHECKED | NF_PKGNS;
   ns->name = sym__;
   ns->type = (type_t*)nst;
@@ -520,32 +821,27 @@ static err_t create_pkg_api_ns(memalloc_t api_ma, pkg_t* pkg) {
   ns->member_names = member_names;
   ns->pkg = pkg; // note: "pkg" field is only valid with flags&NF_PKGNS
 
-  // populate namespace type members and member_names
+  // populate namespace type members
+  nst->members.len = pkg->api.len;
   for (u32 i = 0; i < pkg->api.len; i++) {
     node_t* n = pkg->api.v[i];
+    if (n == NULL) {
+      // not yet decoded; updated by pkg_api_member
+      nst->members.v[i] = (node_t*)type_unknown;
+      continue;
+    }
     switch (n->kind) {
-      case EXPR_FUN: {
-        fun_t* fn = (fun_t*)n;
-        member_names[i] = fn->name ? fn->name : sym__;
-        nst->members.v[i] = (node_t*)fn->type;
+      case EXPR_FUN:
+        nst->members.v[i] = (node_t*)((fun_t*)n)->type;
         break;
-      }
-      case STMT_TYPEDEF: {
-        type_t* t = ((typedef_t*)n)->type;
-        if (t->kind == TYPE_STRUCT) {
-          member_names[i] = ((structtype_t*)t)->name ? ((structtype_t*)t)->name : sym__;
-        } else {
-          assertf(t->kind == TYPE_ALIAS, "unexpected %s", nodekind_name(t->kind));
-          member_names[i] = ((aliastype_t*)t)->name;
-        }
+      case STMT_TYPEDEF:
+      case TYPE_STRUCT: // template instance
+      case TYPE_ALIAS:  // template instance
         nst->members.v[i] = (node_t*)type_unknown;
         break;
-      }
       default:
         safecheckf(0, "TODO %s %s", __FUNCTION__, nodekind_name(n->kind));
-        member_names[i] = sym__;
         nst->members.v[i] = (node_t*)type_unknown;
-
     } // switch
   }
 
@@ -570,11 +866,33 @@ oom:
 }
 
 
-// load_pkg_api decodes AST from astdec and assigns it to pkg->api
+// load_pkg_api decodes AST from astdec and assigns it to pkg->api.
+// With the binary format, only the names of API members are decoded up front;
+// pkg->apidec is set and members are decoded on demand by pkg_api_member.
 static err_t load_pkg_api(memalloc_t api_ma, pkg_t* pkg, astdecoder_t* astdec) {
   node_t** nodev;
   u32 nodec;
-  err_t err = astdecoder_decode_ast(astdec, &nodev, &nodec);
+  sym_t* namev;
+  err_t err = astdecoder_decode_rootnames(astdec, &namev, &nodec);
+  if (err == 0) {
+    nodev = mem_alloc_zeroed(api_ma, (usize)nodec * sizeof(node_t*)).p;
+    if (!nodev && nodec > 0)
+      return ErrNoMem;
+    pkg->api.v = nodev;
+    pkg->api.cap = nodec;
+    pkg->api.len = nodec;
+    if (( err = create_pkg_api_ns(api_ma, pkg, namev) ))
+      return err;
+    pkg->apidec = astdec;
+    return 0;
+  }
+  if (err != ErrNotSupported) {
+    dlog("astdecode error: %s", err_str(err));
+    return err;
+  }
+
+  // format does not support lazy decoding; decode everything now
+  err = astdecoder_decode_ast(astdec, &nodev, &nodec);
   if (err) {
     dlog("astdecode error: %s", err_str(err));
     return err;
@@ -587,13 +905,18 @@ static err_t load_pkg_api(memalloc_t api_ma, pkg_t* pkg, astdecoder_t* astdec) {
   pkg->api.cap = nodec;
   pkg->api.len = nodec;
 
-  return create_pkg_api_ns(api_ma, pkg);
+  return create_pkg_api_ns(api_ma, pkg, NULL);
 }
 
 
 static err_t build_dependency(compiler_t* c, memalloc_t api_ma, pkgcell_t pkgc) {
+  // note: parent is NULL for a top-level package loaded by build_toplevel_pkgs
+  if (c->loadonly) {
+    trace_import("not building \"%s\" (load only)", pkgc.pkg->path.p);
+    return ErrCanceled;
+  }
   trace_import("\"%s\" building dependency \"%s\"",
-    pkgc.parent->pkg->path.p, pkgc.pkg->path.p);
+    pkgc.parent ? pkgc.parent->pkg->path.p : "(top-level)", pkgc.pkg->path.p);
   u32 pkgbuildflags = PKGBUILD_DEP;
   err_t err = build_pkg(pkgc, c, /*outfile*/"", api_ma, pkgbuildflags);
   if (err)
@@ -614,7 +937,7 @@ static bool load_dependency1(
   // check if source files have been modified
   if (pkg->mtime == 0)
     return false;
-  if (!check_pkg_src_uptodate(pkg, pkg->mtime))
+  if (!check_pkg_src_uptodate(c, pkg, pkg->mtime))
     return false;
 
   err_t err = 0;
@@ -679,6 +1002,7 @@ static void load_dependency0(
   pkgcell_t pkgc = { .parent = parent, .pkg = pkg };
   sha256_t* imports_api_sha256v = NULL;
   u32 imports_api_sha256c = 0;
+  u64 trace_start = timetrace_begin();
 
   // get library file mtime
   str_t libfile = {0};
@@ -815,8 +1139,27 @@ rebuild:
     goto rebuild;
   }
 
-end:
+  // if the API is decoded lazily, the package takes ownership of the decoder
+  // and the metafile data, which must outlive the decoder.
+  if (!err && pkg->apidec) {
+    assert(pkg->apidec == astdec);
+    pkg->apidata = encdata;
+    pkg->apidatasize = metast.st_size;
+    pkg->apifile = metafile;
+    astdec = NULL;
+    encdata = NULL;
+    metafile = (str_t){0};
+  }
 
+end:
+  // note: includes time spent building the package, if it was built
+  timetrace_end(trace_start, "load_dependency", pkg->path.p);
+
+  // If we built the package, build_pkg resolves libfut once the library is built.
+  // Otherwise the library is up to date (or we failed.)
+  // Note that build_dependency never builds anything in loadonly mode.
+  if (!did_build || c->loadonly)
+    future_finalize(&pkg->libfut, err);
   future_finalize(&pkg->loadfut, err);
   if (err) {
     trace_import("loaded package \"%s\" error: %s", pkg->path.p, err_str(err));
@@ -837,13 +1180,20 @@ end:
 static void load_dependency(
   compiler_t* c, memalloc_t api_ma, const pkgcell_t* parent, pkg_t* pkg, bool sync)
 {
+  // note: must happen before future_acquire (see build_toplevel_pkg1)
+  AtomicStore(&pkg->imported, true, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+
   if (!future_acquire(&pkg->loadfut)) {
     // already loaded or it's currently in the process of being loaded
     return;
   }
 
+  // whoever loads the package is also responsible for its library (see libfut)
+  safecheckx(future_acquire(&pkg->libfut));
+
   // if COMAXPROC is set to 1 or there is only one CPU available, don't use threads
-  if (comaxproc == 1 || sync) {
+  if (comaxproc == 1 || sync || c->loadonly) {
     load_dependency0(c, api_ma, parent, pkg);
     return;
   }
@@ -856,6 +1206,48 @@ static void load_dependency(
 }
 
 
+err_t pkgbuild_load_api(compiler_t* c, memalloc_t api_ma, pkg_t* pkg) {
+  c->loadonly = true;
+  load_dependency(c, api_ma, NULL, pkg, /*sync*/true);
+  c->loadonly = false;
+
+  err_t err = future_wait(&pkg->loadfut);
+  if (err || !pkg->api_ns)
+    return err;
+
+  // decode members which would otherwise be decoded when first looked up
+  for (u32 i = 0; i < pkg->api_ns->members.len; i++) {
+    if (!pkg_api_member(pkg, i))
+      return ErrInvalid;
+  }
+  return 0;
+}
+
+
+bool pkgbuild_src_uptodate(compiler_t* c, pkg_t* pkg) {
+  if (pkg->mtime == 0)
+    return false;
+
+  // check_pkg_src_uptodate replaces pkg->srcfiles with the files it finds on disk.
+  // Keep the srcfiles the package was loaded with since its API refers to them.
+  ptrarray_t loaded_srcfiles = pkg->srcfiles;
+  pkg->srcfiles = (ptrarray_t){0};
+  for (u32 i = 0; i < loaded_srcfiles.len; i++) {
+    if (!ptrarray_push(&pkg->srcfiles, memalloc_ctx(), loaded_srcfiles.v[i])) {
+      ptrarray_dispose(&pkg->srcfiles, memalloc_ctx());
+      pkg->srcfiles = loaded_srcfiles;
+      return false;
+    }
+  }
+
+  bool ok = check_pkg_src_uptodate(c, pkg, pkg->mtime);
+
+  srcfilearray_dispose(&pkg->srcfiles);
+  pkg->srcfiles = loaded_srcfiles;
+  return ok;
+}
+
+
 static bool report_import_cycle(pkgbuild_t* pb, const pkg_t* pkg) {
   elog("import cycle not allowed; import stack:");
   pkgcell_t pkgc = pb->pkgc;
@@ -1047,9 +1439,23 @@ err_t pkgbuild_analyze(pkgbuild_t* pb) {
     return ErrCanceled;
   }
 
+  // keep IR around for the LLVM backend
+  if (c->backend == BACKEND_LLVM) {
+    pb->irunitv = mem_alloctv(c->ma, irunit_t*, (usize)pb->unitc);
+    if (!pb->irunitv)
+      return ErrNoMem;
+    if (!map_init(&pb->irfunm, c->ma, 32)) {
+      mem_freetv(c->ma, pb->irunitv, (usize)pb->unitc);
+      pb->irunitv = NULL;
+      return ErrNoMem;
+    }
+  }
+
   // build IR -- performs ownership analysis; updates "drops" lists in AST
   dlog_if(opt_trace_ir, "————————— IR —————————");
-  if (( err = iranalyze(c, pb->ast_ma, pb->pkgc.pkg, pb->unitv, pb->unitc) )) {
+  if (( err = iranalyze(c, pb->ast_ma, pb->pkgc.pkg, pb->unitv, pb->unitc,
+                        pb->irunitv) ))
+  {
     dlog("iranalyze: %s", err_str(err));
     return err;
   }
@@ -1058,6 +1464,23 @@ err_t pkgbuild_analyze(pkgbuild_t* pb) {
     return ErrCanceled;
   }
 
+  // index functions by their AST node.
+  // Units list every function they reference but only one of them has its body.
+  if (pb->irunitv) for (u32 i = 0; i < pb->unitc; i++) {
+    const irunit_t* u = pb->irunitv[i];
+    if (!u)
+      continue;
+    for (u32 j = 0; j < u->functions.len; j++) {
+      irfun_t* f = u->functions.v[j];
+      if (f->blocks.len == 0)
+        continue;
+      void** vp = map_assign_ptr(&pb->irfunm, c->ma, f->ast);
+      if (!vp)
+        return ErrNoMem;
+      *vp = f;
+    }
+  }
+
   // trace & dlog
   if (opt_trace_ir && c->opt_printast) {
     dlog("————————— AST after IR —————————");
@@ -1113,7 +1536,7 @@ err_t pkgbuild_setinfo(pkgbuild_t* pb) {
   if ((pb->flags & PKGBUILD_DEP) == 0 && pb->c->opt_nomain == false) {
     // check if there's a main function
     const fun_t** mainfunp = (const fun_t**)map_lookup_ptr(&pkg->defs, sym_main);
-    if (mainfunp && (*mainfunp)->kind == EXPR_FUN) {
+    if (mainfunp && *mainfunp && (*mainfunp)->kind == EXPR_FUN) {
       if UNLIKELY(!ast_is_main_fun(*mainfunp))
         return report_bad_mainfun(pb, *mainfunp);
       // we have a proper "main" function
@@ -1151,6 +1574,25 @@ static err_t pkgbuild_cgen_pub_api(pkgbuild_t* pb) {
     pb->pkgapi.pub_header.p, pb->pkgapi.pub_header.len);
 
   err = fs_writefile_mkdirs(pubhfile.p, 0660, pb->pkgapi.pub_header);
+  if (err)
+    goto end;
+
+  // Write package-internal API to a header file which all units include.
+  // This allows it to be precompiled once (see pkgbuild_build_pch)
+  buf_t buf = buf_make(pb->c->ma);
+  if UNLIKELY(!pkg_buildfile(pb->pkgc.pkg, pb->c, &pb->pkgapi.pkg_hfile, PKG_PKGHFILE_NAME))
+    err = ErrNoMem;
+  if (!err)
+    err = cgen_pkgapi_header(&pb->cgen, &pb->pkgapi, &buf);
+  if (!err)
+    err = fs_writefile(pb->pkgapi.pkg_hfile.p, 0660, buf_slice(buf));
+  buf_dispose(&buf);
+  if (err) {
+    // fall back to embedding the API in each unit's C file
+    dlog("failed to write %s: %s", PKG_PKGHFILE_NAME, err_str(err));
+    pb->pkgapi.pkg_hfile.len = 0;
+    err = 0;
+  }
 
 end:
   str_free(pubhfile);
@@ -1194,30 +1636,245 @@ err_t pkgbuild_cgen_pub(pkgbuild_t* pb) {
 }
 
 
-err_t pkgbuild_cgen_pkg(pkgbuild_t* pb) {
+// Per-unit fingerprints
+//
+// The object file of each .co unit is accompanied by a "{name}.sum" file in the
+// build directory, containing the SHA-256 "fingerprint" of everything that went into
+// compiling the object: the compiler version, cflags_co, the API checksums of
+// imported packages (whose pub.h files the generated C includes), the package's
+// own API (pkg.h, which the generated C includes) and the generated C text itself.
+// When a unit's fingerprint matches the one on file and its object file exists,
+// we skip writing its C file and compiling it.
+//
+// The fingerprint file is removed before a unit is compiled and written after the
+// compiler has successfully produced the object file, so an interrupted or failed
+// compilation is never mistaken for an up-to-date one.
+
+
+static str_t cosumfile_of_srcfile_id(pkgbuild_t* pb, u32 srcfile_id) {
+  // "{builddir}/{name}.o" => "{builddir}/{name}.sum"
+  const char* ofile = ofile_of_srcfile_id(pb, srcfile_id);
+  usize len = strlen(ofile);
+  assert(len > 2 && strcmp(ofile + len - 2, ".o") == 0);
+  str_t s = str_makelen(ofile, len - 2);
+  if (!str_append(&s, ".sum"))
+    panic("out of memory");
+  return s;
+}
+
+
+// cosum_salt computes the part of unit fingerprints that is shared by all units
+static void cosum_salt(pkgbuild_t* pb, sha256_t* result) {
+  compiler_t* c = pb->c;
+  pkg_t* pkg = pb->pkgc.pkg;
+  SHA256 state;
+  sha256_init(&state, result);
+
+  sha256_write(&state, CO_VERSION_STR, strlen(CO_VERSION_STR) + 1);
+
+  #if !defined(CO_DISTRIBUTION)
+    // during development coprelude.h is used directly from coroot (see compiler.c)
+    char* coprelude = path_join_alloca(coroot, "co", "coprelude.h");
+    unixtime_t coprelude_mtime = fs_mtime(coprelude);
+    sha256_write(&state, &coprelude_mtime, sizeof(coprelude_mtime));
+  #endif
+
+  for (usize i = 0; i < c->cflags_co.len; i++) {
+    const char* flag = c->cflags_co.strings[i];
+    sha256_write(&state, flag, strlen(flag) + 1);
+  }
+
+  for (u32 i = 0; i < pkg->imports.len; i++) {
+    const pkg_t* dep = pkg->imports.v[i];
+    sha256_write(&state, &dep->api_sha256, sizeof(dep->api_sha256));
+  }
+
+  sha256_write(&state, pb->pkgapi.pkg_header.p, pb->pkgapi.pkg_header.len);
+
+  sha256_close(&state);
+}
+
+
+static void cosum_compute(const sha256_t* salt, slice_t ctext, sha256_t* result) {
+  SHA256 state;
+  sha256_init(&state, result);
+  sha256_write(&state, salt, sizeof(*salt));
+  sha256_write(&state, ctext.p, ctext.len);
+  sha256_close(&state);
+}
+
+
+// cosum_check returns true if the unit's object file exists and was compiled from
+// inputs with the same fingerprint as cosum
+static bool cosum_check(pkgbuild_t* pb, u32 srcfile_id, const sha256_t* cosum) {
+  if (!fs_isfile(ofile_of_srcfile_id(pb, srcfile_id)))
+    return false;
+  str_t filename = cosumfile_of_srcfile_id(pb, srcfile_id);
+  const void* data;
+  struct stat st;
+  bool ok = false;
+  if (mmap_file_ro(filename.p, &data, &st) == 0) {
+    ok = (usize)st.st_size == sizeof(*cosum) && memcmp(data, cosum, sizeof(*cosum)) == 0;
+    mmap_unmap(data, (usize)st.st_size);
+  }
+  str_free(filename);
+  return ok;
+}
+
+
+static err_t cosum_write(pkgbuild_t* pb, u32 srcfile_id, const sha256_t* nullable cosum) {
+  str_t filename = cosumfile_of_srcfile_id(pb, srcfile_id);
+  err_t err;
+  if (cosum) {
+    err = fs_writefile(filename.p, 0644, (slice_t){ .p = cosum, .len = sizeof(*cosum) });
+  } else if (( err = fs_remove(filename.p) ) == ErrNotFound) {
+    err = 0;
+  }
+  str_free(filename);
+  return err;
+}
+
+
+// cgen_unit generates C code for one unit and writes it to cfile,
+// unless the unit's object file is up to date.
+static err_t cgen_unit(
+  pkgbuild_t* pb, cgen_t* g, const sha256_t* salt, unit_t* unit, const char* cfile)
+{
+  err_t err;
+  pkg_t* pkg = pb->pkgc.pkg;
+  u32 srcfile_id = ptrarray_rindexof(&pkg->srcfiles, unit->srcfile);
+  assert(srcfile_id < pkg->srcfiles.len);
+  sha256_t* cosum = &pb->cosumv[srcfile_id];
+
+  // try generating an object file directly with the LLVM backend.
+  // Objects produced this way are not fingerprinted and are always regenerated.
+  if (pb->c->backend == BACKEND_LLVM && pb->irunitv && !pb->c->opt_genasm) {
+    err = llvmgen_unit(pb->c, pkg, unit, &pb->irfunm, g->flags,
+                       ofile_of_srcfile_id(pb, srcfile_id));
+    if (err == 0) {
+      memset(cosum, 0, sizeof(*cosum)); // nothing to compile
+      return cosum_write(pb, srcfile_id, NULL);
+    }
+    if (err != ErrNotSupported)
+      return err;
+    dlog_if(opt_trace_cgen, "llvmgen: %s not supported; using cgen",
+      unit->srcfile->name.p);
+  }
+
+  if (( err = cgen_unit_impl(g, unit, &pb->pkgapi) ))
+    return err;
+
+  if (opt_trace_cgen) {
+    fprintf(stderr, "—————————— cgen %s ——————————\n", relpath(cfile));
+    fwrite(g->outbuf.p, g->outbuf.len, 1, stderr);
+    fputs("\n——————————————————————————————————\n", stderr);
+  }
+
+  // skip writing & compiling the C file if the object file is up to date.
+  // Note that an assembly file is not guaranteed to exist, so -S always compiles.
+  cosum_compute(salt, buf_slice(g->outbuf), cosum);
+  if (!pb->c->opt_genasm && cosum_check(pb, srcfile_id, cosum)) {
+    memset(cosum, 0, sizeof(*cosum));
+    return 0;
+  }
+
+  // remove any old fingerprint, in case compilation fails
+  if (( err = cosum_write(pb, srcfile_id, NULL) ))
+    return err;
+
+  return fs_writefile_mkdirs(cfile, 0660, buf_slice(g->outbuf));
+}
+
+
+typedef struct {
+  pkgbuild_t*     pb;
+  const sha256_t* salt;
+  unit_t*         unit;
+  const char*     cfile;
+  sema_t          sem;
+  _Atomic(err_t)  err;
+} cgenjob_t;
+
+
+// cgenjob_run runs cgen_unit with a code generator of its own
+static void cgenjob_run(cgenjob_t* job) {
+  pkgbuild_t* pb = job->pb;
+  cgen_t g;
   err_t err = 0;
+  if (!cgen_init(&g, pb->c, pb->pkgc.pkg, pb->c->ma, pb->cgen.flags)) {
+    err = ErrNoMem;
+  } else {
+    err = cgen_unit(pb, &g, job->salt, job->unit, job->cfile);
+    cgen_dispose(&g);
+  }
+  AtomicStoreRel(&job->err, err);
+  sema_signal(&job->sem, 1);
+}
 
-  // generate one C file for each unit
-  for (u32 i = 0; i < pb->unitc; i++) {
-    unit_t* unit = pb->unitv[i];
-    const char* cfile = cfile_of_unit(pb, unit);
 
-    if (pb->c->opt_verbose)
-      pkgbuild_begintask(pb, "cgen %s", relpath(cfile));
+err_t pkgbuild_cgen_pkg(pkgbuild_t* pb) {
+  err_t err = 0;
+  pkg_t* pkg = pb->pkgc.pkg;
 
-    if (( err = cgen_unit_impl(&pb->cgen, unit, &pb->pkgapi) ))
-      break;
+  // allocate fingerprint array
+  if (!pb->cosumv) {
+    pb->cosumv = mem_alloctv(pb->c->ma, sha256_t, (usize)pkg->srcfiles.len);
+    if UNLIKELY(!pb->cosumv)
+      return ErrNoMem;
+  }
 
-    if (opt_trace_cgen) {
-      fprintf(stderr, "—————————— cgen %s ——————————\n", relpath(cfile));
-      fwrite(pb->cgen.outbuf.p, pb->cgen.outbuf.len, 1, stderr);
-      fputs("\n——————————————————————————————————\n", stderr);
+  // compute the part of the fingerprint which is common to all units
+  sha256_t salt;
+  cosum_salt(pb, &salt);
+
+  // Generate one C file for each unit.
+  // Generate units serially when tracing is enabled or if there're no threads.
+  if (opt_trace_cgen || comaxproc == 1 || pb->unitc < 2) {
+    for (u32 i = 0; i < pb->unitc && err == 0; i++) {
+      unit_t* unit = pb->unitv[i];
+      u32 srcfile_id = ptrarray_rindexof(&pkg->srcfiles, unit->srcfile);
+      const char* cfile = cfile_of_srcfile_id(pb, srcfile_id);
+      if (pb->c->opt_verbose)
+        pkgbuild_begintask(pb, "cgen %s", relpath(cfile));
+      err = cgen_unit(pb, &pb->cgen, &salt, unit, cfile);
     }
+    return err;
+  }
 
-    if (( err = fs_writefile_mkdirs(cfile, 0660, buf_slice(pb->cgen.outbuf)) ))
-      break;
+  // generate units concurrently, each with its own code generator.
+  // Note: strlist_array lazily builds its array; do so now, before jobs read it.
+  strlist_array(&pb->ofiles);
+  cgenjob_t* jobv = mem_alloctv(pb->c->ma, cgenjob_t, pb->unitc);
+  if (!jobv)
+    return ErrNoMem;
+
+  for (u32 i = 0; i < pb->unitc; i++) {
+    cgenjob_t* job = &jobv[i];
+    unit_t* unit = pb->unitv[i];
+    u32 srcfile_id = ptrarray_rindexof(&pkg->srcfiles, unit->srcfile);
+    job->pb = pb;
+    job->salt = &salt;
+    job->unit = unit;
+    job->cfile = cfile_of_srcfile_id(pb, srcfile_id);
+    job->err = 0;
+    safecheckx(sema_init(&job->sem, 0) == 0);
+    if (pb->c->opt_verbose)
+      pkgbuild_begintask(pb, "cgen %s", relpath(job->cfile));
+    // generate last unit on the current thread to make the most of what we have
+    if (i == pb->unitc - 1 || threadpool_submit(cgenjob_run, job) != 0)
+      cgenjob_run(job);
   }
 
+  // wait for results
+  for (u32 i = 0; i < pb->unitc; i++) {
+    safecheckx(sema_wait(&jobv[i].sem));
+    err_t err1 = AtomicLoadAcq(&jobv[i].err);
+    if (err1 && !err)
+      err = err1;
+    sema_dispose(&jobv[i].sem);
+  }
+
+  mem_freetv(pb->c->ma, jobv, pb->unitc);
   return err;
 }
 
@@ -1252,6 +1909,16 @@ err_t pkgbuild_metagen(pkgbuild_t* pb) {
       dlog("astencoder_add_ast: %s", err_str(err));
   }
 
+  // Add instances of the package's templates, which importers use instead of
+  // instantiating the same templates again (see pkg_tinstance_name.)
+  // The array is allocated in pb->ast_ma; don't leave it dangling.
+  for (u32 i = 0; i < pkg->tinstances.len && err == 0; i++) {
+    err = astencoder_add_ast(astenc, pkg->tinstances.v[i], ASTENCODER_PUB_API);
+    if (err)
+      dlog("astencoder_add_ast: %s", err_str(err));
+  }
+  pkg->tinstances = (nodearray_t){0};
+
   // Register all source files.
   // This is needed since, even though astencoder_add_ast implicitly registers source
   // files for us, it only does so for nodes which are part of the public package API.
@@ -1270,13 +1937,24 @@ err_t pkgbuild_metagen(pkgbuild_t* pb) {
 
   // finalize
   if (!err)
-    err = astencoder_encode(astenc, &outbuf);
+    err = astencoder_encode(astenc, &outbuf, opt_textmeta ? ASTENCODER_TEXT : 0);
   astencoder_free(astenc);
   if (err)
     goto end;
 
-  // write to file
-  err = fs_writefile_mkdirs(filename.p, 0644, buf_slice(outbuf));
+  // write to file.
+  // Write to a temporary file and rename it, since the metafile may be mmap'd
+  // by a package that decodes its API lazily (see pkg_api_member.)
+  str_t tmpname = str_makelen(filename.p, filename.len);
+  if (!str_append(&tmpname, ".tmp")) {
+    err = ErrNoMem;
+  } else if (( err = fs_writefile_mkdirs(tmpname.p, 0644, buf_slice(outbuf)) ) == 0) {
+    if (rename(tmpname.p, filename.p) != 0) {
+      err = err_errno();
+      fs_remove(tmpname.p);
+    }
+  }
+  str_free(tmpname);
 
 end:
   str_free(filename);
@@ -1285,6 +1963,48 @@ end:
 }
 
 
+// pkgbuild_build_pch precompiles the package header (pkg.h) when more than one unit
+// is to be compiled, so that its declarations (and coprelude.h) are only parsed once.
+// Units pick up the PCH by its conventional name (see add_pch_args in compiler.c),
+// so we must also make sure that no stale PCH is left behind when we don't build one.
+// Failure to build the PCH is not an error; units include pkg.h either way.
+static void pkgbuild_build_pch(pkgbuild_t* pb) {
+  pkg_t* pkg = pb->pkgc.pkg;
+  str_t pchfile = {0};
+
+  if (pb->pkgapi.pkg_hfile.len == 0)
+    return;
+  if UNLIKELY(!pkg_buildfile(pkg, pb->c, &pchfile, PKG_PCHFILE_NAME))
+    return;
+  err_t err = fs_remove(pchfile.p);
+  if (err && err != ErrNotFound) {
+    dlog("fs_remove %s: %s", pchfile.p, err_str(err));
+    goto end;
+  }
+
+  u32 ncompile = 0;
+  for (u32 i = 0; i < pkg->srcfiles.len; i++) {
+    srcfile_t* srcfile = pkg->srcfiles.v[i];
+    ncompile += (u32)(srcfile->type == FILE_CO &&
+                      !(pb->cosumv && sha256_iszero(&pb->cosumv[i])));
+  }
+  if (ncompile < 2)
+    goto end;
+
+  if (pb->c->opt_verbose) {
+    pb->bgt->ntotal++;
+    pkgbuild_begintask(pb, "precompile %s", relpath(pb->pkgapi.pkg_hfile.p));
+  }
+  if (( err = compile_c_to_pch(pb->c, pkg->dir.p, pb->pkgapi.pkg_hfile.p, pchfile.p) )) {
+    dlog("compile_c_to_pch: %s", err_str(err));
+    fs_remove(pchfile.p);
+  }
+
+end:
+  str_free(pchfile);
+}
+
+
 err_t pkgbuild_begin_late_compilation(pkgbuild_t* pb) {
   pkg_t* pkg = pb->pkgc.pkg;
 
@@ -1294,12 +2014,19 @@ err_t pkgbuild_begin_late_compilation(pkgbuild_t* pb) {
   err_t err = 0;
   assertf(pb->ofiles.len > 0, "prepare_builddir not called");
 
+  pkgbuild_build_pch(pb);
+
   for (u32 i = 0; i < pkg->srcfiles.len && err == 0; i++) {
     srcfile_t* srcfile = pkg->srcfiles.v[i];
     if (srcfile->type != FILE_CO)
       continue;
     const char* cfile = cfile_of_srcfile_id(pb, i);
     const char* ofile = ofile_of_srcfile_id(pb, i);
+    if (pb->cosumv && sha256_iszero(&pb->cosumv[i])) {
+      // object file is up to date (see pkgbuild_cgen_pkg)
+      pb->bgt->n++;
+      continue;
+    }
     pkgbuild_begintask(pb, "compile %s",
       pb->c->opt_verbose ? relpath(cfile) : srcfile->name.p);
     err = compile_c_source(pb, &pb->promisev[i], cfile, ofile, srcfile->type);
@@ -1315,6 +2042,9 @@ err_t pkgbuild_await_compilation(pkgbuild_t* pb) {
   err_t err = 0;
   for (u32 i = 0; i < pb->pkgc.pkg->srcfiles.len; i++) {
     err_t err1 = promise_await(&pb->promisev[i]);
+    // record fingerprint of successfully compiled .co units
+    if (!err1 && pb->cosumv && !sha256_iszero(&pb->cosumv[i]))
+      err1 = cosum_write(pb, i, &pb->cosumv[i]);
     if (!err)
       err = err1;
   }
@@ -1345,6 +2075,10 @@ static err_t link_exe(pkgbuild_t* pb, const char* outfile) {
   // char libflag[PATH_MAX];
   // snprintf(libflag, sizeof(libflag), "-L%s", c->libdir);
 
+  // wait for libraries of dependencies which are being built in the background
+  if (( err = await_dep_libs(c, pb->pkgc.pkg) ))
+    goto end;
+
   // build list of (unique) dependencies
   if (!deplist_add_deps_of(&deplist, pb->c->ma, pb->pkgc.pkg)) {
     err = ErrNoMem;
@@ -1468,10 +2202,13 @@ err_t pkgbuild_link(pkgbuild_t* pb, const char* outfile) {
   if (( err = fs_mkdirs(dir, 0755, FS_VERBOSE) ))
     return err;
 
+  u64 trace_start = timetrace_begin();
   if (pb->flags & PKGBUILD_EXE) {
     err = link_exe(pb, outfile);
+    timetrace_end(trace_start, "llvm_link", outfile);
   } else {
     err = link_lib_archive(pb, outfile);
+    timetrace_end(trace_start, "llvm_write_archive", outfile);
   }
 
   bgtask_end(pb->bgt, "%s",
@@ -1483,35 +2220,95 @@ err_t pkgbuild_link(pkgbuild_t* pb, const char* outfile) {
 }
 
 
+#define DO_STEP(fn, args...) { \
+  u64 trace_start = timetrace_begin(); \
+  err = fn(pb, ##args); \
+  timetrace_end(trace_start, #fn, pb->pkgc.pkg->path.p); \
+  if (err) { \
+    dlog("%s: %s", #fn, err_str(err)); \
+    goto end; \
+  } \
+}
+
+
+// build_pkg_end completes a package build and disposes of pb (unless
+// PKGBUILD_NOCLEANUP is set.) For dependencies, this resolves pkg->libfut.
+static err_t build_pkg_end(pkgbuild_t* pb, err_t err, bool did_await_compilation) {
+  compiler_t* c = pb->c;
+  pkg_t* pkg = pb->pkgc.pkg;
+  u32 flags = pb->flags;
+
+  if (!did_await_compilation)
+    pkgbuild_await_compilation(pb);
+  // Record source checksums only once the product has been linked, so that a
+  // failed or interrupted build is not mistaken for an up-to-date one.
+  if (!err && (flags & PKGBUILD_NOLINK) == 0 && ( err = pkgbuild_write_srcsums(pb) ))
+    dlog("pkgbuild_write_srcsums: %s", err_str(err));
+  if ((flags & PKGBUILD_NOCLEANUP) == 0) {
+    pkgbuild_dispose(pb);
+    mem_freet(c->ma, pb);
+  }
+  if (flags & PKGBUILD_DEP)
+    future_finalize(&pkg->libfut, err);
+  return err;
+}
+
+
+// build_pkg_lib generates, compiles and links the package's code.
+// This is the part of a package build that importers don't need to wait for.
+static err_t build_pkg_lib(pkgbuild_t* pb, const char* outfile) {
+  err_t err;
+  bool did_await_compilation = false;
+
+  // generate package C code
+  DO_STEP(pkgbuild_cgen_pkg);
+
+  // begin compilation of C source files generated from compis sources
+  DO_STEP(pkgbuild_begin_late_compilation);
+
+  // wait for compilation tasks to finish
+  did_await_compilation = true;
+  DO_STEP(pkgbuild_await_compilation);
+
+  // link exe or library (does nothing if PKGBUILD_NOLINK flag is set)
+  DO_STEP(pkgbuild_link, outfile);
+
+end:
+  return build_pkg_end(pb, err, did_await_compilation);
+}
+
+
+static void build_pkg_lib_async(pkgbuild_t* pb) {
+  // note: the result is communicated via pkg->libfut
+  build_pkg_lib(pb, /*outfile*/"");
+}
+
+
 static err_t build_pkg(
   pkgcell_t pkgc, compiler_t* c, const char* outfile,
   memalloc_t api_ma, u32 pkgbuild_flags)
 {
   err_t err;
-  bool did_await_compilation = false;
 
   if UNLIKELY(compiler_errcount(c) > 0) {
     dlog("%s failing immediately (compiler has encountered errors)", __FUNCTION__);
-    return ErrCanceled;
+    err = ErrCanceled;
+    goto early_end;
   }
 
   vlog("building package \"%s\" (%s)", pkgc.pkg->path.p, pkgc.pkg->dir.p);
 
   // create pkgbuild_t struct
   pkgbuild_t* pb = mem_alloct(c->ma, pkgbuild_t);
-  if (!pb)
-    return ErrNoMem;
+  if (!pb) {
+    err = ErrNoMem;
+    goto early_end;
+  }
   if UNLIKELY(( err = pkgbuild_init(pb, pkgc, c, api_ma, pkgbuild_flags) )) {
     mem_freex(c->ma, MEM(pb, sizeof(pkgbuild_t)));
-    return err;
+    goto early_end;
   }
 
-  #define DO_STEP(fn, args...) \
-    if (( err = fn(pb, ##args) )) { \
-      dlog("%s: %s", #fn, err_str(err)); \
-      goto end; \
-    }
-
   // locate source files
   DO_STEP(pkgbuild_locate_sources);
 
@@ -1536,47 +2333,232 @@ static err_t build_pkg(
   // generate package metadata (can run in parallel to the rest of these tasks)
   DO_STEP(pkgbuild_metagen);
 
-  // generate package C code
-  DO_STEP(pkgbuild_cgen_pkg);
+  // checksum source files, used to check if the package is up to date
+  DO_STEP(pkgbuild_srcsums);
 
-  // begin compilation of C source files generated from compis sources
-  DO_STEP(pkgbuild_begin_late_compilation);
-
-  // wait for compilation tasks to finish
-  did_await_compilation = true;
-  DO_STEP(pkgbuild_await_compilation);
+  // The package's API (metafile and pub.h) is complete at this point, which is all
+  // that importers of a dependency need. Build the library in the background so
+  // that importers can proceed; they wait for pkg->libfut only when linking.
+  if ((pkgbuild_flags & PKGBUILD_DEP) && threadpool_submit(build_pkg_lib_async, pb) == 0)
+    return 0;
 
-  // link exe or library (does nothing if PKGBUILD_NOLINK flag is set)
-  DO_STEP(pkgbuild_link, outfile);
+  return build_pkg_lib(pb, outfile);
 
 end:
-  if (!did_await_compilation)
-    pkgbuild_await_compilation(pb);
-  if ((pkgbuild_flags & PKGBUILD_NOCLEANUP) == 0) {
-    pkgbuild_dispose(pb);
-    mem_freet(c->ma, pb);
+  return build_pkg_end(pb, err, /*did_await_compilation*/false);
+
+early_end:
+  if (pkgbuild_flags & PKGBUILD_DEP)
+    future_finalize(&pkgc.pkg->libfut, err);
+  return err;
+}
+
+#undef DO_STEP
+
+
+// deplist_add_loaded_deps_of is like deplist_add_deps_of but only visits packages
+// which have been successfully loaded
+static bool deplist_add_loaded_deps_of(
+  ptrarray_t* deplist, memalloc_t ma, const pkg_t* pkg)
+{
+  for (u32 i = 0; i < pkg->imports.len; i++) {
+    pkg_t* dep = pkg->imports.v[i];
+    err_t err;
+    if (!future_trywait(&dep->loadfut, &err) || err)
+      continue;
+    bool added;
+    if (!ptrarray_sortedset_addptr(deplist, ma, dep, &added))
+      return false;
+    if (added && !deplist_add_loaded_deps_of(deplist, ma, dep))
+      return false;
   }
-  #undef DO_STEP
+  return true;
+}
+
+
+// await_dep_libs waits for the libraries of pkg's dependencies to be built.
+// Dependencies which have not been loaded are ignored; a build that failed may
+// have stopped before loading all of them.
+static err_t await_dep_libs(compiler_t* c, const pkg_t* pkg) {
+  ptrarray_t deplist = {0}; // pkg_t*[]
+  err_t err = 0;
+  if (!deplist_add_loaded_deps_of(&deplist, c->ma, pkg))
+    err = ErrNoMem;
+  // note: wait for all, even after an error, so that no work is left running
+  for (u32 i = 0; i < deplist.len; i++) {
+    pkg_t* dep = deplist.v[i];
+    err_t err1 = future_wait(&dep->libfut);
+    if (err1 && !err) {
+      dlog("failed to build library of \"%s\": %s", dep->path.p, err_str(err1));
+      err = err1;
+    }
+  }
+  ptrarray_dispose(&deplist, c->ma);
   return err;
 }
 
 
-err_t build_toplevel_pkg(
-  pkg_t* pkg, compiler_t* c, const char* outfile, u32 pkgbuild_flags)
+// build_imported_toplevel_pkg is called when another top-level package imported pkg
+// before we got around to building it, in which case pkg is being loaded (and built,
+// if needed) as a dependency. For a library that's all there is to do.
+// An executable is built from a pkg_t of its own since pkg is shared with importers.
+static err_t build_imported_toplevel_pkg(
+  compiler_t* c, memalloc_t api_ma, pkg_t* pkg, const char* outfile, u32 flags)
+{
+  err_t err = future_wait(&pkg->loadfut);
+  if (!err)
+    err = future_wait(&pkg->libfut);
+  if (err || !pkg_api_lookup(pkg, sym_main))
+    return err;
+
+  pkg_t* exepkg = mem_alloct(c->ma, pkg_t);
+  if (!exepkg)
+    return ErrNoMem;
+  if (( err = pkg_init(exepkg, c->ma) )) {
+    mem_freet(c->ma, exepkg);
+    return err;
+  }
+  exepkg->path = str_makelen(pkg->path.p, pkg->path.len);
+  exepkg->dir = str_makelen(pkg->dir.p, pkg->dir.len);
+  exepkg->root = str_makelen(pkg->root.p, pkg->root.len);
+  exepkg->isadhoc = pkg->isadhoc;
+  if (!exepkg->path.p || !exepkg->dir.p || !exepkg->root.p) {
+    err = ErrNoMem;
+  } else {
+    err = build_pkg((pkgcell_t){NULL,exepkg}, c, outfile, api_ma, flags);
+    err_t err1 = await_dep_libs(c, exepkg);
+    if (!err)
+      err = err1;
+  }
+
+  if ((flags & PKGBUILD_NOCLEANUP) == 0) {
+    pkg_dispose(exepkg, c->ma);
+    mem_freet(c->ma, exepkg);
+  }
+  return err;
+}
+
+
+// build_toplevel_pkg1 builds pkg, which may be imported by other top-level packages
+// built concurrently
+static err_t build_toplevel_pkg1(
+  compiler_t* c, memalloc_t api_ma, pkg_t* pkg, const char* outfile, u32 flags)
+{
+  // Claim pkg for the duration of the build.
+  // Importers of pkg wait for loadfut, as they would for any dependency.
+  if (!future_acquire(&pkg->loadfut))
+    return build_imported_toplevel_pkg(c, api_ma, pkg, outfile, flags);
+
+  err_t err = build_pkg((pkgcell_t){NULL,pkg}, c, outfile, api_ma, flags);
+
+  if (err) {
+    // importers fail along with us
+    safecheckx(future_acquire(&pkg->libfut));
+    future_finalize(&pkg->libfut, err);
+    future_finalize(&pkg->loadfut, err);
+  } else {
+    // Release our claim. If pkg was imported while we were building it, load it as
+    // a dependency on behalf of the importers. That's quick for a library, which is
+    // up to date; an executable has its library built.
+    // load_dependency sets pkg->imported before it tries to acquire loadfut, so
+    // either we see the flag here or the importer sees the released future.
+    future_release(&pkg->loadfut);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (AtomicLoad(&pkg->imported, memory_order_relaxed))
+      load_dependency(c, api_ma, NULL, pkg, /*sync*/true);
+  }
+
+  // make sure that dependencies built in the background have finished
+  err_t err1 = await_dep_libs(c, pkg);
+  if (!err)
+    err = err1;
+
+  return err;
+}
+
+
+typedef struct {
+  compiler_t* c;
+  memalloc_t  api_ma;
+  pkg_t*      pkg;
+  const char* outfile;
+  u32         flags;
+  err_t       err;
+  thrd_t      t;
+  bool        threaded; // running on thread t
+} toplevel_job_t;
+
+
+static void toplevel_job_run(toplevel_job_t* job) {
+  job->err = build_toplevel_pkg1(job->c, job->api_ma, job->pkg, job->outfile, job->flags);
+  if (job->err)
+    dlog("error while building pkg %s: %s", job->pkg->path.p, err_str(job->err));
+}
+
+
+static int toplevel_job_thread(void* arg) {
+  toplevel_job_run(arg);
+  return 0;
+}
+
+
+err_t build_toplevel_pkgs(
+  pkg_t* pkgv, u32 pkgc, compiler_t* c, const char* outfile, u32 pkgbuild_flags)
 {
   assert((pkgbuild_flags & PKGBUILD_DEP) == 0);
+  assert(pkgc > 0);
 
-  // create AST allocator for APIs, AST that needs to outlive any one package build
+  // create AST allocator for APIs, AST that needs to outlive any one package build.
+  // It's shared by all packages so that common dependencies are only loaded once.
   memalloc_t api_ma = memalloc_bump2(/*slabsize*/0, /*flags*/0);
   if (api_ma == memalloc_null()) {
     dlog("OOM: memalloc_bump_in_zeroed");
     return ErrNoMem;
   }
 
-  err_t err = build_pkg((pkgcell_t){NULL,pkg}, c, outfile, api_ma, pkgbuild_flags);
+  err_t err = 0;
+  toplevel_job_t* jobv = mem_alloctv(c->ma, toplevel_job_t, pkgc);
+  if (!jobv) {
+    err = ErrNoMem;
+    goto end;
+  }
 
+  // Each package is built on a thread of its own rather than on the threadpool.
+  // A package build blocks while waiting for its dependencies to load, and those
+  // loads run on the threadpool; with as many top-level packages as there are
+  // pool workers, no worker would be left to load dependencies.
+  for (u32 i = 0; i < pkgc; i++) {
+    toplevel_job_t* job = &jobv[i];
+    job->c = c;
+    job->api_ma = api_ma;
+    job->pkg = &pkgv[i];
+    job->outfile = outfile;
+    job->flags = pkgbuild_flags;
+    job->err = 0;
+    job->threaded = false;
+    // build last package on the current thread to make the most of what we have
+    if (i == pkgc - 1)
+      continue;
+    job->threaded = thrd_create(&job->t, toplevel_job_thread, job) == thrd_success;
+    if (!job->threaded) {
+      dlog("thrd_create failed; building pkg %s serially", job->pkg->path.p);
+      toplevel_job_run(job);
+    }
+  }
+  toplevel_job_run(&jobv[pkgc - 1]);
+
+  // wait for all packages to finish building
+  for (u32 i = 0; i < pkgc; i++) {
+    if (jobv[i].threaded)
+      thrd_join(jobv[i].t, NULL);
+    if (jobv[i].err && !err)
+      err = jobv[i].err;
+  }
+
+  mem_freetv(c->ma, jobv, pkgc);
+
+end:
   if ((pkgbuild_flags & PKGBUILD_NOCLEANUP) == 0)
     memalloc_bump2_dispose(api_ma);
-
   return err;
 }
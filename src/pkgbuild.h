@@ -28,8 +28,12 @@ typedef struct {
   strlist_t     cfiles;   // ".c" file paths, indexed by pkg->file id
   strlist_t     ofiles;   // ".o" file paths, indexed by pkg->file id
   promise_t*    promisev; // one promise for each srcfile, indexed by pkg->file id
+  sha256_t*     cosumv;   // fingerprint of each .co unit, indexed by pkg->file id
+  sha256_t*     srcsumv;  // checksum of each source file, indexed by pkg->file id
   cgen_t        cgen;
   cgen_pkgapi_t pkgapi;
+  irunit_t**    irunitv;  // IR of each unit, indexed like unitv (BACKEND_LLVM only)
+  map_t         irfunm;   // fun_t* => irfun_t* (BACKEND_LLVM only)
 } pkgbuild_t;
 
 
@@ -50,7 +54,20 @@ err_t pkgbuild_await_compilation(pkgbuild_t* pb);
 err_t pkgbuild_link(pkgbuild_t* pb, const char* outfile/*can be empty*/);
 
 // higher-level functionality
-err_t build_toplevel_pkg(
-  pkg_t* pkg, compiler_t* c, const char* outfile, u32 pkgbuild_flags);
+// build_toplevel_pkgs builds packages concurrently.
+// Dependencies, including packages of pkgv imported by others, are loaded once.
+// Packages must have been added to c's pkgindex.
+err_t build_toplevel_pkgs(
+  pkg_t* pkgv, u32 pkgc, compiler_t* c, const char* outfile, u32 pkgbuild_flags);
+
+// pkgbuild_load_api loads the API of pkg and of its dependencies without building
+// anything, on the calling thread, and decodes the API in full rather than on demand.
+// Fails with ErrCanceled if pkg or one of its dependencies would need to be built.
+// Used by the compile server to keep APIs of dependencies in memory between builds.
+err_t pkgbuild_load_api(compiler_t* c, memalloc_t api_ma, pkg_t* pkg);
+
+// pkgbuild_src_uptodate returns true if the sources of pkg, which has been loaded,
+// are unchanged since its products were built (same as when a dependency is loaded.)
+bool pkgbuild_src_uptodate(compiler_t* c, pkg_t* pkg);
 
 ASSUME_NONNULL_END
@@ -4,6 +4,8 @@
 #include "abuf.h"
 #include "unicode.h"
 
+#include <string.h> // memchr
+
 
 static const struct { const char* s; u8 len; tok_t t; } keywordtab[] = {
   #define _(NAME, ...)
@@ -13,17 +15,235 @@ static const struct { const char* s; u8 len; tok_t t; } keywordtab[] = {
   #undef KEYWORD
 };
 
+// keyword_hashtab is a perfect hash table of keywords, mapping keyword_hash of a
+// keyword to its index in keywordtab, plus one (0 means "not a keyword".)
+// scanner_init verifies this table in debug builds.
+static const u8 keyword_hashtab[32] = {
+  [28] = 1,  // const
+  [25] = 2,  // else
+  [17] = 3,  // false
+  [27] = 4,  // for
+  [1]  = 5,  // fun
+  [19] = 6,  // if
+  [2]  = 7,  // import
+  [23] = 8,  // let
+  [8]  = 9,  // mut
+  [11] = 10, // pub
+  [3]  = 11, // return
+  [14] = 12, // true
+  [21] = 13, // type
+  [29] = 14, // var
+};
+
+// keyword_hash requires len >= 2
+inline static u32 keyword_hash(const u8* s, usize len) {
+  return ((u32)s[0] + (u32)s[1] + (u32)len*2) % countof(keyword_hashtab);
+}
+
+
+//—————————————————————————————————————————————————————————————————————————————————————
+// byte scanning
+//
+// The scanner's inner loops skip runs of bytes of some class, e.g. identifier
+// characters. On CPUs with SIMD instructions we classify 16 or 32 bytes at a time.
+// Each vector implementation handles whole vectors and falls back to the scalar
+// implementation for the remaining tail, so all implementations produce the same
+// result. SSE2 is always available on x86_64; AVX2 is selected at runtime.
+// Other architectures use the scalar implementation.
+
+typedef struct bytescan_ {
+  // each function returns a pointer to the first byte in [p,end) which is not
+  // part of the class, or end if all bytes are.
+  const u8* (*ident)(const u8* p, const u8* end); // [0-9A-Za-z_]
+  const u8* (*blank)(const u8* p, const u8* end); // whitespace except LF
+  const u8* (*strchars)(const u8* p, const u8* end); // anything but " \ LF
+  const u8* (*commentchars)(const u8* p, const u8* end); // anything but / LF
+} bytescan_t;
+
+
+static const u8* ident_scalar(const u8* p, const u8* end) {
+  while (p < end && ( isalnum(*p) || *p == '_' ))
+    p++;
+  return p;
+}
+
+static const u8* blank_scalar(const u8* p, const u8* end) {
+  while (p < end && isspace(*p) && *p != '\n')
+    p++;
+  return p;
+}
+
+static const u8* strchars_scalar(const u8* p, const u8* end) {
+  while (p < end && *p != '"' && *p != '\\' && *p != '\n')
+    p++;
+  return p;
+}
+
+static const u8* commentchars_scalar(const u8* p, const u8* end) {
+  while (p < end && *p != '/' && *p != '\n')
+    p++;
+  return p;
+}
+
+static const bytescan_t bytescan_scalar = {
+  ident_scalar, blank_scalar, strchars_scalar, commentchars_scalar };
+
+
+// DEF_BYTESCAN_FN defines a function NAME_ISA which scans VECSIZE bytes at a time.
+// STOPMASK_ISA_NAME(v) returns a bitmask with bits set for bytes which end the
+// scan, (1 << BITS_ISA) bits per byte.
+#define DEF_BYTESCAN_FN(ISA, NAME) \
+  ATTRS_##ISA static const u8* NAME##_##ISA(const u8* p, const u8* end) { \
+    for (; end - p >= VECSIZE_##ISA; p += VECSIZE_##ISA) { \
+      u64 m = STOPMASK_##ISA##_##NAME(LOAD_##ISA(p)); \
+      if (m) \
+        return p + (__builtin_ctzll(m) >> BITS_##ISA); \
+    } \
+    return NAME##_scalar(p, end); \
+  }
+#define DEF_BYTESCAN(ISA) \
+  DEF_BYTESCAN_FN(ISA, ident) \
+  DEF_BYTESCAN_FN(ISA, blank) \
+  DEF_BYTESCAN_FN(ISA, strchars) \
+  DEF_BYTESCAN_FN(ISA, commentchars) \
+  static const bytescan_t bytescan_##ISA = { \
+    ident_##ISA, blank_##ISA, strchars_##ISA, commentchars_##ISA };
+
+
+#if defined(__SSE2__) || defined(__x86_64__)
+  #include <immintrin.h>
+
+  #define ATTRS_sse2
+  #define VECSIZE_sse2 16
+  #define BITS_sse2    0
+  #define LOAD_sse2(p) _mm_loadu_si128((const __m128i*)(p))
+
+  // sse2_inrange returns a mask of bytes b for which lo <= b < lo+n (unsigned)
+  inline static __m128i sse2_inrange(__m128i v, u8 lo, u8 n) {
+    v = _mm_add_epi8(v, _mm_set1_epi8((char)(0x80 - lo)));
+    return _mm_cmplt_epi8(v, _mm_set1_epi8((char)(-128 + n)));
+  }
+  inline static u64 sse2_mask(__m128i m) { return (u64)(u32)_mm_movemask_epi8(m); }
+  inline static __m128i sse2_eq(__m128i v, char c) {
+    return _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+  }
+
+  inline static u64 STOPMASK_sse2_ident(__m128i v) {
+    __m128i m = _mm_or_si128(
+      _mm_or_si128(sse2_inrange(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 26),
+                   sse2_inrange(v, '0', 10)),
+      sse2_eq(v, '_'));
+    return sse2_mask(m) ^ 0xffff;
+  }
+  inline static u64 STOPMASK_sse2_blank(__m128i v) {
+    __m128i m = _mm_or_si128(
+      sse2_eq(v, ' '),
+      _mm_andnot_si128(sse2_eq(v, '\n'), sse2_inrange(v, '\t', 5)));
+    return sse2_mask(m) ^ 0xffff;
+  }
+  inline static u64 STOPMASK_sse2_strchars(__m128i v) {
+    return sse2_mask(_mm_or_si128(
+      _mm_or_si128(sse2_eq(v, '"'), sse2_eq(v, '\\')), sse2_eq(v, '\n')));
+  }
+  inline static u64 STOPMASK_sse2_commentchars(__m128i v) {
+    return sse2_mask(_mm_or_si128(sse2_eq(v, '/'), sse2_eq(v, '\n')));
+  }
+
+  DEF_BYTESCAN(sse2)
+  #define HAS_BYTESCAN_SSE2
+#endif
+
+
+#if defined(__x86_64__) && (defined(__clang__) || defined(__GNUC__))
+  #include <cpuid.h>
+
+  #define ATTRS_avx2   __attribute__((target("avx2")))
+  #define VECSIZE_avx2 32
+  #define BITS_avx2    0
+  #define LOAD_avx2(p) _mm256_loadu_si256((const __m256i*)(p))
+
+  ATTRS_avx2 inline static __m256i avx2_inrange(__m256i v, u8 lo, u8 n) {
+    v = _mm256_add_epi8(v, _mm256_set1_epi8((char)(0x80 - lo)));
+    return _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(-128 + n)), v);
+  }
+  ATTRS_avx2 inline static u64 avx2_mask(__m256i m) {
+    return (u64)(u32)_mm256_movemask_epi8(m);
+  }
+  ATTRS_avx2 inline static __m256i avx2_eq(__m256i v, char c) {
+    return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c));
+  }
+
+  ATTRS_avx2 inline static u64 STOPMASK_avx2_ident(__m256i v) {
+    __m256i m = _mm256_or_si256(
+      _mm256_or_si256(
+        avx2_inrange(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 26),
+        avx2_inrange(v, '0', 10)),
+      avx2_eq(v, '_'));
+    return avx2_mask(m) ^ 0xffffffff;
+  }
+  ATTRS_avx2 inline static u64 STOPMASK_avx2_blank(__m256i v) {
+    __m256i m = _mm256_or_si256(
+      avx2_eq(v, ' '),
+      _mm256_andnot_si256(avx2_eq(v, '\n'), avx2_inrange(v, '\t', 5)));
+    return avx2_mask(m) ^ 0xffffffff;
+  }
+  ATTRS_avx2 inline static u64 STOPMASK_avx2_strchars(__m256i v) {
+    return avx2_mask(_mm256_or_si256(
+      _mm256_or_si256(avx2_eq(v, '"'), avx2_eq(v, '\\')), avx2_eq(v, '\n')));
+  }
+  ATTRS_avx2 inline static u64 STOPMASK_avx2_commentchars(__m256i v) {
+    return avx2_mask(_mm256_or_si256(avx2_eq(v, '/'), avx2_eq(v, '\n')));
+  }
+
+  DEF_BYTESCAN(avx2)
+
+  static bool cpu_has_avx2() {
+    u32 a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d))
+      return false;
+    // OSXSAVE and AVX
+    if ((c & (1u << 27)) == 0 || (c & (1u << 28)) == 0)
+      return false;
+    // OS saves XMM and YMM state
+    u32 xcr0_lo, xcr0_hi;
+    __asm__ volatile ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6)
+      return false;
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+      return false;
+    return (b & (1u << 5)) != 0;
+  }
+  #define HAS_BYTESCAN_AVX2
+#endif
+
+
+static const bytescan_t* bytescan_for_host() {
+  #if defined(HAS_BYTESCAN_AVX2)
+    if (cpu_has_avx2())
+      return &bytescan_avx2;
+  #endif
+  #if defined(HAS_BYTESCAN_SSE2)
+    return &bytescan_sse2;
+  #else
+    return &bytescan_scalar;
+  #endif
+}
+
 
 bool scanner_init(scanner_t* s, compiler_t* c) {
   memset(s, 0, sizeof(*s));
   s->compiler = c;
+  s->bytescan = bytescan_for_host();
   buf_init(&s->litbuf, c->ma);
 
-  // keywordtab must be sorted
+  // keyword_hashtab must match keywordtab
   #if DEBUG
-    for (usize i = 1; i < countof(keywordtab); i++)
-      assertf(strcmp(keywordtab[i-1].s, keywordtab[i].s) < 0,
-        "keywordtab out of order (%s)", keywordtab[i].s);
+    for (usize i = 0; i < countof(keywordtab); i++) {
+      assertf(keywordtab[i].len >= 2, "keyword too short (%s)", keywordtab[i].s);
+      u32 h = keyword_hash((const u8*)keywordtab[i].s, keywordtab[i].len);
+      assertf(keyword_hashtab[h] == i + 1,
+        "keyword_hashtab[%u] should be %zu (%s)", h, i + 1, keywordtab[i].s);
+    }
   #endif
 
   return true;
@@ -541,6 +761,9 @@ static void string(scanner_t* s) {
   buf_clear(&s->litbuf);
 
   while (s->inp < s->inend) {
+    s->inp = s->bytescan->strchars(s->inp, s->inend);
+    if (s->inp == s->inend)
+      break;
     switch (*s->inp) {
       case '\\':
         s->inp++; // eat next byte
@@ -759,39 +982,24 @@ static void identifier_utf8(scanner_t* s) {
 }
 
 
-static void maybe_keyword(scanner_t* s) {
-  // binary search for matching keyword & convert currtok to keyword
-  usize low = 0, high = countof(keywordtab), mid;
-  slice_t lit = scanner_lit(s);
-  int cmp;
+static tok_t keyword_lookup(const u8* s, usize len) {
+  if (len < 2 || len > KEYWORD_MAXLEN)
+    return TID;
+  u32 i = keyword_hashtab[keyword_hash(s, len)];
+  if (i == 0 || keywordtab[--i].len != len || memcmp(s, keywordtab[i].s, len) != 0)
+    return TID;
+  return keywordtab[i].t;
+}
 
-  if (lit.len > KEYWORD_MAXLEN)
-    return;
 
-  while (low < high) {
-    mid = (low + high) / 2;
-    cmp = strncmp(lit.chars, keywordtab[mid].s, lit.len);
-    // dlog("maybe_keyword %.*s <> %s = %d",
-    //  (int)lit.len, lit.chars, keywordtab[mid].s, cmp);
-    if (cmp == 0) {
-      if (lit.len < keywordtab[mid].len) {
-        high = mid;
-      } else {
-        s->tok = keywordtab[mid].t;
-        break;
-      }
-    } else if (cmp < 0) {
-      high = mid;
-    } else {
-      low = mid + 1;
-    }
-  }
+static void maybe_keyword(scanner_t* s) {
+  slice_t lit = scanner_lit(s);
+  s->tok = keyword_lookup(lit.bytes, lit.len);
 }
 
 
 static void identifier(scanner_t* s) {
-  while (s->inp < s->inend && ( isalnum(*s->inp) || *s->inp == '_' ))
-    s->inp++;
+  s->inp = s->bytescan->ident(s->inp, s->inend);
   if (s->inp < s->inend && (u8)*s->inp >= UTF8_SELF)
     return identifier_utf8(s);
   s->tok = TID;
@@ -809,8 +1017,8 @@ static void skip_comment(scanner_t* s) {
   if (c == '/') {
     // line comment "// ... <LF>"
     s->inp += 2;
-    while (s->inp < s->inend && *s->inp != '\n')
-      s->inp++;
+    const u8* lf = memchr(s->inp, '\n', (usize)(s->inend - s->inp));
+    s->inp = lf ? lf : s->inend;
     return;
   }
 
@@ -818,9 +1026,12 @@ static void skip_comment(scanner_t* s) {
   s->inp += 2;
   const u8* startstar = s->inp - 1; // make sure "/*/" != "/**/"
   while (s->inp < s->inend) {
+    s->inp = s->bytescan->commentchars(s->inp, s->inend);
+    if (s->inp == s->inend)
+      break;
     if (*s->inp == '\n') {
       newline(s);
-    } else if (*s->inp == '/' && *(s->inp - 1) == '*' && s->inp - 1 != startstar) {
+    } else if (*(s->inp - 1) == '*' && s->inp - 1 != startstar) {
       s->inp++; // consume '*'
       break;
     }
@@ -1012,11 +1223,12 @@ indent_unwind:
 
   // skip whitespace
   bool is_linestart = s->inp == s->linestart;
-  while (s->inp < s->inend && isspace(*s->inp)) {
-    if (*s->inp == '\n') {
-      is_linestart = true;
-      newline(s);
-    }
+  for (;;) {
+    s->inp = s->bytescan->blank(s->inp, s->inend);
+    if (s->inp == s->inend || *s->inp != '\n')
+      break;
+    is_linestart = true;
+    newline(s);
     s->inp++;
   }
 
@@ -1216,3 +1428,70 @@ void scanner_next(scanner_t* s) {
   }
   #endif
 }
+
+
+#ifdef CO_ENABLE_TESTS
+UNITTEST_DEF(scanner_bytescan) {
+  // all bytescan implementations must produce the same result as the scalar one
+  const bytescan_t* impls[2];
+  u32 nimpls = 0;
+  #if defined(HAS_BYTESCAN_SSE2)
+    impls[nimpls++] = &bytescan_sse2;
+  #endif
+  #if defined(HAS_BYTESCAN_AVX2)
+    if (cpu_has_avx2())
+      impls[nimpls++] = &bytescan_avx2;
+  #endif
+
+  // input with mostly interesting bytes, including ones >=0x80
+  static const u8 alphabet[] = "aZ_09 \t\v\f\r\n\"\\/*#\x80\xff\x1f\x7f`{@[";
+  u8 buf[256];
+  u32 x = 1;
+  for (u32 round = 0; round < 2000; round++) {
+    // runs of a repeated byte make the scans go further than a few bytes
+    for (u32 i = 0; i < sizeof(buf);) {
+      x = x*1103515245 + 12345;
+      u8 c = alphabet[(x >> 8) % (sizeof(alphabet) - 1)];
+      u32 n = 1 + ((x >> 20) % 40);
+      for (; n > 0 && i < sizeof(buf); n--)
+        buf[i++] = c;
+    }
+    const u8* end = buf + sizeof(buf) - (round % 40);
+    for (u32 start = 0; start < 48; start++) {
+      const u8* p = buf + start;
+      for (u32 i = 0; i < nimpls; i++) {
+        assert(impls[i]->ident(p, end) == bytescan_scalar.ident(p, end));
+        assert(impls[i]->blank(p, end) == bytescan_scalar.blank(p, end));
+        assert(impls[i]->strchars(p, end) == bytescan_scalar.strchars(p, end));
+        assert(impls[i]->commentchars(p, end) == bytescan_scalar.commentchars(p, end));
+      }
+    }
+  }
+}
+
+
+// scanner_keyword_lookup checks that keyword_lookup finds every keyword and
+// nothing else, including words which differ from a keyword only slightly.
+// (See "co bench scanner" for throughput.)
+UNITTEST_DEF(scanner_keyword_lookup) {
+  static const char* words[] = {
+    "x", "i", "n", "fo", "if", "in", "va", "var", "vars", "for", "fun", "func",
+    "foo", "let", "len", "mut", "pub", "true", "type", "typ", "types", "else",
+    "elif", "false", "falsy", "const", "constant", "import", "imports", "return",
+    "returns", "buf", "node", "ptr", "count", "result", "scanner", "a_b_c",
+    "int", "u8", "str", "self", "this", "error", "IF", "Type",
+  };
+  for (u32 i = 0; i < countof(keywordtab); i++)
+    assert(keyword_lookup((const u8*)keywordtab[i].s, keywordtab[i].len) == keywordtab[i].t);
+  for (u32 i = 0; i < countof(words); i++) {
+    usize len = strlen(words[i]);
+    tok_t expect = TID;
+    for (u32 j = 0; j < countof(keywordtab); j++) {
+      if (keywordtab[j].len == len && memcmp(keywordtab[j].s, words[i], len) == 0)
+        expect = keywordtab[j].t;
+    }
+    tok_t t = keyword_lookup((const u8*)words[i], len);
+    assertf(t == expect, "%s: %s != %s", words[i], tok_name(t), tok_name(expect));
+  }
+}
+#endif // CO_ENABLE_TESTS
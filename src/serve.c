@@ -0,0 +1,1091 @@
+// compile server ("co serve") and client
+// SPDX-License-Identifier: Apache-2.0
+#include "colib.h"
+#include "path.h"
+#include "compiler.h"
+#include "pkgbuild.h"
+#include "userconfig.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// The compile server is a long-lived process which has performed the process-wide
+// initialization that "co build" normally does on every invocation (symbol & typeid
+// tables, universe, LLVM targets, user config.) It listens on a unix socket and
+// each build request it receives is executed in a fork of the server, which starts
+// out with that state already in place.
+//
+// The server also keeps the APIs of dependency packages loaded between builds.
+// When a build finishes, it reports its compiler configuration and the packages
+// it loaded (see serve_report_build.) The server then loads the APIs of those
+// packages from their metafiles ("pub.coast") into a compiler_t of its own,
+// decoding them in full, without building anything; a package which is not up
+// to date is left for the next build to build. The symbols and typeids these
+// APIs refer to are interned in the server's tables along the way.
+// A build with the same configuration starts out with that compiler_t, its
+// package index already holding the loaded packages (see serve_warm_compiler.)
+//
+// Before each build, every loaded package is checked the same way "co build"
+// checks a dependency: the mtimes of its library and metafile must be what they
+// were when it was loaded and its source files must be unchanged, by mtime or
+// else by content checksum (see pkgbuild_src_uptodate.) Packages which fail the
+// check are dropped along with all packages which import them, directly or not,
+// and are then loaded (and if needed built) by the build like any dependency.
+// The packages a build is asked to build are dropped in the build's process.
+//
+// Running builds in child processes keeps them isolated from each other and from
+// the server: main_build keeps its options in globals, changes the working
+// directory, owns stdio and may exit the process on error, and whatever a build
+// does to the loaded packages (e.g. decoding on demand or code generation) stays
+// in its own copy of the server's memory.
+//
+// "co build" forwards to the server when one is running (see serve_forward.)
+// The client passes its stdin, stdout and stderr along with the request so that
+// the build's output appears as if the client produced it, and then waits for
+// the exit status of the build.
+//
+// A request is declined, making the client build on its own, when the server is
+// not the same compis executable as the client or when their environments differ
+// in a way that affects builds (see serve_envvars.)
+//
+// Wire format:
+//   request  = u32 SERVE_MAGIC, u32 size, u8 payload[size]   (+ 3 fds)
+//   payload  = cstr version, cstr exefile, cstr exemtime, cstr cwd,
+//              cstr env[countof(serve_envvars)], cstr arg ...
+//   response = i32 status  (SERVE_DECLINED if the request was declined)
+
+#define SERVE_MAGIC      0x76736f63u // "cosv"
+#define SERVE_DECLINED   (-1)
+#define SERVE_MAXPAYLOAD (1024*1024)
+#define SERVE_MAXCONN    64
+#define SERVE_SOCKNAME   "serve.sock"
+#define SERVE_REPORTSIZE (1024*1024)
+
+int main_build(int argc, char* argv[]); // build.c
+
+// serve_envvars are environment variables which must be the same in the server
+// and client processes for a request to be accepted
+static const char* serve_envvars[] = {
+  "COROOT", "COPATH", "COCACHE", "COMAXPROC", "COOBJCACHE", "COMPIS_USERCONFIG",
+};
+
+typedef struct {
+  u32 magic;
+  u32 size;
+} serve_hdr_t;
+
+// servereport_t is memory shared between the server and a build, which the build
+// writes its compiler configuration and the packages it loaded to
+typedef struct {
+  u32               size;   // bytes used of data; set last, when the report is complete
+  compiler_config_t config; // target points to static data; buildroot is in data
+  char              data[]; // cstr buildroot, {cstr pkgdir, cstr pkgpath} ...
+} servereport_t;
+
+typedef struct {
+  int         fd;       // connection, or -1 if slot is free
+  pid_t       pid;      // process running the build, or 0 if none
+  int         iofds[3]; // client's stdio, or -1 until received
+  serve_hdr_t hdr;
+  u32         hdrlen;   // number of bytes of hdr received so far
+  u32         len;      // number of bytes of payload received so far
+  char*       payload;  // hdr.size+1 bytes, allocated when hdr is complete
+  servereport_t* nullable report; // SERVE_REPORTSIZE bytes, kept for the slot
+} serveconn_t;
+
+// warmpkg_t is a package loaded by the server
+typedef struct {
+  pkg_t*     pkg;
+  unixtime_t libmtime;  // mtime of the package's library when it was loaded
+  unixtime_t metamtime; // mtime of the package's metafile when it was loaded
+} warmpkg_t;
+
+// server state
+static int         g_lfd = -1; // listening socket
+static unixtime_t  g_exemtime;
+static serveconn_t g_conns[SERVE_MAXCONN];
+
+// packages loaded by the server, inherited by builds
+static struct {
+  bool              ok;       // c has been configured
+  compiler_t        c;
+  compiler_config_t config;   // what c was configured with; buildroot is absolute
+  memalloc_t        api_ma;   // memory of loaded APIs
+  warmpkg_t*        pkgv;     // all packages in c's pkgindex
+  u32               pkgc, pkgcap;
+  u32               ndropped; // packages dropped since c was configured
+} g_warm;
+
+// in a build: where to report to, or NULL when not running as a build of the server
+static servereport_t* g_report = NULL;
+
+// cli options
+static bool opt_help = false;
+static int  opt_verbose = 0;
+static const char* opt_timeout = "";
+
+#define FOREACH_CLI_OPTION(S, SV, L, LV,  DEBUG_L, DEBUG_LV) \
+  /* S( var, ch, name,          descr) */\
+  /* SV(var, ch, name, valname, descr) */\
+  /* L( var,     name,          descr) */\
+  /* LV(var,     name, valname, descr) */\
+  LV(&opt_timeout,     "timeout", "<sec>", "Exit after being idle for <sec> seconds")\
+  S( &opt_verbose,'v', "verbose", "Verbose mode prints extra information")\
+  S( &opt_help,   'h', "help",    "Print help on stdout and exit")\
+// end FOREACH_CLI_OPTION
+
+#include "cliopt.inc.h"
+
+
+static void help(const char* cmdname) {
+  printf(
+    "Runs a compile server which \"%s build\" forwards builds to.\n"
+    "Each build runs in a fork of the server, which keeps the APIs of packages\n"
+    "imported by earlier builds loaded until their files change.\n"
+    "Usage: %s %s [options]\n"
+    "Options:\n"
+    "",
+    coprogname, coprogname, cmdname);
+  cliopt_print();
+  printf(
+    "Environment variables:\n"
+    "  COSERVE  Socket path, or \"off\" to disable. Defaults to $COCACHE/%s\n",
+    SERVE_SOCKNAME);
+  exit(0);
+}
+
+
+// sockpath_get writes the path of the server's socket to buf.
+// Returns false if the compile server is disabled or the path is too long.
+static bool sockpath_get(char* buf, usize bufcap) {
+  const char* s = getenv("COSERVE");
+  if (s && (streq(s, "off") || streq(s, "0")))
+    return false;
+  int n;
+  if (s && *s) {
+    n = snprintf(buf, bufcap, "%s", s);
+  } else {
+    n = snprintf(buf, bufcap, "%s" PATH_SEP_STR SERVE_SOCKNAME, cocachedir);
+  }
+  return n > 0 && (usize)n < bufcap;
+}
+
+
+static bool sockaddr_make(struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  return sockpath_get(addr->sun_path, sizeof(addr->sun_path));
+}
+
+
+static bool write_full(int fd, const void* p, usize size) {
+  while (size > 0) {
+    isize n = write(fd, p, size);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p = (const u8*)p + n;
+    size -= (usize)n;
+  }
+  return true;
+}
+
+
+static bool read_full(int fd, void* p, usize size) {
+  while (size > 0) {
+    isize n = read(fd, p, size);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    if (n == 0)
+      return false;
+    p = (u8*)p + n;
+    size -= (usize)n;
+  }
+  return true;
+}
+
+
+// payload_add_identity appends the parts of the payload which identify the
+// client (or server) process: version, exefile, exemtime, cwd and env
+static bool payload_add_identity(buf_t* buf, const char* cwd, unixtime_t exemtime) {
+  bool ok = buf_append(buf, CO_VERSION_STR, strlen(CO_VERSION_STR) + 1);
+  ok &= buf_append(buf, coexefile, strlen(coexefile) + 1);
+  ok &= buf_printf(buf, "%llu", (unsigned long long)exemtime) && buf_push(buf, 0);
+  ok &= buf_append(buf, cwd, strlen(cwd) + 1);
+  for (usize i = 0; i < countof(serve_envvars); i++) {
+    const char* v = getenv(serve_envvars[i]);
+    v = v ? v : "";
+    ok &= buf_append(buf, v, strlen(v) + 1);
+  }
+  return ok;
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————————
+// client
+
+
+bool serve_forward(int argc, char* argv[], int* statusp) {
+  struct sockaddr_un addr;
+  if (!sockaddr_make(&addr))
+    return false;
+
+  // quick check to avoid creating a socket in the common case of no server
+  struct stat st;
+  if (stat(addr.sun_path, &st) != 0 || !S_ISSOCK(st.st_mode))
+    return false;
+
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd)))
+    return false;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return false;
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    dlog("serve: connect %s: %s", addr.sun_path, strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  bool ok = false;
+  buf_t payload = buf_make(memalloc_ctx());
+  if (!payload_add_identity(&payload, cwd, fs_mtime(coexefile)))
+    goto end;
+  for (int i = 0; i < argc; i++) {
+    if (!buf_append(&payload, argv[i], strlen(argv[i]) + 1))
+      goto end;
+  }
+  if (payload.len > SERVE_MAXPAYLOAD)
+    goto end;
+
+  // make sure anything we've printed so far appears before the build's output
+  fflush(stdout);
+  fflush(stderr);
+
+  // send header along with our stdio file descriptors
+  serve_hdr_t hdr = { .magic = SERVE_MAGIC, .size = (u32)payload.len };
+  int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+  union {
+    char buf[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } cmsgbuf;
+  memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+  struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = cmsgbuf.buf,
+    .msg_controllen = sizeof(cmsgbuf.buf),
+  };
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  isize n;
+  while ((n = sendmsg(fd, &msg, 0)) < 0 && errno == EINTR) {}
+  if (n != (isize)sizeof(hdr) || !write_full(fd, payload.p, payload.len))
+    goto end;
+
+  // wait for the build to finish.
+  // Note that if we are interrupted (e.g. ^C), the server notices the closed
+  // connection and stops the build.
+  i32 status;
+  if (!read_full(fd, &status, sizeof(status))) {
+    elog("%s: lost connection to compile server", coprogname);
+    *statusp = 1;
+    ok = true;
+  } else if (status != SERVE_DECLINED) {
+    dlog("serve: build finished with status %d", status);
+    *statusp = status;
+    ok = true;
+  } else {
+    dlog("serve: request declined by server");
+  }
+
+end:
+  buf_dispose(&payload);
+  close(fd);
+  return ok;
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————————
+// loaded packages
+
+
+static void warm_diaghandler(const diag_t* d, void* nullable userdata) {
+  dlog("serve: %s", d->msg);
+}
+
+
+// warm_config_eq returns true if a compiler configured with a is usable for b.
+// b->buildroot must be absolute. verbose is set per build and is not compared.
+static bool warm_config_eq(const compiler_config_t* a, const compiler_config_t* b) {
+  return streq(a->target->triple, b->target->triple) &&
+         streq(a->target->sysver, b->target->sysver) &&
+         streq(a->buildroot, b->buildroot) &&
+         a->buildmode == b->buildmode &&
+         a->backend == b->backend &&
+         a->nolto == b->nolto &&
+         a->nomain == b->nomain &&
+         a->printast == b->printast &&
+         a->printir == b->printir &&
+         a->genirdot == b->genirdot &&
+         a->genasm == b->genasm &&
+         a->ccfork == b->ccfork &&
+         a->nolibc == b->nolibc &&
+         a->nolibcxx == b->nolibcxx &&
+         a->nostdruntime == b->nostdruntime &&
+         (!b->sysver || !*b->sysver) &&
+         (!b->sysroot || !*b->sysroot);
+}
+
+
+static void warm_reset() {
+  if (!g_warm.ok)
+    return;
+  compiler_dispose(&g_warm.c);
+  memalloc_bump2_dispose(g_warm.api_ma);
+  free(g_warm.pkgv);
+  memset(&g_warm, 0, sizeof(g_warm));
+}
+
+
+static bool warm_init(const compiler_config_t* config) {
+  compiler_config_t cfg = *config;
+  cfg.verbose = 0;
+  cfg.sysver = NULL;
+  cfg.sysroot = NULL;
+
+  compiler_init(&g_warm.c, memalloc_ctx(), &warm_diaghandler);
+  err_t err = compiler_configure(&g_warm.c, &cfg);
+  if (!err && ( g_warm.api_ma = memalloc_bump2(/*slabsize*/0, /*flags*/0) ) ==
+              memalloc_null())
+  {
+    err = ErrNoMem;
+  }
+  if (err) {
+    dlog("serve: compiler_configure: %s", err_str(err));
+    compiler_dispose(&g_warm.c);
+    memset(&g_warm, 0, sizeof(g_warm));
+    return false;
+  }
+
+  g_warm.config = cfg;
+  g_warm.config.buildroot = g_warm.c.buildroot;
+  g_warm.ok = true;
+  return true;
+}
+
+
+// warm_stamp gets the mtimes of pkg's library and metafile (0 if missing)
+static void warm_stamp(const pkg_t* pkg, unixtime_t* libmtime, unixtime_t* metamtime) {
+  str_t libfile = {0}, metafile = {0};
+  *libmtime = pkg_libfile(pkg, &g_warm.c, &libfile) ? fs_mtime(libfile.p) : 0;
+  *metamtime = pkg_buildfile(pkg, &g_warm.c, &metafile, PKG_METAFILE_NAME) ?
+               fs_mtime(metafile.p) : 0;
+  str_free(libfile);
+  str_free(metafile);
+}
+
+
+static u32 warm_indexof(const pkg_t* pkg) {
+  for (u32 i = 0; i < g_warm.pkgc; i++) {
+    if (g_warm.pkgv[i].pkg == pkg)
+      return i;
+  }
+  return U32_MAX;
+}
+
+
+// warm_drop removes the packages in drop from the package index, along with all
+// packages which import them, directly or indirectly.
+// Dropped packages are not freed since other dropped packages may refer to them;
+// their memory is reclaimed by warm_reset.
+static void warm_drop(ptrarray_t* drop) {
+  compiler_t* c = &g_warm.c;
+
+  for (bool changed = true; changed; ) {
+    changed = false;
+    for (u32 i = 0; i < g_warm.pkgc; i++) {
+      pkg_t* pkg = g_warm.pkgv[i].pkg;
+      if (ptrarray_rindexof(drop, pkg) != U32_MAX)
+        continue;
+      for (u32 j = 0; j < pkg->imports.len; j++) {
+        if (ptrarray_rindexof(drop, pkg->imports.v[j]) != U32_MAX) {
+          safecheckx(ptrarray_push(drop, memalloc_ctx(), pkg));
+          changed = true;
+          break;
+        }
+      }
+    }
+  }
+
+  for (u32 i = 0; i < drop->len; i++) {
+    pkg_t* pkg = drop->v[i];
+    dlog("serve: dropping package %s", pkg->path.p);
+    map_del(&c->pkgindex, pkg->dir.p, pkg->dir.len);
+    if (c->stdruntime_pkg == pkg)
+      c->stdruntime_pkg = NULL;
+    u32 index = warm_indexof(pkg);
+    if (index != U32_MAX)
+      g_warm.pkgv[index] = g_warm.pkgv[--g_warm.pkgc];
+    g_warm.ndropped++;
+  }
+}
+
+
+// warm_check drops loaded packages which have changed since they were loaded.
+// Called by the server before starting a build.
+static void warm_check() {
+  if (!g_warm.ok)
+    return;
+
+  ptrarray_t drop = {0};
+  for (u32 i = 0; i < g_warm.pkgc; i++) {
+    warmpkg_t* wp = &g_warm.pkgv[i];
+    unixtime_t libmtime, metamtime;
+    warm_stamp(wp->pkg, &libmtime, &metamtime);
+    if (libmtime != wp->libmtime || metamtime != wp->metamtime ||
+        !pkgbuild_src_uptodate(&g_warm.c, wp->pkg))
+    {
+      safecheckx(ptrarray_push(&drop, memalloc_ctx(), wp->pkg));
+    }
+  }
+  if (drop.len > 0)
+    warm_drop(&drop);
+  ptrarray_dispose(&drop, memalloc_ctx());
+
+  // start over when more memory is held by dropped packages than by loaded ones
+  if (g_warm.ndropped > g_warm.pkgc) {
+    vlog("unloading all packages");
+    warm_reset();
+  }
+}
+
+
+// warm_load loads the API of a package reported by a build
+static void warm_load(const char* dir, const char* path) {
+  slice_t pkgdir = slice_cstr(dir);
+  slice_t pkgpath = slice_cstr(path);
+
+  // the package may have been removed since the build
+  if (pkgdir.len <= pkgpath.len || !path_isabs(dir) || !fs_isdir(dir))
+    return;
+
+  pkg_t* pkg;
+  err_t err = pkgindex_intern(&g_warm.c, pkgdir, pkgpath, /*api_sha256*/NULL, &pkg);
+  if (!err)
+    err = pkgbuild_load_api(&g_warm.c, g_warm.api_ma, pkg);
+  if (err)
+    dlog("serve: not loading package %s: %s", path, err_str(err));
+}
+
+
+// warm_up loads the packages reported by a build which just finished
+static void warm_up(servereport_t* nullable r) {
+  if (!r || r->size == 0 || r->size > SERVE_REPORTSIZE - sizeof(*r))
+    return;
+
+  const char* p = r->data;
+  const char* end = r->data + r->size;
+  compiler_config_t config = r->config;
+  config.buildroot = p;
+  p += strlen(p) + 1;
+
+  if (g_warm.ok && !warm_config_eq(&g_warm.config, &config)) {
+    vlog("build configuration changed; unloading all packages");
+    warm_reset();
+  }
+  if (!g_warm.ok && !warm_init(&config))
+    return;
+
+  u64 start = nanotime();
+  while (p < end) {
+    const char* dir = p;
+    p += strlen(p) + 1;
+    if (p >= end)
+      break;
+    const char* path = p;
+    p += strlen(p) + 1;
+    warm_load(dir, path);
+  }
+
+  // Track all packages which are now in the index, including dependencies of the
+  // reported ones. Packages which failed to load are dropped; the next build will
+  // load (or build) them.
+  ptrarray_t drop = {0};
+  compiler_t* c = &g_warm.c;
+  for (const mapent_t* e = map_it(&c->pkgindex); map_itnext(&c->pkgindex, &e); ) {
+    pkg_t* pkg = e->value;
+    if (warm_indexof(pkg) != U32_MAX)
+      continue;
+    err_t err;
+    if (!future_trywait(&pkg->loadfut, &err) || err) {
+      safecheckx(ptrarray_push(&drop, memalloc_ctx(), pkg));
+      continue;
+    }
+    if (g_warm.pkgc == g_warm.pkgcap) {
+      u32 cap = MAX(16u, g_warm.pkgcap * 2);
+      warmpkg_t* v = realloc(g_warm.pkgv, sizeof(warmpkg_t) * cap);
+      if (!v) {
+        safecheckx(ptrarray_push(&drop, memalloc_ctx(), pkg));
+        continue;
+      }
+      g_warm.pkgv = v;
+      g_warm.pkgcap = cap;
+    }
+    warmpkg_t* wp = &g_warm.pkgv[g_warm.pkgc++];
+    wp->pkg = pkg;
+    warm_stamp(pkg, &wp->libmtime, &wp->metamtime);
+  }
+  if (drop.len > 0)
+    warm_drop(&drop);
+  ptrarray_dispose(&drop, memalloc_ctx());
+
+  char duration[25];
+  fmtduration(duration, nanotime() - start);
+  vlog("%u package%s loaded (%s)",
+    g_warm.pkgc, g_warm.pkgc == 1 ? "" : "s", duration);
+}
+
+
+compiler_t* nullable serve_warm_compiler(
+  const compiler_config_t* ccfg, diaghandler_t dh, pkg_t* pkgv, u32 pkgc)
+{
+  if (!g_warm.ok)
+    return NULL;
+
+  compiler_config_t config = *ccfg;
+  str_t buildroot = path_abs(ccfg->buildroot);
+  config.buildroot = buildroot.p ? buildroot.p : "";
+  bool ok = warm_config_eq(&g_warm.config, &config);
+  str_free(buildroot);
+  if (!ok)
+    return NULL;
+
+  compiler_t* c = &g_warm.c;
+
+  // Packages to be built are not used from the server. Cached packages which import
+  // them must be checked against the API they're about to get, so drop those too.
+  ptrarray_t drop = {0};
+  for (u32 i = 0; i < pkgc; i++) {
+    void** vp = map_lookup(&c->pkgindex, pkgv[i].dir.p, pkgv[i].dir.len);
+    if (vp)
+      safecheckx(ptrarray_push(&drop, memalloc_ctx(), *vp));
+  }
+  if (drop.len > 0)
+    warm_drop(&drop);
+  ptrarray_dispose(&drop, memalloc_ctx());
+
+  c->diaghandler = dh;
+  c->opt_verbose = ccfg->verbose;
+  c->uconf = userconfig_for_target(&c->target);
+  dlog("serve: using %u loaded package%s", g_warm.pkgc, g_warm.pkgc == 1 ? "" : "s");
+  return c;
+}
+
+
+static bool report_add(char** pp, const char* end, const char* s) {
+  usize size = strlen(s) + 1;
+  if ((usize)(end - *pp) < size)
+    return false;
+  memcpy(*pp, s, size);
+  *pp += size;
+  return true;
+}
+
+
+void serve_report_build(
+  compiler_t* c, const compiler_config_t* ccfg, const pkg_t* pkgv, u32 pkgc)
+{
+  servereport_t* r = g_report;
+  if (!r)
+    return;
+
+  char* p = r->data;
+  const char* end = (const char*)r + SERVE_REPORTSIZE;
+  r->config = *ccfg;
+  r->config.buildroot = NULL;
+  if (!report_add(&p, end, c->buildroot))
+    return;
+
+  // report the packages which were loaded, except those which were built as requested
+  rwmutex_rlock(&c->pkgindex_mu);
+  for (const mapent_t* e = map_it(&c->pkgindex); map_itnext(&c->pkgindex, &e); ) {
+    pkg_t* pkg = e->value;
+    err_t err;
+    if ((pkg >= pkgv && pkg < pkgv + pkgc) ||
+        !future_trywait(&pkg->loadfut, &err) || err)
+    {
+      continue;
+    }
+    char* pkgstart = p;
+    if (!report_add(&p, end, pkg->dir.p) || !report_add(&p, end, pkg->path.p)) {
+      p = pkgstart;
+      break;
+    }
+  }
+  rwmutex_runlock(&c->pkgindex_mu);
+
+  r->size = (u32)(p - r->data);
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————————
+// server
+
+
+static void reset_getopt() {
+  #if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+      defined(__NetBSD__)
+    optreset = 1;
+    optind = 1;
+  #else
+    optind = 0; // glibc & musl: 0 forces full reinitialization
+  #endif
+}
+
+
+// run_build runs in the child process, never returns
+static _Noreturn void run_build(
+  int iofds[3], servereport_t* nullable report, char* cwd, int argc, char** argv)
+{
+  // restore default signal dispositions changed by the server
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGPIPE, SIG_DFL);
+
+  // put the build in its own process group so that it can be stopped as a whole
+  setpgid(0, 0);
+
+  for (int i = 0; i < 3; i++) {
+    if (dup2(iofds[i], i) < 0)
+      _exit(1);
+  }
+
+  // close the listening socket, client connections (the server keeps track
+  // of the client, not the build) and the stdio of this and other clients
+  close(g_lfd);
+  for (u32 i = 0; i < SERVE_MAXCONN; i++) {
+    if (g_conns[i].fd < 0)
+      continue;
+    close(g_conns[i].fd);
+    for (int j = 0; j < 3; j++) {
+      if (g_conns[i].iofds[j] > STDERR_FILENO)
+        close(g_conns[i].iofds[j]);
+    }
+  }
+
+  if (chdir(cwd) != 0) {
+    warn("chdir %s", cwd);
+    _exit(1);
+  }
+  relpath_init();
+
+  // the server's own command-line state must not leak into the build
+  coverbose = 0;
+  g_report = report;
+  userconfig_load(argc, argv);
+  reset_getopt();
+
+  int status = main_build(argc, argv);
+  fflush(stdout);
+  fflush(stderr);
+  exit(status);
+}
+
+
+static void conn_init(serveconn_t* conn, int fd) {
+  servereport_t* report = conn->report;
+  memset(conn, 0, sizeof(*conn));
+  conn->fd = fd;
+  conn->report = report;
+  for (int i = 0; i < 3; i++)
+    conn->iofds[i] = -1;
+}
+
+
+// conn_release frees the request state of conn (but keeps the connection open)
+static void conn_release(serveconn_t* conn) {
+  for (int i = 0; i < 3; i++) {
+    if (conn->iofds[i] > -1)
+      close(conn->iofds[i]);
+    conn->iofds[i] = -1;
+  }
+  free(conn->payload);
+  conn->payload = NULL;
+}
+
+
+static void conn_close(serveconn_t* conn) {
+  conn_release(conn);
+  close(conn->fd);
+  conn->fd = -1;
+  conn->pid = 0;
+}
+
+
+static void conn_reply(serveconn_t* conn, i32 status) {
+  // note: we ignore errors here; the client may have gone away
+  write_full(conn->fd, &status, sizeof(status));
+  conn_close(conn);
+}
+
+
+static bool identity_matches(const char* payload, usize len, const char* cwd) {
+  bool ok = false;
+  buf_t ours = buf_make(memalloc_ctx());
+  if (payload_add_identity(&ours, cwd, g_exemtime))
+    ok = ours.len <= len && memcmp(ours.p, payload, ours.len) == 0;
+  buf_dispose(&ours);
+  return ok;
+}
+
+
+// conn_start starts a build for the request which has been read into conn
+static void conn_start(serveconn_t* conn) {
+  char* payload = conn->payload;
+  usize size = (usize)conn->hdr.size;
+  payload[size] = 0;
+
+  // split payload into strings
+  char* strv[4 + countof(serve_envvars) + 256];
+  u32 strc = 0;
+  for (char* p = payload; p < payload + size; p += strlen(p) + 1) {
+    if (strc == countof(strv) - 1)
+      goto fail;
+    strv[strc++] = p;
+  }
+  u32 argstart = 4 + countof(serve_envvars);
+  if (strc <= argstart)
+    goto fail;
+  strv[strc] = NULL;
+  char* cwd = strv[3];
+  char** argv = &strv[argstart];
+  int argc = (int)(strc - argstart);
+
+  // decline if the client isn't running the same executable in a similar
+  // environment, or if our executable has been replaced since we started
+  if (fs_mtime(coexefile) != g_exemtime) {
+    vlog("compis executable changed; declining request");
+    conn_reply(conn, SERVE_DECLINED);
+    return;
+  }
+  if (!identity_matches(payload, size, cwd)) {
+    vlog("client environment differs; declining request");
+    conn_reply(conn, SERVE_DECLINED);
+    return;
+  }
+
+  vlog("build %s (in %s)", argc > 1 ? argv[1] : ".", relpath(cwd));
+
+  // drop loaded packages which have changed since they were loaded
+  warm_check();
+
+  // map memory for the build to report what it loaded.
+  // Without it, the build still runs but the server won't load anything for it.
+  if (!conn->report) {
+    void* p = mmap(NULL, SERVE_REPORTSIZE, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANON, -1, 0);
+    if (p == MAP_FAILED) {
+      warn("mmap");
+    } else {
+      conn->report = p;
+    }
+  }
+  if (conn->report)
+    conn->report->size = 0;
+
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid == 0)
+    run_build(conn->iofds, conn->report, cwd, argc, argv);
+  if (pid < 0) {
+    warn("fork");
+    conn_reply(conn, SERVE_DECLINED);
+    return;
+  }
+  setpgid(pid, pid); // also done by the child; whichever comes first
+  conn->pid = pid;
+  conn_release(conn);
+  return;
+
+fail:
+  dlog("serve: invalid request");
+  conn_close(conn);
+}
+
+
+// conn_read_hdr reads the request header and file descriptors.
+// Returns false if the connection failed or the header is invalid.
+static bool conn_read_hdr(serveconn_t* conn) {
+  isize n;
+  if (conn->hdrlen == 0) {
+    // file descriptors arrive along with the first byte of the header
+    union {
+      char buf[CMSG_SPACE(sizeof(conn->iofds))];
+      struct cmsghdr align;
+    } cmsgbuf;
+    struct iovec iov = { .iov_base = &conn->hdr, .iov_len = sizeof(conn->hdr) };
+    struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = cmsgbuf.buf,
+      .msg_controllen = sizeof(cmsgbuf.buf),
+    };
+    while ((n = recvmsg(conn->fd, &msg, 0)) < 0 && errno == EINTR) {}
+    struct cmsghdr* cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(conn->iofds)))
+    {
+      memcpy(conn->iofds, CMSG_DATA(cmsg), sizeof(conn->iofds));
+    }
+    if (n > 0 && (conn->iofds[0] < 0 || (msg.msg_flags & MSG_CTRUNC)))
+      return false;
+  } else {
+    u8* p = (u8*)&conn->hdr + conn->hdrlen;
+    while ((n = read(conn->fd, p, sizeof(conn->hdr) - conn->hdrlen)) < 0 &&
+           errno == EINTR) {}
+  }
+  if (n < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+  if (n == 0)
+    return false;
+  conn->hdrlen += (u32)n;
+  if (conn->hdrlen < sizeof(conn->hdr))
+    return true;
+
+  if (conn->hdr.magic != SERVE_MAGIC || conn->hdr.size > SERVE_MAXPAYLOAD)
+    return false;
+  return (conn->payload = malloc((usize)conn->hdr.size + 1)) != NULL;
+}
+
+
+// conn_read reads whatever part of a request is available on conn without
+// blocking, and starts a build once the complete request has been received
+static void conn_read(serveconn_t* conn) {
+  if (conn->hdrlen < sizeof(conn->hdr)) {
+    if (!conn_read_hdr(conn)) {
+      dlog("serve: invalid request");
+      conn_close(conn);
+      return;
+    }
+    if (conn->hdrlen < sizeof(conn->hdr))
+      return;
+  }
+
+  while (conn->len < conn->hdr.size) {
+    isize n = read(conn->fd, conn->payload + conn->len, conn->hdr.size - conn->len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+    }
+    if (n <= 0) {
+      conn_close(conn);
+      return;
+    }
+    conn->len += (u32)n;
+  }
+
+  conn_start(conn);
+}
+
+
+// reap_children collects the exit status of finished builds
+static void reap_children() {
+  int wstatus;
+  pid_t pid;
+  while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+    for (u32 i = 0; i < SERVE_MAXCONN; i++) {
+      if (g_conns[i].pid != pid)
+        continue;
+      i32 status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) :
+                   WIFSIGNALED(wstatus) ? 128 + WTERMSIG(wstatus) :
+                   1;
+      conn_reply(&g_conns[i], status);
+      // note: a build which fails (e.g. on a compile error) still loads packages
+      warm_up(g_conns[i].report);
+      break;
+    }
+  }
+}
+
+
+static void on_sigchld(int sig) {
+  // nothing to do; we're just interrupting poll
+}
+
+
+static int listen_on(const struct sockaddr_un* addr) {
+  // check if another server is already running
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr*)addr, sizeof(*addr)) == 0) {
+    close(fd);
+    elog("%s: a compile server is already running (%s)",
+      coprogname, relpath(addr->sun_path));
+    return -1;
+  }
+  close(fd);
+
+  // remove stale socket file of a server that's no longer running
+  unlink(addr->sun_path);
+
+  char* dir = path_dir_alloca(addr->sun_path);
+  err_t err = fs_mkdirs(dir, 0755, 0);
+  if (err && err != ErrExists) {
+    elog("%s: %s", dir, err_str(err));
+    return -1;
+  }
+
+  if (( fd = socket(AF_UNIX, SOCK_STREAM, 0) ) < 0)
+    return -1;
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  mode_t umask_prev = umask(0077); // only the current user may connect
+  int r = bind(fd, (struct sockaddr*)addr, sizeof(*addr));
+  umask(umask_prev);
+  if (r != 0 || listen(fd, SERVE_MAXCONN) != 0) {
+    warn("%s", addr->sun_path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+int serve_main(int argc, char* argv[]) {
+  if (!cliopt_parse(&argc, &argv, help))
+    return 1;
+
+  coverbose = MAX(coverbose, (u8)opt_verbose);
+
+  int timeout_ms = -1;
+  if (*opt_timeout) {
+    char* end;
+    unsigned long n = strtoul(opt_timeout, &end, 10);
+    if (*end || n > I32_MAX / 1000)
+      errx(1, "invalid value for --timeout: %s", opt_timeout);
+    timeout_ms = n ? (int)n * 1000 : -1;
+  }
+
+  struct sockaddr_un addr;
+  if (!sockaddr_make(&addr))
+    errx(1, "compile server is disabled (COSERVE=%s)", getenv("COSERVE"));
+
+  g_exemtime = fs_mtime(coexefile);
+  for (u32 i = 0; i < SERVE_MAXCONN; i++)
+    g_conns[i].fd = -1;
+
+  int lfd = g_lfd = listen_on(&addr);
+  if (lfd < 0)
+    return 1;
+
+  // we want to be interrupted by SIGCHLD (i.e. no SA_RESTART)
+  struct sigaction sa = { .sa_handler = on_sigchld };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGCHLD, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  vlog("listening on %s", relpath(addr.sun_path));
+
+  struct pollfd pfdv[SERVE_MAXCONN + 1];
+  serveconn_t* pconnv[SERVE_MAXCONN + 1];
+  for (;;) {
+    reap_children();
+
+    // stop if the executable has been replaced (e.g. upgraded or rebuilt)
+    if (fs_mtime(coexefile) != g_exemtime) {
+      vlog("compis executable changed; exiting");
+      break;
+    }
+
+    u32 nfds = 0, nactive = 0;
+    pfdv[nfds++] = (struct pollfd){ .fd = lfd, .events = POLLIN };
+    for (u32 i = 0; i < SERVE_MAXCONN; i++) {
+      if (g_conns[i].fd < 0)
+        continue;
+      nactive++;
+      pconnv[nfds] = &g_conns[i];
+      pfdv[nfds++] = (struct pollfd){ .fd = g_conns[i].fd, .events = POLLIN };
+    }
+
+    // when there are builds running, wake up now and then to check on them,
+    // in case SIGCHLD arrived just before we started polling
+    int n = poll(pfdv, nfds, nactive ? 1000 : timeout_ms);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      warn("poll");
+      break;
+    }
+    if (n == 0 && nactive == 0) {
+      vlog("idle timeout; exiting");
+      break;
+    }
+
+    for (u32 i = 1; i < nfds; i++) {
+      if (pfdv[i].revents == 0)
+        continue;
+      serveconn_t* conn = pconnv[i];
+      if (conn->pid == 0) {
+        conn_read(conn);
+      } else {
+        // client went away (it doesn't send anything while waiting); stop its build
+        vlog("client disconnected; stopping build [%d]", (int)conn->pid);
+        kill(-conn->pid, SIGTERM);
+        conn_close(conn); // reap_children will collect the process later
+        // the build may still write its report; don't give that memory to another
+        if (conn->report) {
+          munmap(conn->report, SERVE_REPORTSIZE);
+          conn->report = NULL;
+        }
+      }
+    }
+
+    if (pfdv[0].revents & POLLIN) {
+      int fd = accept(lfd, NULL, NULL);
+      if (fd < 0)
+        continue;
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      u32 i = 0;
+      while (i < SERVE_MAXCONN && g_conns[i].fd > -1)
+        i++;
+      if (i == SERVE_MAXCONN) {
+        i32 status = SERVE_DECLINED;
+        write_full(fd, &status, sizeof(status));
+        close(fd);
+        continue;
+      }
+      conn_init(&g_conns[i], fd);
+    }
+  }
+
+  close(lfd);
+  unlink(addr.sun_path);
+  return 0;
+}
@@ -99,3 +99,21 @@ void srcfile_close(srcfile_t* sf) {
   }
   sf->data = NULL;
 }
+
+
+err_t srcfile_sha256(srcfile_t* sf, sha256_t* result) {
+  bool was_open = sf->data != NULL;
+  err_t err = srcfile_open(sf);
+  if UNLIKELY(err) {
+    // mmap fails for empty files, which we treat as empty input
+    if (sf->size == 0 && err == ErrInvalid) {
+      sha256_data(result, "", 0);
+      return 0;
+    }
+    return err;
+  }
+  sha256_data(result, sf->data, sf->size);
+  if (!was_open)
+    srcfile_close(sf);
+  return 0;
+}
@@ -4,6 +4,7 @@
 #pragma once
 #include "str.h"
 #include "array.h"
+#include "sha256.h"
 ASSUME_NONNULL_BEGIN
 
 typedef u8 filetype_t;
@@ -30,6 +31,9 @@ typedef struct srcfile_ {
 err_t srcfile_open(srcfile_t* sf);
 void srcfile_close(srcfile_t* sf);
 void srcfile_dispose(srcfile_t* sf);
+// srcfile_sha256 computes the SHA-256 checksum of the file's contents.
+// The file is opened and closed as needed; an already-open srcfile stays open.
+err_t srcfile_sha256(srcfile_t* sf, sha256_t* result);
 srcfile_t* nullable srcfilearray_add(
   ptrarray_t* srcfiles, const char* name, usize namelen, bool* nullable addedp);
 void srcfilearray_dispose(ptrarray_t* srcfiles);
@@ -1,6 +1,9 @@
 // SPDX-License-Identifier: Apache-2.0
 #include "colib.h"
 #include "subproc.h"
+#include "thread.h"
+#include "threadpool.h"
+#include "timetrace.h"
 
 // enable posix_spawn_file_actions_addchdir_np
 #if defined(__APPLE__) || defined(__linux__)
@@ -109,14 +112,121 @@
 
 void subproc_open(subproc_t* p, pid_t pid) {
   assert(p->pid == 0);
+  jobtoken_t token = p->token; // acquired by subprocs_alloc
   memset(p, 0, sizeof(*p));
   p->pid = pid;
+  p->token = token;
+  p->trace_start = timetrace_begin();
 }
 
 
 void subproc_close(subproc_t* p) {
   assert(p->pid != 0);
   p->pid = 0;
+  jobserver_release(&p->token);
+}
+
+
+struct subproc_thread_ {
+  _Atomic(u32)   claimed; // set by whoever runs fn (a pool thread or the awaiter)
+  _Atomic(u32)   refcount;
+  sema_t         done;
+  err_t          err;
+  subproc_fork_t fn;
+  uintptr        args[6];
+};
+
+
+static void subproc_thread_release(subproc_thread_t* t) {
+  if (AtomicSub(&t->refcount, 1, memory_order_acq_rel) > 1)
+    return;
+  sema_dispose(&t->done);
+  mem_freet(memalloc_default(), t);
+}
+
+
+static bool subproc_thread_claim(subproc_thread_t* t) {
+  u32 expect = 0;
+  return AtomicCASAcqRel(&t->claimed, &expect, 1);
+}
+
+
+static err_t subproc_thread_call(subproc_thread_t* t) {
+  uintptr* a = t->args;
+  return t->fn(a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+
+static void subproc_thread_run(subproc_thread_t* t) {
+  if (subproc_thread_claim(t)) {
+    t->err = subproc_thread_call(t);
+    sema_signal(&t->done, 1);
+  }
+  subproc_thread_release(t);
+}
+
+
+static err_t subproc_thread_await(subproc_t* p) {
+  subproc_thread_t* t = assertnotnull(p->thread);
+  if (subproc_thread_claim(t)) {
+    // job has not started yet; run it here instead of waiting for a pool thread,
+    // which also avoids deadlock when the pool is saturated with awaiters.
+    trace("thread[%p] running on awaiter", t);
+    p->err = subproc_thread_call(t);
+  } else {
+    sema_wait(&t->done);
+    p->err = t->err;
+  }
+  trace("thread[%p] done (%s)", t, p->err ? err_str(p->err) : "ok");
+  subproc_thread_release(t);
+  p->thread = NULL;
+  subproc_close(p);
+  return p->err;
+}
+
+
+static void subproc_thread_cancel(subproc_t* p) {
+  subproc_thread_t* t = assertnotnull(p->thread);
+  // we can't interrupt a thread; prevent the job from starting or wait for it
+  if (!subproc_thread_claim(t))
+    sema_wait(&t->done);
+  subproc_thread_release(t);
+  p->thread = NULL;
+  subproc_close(p);
+}
+
+
+err_t _subproc_thread(
+  subproc_t* p,
+  subproc_fork_t fn,
+  uintptr a, uintptr b, uintptr c, uintptr d, uintptr e, uintptr f)
+{
+  if (comaxproc < 2)
+    return ErrNotSupported;
+
+  subproc_thread_t* t = mem_alloct(memalloc_default(), subproc_thread_t);
+  if (!t)
+    return ErrNoMem;
+  err_t err = sema_init(&t->done, 0);
+  if (err) {
+    mem_freet(memalloc_default(), t);
+    return err;
+  }
+  t->fn = fn;
+  t->args[0] = a; t->args[1] = b; t->args[2] = c;
+  t->args[3] = d; t->args[4] = e; t->args[5] = f;
+  t->refcount = 2; // one for the pool job, one for the awaiter
+
+  if (( err = threadpool_submit(subproc_thread_run, t) )) {
+    sema_dispose(&t->done);
+    mem_freet(memalloc_default(), t);
+    return err;
+  }
+
+  trace("thread[%p] submitted", t);
+  subproc_open(p, SUBPROC_THREAD_PID);
+  p->thread = t;
+  return 0;
 }
 
 
@@ -124,6 +234,9 @@ err_t subproc_await(subproc_t* p) {
   if (p->pid == 0)
     return ErrCanceled;
 
+  if (p->pid == SUBPROC_THREAD_PID)
+    return subproc_thread_await(p);
+
   if (p->err) {
     subproc_close(p);
     return p->err;
@@ -184,6 +297,9 @@ err_t subproc_await(subproc_t* p) {
     }
   #endif
 
+  // note: end time is when we reaped the process, which may be after it exited
+  timetrace_subproc(p->trace_start, "subprocess", (long)p->pid);
+
   subproc_close(p);
   return p->err;
 }
@@ -348,8 +464,13 @@ err_t _subproc_fork(
 
 void subprocs_cancel(subprocs_t* sp) {
   for (u32 i = 0; i < sp->cap; i++) {
-    if (sp->procs[i].pid)
+    if (sp->procs[i].pid == SUBPROC_THREAD_PID) {
+      subproc_thread_cancel(&sp->procs[i]);
+    } else if (sp->procs[i].pid) {
       kill(sp->procs[i].pid, /*SIGINT*/2);
+    }
+    // note: also returns tokens of procs which failed to start
+    jobserver_release(&sp->procs[i].token);
   }
   if (sp->promise)
     sp->promise->await = NULL;
@@ -363,8 +484,11 @@ static err_t _subprocs_await(subprocs_t* sp, u32 maxcount) {
 
   for (u32 i = 0; i < sp->cap; i++) {
     subproc_t* proc = &sp->procs[i];
-    if (proc->pid == 0)
+    if (proc->pid == 0) {
+      // return token of a proc which failed to start
+      jobserver_release(&proc->token);
       continue;
+    }
 
     nawait++;
     err_t err1 = subproc_await(proc);
@@ -394,18 +518,41 @@ err_t subprocs_await_one(subprocs_t* sp) {
 
 
 subproc_t* nullable subprocs_alloc(subprocs_t* sp) {
-  // select the first unused proc
+  // select the first unused proc and count running ones
+  subproc_t* proc = NULL;
+  u32 nrunning = 0;
   for (u32 i = 0; i < sp->cap; i++) {
-    subproc_t* proc = &sp->procs[i];
-    if (proc->pid == 0) {
-      memset(proc, 0, sizeof(*proc));
-      return proc;
+    if (sp->procs[i].pid != 0) {
+      nrunning++;
+    } else if (!proc) {
+      proc = &sp->procs[i];
+      // return token of a proc which failed to start
+      jobserver_release(&proc->token);
     }
   }
 
+  // Every process needs a token from the job server (the process-wide implicit
+  // token is one of them.) We never block on the job server while holding tokens
+  // for processes we have yet to reap, since that could deadlock with another
+  // thread doing the same. Instead we wait for one of our own processes.
+  // When none of our processes are running we hold no tokens and can block.
+  jobtoken_t token = {0};
+  if (proc && nrunning == 0) {
+    jobserver_acquire(&token);
+  } else if (proc && !jobserver_tryacquire(&token)) {
+    proc = NULL;
+  }
+  if (proc) {
+    memset(proc, 0, sizeof(*proc));
+    proc->token = token;
+    return proc;
+  }
+
   // saturated; wait for a process to finish
-  trace("subprocs_alloc wait (cap=%u)", sp->cap);
+  trace("subprocs_alloc wait (cap=%u, running=%u)", sp->cap, nrunning);
+  jobserver_wait_begin();
   err_t err = subprocs_await_one(sp);
+  jobserver_wait_end();
   if (err) {
     // ErrEnd here if subprocs_cancel has been called
     if (err != ErrEnd)
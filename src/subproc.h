@@ -1,13 +1,21 @@
 // subprocess management
 // SPDX-License-Identifier: Apache-2.0
 #pragma once
+#include "jobserver.h"
 ASSUME_NONNULL_BEGIN
 
+typedef struct subproc_thread_ subproc_thread_t;
+
 typedef struct {
-  pid_t pid;
+  pid_t pid; // >0 for a process, SUBPROC_THREAD_PID for a thread, 0 when unused
   err_t err;
+  subproc_thread_t* nullable thread; // non-NULL when pid==SUBPROC_THREAD_PID
+  u64   trace_start; // timetrace_begin() when the process was started
+  jobtoken_t token;  // job server token held while running (see subprocs_alloc)
 } subproc_t;
 
+#define SUBPROC_THREAD_PID ((pid_t)-1)
+
 typedef struct {
   memalloc_t          ma;
   subproc_t*          procs;
@@ -44,12 +52,26 @@ err_t subproc_spawn(
   __VARG_CONCAT(_subproc_fork,__VARG_NARGS(__VA_ARGS__))( \
     (p), (subproc_fork_t)(fn), (cwd), __VA_ARGS__)
 
+// subproc_thread calls fn bound to subproc p on a threadpool thread.
+// It's an in-process alternative to subproc_fork and shares its calling convention,
+// except that fn must be thread safe and must not change process-wide state like cwd.
+// If the job has not yet started when p is awaited, it runs on the awaiting thread.
+// Returns ErrNotSupported if the threadpool is not available (e.g. comaxproc==1).
+//
+// err_t subproc_thread(subproc_t* p, f(...uintptr), ...uintptr)
+#define subproc_thread(p, fn, ...) \
+  __VARG_CONCAT(_subproc_thread,__VARG_NARGS(__VA_ARGS__))( \
+    (p), (subproc_fork_t)(fn), __VA_ARGS__)
+
 typedef err_t(*subproc_fork_t)(
   uintptr a, uintptr b, uintptr c, uintptr d, uintptr e, uintptr f);
 
 err_t _subproc_fork(subproc_t* p, subproc_fork_t fn, const char* nullable cwd,
   uintptr a, uintptr b, uintptr c, uintptr d, uintptr e, uintptr f);
 
+err_t _subproc_thread(subproc_t* p, subproc_fork_t fn,
+  uintptr a, uintptr b, uintptr c, uintptr d, uintptr e, uintptr f);
+
 #define _subproc_fork6(p, fn, cwd, a, b, c, d, e, f) _subproc_fork( \
   (p), (subproc_fork_t)(fn), (cwd), \
   (uintptr)(a), (uintptr)(b), (uintptr)(c), (uintptr)(d), (uintptr)(e), (uintptr)(f))
@@ -71,5 +93,18 @@ err_t _subproc_fork(subproc_t* p, subproc_fork_t fn, const char* nullable cwd,
 #define _subproc_fork0(p, fn, cwd) _subproc_fork( \
   (p), (subproc_fork_t)(fn), (cwd), 0, 0, 0, 0, 0, 0)
 
+#define _subproc_thread6(p, fn, a, b, c, d, e, f) _subproc_thread((p), (fn), \
+  (uintptr)(a), (uintptr)(b), (uintptr)(c), (uintptr)(d), (uintptr)(e), (uintptr)(f))
+#define _subproc_thread5(p, fn, a, b, c, d, e) _subproc_thread((p), (fn), \
+  (uintptr)(a), (uintptr)(b), (uintptr)(c), (uintptr)(d), (uintptr)(e), 0)
+#define _subproc_thread4(p, fn, a, b, c, d) _subproc_thread((p), (fn), \
+  (uintptr)(a), (uintptr)(b), (uintptr)(c), (uintptr)(d), 0, 0)
+#define _subproc_thread3(p, fn, a, b, c) _subproc_thread((p), (fn), \
+  (uintptr)(a), (uintptr)(b), (uintptr)(c), 0, 0, 0)
+#define _subproc_thread2(p, fn, a, b) _subproc_thread((p), (fn), \
+  (uintptr)(a), (uintptr)(b), 0, 0, 0, 0)
+#define _subproc_thread1(p, fn, a) _subproc_thread((p), (fn), \
+  (uintptr)(a), 0, 0, 0, 0, 0)
+
 
 ASSUME_NONNULL_END
@@ -11,9 +11,24 @@
 extern usize strnlen(const char* s, usize maxlen); // libc
 #endif
 
-static strset_t   symbols;
-static memalloc_t sym_ma;
-static rwmutex_t  sym_mu;
+// The symbol table is split into SYM_NSHARDS independently locked shards,
+// selected by hash, so that threads interning different symbols rarely contend.
+// In front of the shared table is a small direct-mapped per-thread cache of
+// recently interned symbols, which is checked without any locking; most lookups
+// are for identifiers that the same thread has seen recently (e.g. "x", "int".)
+// Symbols are never removed, so a symbol pointer is valid forever once found.
+#define SYM_NSHARDS     64  // must be a power of two
+#define SYM_CACHE_SIZE  256 // must be a power of two
+#define CACHE_LINE_SIZE 64
+
+typedef struct {
+  rwmutex_t mu;
+  strset_t  set;
+} __attribute__((aligned(CACHE_LINE_SIZE))) symshard_t;
+
+static symshard_t  symbols[SYM_NSHARDS];
+static memalloc_t  sym_ma;
+static _Thread_local sym_t sym_cache[SYM_CACHE_SIZE];
 
 #define FOREACH_PREDEFINED_SYMBOL(_/*(name)*/) \
   _(_) \
@@ -43,6 +58,18 @@ FOREACH_NODEKIND_PRIMTYPE(_)
 sym_t _sym_primtype_nametab[PRIMTYPE_COUNT] = {0};
 
 
+static usize sym_hash(const char* key, usize keylen) {
+  // note: independent of the hash seeds of the shards' tables
+  return strset_hashfn(0, &(slice_t){ .p = key, .len = keylen });
+}
+
+
+inline static symshard_t* sym_shard(usize hash) {
+  // low bits of hash are used for the thread cache; use the bits above them
+  return &symbols[(hash / SYM_CACHE_SIZE) & (SYM_NSHARDS - 1)];
+}
+
+
 sym_t sym_intern(const char* key, usize keylen) {
   #ifdef DEBUG
     // check for prohibited bytes in key.
@@ -58,19 +85,28 @@ sym_t sym_intern(const char* key, usize keylen) {
     }
   #endif
 
+  usize hash = sym_hash(key, keylen);
+
+  // check the thread's cache.
+  // Keys never contain NUL, so sym[keylen]==0 means the lengths are equal.
+  sym_t* cached = &sym_cache[hash & (SYM_CACHE_SIZE - 1)];
+  if (*cached && strncmp(*cached, key, keylen) == 0 && (*cached)[keylen] == 0)
+    return *cached;
+
   // lookup under read-only lock
-  rwmutex_rlock(&sym_mu);
-  slice_t* ent = strset_lookup(&symbols, key, keylen);
-  rwmutex_runlock(&sym_mu);
+  symshard_t* shard = sym_shard(hash);
+  rwmutex_rlock(&shard->mu);
+  slice_t* ent = strset_lookup(&shard->set, key, keylen);
+  rwmutex_runlock(&shard->mu);
   if (!ent) {
     // not found; assign under full write lock
-    rwmutex_lock(&sym_mu);
-    ent = strset_assign(&symbols, key, keylen, NULL);
-    rwmutex_unlock(&sym_mu);
+    rwmutex_lock(&shard->mu);
+    ent = strset_assign(&shard->set, key, keylen, NULL);
+    rwmutex_unlock(&shard->mu);
     if UNLIKELY(!ent)
       goto oom;
   }
-  return ent->chars;
+  return *cached = ent->chars;
 
 oom:
   panic("out of memory");
@@ -96,8 +132,9 @@ static sym_t def_static_symn(const char* static_key, usize keylen) {
 
   UNUSED slice_t* ent;
 
+  symshard_t* shard = sym_shard(sym_hash(static_key, keylen));
   ent = hashtable_assign(
-    (hashtable_t*)&symbols,
+    (hashtable_t*)&shard->set,
     strset_hashfn,
     strset_eqfn,
     sizeof(slice_t),
@@ -124,10 +161,12 @@ inline static sym_t def_static_sym(const char* static_cstr) {
 
 
 void sym_init(memalloc_t ma) {
-  safecheckx(rwmutex_init(&sym_mu) == 0);
   sym_ma = ma;
-  UNUSED err_t err = strset_init(&symbols, ma, 4096/sizeof(slice_t)/2);
-  safecheckf(err == 0, "strset_init: %s", err_str(err));
+  for (u32 i = 0; i < SYM_NSHARDS; i++) {
+    safecheckx(rwmutex_init(&symbols[i].mu) == 0);
+    UNUSED err_t err = strset_init(&symbols[i].set, ma, 4096/sizeof(slice_t)/2);
+    safecheckf(err == 0, "strset_init: %s", err_str(err));
+  }
 
   #define _(NAME) sym_##NAME = def_static_sym(#NAME);
   FOREACH_PREDEFINED_SYMBOL(_)
@@ -154,3 +193,63 @@ void sym_init(memalloc_t ma) {
   FOREACH_NODEKIND_PRIMTYPE(_)
   #undef _
 }
+
+
+#ifdef CO_ENABLE_TESTS
+
+// sym_intern_threads checks that two threads interning the same strings both get
+// the same symbol for each string, whether it comes from a shard or from a
+// thread's cache. This runs on every startup of a debug build, so it only uses a
+// few symbols; see "co bench sym" for a stress test with up to 64 threads.
+#define TEST_NKEYS   8
+#define TEST_NROUNDS 4
+
+typedef struct { char s[16]; } testkey_t;
+
+typedef struct {
+  thrd_t     t;
+  testkey_t* keys;
+  sym_t*     expect;
+  u32        seed;
+} test_thread_t;
+
+static int test_thread(test_thread_t* t) {
+  u32 x = t->seed;
+  for (u32 round = 0; round < TEST_NROUNDS; round++) {
+    for (u32 i = 0; i < TEST_NKEYS; i++) {
+      // visit keys in a per-thread pseudo-random order
+      x = x*1103515245 + 12345;
+      u32 k = (x >> 8) % TEST_NKEYS;
+      sym_t sym = sym_intern(t->keys[k].s, strlen(t->keys[k].s));
+      safecheckxf(sym == t->expect[k], "%s", t->keys[k].s);
+    }
+  }
+  return 0;
+}
+
+UNITTEST_DEF(sym_intern_threads) {
+  testkey_t keys[TEST_NKEYS];
+  sym_t expect[TEST_NKEYS];
+  test_thread_t threads[2];
+
+  for (u32 i = 0; i < TEST_NKEYS; i++) {
+    snprintf(keys[i].s, sizeof(keys[i].s), "test_%u", i);
+    expect[i] = sym_intern(keys[i].s, strlen(keys[i].s));
+  }
+  for (u32 i = 0; i < TEST_NKEYS; i++)
+    assert(sym_cstr(keys[i].s) == expect[i]);
+
+  for (u32 i = 0; i < countof(threads); i++) {
+    test_thread_t* t = &threads[i];
+    *t = (test_thread_t){ .keys = keys, .expect = expect, .seed = i + 1 };
+    int err = thrd_create(&t->t, (thrd_start_t)test_thread, t);
+    assert(err == 0);
+  }
+  for (u32 i = 0; i < countof(threads); i++) {
+    int result = 1;
+    int err = thrd_join(threads[i].t, &result);
+    assert(err == 0 && result == 0);
+  }
+}
+
+#endif // CO_ENABLE_TESTS
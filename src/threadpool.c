@@ -1,5 +1,15 @@
 // simple globally-shared thread pool
 // SPDX-License-Identifier: Apache-2.0
+//
+// Each worker thread has its own double-ended queue of jobs.
+// A job submitted from a worker thread is pushed onto that worker's own queue
+// (no shared state is touched), a job submitted from any other thread is pushed
+// onto the queue of a worker selected in round-robin order.
+// Workers take jobs from the back of their own queue (most recently submitted
+// first, which is likely to still be in cache) and, when out of work, steal jobs
+// from the front of other workers' queues. Workers with nothing to do sleep on a
+// semaphore which is signalled when jobs are submitted.
+//
 #include "colib.h"
 #include "threadpool.h"
 #include "thread.h"
@@ -13,11 +23,6 @@
 #endif
 
 
-typedef struct {
-  thrd_t t;
-} worker_thread_t;
-
-
 typedef struct {
   _threadpool_fun_t fn;
   const void* a;
@@ -31,14 +36,40 @@ typedef struct {
 } message_t;
 
 
-static worker_thread_t* g_threadv = NULL;
-static mutex_t          g_spawnmu;
-static u32              g_threadcap = 0;
-static _Atomic(u32)     g_threadlen = 0;
-static chan_t*          g_workch = NULL;
-static _Atomic(u32)     g_inflightcount = 0; // current workloads in process
+typedef struct threadpool_ threadpool_t;
+
+
+typedef struct {
+  thrd_t        t;
+  threadpool_t* pool;
+  u32           id;
+  // job queue; a ring buffer of cap (power of two) entries, protected by mu
+  spinmutex_t   mu;
+  message_t*    v;
+  u32           cap;
+  u32           head; // index of front (oldest) entry
+  u32           len;
+  _Atomic(u32)  approxlen; // len, readable without holding mu
+} worker_thread_t;
+
+
+struct threadpool_ {
+  worker_thread_t* threadv;
+  mutex_t          spawnmu;
+  u32              threadcap;
+  _Atomic(u32)     threadlen;
+  _Atomic(u32)     inflightcount; // current workloads in process
+  _Atomic(u32)     nidle;         // number of workers sleeping on idlesema
+  _Atomic(u32)     rrnext;        // next worker for jobs submitted from outside
+  _Atomic(bool)    stop;
+  sema_t           idlesema;
+};
+
+
+static threadpool_t g_pool;
+static _Thread_local worker_thread_t* t_worker = NULL; // current thread's worker
 #ifdef CO_TRACE_THREADPOOL
-static _Atomic(u32)     g_trace_idgen = 0;
+static _Atomic(u32) g_trace_idgen = 0;
 #endif
 
 
@@ -47,180 +78,301 @@ static _Atomic(u32)     g_trace_idgen = 0;
 // sooner than it takes to spawn a new thread and have it start accepting work.
 #define SPAWN_THRESHOLD 2
 
+// QUEUE_INITCAP: initial capacity of a worker's job queue (must be a power of two)
+#define QUEUE_INITCAP 16
 
-#ifdef CO_TRACE_THREADPOOL
-  static u32 worker_trace_id(const worker_thread_t* t) {
-    u32 worker_id = 0;
-    for (; worker_id < g_threadcap && t != &g_threadv[worker_id]; worker_id++) {}
-    return worker_id;
+
+static bool queue_push(worker_thread_t* w, const message_t* msg) {
+  spinmutex_lock(&w->mu);
+  if UNLIKELY(w->len == w->cap) {
+    u32 newcap = w->cap ? w->cap * 2 : QUEUE_INITCAP;
+    message_t* v = mem_alloctv(memalloc_default(), message_t, newcap);
+    if (!v) {
+      spinmutex_unlock(&w->mu);
+      return false;
+    }
+    for (u32 i = 0; i < w->len; i++)
+      v[i] = w->v[(w->head + i) & (w->cap - 1)];
+    if (w->v)
+      mem_freetv(memalloc_default(), w->v, w->cap);
+    w->v = v;
+    w->cap = newcap;
+    w->head = 0;
   }
-#endif
+  w->v[(w->head + w->len) & (w->cap - 1)] = *msg;
+  w->len++;
+  AtomicStore(&w->approxlen, w->len, memory_order_relaxed);
+  spinmutex_unlock(&w->mu);
+  return true;
+}
+
+
+// queue_pop takes the most recently pushed job (called by the queue's owner)
+static bool queue_pop(worker_thread_t* w, message_t* msg) {
+  if (AtomicLoad(&w->approxlen, memory_order_relaxed) == 0)
+    return false;
+  bool ok = false;
+  spinmutex_lock(&w->mu);
+  if (w->len > 0) {
+    w->len--;
+    *msg = w->v[(w->head + w->len) & (w->cap - 1)];
+    AtomicStore(&w->approxlen, w->len, memory_order_relaxed);
+    ok = true;
+  }
+  spinmutex_unlock(&w->mu);
+  return ok;
+}
+
+
+// queue_steal takes the least recently pushed job (called by other workers)
+static bool queue_steal(worker_thread_t* w, message_t* msg) {
+  if (AtomicLoad(&w->approxlen, memory_order_relaxed) == 0)
+    return false;
+  bool ok = false;
+  spinmutex_lock(&w->mu);
+  if (w->len > 0) {
+    *msg = w->v[w->head];
+    w->head = (w->head + 1) & (w->cap - 1);
+    w->len--;
+    AtomicStore(&w->approxlen, w->len, memory_order_relaxed);
+    ok = true;
+  }
+  spinmutex_unlock(&w->mu);
+  return ok;
+}
+
+
+// take_job takes a job from t's own queue or, if empty, steals one from another worker
+static bool take_job(worker_thread_t* t, message_t* msg) {
+  if (queue_pop(t, msg))
+    return true;
+  threadpool_t* pool = t->pool;
+  u32 threadlen = AtomicLoadAcq(&pool->threadlen);
+  for (u32 i = 1; i < threadlen; i++) {
+    worker_thread_t* victim = &pool->threadv[(t->id + i) % threadlen];
+    if (queue_steal(victim, msg)) {
+      trace("worker#%u stole job#%u from worker#%u", t->id, msg->trace_id, victim->id);
+      return true;
+    }
+  }
+  return false;
+}
 
 
 static int worker_thread(worker_thread_t* t) {
+  threadpool_t* pool = t->pool;
   message_t msg;
 
-  #ifdef CO_TRACE_THREADPOOL
-    u32 worker_id = worker_trace_id(t);
-  #endif
+  t_worker = t;
 
-  // receive messages and call job functions until g_workch is closed
+  // take jobs and call job functions until the pool is stopped
+  // (workers of the process-wide pool live as long as the process)
   for (;;) {
-    trace("worker#%u waiting for a job...", worker_id);
-    if (!chan_recv(g_workch, &msg))
-      break; // channel closed
+    if (!take_job(t, &msg)) {
+      // Out of work; go to sleep.
+      // Note that nidle is incremented _before_ checking for work one last time;
+      // paired with the seq_cst fence in pool_submit, this guarantees that we
+      // either see a newly submitted job or that the submitter sees us idle.
+      AtomicAdd(&pool->nidle, 1, memory_order_seq_cst);
+      atomic_thread_fence(memory_order_seq_cst);
+      bool found = take_job(t, &msg);
+      if (!found) {
+        if (AtomicLoadAcq(&pool->stop)) {
+          AtomicSub(&pool->nidle, 1, memory_order_relaxed);
+          break;
+        }
+        trace("worker#%u waiting for a job...", t->id);
+        sema_wait(&pool->idlesema);
+      }
+      AtomicSub(&pool->nidle, 1, memory_order_relaxed);
+      if (!found)
+        continue;
+    }
     trace("worker#%u got job#%u (%p,%p,%p,%p,%p)",
-      worker_id, msg.trace_id, msg.a, msg.b, msg.c, msg.d, msg.e);
+      t->id, msg.trace_id, msg.a, msg.b, msg.c, msg.d, msg.e);
     msg.fn(msg.a, msg.b, msg.c, msg.d, msg.e);
-    AtomicSub(&g_inflightcount, 1, memory_order_release);
+    AtomicSub(&pool->inflightcount, 1, memory_order_release);
   }
 
-  trace("worker#%u exit", worker_id);
+  trace("worker#%u exit", t->id);
+  t_worker = NULL;
   return 0;
 }
 
 
-err_t _threadpool_submit(
-  _threadpool_fun_t fn,
-  const void* a, const void* b, const void* c, const void* d, const void* e)
-{
-  if (g_threadcap == 0)
-    return ErrNotSupported;
-
-  message_t msg = { .fn=fn, .a=a, .b=b, .c=c, .d=d, .e=e };
-  #ifdef CO_TRACE_THREADPOOL
-    msg.trace_id = AtomicAdd(&g_trace_idgen, 1, memory_order_relaxed);
-  #endif
-
-  if UNLIKELY(!chan_send(g_workch, &msg)) {
-    // channel closed
-    trace("submit job#%u failed: submission channel closed", msg.trace_id);
-    return ErrEnd;
-  }
+static err_t spawn_worker(worker_thread_t* t) {
+  int status = thrd_create(&t->t, (thrd_start_t)worker_thread, t);
+  if UNLIKELY(status != thrd_success)
+    return (status == thrd_nomem) ? ErrNoMem : ErrInvalid;
+  return 0;
+}
 
-  trace("submit job#%u ok", msg.trace_id);
 
-  // increment g_inflightcount
-  u32 inflightcount = AtomicAdd(&g_inflightcount, 1, memory_order_acquire);
-
-  // spawn additional thread if needed
-  inflightcount++; // +1 since AtomicAdd returns previous value
-  u32 threadlen = AtomicLoadAcq(&g_threadlen);
+static void maybe_spawn_workers(threadpool_t* pool, u32 inflightcount) {
+  u32 threadlen = AtomicLoadAcq(&pool->threadlen);
 
   if (inflightcount <= threadlen || (inflightcount - threadlen) < SPAWN_THRESHOLD ||
-      threadlen == g_threadcap)
+      threadlen == pool->threadcap)
   {
     // etither not enough queue pressure or we have maxed out worker thread count
-    return 0;
+    return;
   }
 
   // let's try to spawn more worker threads
-  mutex_lock(&g_spawnmu);
+  mutex_lock(&pool->spawnmu);
 
-  // check if we are still over-committed (in case of race to lock g_spawnmu)
-  threadlen = AtomicLoadAcq(&g_threadlen);
-  inflightcount = AtomicLoadAcq(&g_inflightcount);
+  // check if we are still over-committed (in case of race to lock spawnmu)
+  threadlen = AtomicLoadAcq(&pool->threadlen);
+  inflightcount = AtomicLoadAcq(&pool->inflightcount);
   if (inflightcount > threadlen && (inflightcount - threadlen) >= SPAWN_THRESHOLD &&
-      threadlen < g_threadcap)
+      threadlen < pool->threadcap)
   {
     // Yup, still over-committed
-    u32 newthreadlen = MIN(inflightcount, g_threadcap);
+    u32 newthreadlen = MIN(inflightcount, pool->threadcap);
     for (u32 i = threadlen; i < newthreadlen; i++) {
-      worker_thread_t* t = &g_threadv[i];
-      int status = thrd_create(&t->t, (thrd_start_t)worker_thread, t);
-      if UNLIKELY(status != thrd_success) {
+      err_t err = spawn_worker(&pool->threadv[i]);
+      if UNLIKELY(err) {
         // treat errors gracefully; don't panic
-        dlog("%s: thrd_create: %s",
-          __FUNCTION__, err_str((status == thrd_nomem) ? ErrNoMem : ErrInvalid));
+        dlog("%s: thrd_create: %s", __FUNCTION__, err_str(err));
         newthreadlen = i;
         break;
       }
-      trace("spawned extra worker#%u", worker_trace_id(t));
+      trace("spawned extra worker#%u", i);
     }
-    // update g_threadlen
-    // race should not be possible here since we hold a lock on g_spawnmu
-    assertf(AtomicLoadAcq(&g_threadlen) == threadlen, "race on g_threadlen");
-    AtomicStore(&g_threadlen, newthreadlen, memory_order_release);
+    // update threadlen
+    // race should not be possible here since we hold a lock on spawnmu
+    assertf(AtomicLoadAcq(&pool->threadlen) == threadlen, "race on threadlen");
+    AtomicStore(&pool->threadlen, newthreadlen, memory_order_release);
   }
 
-  mutex_unlock(&g_spawnmu);
+  mutex_unlock(&pool->spawnmu);
+}
+
+
+static err_t pool_submit(threadpool_t* pool, const message_t* msg) {
+  if (pool->threadcap == 0)
+    return ErrNotSupported;
+
+  // Select queue; the current worker's own queue if called from one of our workers,
+  // else the next worker in round-robin order.
+  worker_thread_t* w = t_worker;
+  if (!w || w->pool != pool) {
+    u32 threadlen = AtomicLoadAcq(&pool->threadlen);
+    w = &pool->threadv[AtomicAdd(&pool->rrnext, 1, memory_order_relaxed) % threadlen];
+  }
+
+  // increment inflightcount (before the job becomes visible to workers)
+  u32 inflightcount = AtomicAdd(&pool->inflightcount, 1, memory_order_acquire);
+
+  if UNLIKELY(!queue_push(w, msg)) {
+    AtomicSub(&pool->inflightcount, 1, memory_order_relaxed);
+    return ErrNoMem;
+  }
+
+  trace("submit job#%u ok (worker#%u)", msg->trace_id, w->id);
+
+  // wake up a sleeping worker, if any (see worker_thread)
+  atomic_thread_fence(memory_order_seq_cst);
+  if (AtomicLoad(&pool->nidle, memory_order_seq_cst) > 0)
+    sema_signal(&pool->idlesema, 1);
+
+  // spawn additional thread if needed
+  maybe_spawn_workers(pool, inflightcount + 1); // +1 since AtomicAdd returns prev value
 
   return 0;
 }
 
 
-#ifdef CO_ENABLE_TESTS
-  static void test_threadpool();
-#else
-  #define test_threadpool() ((void)0)
-#endif
-
+err_t _threadpool_submit(
+  _threadpool_fun_t fn,
+  const void* a, const void* b, const void* c, const void* d, const void* e)
+{
+  message_t msg = { .fn=fn, .a=a, .b=b, .c=c, .d=d, .e=e };
+  #ifdef CO_TRACE_THREADPOOL
+    msg.trace_id = AtomicAdd(&g_trace_idgen, 1, memory_order_relaxed);
+  #endif
+  return pool_submit(&g_pool, &msg);
+}
 
-err_t threadpool_init() {
-  err_t err = 0;
 
-  // note: comaxproc is always >0
-  if (comaxproc == 1)
-    return 0;
+// pool_init initializes pool with room for threadcap workers and starts threadlen
+static err_t pool_init(threadpool_t* pool, u32 threadcap, u32 threadlen) {
+  err_t err;
+  assert(threadcap > 0);
+  assert(threadlen > 0 && threadlen <= threadcap);
 
-  // initially, start at most 4 threads
-  g_threadcap = comaxproc;
-  g_threadlen = MIN(4, g_threadcap);
+  memset(pool, 0, sizeof(*pool));
 
-  // initialize g_spawnmu
-  if (( err = mutex_init(&g_spawnmu) )) {
+  if (( err = mutex_init(&pool->spawnmu) )) {
     dlog("mutex_init failed: %s", err_str(err));
     return err;
   }
-
-  // open a channel
-  u32 chan_bufcap = g_threadcap; // + SPAWN_THRESHOLD;
-  g_workch = chan_open(memalloc_default(), sizeof(message_t), chan_bufcap);
-  if (!g_workch) {
-    elog("%s chan_open failed", __FUNCTION__);
-    return ErrNoMem;
+  if (( err = sema_init(&pool->idlesema, 0) )) {
+    dlog("sema_init failed: %s", err_str(err));
+    goto end_err1;
   }
 
   // allocate storage for worker threads
-  g_threadv = mem_alloctv(memalloc_default(), worker_thread_t, g_threadcap);
-  if (!g_threadv) {
-    dlog("mem_alloctv(worker_thread_t, %u) failed", g_threadcap);
-    g_threadcap = 0;
-    return ErrNoMem;
+  pool->threadv = mem_alloctv(memalloc_default(), worker_thread_t, threadcap);
+  if (!pool->threadv) {
+    dlog("mem_alloctv(worker_thread_t, %u) failed", threadcap);
+    err = ErrNoMem;
+    goto end_err2;
+  }
+  for (u32 i = 0; i < threadcap; i++) {
+    worker_thread_t* t = &pool->threadv[i];
+    t->pool = pool;
+    t->id = i;
+    if (( err = spinmutex_init(&t->mu) )) {
+      while (i--)
+        spinmutex_dispose(&pool->threadv[i].mu);
+      mem_freetv(memalloc_default(), pool->threadv, threadcap);
+      goto end_err2;
+    }
   }
+  pool->threadcap = threadcap;
 
   // spawn threads
-  trace("init: spawning %u threads", g_threadlen);
-  for (u32 i = 0; i < g_threadlen; i++) {
-    worker_thread_t* t = &g_threadv[i];
-    int status = thrd_create(&t->t, (thrd_start_t)worker_thread, t);
-    if (status != thrd_success) {
-      if (status == thrd_nomem) {
-        err = ErrNoMem;
-      } else {
-        err = ErrInvalid;
-      }
+  trace("init: spawning %u threads", threadlen);
+  u32 i = 0;
+  for (; i < threadlen; i++) {
+    if (( err = spawn_worker(&pool->threadv[i]) )) {
       elog("thrd_create: %s", err_str(err));
       break;
     }
   }
+  AtomicStore(&pool->threadlen, i, memory_order_release);
+  if (i == 0) {
+    // can't submit work without any workers
+    pool->threadcap = 0;
+  } else {
+    err = 0;
+  }
+  return err;
 
-  // run test (no-op unless CO_ENABLE_TESTS is defined)
-  test_threadpool();
-
+end_err2:
+  sema_dispose(&pool->idlesema);
+end_err1:
+  mutex_dispose(&pool->spawnmu);
   return err;
 }
 
 
-/*void threadpool_stop() {
-  // stop accepting work
-  // this causes worker threads to exit once they are out of work
-  chan_close(g_workch);
+// pool_stop waits for all jobs to finish and for all workers to exit.
+// No jobs may be submitted to the pool after it has been stopped.
+static void pool_stop(threadpool_t* pool) {
+  if (pool->threadcap == 0)
+    return;
+
+  // workers exit once they are out of work
+  mutex_lock(&pool->spawnmu); // prevent threadlen from changing
+  AtomicStore(&pool->stop, true, memory_order_seq_cst);
+  u32 threadlen = AtomicLoadAcq(&pool->threadlen);
+  mutex_unlock(&pool->spawnmu);
+  sema_signal(&pool->idlesema, threadlen);
 
-  // wait for worker threads to exit
-  u32 threadlen = AtomicLoadAcq(&g_threadlen);
   for (u32 i = 0; i < threadlen; i++) {
-    worker_thread_t* t = &g_threadv[i];
+    worker_thread_t* t = &pool->threadv[i];
     int result = 123;
     int err = thrd_join(t->t, &result);
     if (err)
@@ -230,10 +382,105 @@ err_t threadpool_init() {
   }
 
   // free memory
-  chan_free(g_workch);
-  mutex_dispose(&g_spawnmu);
-  mem_freetv(memalloc_default(), g_threadv, g_threadcap);
-}*/
+  for (u32 i = 0; i < pool->threadcap; i++) {
+    worker_thread_t* t = &pool->threadv[i];
+    assert(t->len == 0);
+    if (t->v)
+      mem_freetv(memalloc_default(), t->v, t->cap);
+    spinmutex_dispose(&t->mu);
+  }
+  mem_freetv(memalloc_default(), pool->threadv, pool->threadcap);
+  sema_dispose(&pool->idlesema);
+  mutex_dispose(&pool->spawnmu);
+}
+
+
+// Each "root" job submitted by threadpool_bench submits fanout "leaf" jobs from
+// within a worker, exercising both the round-robin and the local-push paths of
+// pool_submit.
+typedef struct {
+  threadpool_t* pool;
+  u32           fanout;
+  _Atomic(u32)  remaining;
+  _Atomic(u32)  nfailed; // jobs run inline since pool_submit failed
+  sema_t        done;
+} bench_t;
+
+static void bench_leaf(bench_t* b) {
+  if (AtomicSub(&b->remaining, 1, memory_order_acq_rel) == 1)
+    sema_signal(&b->done, 1);
+}
+
+static void bench_root(bench_t* b) {
+  for (u32 i = 0; i < b->fanout; i++) {
+    message_t msg = { .fn = (_threadpool_fun_t)bench_leaf, .a = b };
+    if (pool_submit(b->pool, &msg)) {
+      AtomicAdd(&b->nfailed, 1, memory_order_relaxed);
+      bench_leaf(b);
+    }
+  }
+  bench_leaf(b);
+}
+
+
+err_t threadpool_bench(u32 nthreads, u32 nroots, u32 fanout, u64* durationp) {
+  assert(nthreads > 0);
+  assert(nroots > 0);
+  threadpool_t pool;
+  bench_t b = { .pool = &pool, .fanout = fanout, .remaining = nroots * (fanout + 1) };
+  err_t err = sema_init(&b.done, 0);
+  if (err)
+    return err;
+  if (( err = pool_init(&pool, nthreads, nthreads) )) {
+    sema_dispose(&b.done);
+    return err;
+  }
+
+  u64 startat = nanotime();
+  for (u32 i = 0; i < nroots; i++) {
+    message_t msg = { .fn = (_threadpool_fun_t)bench_root, .a = &b };
+    if (pool_submit(&pool, &msg)) {
+      AtomicAdd(&b.nfailed, 1, memory_order_relaxed);
+      bench_root(&b);
+    }
+  }
+  if (!sema_wait(&b.done))
+    err = ErrCanceled;
+  *durationp = nanotime() - startat;
+
+  pool_stop(&pool);
+  sema_dispose(&b.done);
+
+  u32 nfailed = AtomicLoad(&b.nfailed, memory_order_acquire);
+  if (nfailed > 0) {
+    dlog("%s: pool_submit failed for %u jobs", __FUNCTION__, nfailed);
+    err = err ? err : ErrNoMem;
+  }
+  return err;
+}
+
+
+#ifdef CO_ENABLE_TESTS
+  static void test_threadpool();
+#else
+  #define test_threadpool() ((void)0)
+#endif
+
+
+err_t threadpool_init() {
+  // note: comaxproc is always >0
+  if (comaxproc == 1)
+    return 0;
+
+  // initially, start at most 4 threads
+  err_t err = pool_init(&g_pool, comaxproc, MIN(4, comaxproc));
+
+  // run test (no-op unless CO_ENABLE_TESTS is defined)
+  if (!err)
+    test_threadpool();
+
+  return err;
+}
 
 
 //———————————————————————————————————————————————————————————————————————————————————————
@@ -251,10 +498,10 @@ static void test_threadpool() {
   bool ok;
   u32 result, sum;
 
-  u32 nwork = g_threadlen + SPAWN_THRESHOLD;
+  u32 nwork = AtomicLoadAcq(&g_pool.threadlen) + SPAWN_THRESHOLD;
 
   // note: our channel must have a buffer that can fit nwork, otherwise we might
-  // deadlock in case the threadpool g_threadcap is less than nwork.
+  // deadlock in case the threadpool threadcap is less than nwork.
   chan_t* ch = chan_open(memalloc_default(), sizeof(u32), nwork);
   assertnotnull(ch);
 
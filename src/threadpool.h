@@ -39,6 +39,12 @@ err_t threadpool_submit(void(*)(/*arg void* ...*/), ...);
 
 err_t threadpool_init();
 
+// threadpool_bench measures job throughput of a pool of nthreads workers,
+// separate from the process-wide pool. It submits nroots jobs from the calling
+// thread, each of which submits fanout jobs from within a worker, and sets
+// *duration to the number of nanoseconds it took for all of them to finish.
+err_t threadpool_bench(u32 nthreads, u32 nroots, u32 fanout, u64* duration);
+
 //———————————————————————————————————————————————————————————————————————————————————————
 // implementation
 
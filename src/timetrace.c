@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: Apache-2.0
+#include "colib.h"
+#include "timetrace.h"
+#include "thread.h"
+#include "array.h"
+#include "buf.h"
+
+#include <stdlib.h> // free
+#include <string.h> // strdup
+
+// Events are recorded as "complete" events (ph="X") which carry both start time
+// and duration, so that spans need not be properly nested per thread.
+// Threads of the compis process are listed under TRACE_PID_SELF with small
+// sequential thread ids (1 for the first thread to record an event, which is
+// normally the main thread). Subprocesses are listed under TRACE_PID_SUBPROC with
+// their OS process id as "thread" id.
+
+#define TRACE_PID_SELF    1
+#define TRACE_PID_SUBPROC 2
+
+typedef struct {
+  const char*    name;
+  char* nullable detail;
+  u64            start, end; // nanotime
+  u32            pid, tid;
+} ttevent_t;
+
+bool timetrace_enabled = false;
+
+static mutex_t  g_mu;
+static array_t  g_events; // ttevent_t
+static u64      g_origin; // nanotime when tracing started
+static _Atomic(u32) g_tidgen = 0;
+
+
+err_t timetrace_enable() {
+  err_t err = mutex_init(&g_mu);
+  if (err)
+    return err;
+  array_init(&g_events);
+  g_origin = nanotime();
+  timetrace_enabled = true;
+  return 0;
+}
+
+
+static u32 thread_tid() {
+  static _Thread_local u32 tid = 0;
+  if (tid == 0)
+    tid = AtomicAdd(&g_tidgen, 1, memory_order_relaxed) + 1;
+  return tid;
+}
+
+
+static void add_event(
+  const char* name, const char* nullable detail, u64 start, u32 pid, u32 tid)
+{
+  ttevent_t ev = {
+    .name = name,
+    .start = start,
+    .end = nanotime(),
+    .pid = pid,
+    .tid = tid,
+  };
+  if (detail && !( ev.detail = strdup(detail) ))
+    return;
+  mutex_lock(&g_mu);
+  bool ok = array_push(ttevent_t, &g_events, memalloc_default(), ev);
+  mutex_unlock(&g_mu);
+  if (!ok)
+    free(ev.detail);
+}
+
+
+void timetrace_end(u64 start, const char* name, const char* nullable detail) {
+  if (start)
+    add_event(name, detail, start, TRACE_PID_SELF, thread_tid());
+}
+
+
+void timetrace_subproc(u64 start, const char* name, long pid) {
+  if (start)
+    add_event(name, NULL, start, TRACE_PID_SUBPROC, (u32)pid);
+}
+
+
+static void json_str(buf_t* buf, const char* s) {
+  buf_push(buf, '"');
+  for (; *s; s++) {
+    u8 c = *(const u8*)s;
+    if (c == '"' || c == '\\') {
+      buf_push(buf, '\\');
+      buf_push(buf, c);
+    } else if (c < 0x20) {
+      buf_printf(buf, "\\u%04x", c);
+    } else {
+      buf_push(buf, c);
+    }
+  }
+  buf_push(buf, '"');
+}
+
+
+err_t timetrace_write(const char* filename) {
+  if (!timetrace_enabled)
+    return ErrInvalid;
+
+  buf_t buf = buf_make(memalloc_default());
+  buf_print(&buf, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+  // name the two "processes"
+  buf_printf(&buf,
+    "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":0,"
+    "\"args\":{\"name\":\"compis\"}},\n"
+    "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":0,"
+    "\"args\":{\"name\":\"subprocesses\"}}",
+    TRACE_PID_SELF, TRACE_PID_SUBPROC);
+
+  mutex_lock(&g_mu);
+  for (u32 i = 0; i < g_events.len; i++) {
+    const ttevent_t* ev = array_ptr(ttevent_t, &g_events, i);
+    u64 ts = ev->start > g_origin ? ev->start - g_origin : 0;
+    u64 dur = ev->end > ev->start ? ev->end - ev->start : 0;
+    buf_print(&buf, ",\n{\"name\":");
+    json_str(&buf, ev->name);
+    // ts & dur are in microseconds
+    buf_printf(&buf, ",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%llu.%03llu,"
+      "\"dur\":%llu.%03llu",
+      ev->pid, ev->tid,
+      (unsigned long long)(ts / 1000), (unsigned long long)(ts % 1000),
+      (unsigned long long)(dur / 1000), (unsigned long long)(dur % 1000));
+    if (ev->detail) {
+      buf_print(&buf, ",\"args\":{\"detail\":");
+      json_str(&buf, ev->detail);
+      buf_push(&buf, '}');
+    }
+    buf_push(&buf, '}');
+  }
+  mutex_unlock(&g_mu);
+
+  buf_print(&buf, "\n]}\n");
+
+  err_t err = buf.oom ? ErrNoMem : fs_writefile(filename, 0644, buf_slice(buf));
+  buf_dispose(&buf);
+  return err;
+}
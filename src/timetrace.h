@@ -0,0 +1,36 @@
+// timing of build phases, exported as Chrome trace event JSON (--trace=<file>)
+// SPDX-License-Identifier: Apache-2.0
+//
+// Example
+//   u64 t = timetrace_begin();
+//   do_work();
+//   timetrace_end(t, "work", filename);
+//
+// The resulting file can be opened in chrome://tracing or https://ui.perfetto.dev
+//
+#pragma once
+ASSUME_NONNULL_BEGIN
+
+extern bool timetrace_enabled;
+
+// timetrace_enable starts recording events. Must be called before any threads
+// that may record events are started.
+err_t timetrace_enable();
+
+// timetrace_begin returns the start time of a span, or 0 if tracing is disabled
+inline static u64 timetrace_begin() {
+  return timetrace_enabled ? nanotime() : 0;
+}
+
+// timetrace_end records a span which started at start (from timetrace_begin)
+// and ends now, on the calling thread. name should be a constant string;
+// detail (e.g. a filename) is copied. Does nothing if start is 0.
+void timetrace_end(u64 start, const char* name, const char* nullable detail);
+
+// timetrace_subproc records a span for a subprocess with process id pid
+void timetrace_subproc(u64 start, const char* name, long pid);
+
+// timetrace_write writes all recorded events to filename as JSON
+err_t timetrace_write(const char* filename);
+
+ASSUME_NONNULL_END
@@ -77,7 +77,7 @@ _( TBYTELIT, "byte literal" )
 _( TSTRLIT, "string literal" )
 _( TCHARLIT, "character literal" )
 
-// keywords (must be sorted)
+// keywords (update keyword_hashtab in scanner.c when changing these)
 KEYWORD( "const",  TCONST )
 KEYWORD( "else",   TELSE )
 KEYWORD( "false",  TFALSE )
@@ -52,6 +52,7 @@ typedef struct {
   map_t           postanalyze;    // set of nodes to analyze at the very end (keys only)
   maparray_t      freemaps;
   map_t           templateimap;   // typeid_t => usertype_t*
+  nodearray_t     tinstances;     // template instances, in order of instantiation
   buf_t           tmpbuf;
   bool            reported_error; // true if an error diagnostic has been reported
   u32             pubnest;        // NF_VIS_PUB nesting level
@@ -3451,6 +3452,15 @@ static void arraylit(typecheck_t* a, arraylit_t* n) {
 }
 
 
+// ns_member returns ns->members.v[i], decoding it first if ns is a lazily-loaded
+// package API. Returns NULL if decoding failed.
+static node_t* nullable ns_member(nsexpr_t* ns, u32 i) {
+  if (ns->flags & NF_PKGNS)
+    return pkg_api_member(ns->pkg, i);
+  return ns->members.v[i];
+}
+
+
 static void member_ns(typecheck_t* a, member_t* n) {
   nsexpr_t* ns = (nsexpr_t*)unwrap_id(n->recv);
   if (ns->kind != EXPR_NS) {
@@ -3464,11 +3474,14 @@ static void member_ns(typecheck_t* a, member_t* n) {
 
   for (u32 i = 0; i < ns->members.len; i++) {
     if (ns->member_names[i] == name) {
-      if UNLIKELY(!node_isexpr(ns->members.v[i])) {
-        error(a, n, "names a %s", nodekind_fmt(ns->members.v[i]->kind));
+      node_t* member = ns_member(ns, i);
+      if UNLIKELY(!member)
+        break;
+      if UNLIKELY(!node_isexpr(member)) {
+        error(a, n, "names a %s", nodekind_fmt(member->kind));
         return;
       }
-      target = (expr_t*)ns->members.v[i];
+      target = (expr_t*)member;
       incuse_read(target);
       n->target = target;
       n->type = target->type;
@@ -4338,10 +4351,11 @@ static void templateimap_mkkey(
 
 
 static void templateimap_add(
-  typecheck_t* a, const usertype_t* template, usertype_t* instance)
+  typecheck_t* a, const usertype_t* template, const nodearray_t* template_args,
+  usertype_t* instance)
 {
   a->tmpbuf.len = 0;
-  templateimap_mkkey(&a->tmpbuf, template, &instance->templateparams);
+  templateimap_mkkey(&a->tmpbuf, template, template_args);
 
   void* v = mem_alloc(a->ma, a->tmpbuf.len).p;
   if (v) memcpy(v, a->tmpbuf.p, a->tmpbuf.len);
@@ -4397,6 +4411,41 @@ static usertype_t* nullable templateimap_lookup(
 }
 
 
+// pkg_of_node returns the package which n was defined in, or NULL if unknown
+static pkg_t* nullable pkg_of_node(typecheck_t* a, const node_t* n) {
+  const srcfile_t* srcfile = loc_srcfile(n->loc, locmap(a));
+  return srcfile ? srcfile->pkg : NULL;
+}
+
+
+// imported_templatei_lookup looks for an instance of a template defined by another
+// package in the API of that package (see record_tinstances)
+static usertype_t* nullable imported_templatei_lookup(
+  typecheck_t* a, const usertype_t* template, const nodearray_t* template_args)
+{
+  pkg_t* pkg = pkg_of_node(a, (node_t*)template);
+  if (!pkg || pkg == a->pkg || !pkg->api_ns)
+    return NULL;
+
+  sym_t name;
+  switch (template->kind) {
+    case TYPE_STRUCT: name = ((structtype_t*)template)->name; break;
+    case TYPE_ALIAS:  name = ((aliastype_t*)template)->name; break;
+    default:          return NULL;
+  }
+  if (!name)
+    return NULL;
+
+  node_t* n = pkg_api_lookup(pkg, pkg_tinstance_name(name, template_args));
+  if (!n || n->kind != template->kind || (n->flags & NF_TEMPLATEI) == 0)
+    return NULL;
+
+  trace("using template instance %s from package \"%s\"",
+    fmtnode(0, n), pkg->path.p);
+  return (usertype_t*)n;
+}
+
+
 static void instantiate_templatetype(typecheck_t* a, templatetype_t** tp) {
   templatetype_t* tt = *tp;
   usertype_t* template = tt->recv;
@@ -4443,8 +4492,11 @@ static void instantiate_templatetype(typecheck_t* a, templatetype_t** tp) {
     }
   }
 
-  // check if there's an existing instance
+  // check if there's an existing instance, either of our own or one recorded by
+  // the package which defines the template
   usertype_t* instance = templateimap_lookup(a, template, &ctx.args);
+  if (!instance && ( instance = imported_templatei_lookup(a, template, &ctx.args) ))
+    templateimap_add(a, template, &ctx.args, instance);
   if (instance) {
     trace("using existing template instance");
     *(node_t**)tp = (node_t*)instance;
@@ -4486,7 +4538,9 @@ static void instantiate_templatetype(typecheck_t* a, templatetype_t** tp) {
   instance->_typeid = NULL; // scrub cached typeid
 
   // register instance (before checking, in case it refers to itself)
-  templateimap_add(a, template, instance);
+  templateimap_add(a, template, &instance->templateparams, instance);
+  if (!nodearray_push(&a->tinstances, a->ma, (node_t*)instance))
+    return out_of_mem(a);
 
   // typecheck the instance
   *(node_t**)tp = (node_t*)instance;
@@ -4507,11 +4561,72 @@ static void instantiate_templatetype(typecheck_t* a, templatetype_t** tp) {
 }
 
 
+// tinstance_arg_is_exportable returns true if an importer of the package could
+// name template argument n, i.e. if n is made of primitive types and public types
+// defined by the package itself.
+static bool tinstance_arg_is_exportable(typecheck_t* a, const node_t* n) {
+  for (;;) {
+    if (!node_istype(n))
+      return false; // e.g. expression
+    if (nodekind_isprimtype(n->kind))
+      return true;
+    switch (n->kind) {
+      case TYPE_ARRAY:
+      case TYPE_PTR:
+      case TYPE_REF:
+      case TYPE_MUTREF:
+      case TYPE_SLICE:
+      case TYPE_MUTSLICE:
+      case TYPE_OPTIONAL:
+        n = (node_t*)((ptrtype_t*)n)->elem;
+        continue;
+      case TYPE_STRUCT:
+      case TYPE_ALIAS:
+        return (n->flags & NF_VIS_PUB) && pkg_of_node(a, n) == a->pkg;
+      default:
+        return false;
+    }
+  }
+}
+
+
+// record_tinstances sets pkg->tinstances to instances of public templates defined by
+// the package which importers may use, to be recorded in the package's metafile.
+// Instances of templates defined by other packages are not recorded since they
+// belong to the other package (and its source files.)
+static void record_tinstances(typecheck_t* a) {
+  nodearray_t* tinstances = &a->pkg->tinstances;
+  tinstances->len = 0;
+  for (u32 i = 0; i < a->tinstances.len; i++) {
+    usertype_t* t = (usertype_t*)a->tinstances.v[i];
+    if ((t->flags & (NF_VIS_PUB | NF_CHECKED | NF_UNKNOWN)) != (NF_VIS_PUB | NF_CHECKED))
+      continue;
+    if (pkg_of_node(a, (node_t*)t) != a->pkg)
+      continue;
+    for (u32 j = 0; j < t->templateparams.len; j++) {
+      if (!tinstance_arg_is_exportable(a, t->templateparams.v[j]))
+        goto next;
+    }
+    if (!nodearray_push(tinstances, a->ast_ma, (node_t*)t))
+      return out_of_mem(a);
+  next: {}
+  }
+}
+
+
 static void templatetype(typecheck_t* a, templatetype_t** tp) {
   // Use of template, e.g. var x Foo<int>
   //                             ~~~~~~~~
   templatetype_t* tt = *tp;
   type(a, (type_t**)&tt->recv);
+
+  // template defined by another package, e.g. "foo.Vec<int>"
+  if (tt->recv->kind == TYPE_IMPORTED && ((importedtype_t*)tt->recv)->elem) {
+    type_t* t = ((importedtype_t*)tt->recv)->elem;
+    if (nodekind_isusertype(t->kind))
+      tt->recv = (usertype_t*)t;
+  }
+
   usertype_t* template = tt->recv;
 
   // must check template, in case use preceeds definition
@@ -4707,7 +4822,9 @@ static void importedtype(typecheck_t* a, importedtype_t** tp) {
 
   for (u32 i = 0; i < api_ns->members.len; i++) {
     if (api_ns->member_names[i] == imt->name) {
-      node_t* n = api_ns->members.v[i];
+      node_t* n = ns_member(api_ns, i);
+      if UNLIKELY(!n)
+        break;
       if (n->kind == STMT_TYPEDEF) {
         n = (node_t*)((typedef_t*)n)->type;
       } else if (!node_istype(n)) {
@@ -5056,7 +5173,7 @@ static void import_members(typecheck_t* a, import_t* im) {
   // e.g. import *, y as z from "foo/bar"
   assertnotnull(im->idlist);
 
-  const nsexpr_t* api_ns = assertnotnull(im->pkg)->api_ns;
+  nsexpr_t* api_ns = assertnotnull(im->pkg)->api_ns;
   assertf(api_ns, "pkg(%s)", im->pkg->path.p);
   importid_t* star_imid = NULL;
 
@@ -5079,7 +5196,12 @@ static void import_members(typecheck_t* a, import_t* im) {
         // note: parser has already checked for duplicate definitions
         // dlog("importing %s as %s => %s",
         //   origname, imid->name, nodekind_name(api_ns->members.v[i]->kind));
-        define(a, imid->name, api_ns->members.v[i]);
+        node_t* member = ns_member(api_ns, i);
+        if UNLIKELY(!member) {
+          report_unknown_import_member(a, im, imid);
+        } else {
+          define(a, imid->name, member);
+        }
         break;
       }
     }
@@ -5093,6 +5215,10 @@ static void import_members(typecheck_t* a, import_t* im) {
   for (u32 i = 0; i < api_ns->members.len; i++) {
     sym_t name = api_ns->member_names[i];
 
+    // template instances are not imported by name
+    if (pkg_api_name_is_tinstance(name))
+      continue;
+
     // see if this member has already been explicitly imported
     bool found = false;
     for (importid_t* imid = im->idlist; imid; imid = imid->next_id) {
@@ -5140,7 +5266,9 @@ static void import_members(typecheck_t* a, import_t* im) {
         }
       }
     } else {
-      define(a, name, api_ns->members.v[i]);
+      node_t* member = ns_member(api_ns, i);
+      if LIKELY(member)
+        define(a, name, member);
     }
   }
 }
@@ -5211,9 +5339,20 @@ static err_t autoimport_runtime(typecheck_t* a) {
   if (a->pkg == rt_pkg)
     return 0;
 
-  // add runtime's API to our package-level scope
+  // add runtime's API to our package-level scope.
+  // If the API is decoded lazily, its members are added as placeholders which
+  // pkg_def_get decodes on demand.
   const nsexpr_t* ns = assertnotnull(rt_pkg->api_ns);
-  return pkg_def_addm(a->pkg, a->ma, ns->member_names, ns->members.v, ns->members.len);
+  a->pkg->autoimport = rt_pkg;
+  if (!rt_pkg->apidec || ns->members.len == 0)
+    return pkg_def_addm(a->pkg, a->ma, ns->member_names, ns->members.v, ns->members.len);
+  node_t** placeholders = mem_alloctv(a->ma, node_t*, ns->members.len);
+  if (!placeholders)
+    return ErrNoMem;
+  err_t err = pkg_def_addm(
+    a->pkg, a->ma, ns->member_names, placeholders, ns->members.len);
+  mem_freetv(a->ma, placeholders, ns->members.len);
+  return err;
 }
 
 
@@ -5290,6 +5429,9 @@ err_t typecheck(
 
   leave_scope(&a); // package
 
+  if (noerror(&a))
+    record_tinstances(&a);
+
 end3:
   scope_dispose(&a.scope, a.ma);
   scope_dispose(&a.narrowscope, a.ma);
@@ -5298,6 +5440,7 @@ end3:
   nodearray_dispose(&a.visitstack, a.ma);
   array_dispose(didyoumean_t, (array_t*)&a.didyoumean, a.ma);
   buf_dispose(&a.tmpbuf);
+  nodearray_dispose(&a.tinstances, a.ma);
   map_dispose(&a.usertypes, a.ma);
   for (u32 i = 0; i < a.freemaps.len; i++)
     if (a.freemaps.v[i].cap) map_dispose(&a.freemaps.v[i], a.ma);
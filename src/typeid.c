@@ -22,9 +22,27 @@
 // #define TYPEID_TAG_TID   '$'
 
 
-static memalloc_t  typeid_ma;
-static rwmutex_t   typeid_mu;
-static hashtable_t typeid_ht;
+// Interned typeids live in a table split into TYPEID_NSHARDS independently locked
+// shards, selected by the high bits of a typeid's hash, so that threads interning
+// different types rarely contend.
+// The hash is computed once per typeid and stored alongside it in the table, so
+// entries are compared by hash before their bytes and growing a shard's table
+// does not need to rehash any bytes.
+#define TYPEID_NSHARDS  64 // must be a power of two
+#define CACHE_LINE_SIZE 64
+
+typedef struct {
+  usize    hash;
+  typeid_t typeid;
+} typeident_t;
+
+typedef struct {
+  rwmutex_t   mu;
+  hashtable_t ht; // typeident_t
+} __attribute__((aligned(CACHE_LINE_SIZE))) typeidshard_t;
+
+static memalloc_t    typeid_ma;
+static typeidshard_t typeid_shards[TYPEID_NSHARDS];
 
 
 // Conversion of f64 <-> u64
@@ -43,34 +61,47 @@ usize typeid_hash(usize seed, typeid_t typeid) {
 }
 
 
-static usize _typeid_hash(usize seed, const void* typeidp) {
-  typeid_t typeid = *(typeid_t*)typeidp;
-  return typeid_hash(seed, typeid);
+static usize typeident_hash(usize seed, const void* entp) {
+  // note: shards are selected by the high bits, the table index by the low bits
+  return ((const typeident_t*)entp)->hash ^ seed;
+}
+
+
+static bool typeident_eq(const void* ap, const void* bp) {
+  const typeident_t* a = ap;
+  const typeident_t* b = bp;
+  return a->hash == b->hash &&
+         a->typeid->len == b->typeid->len &&
+         memcmp(a->typeid->bytes, b->typeid->bytes, a->typeid->len) == 0;
 }
 
 
-static bool typeid_eq(const void* ap, const void* bp) {
-  typeid_t a = *(typeid_t*)ap;
-  typeid_t b = *(typeid_t*)bp;
-  return a->len == b->len && memcmp(a->bytes, b->bytes, a->len) == 0;
+inline static typeidshard_t* typeid_shard(usize hash) {
+  return &typeid_shards[hash >> (sizeof(usize)*8 - 6)];
 }
+static_assert(TYPEID_NSHARDS == 1 << 6, "");
 
 
 void typeid_init(memalloc_t ma) {
   typeid_ma = ma;
-  safecheckx(rwmutex_init(&typeid_mu) == 0);
-  UNUSED err_t err = hashtable_init(&typeid_ht, ma, sizeof(typeid_t), 256);
-  safecheckf(err == 0, "hashtable_init: %s", err_str(err));
+  for (u32 i = 0; i < TYPEID_NSHARDS; i++) {
+    typeidshard_t* shard = &typeid_shards[i];
+    safecheckx(rwmutex_init(&shard->mu) == 0);
+    UNUSED err_t err = hashtable_init(&shard->ht, ma, sizeof(typeident_t), 16);
+    safecheckf(err == 0, "hashtable_init: %s", err_str(err));
+  }
 }
 
 
-typeid_t typeid_intern_typeid(typeid_t typeid) {
+static typeid_t typeid_intern1(typeid_t typeid, usize hash) {
+  typeidshard_t* shard = typeid_shard(hash);
+  typeident_t keyent = { .hash = hash, .typeid = typeid };
 
-  rwmutex_lock(&typeid_mu);
+  rwmutex_lock(&shard->mu);
 
   bool did_insert;
-  typeid_t* ent = hashtable_assign(
-    &typeid_ht, _typeid_hash, typeid_eq, sizeof(typeid_t), &typeid, &did_insert);
+  typeident_t* ent = hashtable_assign(
+    &shard->ht, typeident_hash, typeident_eq, sizeof(typeident_t), &keyent, &did_insert);
   if UNLIKELY(!ent)
     goto oom;
 
@@ -80,12 +111,12 @@ typeid_t typeid_intern_typeid(typeid_t typeid) {
     if UNLIKELY(!typeid2)
       goto oom;
     memcpy(typeid2, typeid, nbyte);
-    *ent = typeid2;
+    ent->typeid = typeid2;
   }
 
   #ifdef TYPEID_TRACE
   {
-    typeid = *ent;
+    typeid = ent->typeid;
     buf_t tmpbuf = buf_make(typeid_ma);
     buf_appendrepr(&tmpbuf, typeid->bytes, typeid->len);
     trace("[%s] %s typeid %p (%u) '%.*s'", __FUNCTION__,
@@ -95,55 +126,66 @@ typeid_t typeid_intern_typeid(typeid_t typeid) {
   }
   #endif
 
-  rwmutex_unlock(&typeid_mu);
+  typeid = ent->typeid;
+  rwmutex_unlock(&shard->mu);
 
-  return *ent;
+  return typeid;
 oom:
   panic("out of memory");
   UNREACHABLE;
 }
 
 
+typeid_t typeid_intern_typeid(typeid_t typeid) {
+  return typeid_intern1(typeid, typeid_hash(0, typeid));
+}
+
+
 static typeid_t typeid_map_intern(typeid_t typeid) {
+  usize hash = typeid_hash(0, typeid);
+
   #ifdef TYPEID_TRACE
   {
     buf_t tmpbuf = buf_make(typeid_ma);
     buf_appendrepr(&tmpbuf, typeid->bytes, typeid->len);
     trace("[%s] typeid(%u)='%.*s' (hash=0x%lx)", __FUNCTION__,
-      typeid->len, (int)tmpbuf.len, tmpbuf.chars,
-      typeid_hash(typeid_ht.seed, typeid));
+      typeid->len, (int)tmpbuf.len, tmpbuf.chars, hash);
     buf_dispose(&tmpbuf);
   }
   #endif
 
   // lookup under read-only lock
-  rwmutex_rlock(&typeid_mu);
-  typeid_t* ent = hashtable_lookup(
-    &typeid_ht, _typeid_hash, typeid_eq, sizeof(typeid_t), &typeid);
-  rwmutex_runlock(&typeid_mu);
-
-  if (ent) {
+  typeidshard_t* shard = typeid_shard(hash);
+  typeident_t keyent = { .hash = hash, .typeid = typeid };
+  rwmutex_rlock(&shard->mu);
+  typeident_t* ent = hashtable_lookup(
+    &shard->ht, typeident_hash, typeident_eq, sizeof(typeident_t), &keyent);
+  typeid_t existing = ent ? ent->typeid : NULL;
+  rwmutex_runlock(&shard->mu);
+
+  if (existing) {
     #ifdef TYPEID_TRACE
     {
-      typeid = *ent;
       buf_t tmpbuf = buf_make(typeid_ma);
-      buf_appendrepr(&tmpbuf, typeid->bytes, typeid->len);
+      buf_appendrepr(&tmpbuf, existing->bytes, existing->len);
       trace("use existing typeid %p (%u) '%.*s'",
-        typeid, typeid->len, (int)tmpbuf.len, tmpbuf.chars);
+        existing, existing->len, (int)tmpbuf.len, tmpbuf.chars);
       buf_dispose(&tmpbuf);
     }
     #endif
 
-    return *ent;
+    return existing;
   }
 
   // not found; assign under full write lock
-  return typeid_intern_typeid(typeid);
+  return typeid_intern1(typeid, hash);
 }
 
 
-#define PARAMS  buf_t* buf, bool intern, nodearray_t* seenstack, int ind
-#define ARGS    buf, intern, seenstack, ind
+// isfinal is set to false when encountering a type which may still change,
+// e.g. a template placeholder or a type that has not yet been typecheck'ed
+#define PARAMS  buf_t* buf, bool intern, nodearray_t* seenstack, bool* isfinal, int ind
+#define ARGS    buf, intern, seenstack, isfinal, ind
 
 
 static void typeid_fmt_node1(PARAMS, node_t* n);
@@ -243,6 +285,13 @@ static void typeid_fmt_node1(PARAMS, node_t* n) {
     ind, "", nodekind_name(n->kind), n, buf->len);
   ind += 2;
 
+  if (node_istype(n) && (
+        n->kind == TYPE_PLACEHOLDER ||
+        (n->flags & (NF_CHECKED | NF_UNKNOWN | NF_TEMPLATE)) != NF_CHECKED ))
+  {
+    *isfinal = false;
+  }
+
   // kind
   assert(n->kind < NODEKIND_COUNT);
   buf_append(buf, &g_ast_kindtagtab[n->kind], 4);
@@ -347,11 +396,20 @@ static void typeid_fmt_node1(PARAMS, node_t* n) {
 
 
 typeid_t _typeid(type_t* t, bool intern) {
+  // most typeids are small; start with stack storage
+  u32 storage[512/sizeof(u32)];
   memalloc_t ma = memalloc_ctx();
-  buf_t buf = buf_make(ma);
+  buf_t buf = buf_makeext(ma, storage, sizeof(storage));
   nodearray_t seenstack = {0};
+  bool isfinal = true;
 
-  typeid_t typeid = typeid_make(&buf, intern, &seenstack, 0, t);
+  typeid_t typeid = typeid_make(&buf, intern, &seenstack, &isfinal, 0, t);
+
+  // Cache the typeid of a type which can't change, even when not interning.
+  // The typeid is the same as if the type had been interned since it's
+  // deduplicated with typeid_map_intern either way.
+  if (isfinal)
+    t->_typeid = typeid;
 
   nodearray_dispose(&seenstack, ma);
   buf_dispose(&buf);
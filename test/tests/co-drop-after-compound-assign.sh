@@ -0,0 +1,37 @@
+# drops in a branch must survive constant folding of variables which are
+# modified by compound assignment or ++ before the branch
+cat << END > main.co
+type Res
+  x int
+
+fun Res.drop(mut this)
+  print("drop")
+
+fun add_assign()
+  var x = 5
+  x += 1
+  if x == 1 {
+    print("one")
+  } else {
+    var r = Res(x: x)
+  }
+
+fun increment()
+  var x = 0
+  x++
+  if x == 0 {
+    print("zero")
+  } else {
+    var r = Res(x: x)
+  }
+
+pub fun main()
+  add_assign()
+  increment()
+END
+co build -o main main.co
+./main > out.txt
+cat out.txt
+[ "$(grep -o drop out.txt | wc -l)" -eq 2 ] || _err "expected 2 drops"
+grep -q "one\|zero" out.txt && _err "wrong branch taken"
+true
@@ -0,0 +1,39 @@
+# "co serve" keeps the APIs of dependencies loaded between builds.
+# A dependency which changes must be rebuilt instead of used from the server.
+export COSERVE="$PWD/serve.sock"
+co serve -v --timeout 60 > serve.log &
+SERVE_PID=$!
+trap "kill $SERVE_PID 2>/dev/null || true" EXIT
+for i in $(seq 100); do
+  [ -S serve.sock ] && break
+  sleep 0.1
+done
+[ -S serve.sock ] || _err "compile server did not start"
+
+mkdir -p foo
+echo 'pub fun value() int { 1 }' > foo/foo.co
+cat << END > main.co
+import "./foo"
+
+pub fun main() {
+  if foo.value() == 1 {
+    print("one")
+  } else {
+    print("two")
+  }
+}
+END
+
+co build -o main main.co
+[ "$(./main)" = one ] || _err "expected \"one\""
+
+# this build uses the API of foo loaded by the server
+co build -o main main.co
+[ "$(./main)" = one ] || _err "expected \"one\" when foo is loaded"
+
+sleep 1
+echo 'pub fun value() int { 2 }' > foo/foo.co
+co build -o main main.co
+[ "$(./main)" = two ] || _err "expected \"two\" after changing foo"
+
+grep -q "packages\? loaded" serve.log || _err "server did not load any packages"